@@ -3,34 +3,48 @@
 #include "stage_agent.h"
 
 namespace ds::depthscan {
-StageAgent::StageAgent()
-  : m_pump(ui::CreateAsyncModel<StagePump>())
-  , m_move(ui::CreateAsyncModel<StageMove>())
-  , m_auto_focus(ui::CreateAsyncModel<StageAutoFocus>())
-  , m_frame(ui::CreateAsyncModel<StageFrame>())
-  , m_clean(ui::CreateAsyncModel<StageClean>())
-  , m_auto(ui::CreateAsyncModel<StageAutoMode>())
-  , m_auto_exposure(ui::CreateAsyncModel<StageAutoExposure>())
-  , m_led(ui::CreateAsyncModel<StageLED>())
+StageAgent::StageAgent(const StationId& station)
+  : m_station(station)
+  , m_created(std::chrono::steady_clock::now())
+  , m_pump(ui::CreateAsyncModel<StagePump>(station))
+  , m_move(ui::CreateAsyncModel<StageMove>(station))
+  , m_auto_focus(ui::CreateAsyncModel<StageAutoFocus>(station))
+  , m_frame(ui::CreateAsyncModel<StageFrame>(station))
+  , m_clean(ui::CreateAsyncModel<StageClean>(station))
+  , m_auto(ui::CreateAsyncModel<StageAutoMode>(station))
+  , m_auto_exposure(ui::CreateAsyncModel<StageAutoExposure>(station))
+  , m_led(ui::CreateAsyncModel<StageLED>(station))
+  , m_illumination(ui::CreateAsyncModel<StageIllumination>(station))
   , m_progress(0)
   , m_stop(false)
   , m_device_state(StageDSState::idle)
+  , m_retention(false)
+  , m_write_bench_running(false)
+  , m_write_bench_cancel(false)
 {
     std::string camera_name = m_frame->GetCameraName();
-    auto storage = StageSettingStorage::GetInstance();
+    auto storage = StageSettingStorage::GetInstance(m_station);
     storage->SetCameraName(camera_name);
     storage->LoadCameraSettingsFromJson(camera_name);
+    spdlog::info("startup: {} models ready in {} ms",
+                 m_station,
+                 std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now() - m_created)
+                   .count());
 }
 
 void
 StageAgent::Initiate() noexcept
 {
+    StageLogSession::StartRetention();
+    m_retention = true;
     Start<&StageAgent::TaskStatus>(NewLife());
     Start<&StageAgent::TaskEvent>(NewLife());
 }
 
 StageAgent::~StageAgent() 
 {
+    m_write_bench_cancel = true;
 }
 
 void
@@ -88,12 +102,13 @@ StageAgent::DoFocusDevice(async::Lifeguard guard, Device_Cmd cmd)
                 m_device_state &= ~StageDSState::move_busy_x;
                 m_device_state |= StageDSState::move_idle_x;
                 {
-                    int pos_x = 0, pos_y = 0;
                     co_await m_move->GetNotBusy(guard());
-                    pos_x = co_await m_move->GetPos(guard(), MotorRole::mtr_x);
-                    pos_y = co_await m_move->GetPos(guard(), MotorRole::mtr_y);
+                    auto stage = co_await m_move->GetTelemetry(guard());
+                    int pos_x = int(stage.axes[MotorRole::mtr_x].position);
+                    int pos_y = int(stage.axes[MotorRole::mtr_y].position);
                     m_position_label =
-                      wxString::Format("[%d,%d]", pos_x, pos_y);
+                      stage.valid ? wxString::Format("[%d,%d]", pos_x, pos_y)
+                                  : wxString("[?,?]");
                 }
                 done = true;
             }
@@ -138,12 +153,13 @@ StageAgent::DoFocusDevice(async::Lifeguard guard, Device_Cmd cmd)
                 m_device_state &= ~StageDSState::move_busy_y;
                 m_device_state |= StageDSState::move_idle_y;
                 {
-                    int pos_x = 0, pos_y = 0;
                     co_await m_move->GetNotBusy(guard());
-                    pos_x = co_await m_move->GetPos(guard(), MotorRole::mtr_x);
-                    pos_y = co_await m_move->GetPos(guard(), MotorRole::mtr_y);
+                    auto stage = co_await m_move->GetTelemetry(guard());
+                    int pos_x = int(stage.axes[MotorRole::mtr_x].position);
+                    int pos_y = int(stage.axes[MotorRole::mtr_y].position);
                     m_position_label =
-                      wxString::Format("[%d,%d]", pos_x, pos_y);
+                      stage.valid ? wxString::Format("[%d,%d]", pos_x, pos_y)
+                                  : wxString("[?,?]");
                 }
                 done = true;
             }
@@ -168,13 +184,16 @@ StageAgent::DoFocusDevice(async::Lifeguard guard, Device_Cmd cmd)
             break;
 
         case Device_Cmd::SAVE_INIT: {
-            int pos_x = 0, pos_y = 0;
             co_await m_move->GetNotBusy(guard());
-            pos_x = co_await m_move->GetPos(guard(), MotorRole::mtr_x);
-            pos_y = co_await m_move->GetPos(guard(), MotorRole::mtr_y);
+            auto stage = co_await m_move->GetTelemetry(guard());
+            int pos_x = int(stage.axes[MotorRole::mtr_x].position);
+            int pos_y = int(stage.axes[MotorRole::mtr_y].position);
 
-            auto storage = StageSettingStorage::GetInstance();
-            if (storage) {
+            // never a home position the registers did not confirm
+            auto storage = StageSettingStorage::GetInstance(m_station);
+            if (not stage.valid) {
+                spdlog::error("save init: position unknown, not saved");
+            } else if (storage) {
                 storage->SaveSettingToJson(StageConfigKeys::INIT_X_POS, pos_x);
                 storage->SaveSettingToJson(StageConfigKeys::INIT_Y_POS, pos_y);
             }
@@ -247,6 +266,23 @@ StageAgent::DoFocusDevice(async::Lifeguard guard, Device_Cmd cmd)
                 m_device_state |= StageDSState::move_busy_y;
             }
             break;
+
+        case Device_Cmd::LINK_BENCH:
+            co_await m_move->BenchLink(guard(), 500);
+            break;
+
+        case Device_Cmd::WRITE_BENCH:
+            if (m_write_bench_running) {
+                spdlog::warn("write bench: already running");
+            } else if ((m_device_state & StageDSState::auto_busy) or
+                       m_frame->GetState() ==
+                         ds::camera::CameraState::recording) {
+                spdlog::warn("write bench: not while recording");
+            } else {
+                m_write_bench_running = true;
+                Start<&StageAgent::WriteBench>(NewLife());
+            }
+            break;
     }
     co_return;
 }
@@ -259,15 +295,21 @@ StageAgent::DoPumpDeivce(async::Lifeguard guard, Pump_Cmd cmd,wxString flow)
         case Pump_Cmd::PUMP_CCW: {
             m_device_state &= ~StageDSState::pump_idle;
             m_device_state |= StageDSState::pump_busy;
-            co_await m_pump->StartPump(
-              guard(), MotorDir::motdir_ccw, flow_rate);
+            if (not co_await m_pump->StartPump(
+                  guard(), MotorDir::motdir_ccw, flow_rate)) {
+                m_device_state &= ~StageDSState::pump_busy;
+                m_device_state |= StageDSState::pump_idle;
+            }
             break;
         }
         case Pump_Cmd::PUMP_CW: {   
             m_device_state &= ~StageDSState::pump_idle;
             m_device_state |= StageDSState::pump_busy;
-            co_await m_pump->StartPump(
-                guard(), MotorDir::motdir_cw, flow_rate);
+            if (not co_await m_pump->StartPump(
+                  guard(), MotorDir::motdir_cw, flow_rate)) {
+                m_device_state &= ~StageDSState::pump_busy;
+                m_device_state |= StageDSState::pump_idle;
+            }
             break;
         }
         case Pump_Cmd::PUMP_STOP:
@@ -357,6 +399,17 @@ StageAgent::SetLED(async::Lifeguard guard,
         case LED_Cmd::LED_CAM_OFF:
             co_await m_led->SetLEDCamOff(guard(), value);
             break;
+        case LED_Cmd::LED_SEQUENCE:
+            if (m_illumination->IsRunning())
+                co_await m_illumination->StopSequence(guard());
+            if (value) {
+                // one .dsr per channel, next to the run history
+                m_illumination->SetChannels(value);
+                m_illumination->SetRecordFolder(
+                  StationPath(m_station, PATH_TO_HISTORY) + "/illumination");
+                co_await m_illumination->StartSequence(guard());
+            }
+            break;
     }
     co_return;
 }
@@ -460,9 +513,79 @@ StageAgent::TaskEvent(async::Lifeguard guard)
     co_return;
 }
 
+asio::awaitable<void>
+StageAgent::WriteBench(async::Lifeguard guard)
+{
+    auto timer = ds::async::Timer();
+
+    // 1. distinct live frames, at the frame rate for a normal_seconds
+    // window, then as fast as the writer takes them
+    auto storage = StageSettingStorage::GetInstance(m_station);
+    const auto interval = std::chrono::duration_cast<std::chrono::microseconds>(
+      m_frame->GetFrameInterval());
+    std::vector<cv::Mat> grays;
+    std::optional<uint64_t> last;
+    while (storage and interval.count() > 0 and
+           grays.size() < std::size_t(WRITER_BENCH_FRAMES)) {
+        auto frame = co_await m_frame->GetAsyncFrame(guard());
+        if (not frame)
+            break;
+        if (last and CameraFrameId(*frame) == *last)
+            continue;
+        last = CameraFrameId(*frame);
+        grays.push_back(frame->CreateGray().clone());
+    }
+    if (grays.size() < std::size_t(WRITER_BENCH_FRAMES)) {
+        spdlog::warn("write bench: no frames, frame rate or settings");
+        m_write_bench_running = false;
+        co_return;
+    }
+    const int seconds =
+      std::get<int>(storage->GetSettings(StageConfigKeys::NORMAL_SECONDS));
+    const int frames = int(std::chrono::seconds(seconds) / interval);
+    const auto options = RecordWriterOptions(m_station);
+    const std::filesystem::path path =
+      std::get<std::string>(storage->GetSettings(StageConfigKeys::BENCH_PATH));
+
+    // 2. the writer blocks, so it runs on its own thread; the raw codec
+    // runs as well, as the baseline of the configured one
+    auto raw = options;
+    raw.codec = RecordCodec::raw;
+    m_write_bench_cancel = false;
+    m_write_bench = std::async(
+      std::launch::async,
+      [=, cancel = &m_write_bench_cancel]() {
+          try {
+              for (const auto& run : { options, raw }) {
+                  StageFrameWriter::Bench(
+                    path, grays, frames, interval, run, cancel);
+                  StageFrameWriter::Bench(
+                    path, grays, frames, {}, run, cancel);
+                  if (options.codec == RecordCodec::raw)
+                      break;
+              }
+          } catch (const std::exception& e) {
+              spdlog::error("write bench: {}", e.what());
+          }
+      });
+
+    // 3. a recording that starts meanwhile cancels it
+    while (m_write_bench.wait_for(0s) != std::future_status::ready) {
+        if ((m_device_state & StageDSState::auto_busy) or
+            m_frame->GetState() == ds::camera::CameraState::recording)
+            m_write_bench_cancel = true;
+        co_await timer.AsyncSleepFor(guard(), 100ms);
+    }
+    m_write_bench.get();
+    m_write_bench_running = false;
+    co_return;
+}
+
 asio::awaitable<void>
 StageAgent::ShutDown(async::Lifeguard guard)
 {
+    if (std::exchange(m_retention, false))
+        StageLogSession::StopRetention();
     co_await m_move->StopMove(guard(), MotorRole::mtr_y);
     co_await m_move->StopMove(guard(), MotorRole::mtr_x);
     co_await m_pump->StopPump(guard());
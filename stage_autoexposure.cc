@@ -1,192 +1,236 @@
-
-#include <fstream>
-#include <iostream>
-#include <map>
-#include <opencv2/opencv.hpp>
-#include <spdlog/spdlog.h>
-
-#include "stage_settings.h"
-#include "stage_utility.h"
-#include "stage_autoexposure.h"
-#include <stage_autofocus.h>
-
-namespace ds::depthscan {
-constexpr int iteration = 10;
-
-StageAutoExposure::StageAutoExposure() 
-  : m_frame(ui::CreateAsyncModel<StageFrame>())
-  , m_move(ui::CreateAsyncModel<StageMove>())
-  , m_iteration(0)
-  , m_cancel(false)
-  , m_exposure_value(50us)
-{
-}
-StageAutoExposure::~StageAutoExposure()
-{
-}
-void
-StageAutoExposure::Initiate() noexcept
-{
-}
-
-static void
-SaveExposureCsv(const std::string& path,
-                const std::vector<ExposureResult>& values)
-{
-    std::ofstream file(path);
-
-    if (not file.is_open()) {
-        throw std::runtime_error("Failed to open file");
-    }
-
-    file << "Exposure,Bright,Contrast,Over,Under,Score\n";
-
-    for (size_t i = 0; i < values.size(); i++) {
-        file << values[i].exposure_time << "," << values[i].brightness << ","
-             << values[i].contrast << "," << values[i].overexposed_ratio << ","
-             << values[i].underexposed_ratio << "," << values[i].quality_score
-             << "\n";
-    }
-
-    file.close();
-}
-asio::awaitable<void>
-StageAutoExposure::InitSetup(async::Lifeguard guard)
-{
-    StageFileHandle File(PATH_TO_AUTOEXPOSURE);
-    File.DeleteWholeFiles();
-    m_iteration = 0;
-    m_exposure_data.resize(m_iteration);
-    m_exposure_value = 50us;
-    co_return;
-}
-asio::awaitable<void>
-StageAutoExposure::Processing(async::Lifeguard guard)
-{
-    StageProcessImage Image;
-
-    StageDateTimeFormat Time;
-    std::string TimeStamp = Time.GetTime();
-    StageFileHandle File(PATH_TO_AUTOEXPOSURE);
-    m_exposure_data.resize(iteration);
-    auto timer = ds::async::Timer();
-
-    m_frame->GetCamera()->SetExposureTime(m_exposure_value);
-    co_await timer.AsyncSleepFor(guard(), 1000ms);
-
-    while ((m_iteration < iteration) and (not m_cancel)){
-        auto frame = co_await m_frame->GetAsyncFrame(guard());
-        if (frame) {
-            auto gray = frame->CreateGray();
-            //1. Brightness
-            m_exposure_data[m_iteration].brightness = cv::mean(gray)[0];
-            //2. Contrast
-            cv::Scalar mean, stddev;
-            cv::meanStdDev(gray, mean, stddev);
-            m_exposure_data[m_iteration].contrast = stddev[0];
-            //3. Histogram -> over/under exposure
-            auto hist = Image.CalculateHistogram(gray);
-            double total = gray.rows * gray.cols;
-            hist /= total;
-
-            double over_exposed = 0.0f;
-            for (int i = 240; i < 256; i++) {
-                over_exposed += hist.at<float>(i);
-            }
-            m_exposure_data[m_iteration].overexposed_ratio = over_exposed * 100.0;
-
-            double under_exposed = 0.0;
-            for (int i = 0; i < 15; i++) {
-                under_exposed += hist.at<float>(i);
-            }
-            m_exposure_data[m_iteration].underexposed_ratio = under_exposed * 100.0;
-            // 4. score
-            double brightness_score =
-              1.0 -
-              std::abs(m_exposure_data[m_iteration].brightness - 128.0) / 128.0;
-            double exposure_penalty =
-              5.0 * (m_exposure_data[m_iteration].overexposed_ratio / 100.0 +
-                     m_exposure_data[m_iteration].underexposed_ratio / 100.0);
-
-            m_exposure_data[m_iteration].quality_score =
-              (0.4 * brightness_score +
-               0.3 *
-                 std::min(m_exposure_data[m_iteration].contrast / 50.0, 1.0) -
-               0.3 * exposure_penalty) *
-              100.0;
-
-            m_exposure_data[m_iteration].quality_score =
-              std::max(0.0, m_exposure_data[m_iteration].quality_score);
-
-            m_exposure_data[m_iteration].exposure_time = m_exposure_value;
-            Image.SaveImages(
-              File.GetFileName(
-                TimeStamp, ".png", m_exposure_value, m_iteration),
-              gray,
-              90);
-            m_exposure_value += 10us;
-            m_iteration++;
-            m_frame->GetCamera()->SetExposureTime(m_exposure_value);
-
-            co_await timer.AsyncSleepFor(guard(), 1000ms);
-        }
-    }
-    co_return;
-}
-asio::awaitable<void>
-StageAutoExposure::Complete(async::Lifeguard guard)
-{
-    StageProcessImage Image;
-
-    StageDateTimeFormat Time;
-    std::string TimeStamp = Time.GetTime();
-    StageFileHandle File(PATH_TO_AUTOEXPOSURE);
-
-    auto best_it =
-      std::max_element(m_exposure_data.begin(),
-                       m_exposure_data.end(),
-                       [](const ExposureResult& a, const ExposureResult& b) {
-                           return a.quality_score < b.quality_score;
-                       });
-    m_exposure_value = best_it->exposure_time;
-
-    auto timer = ds::async::Timer();
-
-    m_frame->GetCamera()->SetExposureTime(m_exposure_value);
-    co_await timer.AsyncSleepFor(guard(), 1000ms);
-
-    auto frame = co_await m_frame->GetAsyncFrame(guard());
-    if (frame) {
-        auto gray = frame->CreateGray();
-        Image.SaveImages(
-          File.GetFileName(TimeStamp, ".png", m_exposure_value, "best"),
-          gray,
-          ROTATE);
-    }
-    std::string save_file = File.GetFileName("0000", ".csv", "exposure_log");
-
-    SaveExposureCsv(save_file, m_exposure_data);
-
-    co_return;
-}
-
-asio::awaitable<void>
-StageAutoExposure::StartAutoExposure(async::Lifeguard guard)
-{
-    m_cancel = false;
-    co_await InitSetup(guard());
-    auto timer = ds::async::Timer();
-    co_await timer.AsyncSleepFor(guard(), 1000ms);
-    co_await Processing(guard());
-    co_await Complete(guard());
-
-    co_return;
-}
-asio::awaitable<void>
-StageAutoExposure::CancelAutoExposure(async::Lifeguard guard)
-{
-    m_cancel = true;
-    m_cond.Notify();
-    co_return;
-}
+
+#include <fstream>
+#include <iostream>
+#include <cmath>
+#include <map>
+#include <opencv2/opencv.hpp>
+#include <spdlog/spdlog.h>
+
+#include "stage_settings.h"
+#include "stage_utility.h"
+#include "stage_autoexposure.h"
+#include <stage_autofocus.h>
+
+namespace ds::depthscan {
+constexpr int max_iteration = 12;
+constexpr double brightness_tolerance = 4.0; // gray levels around the target
+constexpr double exposure_resolution = 0.02; // log(exposure) bracket width
+
+StageAutoExposure::StageAutoExposure(const StationId& station)
+  : m_station(station)
+  , m_frame(ui::CreateAsyncModel<StageFrame>(station))
+  , m_move(ui::CreateAsyncModel<StageMove>(station))
+  , m_iteration(0)
+  , m_cancel(false)
+  , m_exposure_value(50us)
+{
+}
+StageAutoExposure::~StageAutoExposure()
+{
+}
+void
+StageAutoExposure::Initiate() noexcept
+{
+}
+
+static void
+SaveExposureCsv(const std::string& path,
+                const std::vector<ExposureResult>& values)
+{
+    std::ofstream file(path);
+
+    if (not file.is_open()) {
+        throw std::runtime_error("Failed to open file");
+    }
+
+    file << "Exposure,Bright,Contrast,Over,Under,Score\n";
+
+    for (size_t i = 0; i < values.size(); i++) {
+        file << values[i].exposure_time << "," << values[i].brightness << ","
+             << values[i].contrast << "," << values[i].overexposed_ratio << ","
+             << values[i].underexposed_ratio << "," << values[i].quality_score
+             << "\n";
+    }
+
+    file.close();
+}
+static ExposureResult
+EvaluateExposure(const cv::Mat& gray)
+{
+    ExposureResult result;
+    // 1-3. Brightness, contrast and over/under exposure in one pass
+    result.SetStatistics(ComputeExposureStatistics(gray));
+    // 4. score
+    double brightness_score =
+      1.0 - std::abs(result.brightness - 128.0) / 128.0;
+    double exposure_penalty = 5.0 * (result.overexposed_ratio / 100.0 +
+                                     result.underexposed_ratio / 100.0);
+
+    result.quality_score = (0.4 * brightness_score +
+                            0.3 * std::min(result.contrast / 50.0, 1.0) -
+                            0.3 * exposure_penalty) *
+                           100.0;
+
+    result.quality_score = std::max(0.0, result.quality_score);
+    return result;
+}
+static double
+ExposureToLog(std::chrono::nanoseconds exposure)
+{
+    return std::log(double(exposure.count()));
+}
+static std::chrono::nanoseconds
+ExposureFromLog(double value)
+{
+    auto exposure = std::chrono::nanoseconds(std::llround(std::exp(value)));
+    return std::clamp<std::chrono::nanoseconds>(
+      exposure, EXPOSURE_MIN, EXPOSURE_MAX);
+}
+asio::awaitable<void>
+StageAutoExposure::InitSetup(async::Lifeguard guard)
+{
+    StageLogSession::Begin(StationPath(m_station, PATH_TO_AUTOEXPOSURE));
+    m_iteration = 0;
+    m_exposure_data.clear();
+    m_exposure_value = 2000us;
+    auto storage = StageSettingStorage::GetInstance(m_station);
+    if (storage) {
+        m_exposure_value =
+          std::chrono::microseconds(storage->GetExposureTime());
+    }
+    m_exposure_value = std::clamp<std::chrono::nanoseconds>(
+      m_exposure_value, EXPOSURE_MIN, EXPOSURE_MAX);
+    co_return;
+}
+asio::awaitable<std::shared_ptr<const ds::camera::Frame>>
+StageAutoExposure::ApplyExposure(async::Lifeguard guard,
+                                 std::chrono::nanoseconds exposure)
+{
+    m_frame->SetExposureTime(exposure);
+    co_return co_await m_frame->GetAsyncFrameAfterChange(guard(),
+                                                         &m_cancel);
+}
+asio::awaitable<void>
+StageAutoExposure::Processing(async::Lifeguard guard)
+{
+    StageProcessImage Image;
+
+    StageDateTimeFormat Time;
+    std::string TimeStamp = Time.GetTime();
+    StageFileHandle File(StationPath(m_station, PATH_TO_AUTOEXPOSURE));
+
+    // Brightness is monotone in exposure: keep a bracket of the target in
+    // log(exposure) and step by secant, falling back to bisection whenever
+    // the secant leaves the bracket (e.g. on a saturated sample).
+    double lower = ExposureToLog(EXPOSURE_MIN);
+    double upper = ExposureToLog(EXPOSURE_MAX);
+    double x = ExposureToLog(m_exposure_value);
+    double prev_x = 0.0;
+    double prev_f = 0.0;
+    bool has_prev = false;
+
+    while ((m_iteration < max_iteration) and (not m_cancel)) {
+        m_exposure_value = ExposureFromLog(x);
+        auto frame = co_await ApplyExposure(guard(), m_exposure_value);
+        if (not frame) {
+            m_iteration++; // a stalled camera must not hold the loop
+            continue;
+        }
+
+        auto gray = frame->CreateGray();
+        ExposureResult result = EvaluateExposure(gray);
+        result.exposure_time = m_exposure_value;
+        m_exposure_data.push_back(result);
+
+        Image.SaveImages(
+          File.GetFileName(TimeStamp, ".png", m_exposure_value, m_iteration),
+          gray,
+          90);
+        m_iteration++;
+
+        double f = result.brightness - EXPOSURE_TARGET;
+        spdlog::info("exposure[{}] {}ns -> {:.1f} ({:.1f})",
+                     m_iteration,
+                     m_exposure_value.count(),
+                     result.brightness,
+                     result.quality_score);
+        if (std::abs(f) <= brightness_tolerance)
+            break;
+        if (f < 0)
+            lower = x;
+        else
+            upper = x;
+        if ((upper - lower) < exposure_resolution)
+            break;
+
+        double next = 0.0;
+        if (has_prev and (f != prev_f)) {
+            next = x - f * (x - prev_x) / (f - prev_f);
+        } else {
+            // first sample: brightness is roughly proportional to exposure
+            next = x + std::log(EXPOSURE_TARGET /
+                                std::max(result.brightness, 1.0));
+        }
+        if (not((next > lower) and (next < upper)))
+            next = (lower + upper) / 2.0;
+
+        prev_x = x;
+        prev_f = f;
+        has_prev = true;
+        x = next;
+    }
+    co_return;
+}
+asio::awaitable<void>
+StageAutoExposure::Complete(async::Lifeguard guard)
+{
+    StageProcessImage Image;
+
+    StageDateTimeFormat Time;
+    std::string TimeStamp = Time.GetTime();
+    StageFileHandle File(StationPath(m_station, PATH_TO_AUTOEXPOSURE));
+
+    if (m_exposure_data.empty())
+        co_return;
+
+    auto best_it =
+      std::max_element(m_exposure_data.begin(),
+                       m_exposure_data.end(),
+                       [](const ExposureResult& a, const ExposureResult& b) {
+                           return a.quality_score < b.quality_score;
+                       });
+    m_exposure_value = best_it->exposure_time;
+
+    auto frame = co_await ApplyExposure(guard(), m_exposure_value);
+    if (frame) {
+        auto gray = frame->CreateGray();
+        Image.SaveImages(
+          File.GetFileName(TimeStamp, ".png", m_exposure_value, "best"),
+          gray,
+          ROTATE);
+    }
+    std::string save_file = File.GetFileName("0000", ".csv", "exposure_log");
+
+    SaveExposureCsv(save_file, m_exposure_data);
+
+    co_return;
+}
+
+asio::awaitable<void>
+StageAutoExposure::StartAutoExposure(async::Lifeguard guard)
+{
+    m_cancel = false;
+    co_await InitSetup(guard());
+    co_await Processing(guard());
+    co_await Complete(guard());
+
+    co_return;
+}
+asio::awaitable<void>
+StageAutoExposure::CancelAutoExposure(async::Lifeguard guard)
+{
+    m_cancel = true;
+    m_cond.Notify();
+    co_return;
+}
 }
\ No newline at end of file
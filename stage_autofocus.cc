@@ -1,1230 +1,1415 @@
-
-#include <fstream>
-#include <iostream>
-#include <map>
-#include <opencv2/opencv.hpp>
-#include <spdlog/spdlog.h>
-#include <chrono>
-#include "label_strings.h"
-#include "stage_autofocus.h"
-#include "stage_settings.h"
-#include "stage_utility.h"
-
-namespace ds::depthscan {
-
-constexpr auto FOCUS = Method_Focus::ROI_LINE; /// ROI
-
-static cv::Mat
-CovertGaussianBlur(const cv::Mat& image, auto kernelSize = (9, 9))
-{
-    cv::Mat imageBlur;
-    cv::GaussianBlur(image, imageBlur, kernelSize, 0);
-    return imageBlur;
-}
-static double
-calculateSlope(const std::vector<double>& x, const std::vector<double>& y)
-{
-    int n = x.size();
-    if (n != y.size() || n == 0) {
-        throw std::invalid_argument(
-          "Vectors x and y must have the same non-zero length");
-    }
-
-    double sum_x = std::accumulate(x.begin(), x.end(), 0.0);
-    double sum_y = std::accumulate(y.begin(), y.end(), 0.0);
-    double sum_xx = std::inner_product(x.begin(), x.end(), x.begin(), 0.0);
-    double sum_xy = std::inner_product(x.begin(), x.end(), y.begin(), 0.0);
-
-    double slope = (n * sum_xy - sum_x * sum_y) / (n * sum_xx - sum_x * sum_x);
-    return slope;
-}
-static std::vector<int>
-find_local_minima(const std::vector<double>& values, int order)
-{
-    std::vector<int> local_minima_indices;
-
-    for (int i = order; i < values.size() - order; ++i) {
-        bool is_local_minima = true;
-
-        for (int j = 1; j <= order; ++j) {
-            if (values[i] >= values[i - j] || values[i] >= values[i + j]) {
-                is_local_minima = false;
-                break;
-            }
-        }
-
-        if (is_local_minima) {
-            std::vector<double> x = { static_cast<double>(i - order),
-                                      static_cast<double>(i),
-                                      static_cast<double>(i + order) };
-            std::vector<double> y = { values[i - order],
-                                      values[i],
-                                      values[i + order] };
-            double slope = calculateSlope(x, y);
-            // spdlog::info("slope[{}] : {}", i, slope);
-            if (std::abs(slope) >= 0.000001)
-                local_minima_indices.push_back(i);
-        }
-    }
-
-    return local_minima_indices;
-}
-static std::vector<int>
-find_local_maxima(const std::vector<double>& values, int order)
-{
-    std::vector<int> local_maxima_indices;
-
-    for (int i = order; i < values.size() - order; ++i) {
-
-        std::vector<double> x = { static_cast<double>(i - order),
-                                  static_cast<double>(i),
-                                  static_cast<double>(i + order) };
-        std::vector<double> y = { values[i - order],
-                                  values[i],
-                                  values[i + order] };
-        double slope = calculateSlope(x, y);
-
-        if (slope > 0.005) {
-            // spdlog::info("slope[{}] : {}", i, slope);
-            local_maxima_indices.push_back(i);
-        }
-    }
-
-    return local_maxima_indices;
-}
-
-static int
-CalculateCalibration(int idx, bool fine, int width)
-{
-    int calibration = 0;
-    int center_idx = width / 2 ;
-
-    calibration = (idx - center_idx);
-
-    if (fine) {
-        calibration = std::clamp(calibration, -50, 50);
-    } else {
-        calibration = std::clamp(calibration, -(width / 2), (width / 2));
-    }
-    return calibration;
-}
-static void
-SaveCenteringImages(const std::string path,const cv::Mat& img,
-                    int pos,
-                    int num)
-{
-    StageDateTimeFormat Time;
-    std::string TimeStamp = Time.GetTime();
-
-    StageFileHandle File(path);
-    StageProcessImage Image;
-
-    Image.SaveImages(
-      File.GetFileName(TimeStamp, ".png", pos, num, "C"), img, 0);
-}
-
-static cv::Mat
-CovertGaussianBlur(const cv::Mat& image, cv::Size kernelSize = cv::Size(31, 31))
-{
-    cv::Mat imageBlur;
-    cv::GaussianBlur(image, imageBlur, kernelSize, 5.0, 5.0, cv::BORDER_DEFAULT);
-    return imageBlur;
-}
-static auto
-FocusingImageRegions(
-  const cv::Mat& src, int x, int y, int width, int height, int offset)
-{
-    StageProcessImage Image;
-
-    return std::make_pair(
-      Image.CropImage(src, x, y, width, height),
-      Image.CropImage(src, x + offset, y + offset, width, height));
-}
-static void
-SaveFocusingImages(const std::string path,const cv::Mat& image, int pos, int num, double angle)
-{
-    StageDateTimeFormat Time;
-    std::string TimeStamp = Time.GetTime();
-
-    StageFileHandle File(path);
-    StageProcessImage Image;
-
-    Image.SaveImages(
-      File.GetFileName(TimeStamp, ".png", pos, num), image, angle);
-}
-
-static bool
-IsFocusMethodROI(Method_Focus method)
-{
-    if (FOCUS == method)
-        return true;
-    else
-        return false;
-}
-static bool
-IsFinal(int final_num, int now_step)
-{
-    if (now_step >= (final_num - 1))
-        return true;
-    else
-        return false;
-}
-static int
-DetermineIndex(const std::vector<int>& local_indices,
-               const std::vector<double>& templates,
-               bool minMethod)
-{
-    int idx = 0;
-    if (local_indices.size() >= 2) {
-        std::vector<std::pair<int, double>> sorted_ma;
-        for (int index : local_indices) {
-            sorted_ma.emplace_back(index, templates[index]);
-        }
-        if (minMethod) {
-            std::sort(sorted_ma.begin(),
-                      sorted_ma.end(),
-                      [](const std::pair<int, double>& a,
-                         const std::pair<int, double>& b) {
-                          return a.second < b.second;
-                      });
-        } else {
-            std::sort(sorted_ma.begin(),
-                      sorted_ma.end(),
-                      [](const std::pair<int, double>& a,
-                         const std::pair<int, double>& b) {
-                          return a.second > b.second;
-                      });
-        }
-        idx = sorted_ma[0].first;
-        // int second_idx = sorted_ma[1].first;
-        //  int decision_idx    = (min_idx + second_min_idx) / 2;
-
-    } else {
-        auto element_iter =
-          std::min_element(templates.begin(), templates.end() - 1);
-
-        if (minMethod)
-            element_iter =
-              std::min_element(templates.begin(), templates.end() - 1);
-        else
-            element_iter =
-              std::max_element(templates.begin(), templates.end() - 1);
-
-        if (element_iter != templates.end()) {
-            idx = std::distance(templates.begin(), element_iter);
-        }
-    }
-    spdlog::info("local:({})", idx);
-    return idx;
-}
-static std::tuple<int, int, int, int>
-FinalizeFocus(const std::vector<double>& templates,
-              const std::vector<double>& positions,
-              bool overall)
-{
-    auto local_minima_indices = find_local_minima(templates, 3);
-    int decision_min_idx =
-      DetermineIndex(local_minima_indices, templates, true);
-    // decision_idx += 15; /// 15steps is external mark
-
-    auto local_maxima_indices = find_local_maxima(templates, 2);
-    int decision_max_idx =
-      DetermineIndex(local_maxima_indices, templates, false);
-
-    int decision_idx = 0;
-
-    if (IsFocusMethodROI(Method_Focus::ROI_LINE)) {
-        if (overall)
-            decision_idx = decision_min_idx + 4;
-        else
-            // decision_idx = decision_max_idx+0;
-            decision_idx = decision_min_idx + 3;
-    }
-    else if (IsFocusMethodROI(Method_Focus::ROI_MARKER)) {
-        //if (decision_min_idx > 35)
-        //    decision_idx = decision_min_idx - 35;
-        decision_idx = decision_min_idx + 70;
-    } else {
-            decision_idx += decision_min_idx;
-    }
-    int decision_pos = 0;
-    if (decision_idx >= positions.size()) {
-        decision_pos =
-          positions[positions.size() - 2] + (decision_idx - positions.size()) * 256;
-        spdlog::info(
-          "over:({},{},{})", decision_idx, positions.size(), decision_pos);
-        decision_idx = positions.size() - 1;
-    } else if (decision_idx < 0) {
-        decision_idx = 0;
-        decision_pos = positions[decision_idx];
-    } else {
-        decision_pos = positions[decision_idx];
-    }
-
-    return { decision_min_idx, decision_max_idx, decision_idx, decision_pos };
-}
-static void
-SaveFocusCsv(const std::string& path,
-             const std::vector<double>& values,
-             const std::vector<double>& positions,
-             int min_idx,
-             int second_min_idx,
-             int decision_idx,
-             int decision_pos,
-             int length)
-{
-    std::ofstream file(path);
-
-    if (not file.is_open()) {
-        throw std::runtime_error("Failed to open file");
-    }
-
-    file << "Index,Position,Value\n";
-
-    for (size_t i = 0; i < length; i++) {
-        file << i << "," << positions[i] << "," << values[i] << "\n";
-    }
-    file << "First:" << min_idx << ",Second:" << second_min_idx
-         << ",Decision:" << decision_idx << "," << decision_pos << "\n";
-    file.close();
-}
-static void
-SaveFocusLog(const std::string& path,
-             int num,
-             bool bubble,
-             int min_idx,
-             int max_idx,
-             int x_pos,
-             int y_pos)
-{
-    std::ofstream file(path, std::ios::app);
-
-    if (not file.is_open()) {
-        throw std::runtime_error("Failed to open file");
-    }
-
-    file << num << "," << bubble << "," << min_idx << "," << max_idx << ","
-         << x_pos << "," << y_pos << "\n";
-    file.close();
-}
-static std::tuple<cv::Mat, int>
-DetectVerticalLines(const cv::Mat& image, const int width)
-{
-    cv::Mat vertical_kernel =
-      cv::getStructuringElement(cv::MORPH_RECT, cv::Size(20, 30));
-    cv::Mat vertical_lines;
-    cv::morphologyEx(image, vertical_lines, cv::MORPH_OPEN, vertical_kernel);
-
-    cv::Mat vertical_edge;
-    cv::Canny(vertical_lines, vertical_edge, 50, 100, 3, false);
-    std::vector<cv::Vec4i> lines;
-
-    // cv::HoughLinesP(vertical_edge, lines, 1, CV_PI / 180, 50, 100, 10);
-    cv::HoughLinesP(vertical_edge, lines, 1, CV_PI / 180, 100, 150, 10);
-    cv::Mat output;
-    cv::cvtColor(image, output, cv::COLOR_GRAY2BGR);
-
-    int line_color_size = 8;
-
-    std::vector<int> y_coords;
-    if (not lines.empty()) {
-        for (const auto& line : lines) {
-            if (std::abs(line[0] - line[2]) < 10) {
-                cv::line(output,
-                         cv::Point(line[0], line[1]),
-                         cv::Point(line[2], line[3]),
-                         cv::Scalar(0, 0, 255), /* red */
-                         line_color_size);
-                y_coords.push_back((line[0] + line[2]) / 2);
-            }
-        }
-        spdlog::info("edge coords: ({},{})", lines.size(), y_coords.size());
-        std::sort(y_coords.begin(), y_coords.end());
-        std::vector<std::vector<int>> clusters;
-        std::vector<int> current_cluster;
-        for (int x : y_coords) {
-            if (current_cluster.empty()) {
-                current_cluster.push_back(x);
-            } else {
-                if (x - current_cluster.back() < 50) {
-                    current_cluster.push_back(x);
-                } else {
-                    clusters.push_back(current_cluster);
-                    current_cluster.clear();
-                    current_cluster.push_back(x);
-                }
-            }
-        }
-        if (not current_cluster.empty()) {
-            clusters.push_back(current_cluster);
-        }
-
-        std::vector<int> edges;
-        for (const auto& cluster : clusters) {
-            int _edge = cluster[cluster.size() / 2]; // take the middle value
-            edges.push_back(_edge);
-        }
-        for (const auto& edge : edges) {
-            cv::line(output,
-                     cv::Point(edge, 0),
-                     cv::Point(edge, image.rows),
-                     cv::Scalar(255, 0, 0), /* blue */
-                     line_color_size);
-        }
-        spdlog::info("edge: {}", edges.size());
-        std::sort(edges.begin(), edges.end());
-        int left_edge = -1;
-        int right_edge = -1;
-        if (edges.size() >= 2) {
-            left_edge = edges.front();
-            right_edge = edges.back();
-            if ((right_edge - left_edge) < 10) {
-                right_edge = -1;
-            }
-        } else if (edges.size() == 1) {
-            int edge = edges[0];
-            if (edge < width / 2) {
-                left_edge = edge;
-            } else {
-                right_edge = edge;
-            }
-        }
-        spdlog::info("left_edge: {}, right_edge: {}, size: {}, width: {}",
-                     left_edge,
-                     right_edge,
-                     y_coords.size(),
-                       width);
-        std::vector<int> decision_lines;
-        if (left_edge != -1) {
-            cv::line(output,
-                     cv::Point(left_edge, 0),
-                     cv::Point(left_edge, image.rows),
-                     cv::Scalar(0, 255, 0), /* green */
-                     line_color_size);
-            decision_lines.push_back(left_edge);
-        }
-        if (right_edge != -1) {
-            cv::line(output,
-                     cv::Point(right_edge, 0),
-                     cv::Point(right_edge, image.rows),
-                     cv::Scalar(0, 255, 0), /* green */
-                     line_color_size);
-            decision_lines.push_back(right_edge);
-        }
-        int center = 0;
-        int center_idx = width / 2;
-        int edge_idx = center_idx;
-        if (decision_lines.size() >= 2) {
-            if (abs(decision_lines[0] - decision_lines[1]) < (CHANNEL_WIDTH / 2))
-            {
-                if (decision_lines[0] < center_idx) {
-                    edge_idx -= CHANNEL_WIDTH / 2;
-                    if (edge_idx < decision_lines[0])
-                        center = width / 2 - (decision_lines[0] - edge_idx);
-                    else
-                        center = width / 2;
-                } else {
-                    edge_idx += CHANNEL_WIDTH / 2;
-                    if (edge_idx > decision_lines[0])
-                        center = width / 2 + (edge_idx - decision_lines[0]);
-                    else
-                        center = width / 2;
-                }
-            } else {
-                center = (decision_lines[1] + decision_lines[0]) / 2;
-                if (center > center_idx)
-                    center = center_idx - (center - center_idx);
-                else
-                    center = center_idx + (center_idx - center);
-            }
-
-        } else if (decision_lines.size() == 1) {
-
-
-            if (right_edge != -1) {
-                edge_idx += CHANNEL_WIDTH / 2;
-                if (edge_idx > decision_lines[0])
-                    center = width / 2 + (edge_idx - decision_lines[0]);
-                else
-                    center = width / 2;
-
-            } else {
-                edge_idx -= CHANNEL_WIDTH / 2;
-                if (edge_idx < decision_lines[0])
-                    center = width / 2 - (decision_lines[0] - edge_idx);
-                else
-                    center = width / 2;
-            }
-        } else {
-            spdlog::info(" no edge detected");
-            center = width / 2;
-        }
-        spdlog::info("center : {} ", center);
-        return { output, center };
-    } else {
-        spdlog::info(" no line detected");
-        return { output, width / 2 }; // no changed.
-    }
-}
-StageAutoFocus::StageAutoFocus()
-  : m_cancel(false)
-  , m_frame(ui::CreateAsyncModel<StageFrame>())
-  , m_move(ui::CreateAsyncModel<StageMove>())
-  , m_pump(ui::CreateAsyncModel<StagePump>())
-  , m_automode(ui::CreateAsyncModel<StageAutoMode>())
-  , m_state(StageDSState::focus_idle)
-  , m_center_idx(0)
-  , m_need_water(false)
-  , m_min_idx(0)
-  , m_max_idx(0)
-  , m_overall_focusing(false)
-  , m_stop(false)
-  , m_need_focusing(false)
-  , m_ok_user_water(false)
-{
-
-    auto storage = StageSettingStorage::GetInstance();
-    if (storage) {
-        m_step =
-          std::get<int>(storage->GetSettings(StageConfigKeys::FOCUS_STEP));
-        m_total_steps =
-          std::get<int>(storage->GetSettings(StageConfigKeys::FOCUS_NUMOFSTEP));
-        m_start_pos = m_step * int(m_total_steps / 2);
-        m_init_x_pos =
-          std::get<int>(storage->GetSettings(StageConfigKeys::INIT_X_POS));
-
-    }
-}
-StageAutoFocus::~StageAutoFocus() {}
-
-void
-StageAutoFocus::Initiate() noexcept
-{
-}
-
-
-asio::awaitable<void>
-StageAutoFocus::InitSetup(async::Lifeguard guard,
-                          bool fine,
-                          std::string path) ///< ready
-{
-    m_send_progress = 0;
-    m_send_label = LabelStrings::Waiting;
-    SetState(StageDSState::focus_busy);
-
-    co_await m_move->GetNotBusy(guard());
-    m_send_label = LabelStrings::Start;
-    m_num_focus = 0;
-    m_need_water = false;
-    if (not fine) {
-        StageFileHandle File(path);
-        File.DeleteWholeFiles();
-
-        int x_pos=0;
-        int y_pos=0;
-        auto storage = StageSettingStorage::GetInstance();
-        if (storage) {
-            x_pos = std::get<int>(storage->GetSettings("last_x_pos"));
-            y_pos = std::get<int>(storage->GetSettings("last_y_pos"));
-        }
-        co_await m_move->MoveLastPos(guard(), x_pos, y_pos);
-    }
-
-    co_return;
-}
-
-asio::awaitable<void>
-StageAutoFocus::CenterPosition(async::Lifeguard guard,
-                               bool fine,
-                               std::string path) // Get frame and processing the frame
-{
-    bool done = false;
-    StageProcessImage Image;
-
-    auto timer = ds::async::Timer();
-
-    while (not done and not m_cancel) {
-        auto frame = co_await m_frame->GetAsyncFrame(guard());
-        if (frame) {
-            m_send_label = LabelStrings::Checking;
-            // 1. Image pre-process
-            const int height = frame->height;
-            const int width = frame->width;
-            // gray
-
-            cv::Mat src = frame->CreateGray();
-            // 2. ROI & Crop
-            const int roi_start_x = 0;
-            const int roi_start_y = 0;
-            const int roi_width = width ;
-            const int roi_height = height;
-            spdlog::info("w,h=({},{})", width, height);
-            cv::Mat source = Image.ImageRegions(
-              src, roi_start_x, roi_start_y, roi_width, roi_height, ROTATE);
-
-            cv::Mat binary;
-            cv::threshold(source, binary, 100, 255, cv::THRESH_BINARY_INV);
-            SaveCenteringImages(path, binary, 0, 0);
-            // 3. Vertical line detect
-            auto [img_centering, center_idx] =
-              DetectVerticalLines(source, width);
-
-            // 4. compute the calibration
-            int calibration = CalculateCalibration(center_idx, fine, width);
-
-            m_center_idx = center_idx - calibration;
-
-            // save images
-            int y_pos = co_await m_move->GetPos(guard(), MotorRole::mtr_y);
-            int x_pos = co_await m_move->GetPos(guard(), MotorRole::mtr_x);
-            spdlog::info("x,y=({},{})", x_pos, y_pos);
-            SaveCenteringImages(path,img_centering, x_pos, m_num_focus);
-
-            // 5. y centering
-            if (calibration != 0) {
-                y_pos += (calibration * MICRO_STEP_MUILPLIER);
-                co_await m_move->Move(guard(),
-                                      MotorRole::mtr_y,
-                                      SingleMode::mode_cnt,
-                                      200 * MICRO_STEP,
-                                      y_pos);
-                m_move->SetLastPos(MotorRole::mtr_y, y_pos);
-                spdlog::info("offset,y=({},{})", calibration, y_pos);
-            }
-            // 5-1. Detect the line thickness
-            if ((not fine) and IsFocusMethodROI(Method_Focus::ROI_LINE)) {
-
-                cv::Mat line_binary = Image.ImageRegions(
-                  binary,
-                  m_center_idx - (CHANNEL_WIDTH / 2) - LINE_ROI_OFFSET,
-                  height / 2,
-                  LINE_ROI_OFFSET * 2,
-                  200,
-                  ROTATE);                
-
-                // 5-2. 각 열의 픽셀 합산 (히스토그램)
-                std::vector<int> vertical_hist(line_binary.cols, 0);
-                for (int col = 0; col < line_binary.cols; ++col) {
-                    for (int row = 0; row < line_binary.rows; ++row) {
-                        if (line_binary.at<uchar>(row, col) > 0)
-                            vertical_hist[col]++;
-                    }
-                }
-                SaveCenteringImages(path, line_binary, 0, 0);
-                // 5-3. 라인 두께 측정 (임계값 이상인 연속 구간의 길이)
-                int threshold = static_cast<int>(line_binary.rows *
-                                   0.5); // 전체 픽셀의 50% 이상을 라인으로 간주
-                int start = -1, end = -1;
-                for (int col = 0; col < line_binary.cols; ++col) {
-                    if (vertical_hist[col] > threshold) {
-                        if (start == -1)
-                            start = col;
-                        end = col;
-                    }
-                }
-                if (start != -1 && end != -1) {
-                    int thickness = end - start + 1;
-                    spdlog::info("thickness: {}", thickness);
-                    if (thickness < 15*2) {
-                        m_need_water = false;
-                    } else {
-                        m_need_water = true;
-                        m_send_label = LabelStrings::FillWithWater;
-                    }
-                } else {
-                    spdlog::info("thickness is not found" );
-                    m_need_water = false;
-                }
-            }
-
-            // 6. x move
-            auto storage = StageSettingStorage::GetInstance();
-            if (storage) {
-                m_init_x_pos = std::get<int>(
-                  storage->GetSettings(StageConfigKeys::INIT_X_POS));
-            }
-            if (m_overall_focusing)
-                m_pos = BIG_FOCUS_START_POS;
-            else
-                m_pos = m_init_x_pos - m_start_pos;
-
-            if (fine) {
-                // finish the fine auto-focus mode.
-                m_move->SetLastPos(MotorRole::mtr_x, x_pos);
-                m_move->SetLastPos(MotorRole::mtr_y, y_pos);
-                m_send_label = LabelStrings::Completed;
-            } else {
-                co_await m_move->GetNotBusy(guard());
-                if (IsFocusMethodROI(Method_Focus::ROI_MARKER) ||
-                    IsFocusMethodROI(Method_Focus::ROI_EXTERNAL)) {    
-                    co_await m_move->MoveInitPos(guard());
-                    co_await m_move->GetNotBusy(guard());
-                }
-                co_await m_move->Move(guard(),
-                                      MotorRole::mtr_x,
-                                      SingleMode::mode_cnt,
-                                      200 * MICRO_STEP,
-                                      m_pos);
-            }
-            if (storage) {
-                storage->SaveSettingToJson(StageConfigKeys::LAST_Y_POS, y_pos);
-            }
-            done = true;
-        }
-        co_await timer.AsyncSleepFor(guard(), 1ms);
-        // co_return;
-    }
-    co_return;
-}
-
-asio::awaitable<void>
-StageAutoFocus::SearchFlow(async::Lifeguard guard)
-{
-    StageProcessImage Image;
-
-    cv::Mat gray;
-    cv::Mat that_gray;
-
-    bool done = false;
-    float clean_speed = 2.0f;
-    bool first_image = true;
-    auto storage = StageSettingStorage::GetInstance();
-    if (storage) {
-        clean_speed =
-          std::get<float>(storage->GetSettings(StageConfigKeys::CLEAN_SPEED));
-    }
-    auto timer = ds::async::Timer();
-    co_await m_pump->StartPump(guard(), MotorDir::pump_dir_clean, clean_speed);
-
-    m_templates.clear();
-    while (not done and not m_cancel) {
-        auto frame = co_await m_frame->GetAsyncFrame(guard());
-        if (frame) {
-            // 1. Preprocessing
-            cv::Mat src = frame->CreateGray();
-            // 2. ROI & Crop
-            gray = Image.ImageRegions(
-              src, 0, 0, frame->width, frame->height, ROTATE);
-            if (first_image) {
-                first_image = false;
-                that_gray = gray;
-            }
-            // 3. Template matching
-            cv::Mat result;
-            cv::matchTemplate(gray, that_gray, result, cv::TM_CCOEFF_NORMED);
-            double meanValue =
-              std::round(cv::mean(result)[0] * 100000.0) / 100000.0;
-
-            //spdlog::info("similarity [{}]", meanValue);
-            m_templates.push_back(meanValue);
-
-            if (meanValue < FOCUS_WATER_ENTRY_TH) {
-
-                co_await m_pump->StopPump(guard());
-
-                done = true;
-            }
-            that_gray = gray;
-        }
-        co_await timer.AsyncSleepFor(guard(), 1ms);
-    }
-    co_return;
-}
-
-asio::awaitable<void>
-StageAutoFocus::PumpUntilFlow(async::Lifeguard guard)
-{
-    StageProcessImage Image;
-
-    cv::Mat gray;
-    cv::Mat that_gray;
-
-    bool done = false;
-    int clean_speed = 2;
-    bool first_image = true;
-    auto storage = StageSettingStorage::GetInstance();
-    if (storage) {
-        clean_speed = std::get<float>(storage->GetSettings("clean_speed"));
-    }
-    auto timer = ds::async::Timer();
-    co_await m_pump->StartPump(guard(), MotorDir::pump_dir_clean, clean_speed);
-    m_send_label = LabelStrings::DrainTheWater;
-    m_templates.clear();
-    while (not done) {
-        auto frame = co_await m_frame->GetAsyncFrame(guard());
-        if (frame) {
-            // 1. Preprocessing
-            cv::Mat src = frame->CreateGray();
-            // 2. ROI & Crop
-            gray = Image.ImageRegions(
-              src, 0, 0, frame->width, frame->height, ROTATE);
-            if (first_image) {
-                first_image = false;
-                that_gray = gray;
-            }
-            // 3. Template matching
-            cv::Mat result;
-            cv::matchTemplate(gray, that_gray, result, cv::TM_CCOEFF_NORMED);
-            double meanValue =
-              std::round(cv::mean(result)[0] * 100000.0) / 100000.0;
-
-            //spdlog::info("similarity [{}]", meanValue);
-            m_templates.push_back(meanValue);
-
-            if (meanValue < FOCUS_WATER_EXIT_TH) {
-
-                co_await m_pump->StopPump(guard());
-
-                done = true;
-            }
-            that_gray = gray;
-        }
-        co_await timer.AsyncSleepFor(guard(), 1ms);
-    }
-    co_return;
-}
-
-asio::awaitable<void>
-StageAutoFocus::Focusing(async::Lifeguard guard, std::string path)
-{
-    m_templates.resize(m_total_steps, 0.0); //< Do not use vector.clear()
-    m_positions.resize(m_total_steps, 0.0); //< Do not use vector.clear()
-
-    StageDateTimeFormat Time;
-    std::string TimeStamp = Time.GetTime();
-    StageFileHandle File(path);
-
-
-    auto timer = ds::async::Timer();
-    ProgressCalculator progress(m_total_steps);
-
-    while (not IsFinal(m_total_steps, m_num_focus) and not m_cancel) {
-        auto frame = co_await m_frame->GetAsyncFrame(guard());
-        if (frame) {
-            m_send_progress = progress.GetPogress(m_num_focus);
-            if (m_send_progress == 100)
-                m_send_progress = 99;
-            m_send_label = LabelStrings::Focusing;
-            // 1. Image pre-process
-            const int height = frame->height;
-            const int width = frame->width;
-            // gray
-            cv::Mat src = frame->CreateGray();
-            // blur
-            //cv::Mat blurred = CovertGaussianBlur(src, cv::Size(91, 91));
-            //cv::Mat blurred = src;
-
-            // 2. Crop
-            cv::Mat roi_source;
-            cv::Mat tmplate;
-            if (IsFocusMethodROI(Method_Focus::ROI_CHANNEL)) {
-                std::tie(roi_source, tmplate) = FocusingImageRegions(
-                  src, 0, height / 2 - 700, width - 8, 1400, 8); //
-            } else if (IsFocusMethodROI(Method_Focus::ROI_LINE)) {
-                std::tie(roi_source, tmplate) = FocusingImageRegions(
-                  src,
-                  m_center_idx - (CHANNEL_WIDTH / 2) - LINE_ROI_OFFSET,
-                                       height / 2,
-                  LINE_ROI_OFFSET*2,
-                                       200,
-                                       8);
-            } else if (IsFocusMethodROI(Method_Focus::ROI_MARKER)) {
-                std::tie(roi_source, tmplate) =
-                  FocusingImageRegions(src, 0, height - 410, 800, 400, 8);
-                // std::tie(roi_source, tmplate) = FocusingImageRegions(blurred,
-                //                        width / 2 + width / 5 + 300,
-                //                        height / 2 + height / 4 - 150,
-                //                        200,
-                //                        200,
-                //                        8);
-            } else if (IsFocusMethodROI(Method_Focus::ROI_EXTERNAL)) {
-                std::tie(roi_source, tmplate) =
-                  FocusingImageRegions(src, 1000, 500, 200, 500, 8);
-            } else {
-                std::tie(roi_source, tmplate) =
-                  FocusingImageRegions(src, 0, 0, width - 8, height - 8, 8);
-            }
-            cv::Mat blurred_src =
-              CovertGaussianBlur(roi_source, cv::Size(31, 31));
-            cv::Mat blurred_tmpl =
-              CovertGaussianBlur(tmplate, cv::Size(31, 31));
-            // 3. Save images
-            cv::Rect save_roi(width / 4, 0, width / 2, height);
-            SaveFocusingImages(path, src, m_pos, m_num_focus, ROTATE);
-            //SaveFocusingImages(path, source, m_pos, m_num_focus, ROTATE);
-
-            // 4. Template matching
-            cv::Mat result;
-            cv::matchTemplate(
-              blurred_src, blurred_tmpl, result, cv::TM_CCOEFF_NORMED);
-            double meanValue =
-              std::round(cv::mean(result)[0] * 100000.0) / 100000.0;
-
-            // save the template values
-            m_templates[m_num_focus] = meanValue;
-            m_positions[m_num_focus] = m_pos;
-
-            m_pos += m_step;
-            m_num_focus++;    
-            // move next
-            co_await m_move->Move(guard(),
-                                    MotorRole::mtr_x,
-                                    SingleMode::mode_cnt,
-                                    200 * MICRO_STEP,
-                                    m_pos);
-            co_await m_move->GetNotBusy(guard());
-        }
-        co_await timer.AsyncSleepFor(guard(), 1ms);
-        // co_return;
-    }
-    if (not m_cancel) {
-        auto [min_idx, max_idx, decision_idx, decision_pos] =
-          FinalizeFocus(m_templates, m_positions,false);
-
-        m_min_idx = min_idx;
-        m_max_idx = max_idx;
-
-        m_move->SetLastPos(MotorRole::mtr_x, decision_pos);
-
-        co_await m_move->Move(guard(),
-                              MotorRole::mtr_x,
-                              SingleMode::mode_cnt,
-                              200 * MICRO_STEP,
-                              decision_pos);
-        co_await m_move->GetNotBusy(guard());
-
-        std::string save_file;
-
-        save_file = File.GetFileName(TimeStamp, ".csv", "focus");
-        
-        m_num_focus = 0;
-        SaveFocusCsv(save_file,
-                     m_templates,
-                     m_positions,
-                     min_idx,
-                     max_idx,
-                     decision_idx,
-                     decision_pos,
-                     m_total_steps - 1);
-    }
-    co_return;
-}
-
-asio::awaitable<void>
-StageAutoFocus::OverallFocusing(async::Lifeguard guard, std::string path)
-{
-    const int final_num = BIG_FOCUS_TOTAL_STEPS;
-    const int step_size = BIG_FOCUS_STEP;
-
-    m_templates.resize(final_num, 0.0); //< Do not use vector.clear()
-    m_positions.resize(final_num, 0.0); //< Do not use vector.clear()
-
-    StageDateTimeFormat Time;
-    std::string TimeStamp = Time.GetTime();
-    StageFileHandle File(path);
-
-    auto timer = ds::async::Timer();
-
-    while (not IsFinal(final_num, m_num_focus) and not m_cancel) {
-        auto frame = co_await m_frame->GetAsyncFrame(guard());
-        if (frame) {
-            m_send_label = LabelStrings::Focusing;
-            // 1. Image pre-process
-            const int height = frame->height;
-            const int width = frame->width;
-            // gray
-            cv::Mat src = frame->CreateGray();
-            // blur
-            // cv::Mat blurred = CovertGaussianBlur(src);
-            //cv::Mat blurred = src;
-
-            // 2. Crop
-            cv::Mat roi_source;
-            cv::Mat tmplate;
-            if (IsFocusMethodROI(Method_Focus::ROI_CHANNEL)) {
-                std::tie(roi_source, tmplate) = FocusingImageRegions(
-                  src, 0, height / 2 - 700, width - 8, 1400, 8); //
-            } else if (IsFocusMethodROI(Method_Focus::ROI_LINE)) {
-                std::tie(roi_source, tmplate) = FocusingImageRegions(
-                  src,
-                  m_center_idx - (CHANNEL_WIDTH / 2) - LINE_ROI_OFFSET,
-                                       height / 2,
-                  LINE_ROI_OFFSET*2,
-                                       200,
-                                       8);
-            } else if (IsFocusMethodROI(Method_Focus::ROI_MARKER)) {
-                std::tie(roi_source, tmplate) =
-                  FocusingImageRegions(src, 0, height - 410, 800, 400, 8);
-                // std::tie(roi_source, tmplate) = FocusingImageRegions(blurred,
-                //                        width / 2 + width / 5 + 300,
-                //                        height / 2 + height / 4 - 150,
-                //                        200,
-                //                        200,
-                //                        8);
-            } else if (IsFocusMethodROI(Method_Focus::ROI_EXTERNAL)) {
-                std::tie(roi_source, tmplate) =
-                  FocusingImageRegions(src, 1000, 500, 200, 500, 8);
-            } else {
-                std::tie(roi_source, tmplate) =
-                  FocusingImageRegions(src, 0, 0, width - 8, height - 8, 8);
-            }
-
-            // 3. Save images
-            if (m_num_focus == 0) {
-                SaveFocusingImages(
-                  path, roi_source, m_pos, m_num_focus, ROTATE);
-            }
-            SaveFocusingImages(path, roi_source, m_pos, m_num_focus, ROTATE);
-
-            cv::Mat blurred_src =
-              CovertGaussianBlur(roi_source, cv::Size(31, 31));
-            cv::Mat blurred_tmpl =
-              CovertGaussianBlur(tmplate, cv::Size(31, 31));
-            // 4. Template matching
-            cv::Mat result;
-            cv::matchTemplate(
-              blurred_src, blurred_tmpl, result, cv::TM_CCOEFF_NORMED);
-            double meanValue =
-              std::round(cv::mean(result)[0] * 100000.0) / 100000.0;
-
-            // save the template values
-            m_templates[m_num_focus] = meanValue;
-            m_positions[m_num_focus] = m_pos;
-
-            m_pos += step_size;
-            m_num_focus++;
-            co_await m_move->Move(guard(),
-                                  MotorRole::mtr_x,
-                                  SingleMode::mode_cnt,
-                                  200 * MICRO_STEP,
-                                  m_pos);
-
-        }
-        co_await timer.AsyncSleepFor(guard(), 1ms);
-        // co_return;
-    }
-    if (not m_cancel) {
-        auto [min_idx, max_idx, decision_idx, decision_pos] =
-          FinalizeFocus(m_templates, m_positions,true);
-
-        m_init_x_pos = decision_pos;
-        auto storage = StageSettingStorage::GetInstance();
-        if (storage) {
-            storage->SaveSettingToJson(StageConfigKeys::INIT_X_POS,
-                                       m_init_x_pos);
-            storage->SaveSettingToJson(StageConfigKeys::LAST_X_POS,
-                                       m_init_x_pos);
-        }
-
-        spdlog::info("init_x_pos: {}", m_init_x_pos);
-
-        m_move->SetLastPos(MotorRole::mtr_x, decision_pos);
-
-        co_await m_move->Move(guard(),
-                              MotorRole::mtr_x,
-                              SingleMode::mode_cnt,
-                              200 * MICRO_STEP,
-                              decision_pos);
-        co_await m_move->GetNotBusy(guard());
-
-        std::string save_file;
-
-        save_file = File.GetFileName(TimeStamp, ".csv", "focus");
-
-        m_num_focus = 0;
-        SaveFocusCsv(save_file,
-                     m_templates,
-                     m_positions,
-                     min_idx,
-                     max_idx,
-                     decision_idx,
-                     decision_pos,
-                     final_num - 1);
-    }
-    co_return;
-}
-asio::awaitable<void>
-StageAutoFocus::SaveLog(async::Lifeguard guard, std::string path)
-{
-    bool done = false;
-    StageProcessImage Image;
-
-    while (not done and not m_cancel) {
-        auto frame = co_await m_frame->GetAsyncFrame(guard());
-        if (frame) {
-            const int height = frame->height;
-            const int width = frame->width;
-
-            cv::Mat src = frame->CreateGray();
-
-            cv::Mat source = Image.ImageRegions(
-              src, 0, 0, width, height, ROTATE);
-
-            int x_focus_pos = m_move->GetLastPos(MotorRole::mtr_x);
-            int y_focus_pos = m_move->GetLastPos(MotorRole::mtr_y);
-
-            auto storage = StageSettingStorage::GetInstance();
-            if (storage) {
-                storage->SaveSettingToJson(StageConfigKeys::LAST_X_POS,
-                                           x_focus_pos);
-                storage->SaveSettingToJson(StageConfigKeys::LAST_Y_POS,
-                                           y_focus_pos);
-            }
-
-            SaveFocusingImages(path, source, x_focus_pos, 999, 0);
-            std::string last_img_path = PATH_TO_FOCUS + "/last";
-            StageFileHandle Last_File(last_img_path);
-            Last_File.DeleteWholeFiles();
-            SaveFocusingImages(last_img_path, source, x_focus_pos, 999, 0);
-
-            static int count = 0;
-
-            std::string save_path = PATH_TO_HISTORY + "/focus";
-            StageFileHandle File(save_path);
-            std::string save_file =
-              File.GetFileName("0000", ".csv", "focus_log");
-            if ((m_max_idx < m_positions.size()) and
-                (m_min_idx < m_positions.size())) {
-
-                SaveFocusLog(save_file,
-                             ++count,
-                             m_need_water,
-                             m_positions[m_min_idx],
-                             m_positions[m_max_idx],
-                             x_focus_pos,
-                             y_focus_pos);
-            } else {
-                SaveFocusLog(
-                  save_file, ++count, 0, 0, 0, x_focus_pos, y_focus_pos);
-            }
-            m_num_focus = 0;
-            done = true;
-        }
-    }
-    co_return;
-}
-
-asio::awaitable<void>
-StageAutoFocus::StartAutoFocus(async::Lifeguard guard, bool fine)
-{   
-    auto storage = StageSettingStorage::GetInstance();
-    if (storage) {
-        m_step =
-          std::get<int>(storage->GetSettings(StageConfigKeys::FOCUS_STEP));
-        m_total_steps =
-          std::get<int>(storage->GetSettings(StageConfigKeys::FOCUS_NUMOFSTEP));
-        m_start_pos = m_step * int(m_total_steps / 2);
-        m_init_x_pos =
-          std::get<int>(storage->GetSettings(StageConfigKeys::INIT_X_POS));
-    }
-    auto timer = ds::async::Timer();
-    m_ok_user_water = false;
-    m_cancel = false;
-
-    m_overall_focusing = false;
-    std::string path = PATH_TO_FOCUS + "/regular";
-
-    co_await InitSetup(guard(), fine, path);
-    co_await m_move->GetNotBusy(guard());
-    co_await CenterPosition(guard(), fine, path);
-    co_await m_move->GetNotBusy(guard());
-
-    if (IsFocusMethodROI(Method_Focus::ROI_LINE) and (m_need_water)) {
-        while (not m_ok_user_water and not m_cancel) {
-            co_await timer.AsyncSleepFor(guard(), 500ms);
-        }        
-        co_await SearchFlow(guard());
-    }
-    m_ok_user_water = false;
-    co_await Focusing(guard(), path);
-    co_await m_move->GetNotBusy(guard());
-
-    if (IsFocusMethodROI(Method_Focus::ROI_MARKER) ||
-        IsFocusMethodROI(Method_Focus::ROI_EXTERNAL)) {
-        co_await m_move->MoveLastPos(guard(),
-                                     m_move->GetLastPos(MotorRole::mtr_x),
-                                     m_move->GetLastPos(MotorRole::mtr_y));
-    }
-    co_await CenterPosition(guard(), true, path);
-    co_await m_move->GetNotBusy(guard());
-    if (not m_cancel)
-        co_await SaveLog(guard(), path);
-    if (IsFocusMethodROI(Method_Focus::ROI_LINE) and (m_need_water) and
-        (not m_cancel))
-        co_await PumpUntilFlow(guard());
-    m_send_progress = 100;
-    co_await timer.AsyncSleepFor(guard(), 200ms);
-    m_automode->SetNeedRefocus(false);
-    SetState(StageDSState::focus_idle);
-    co_return;
-}
-asio::awaitable<void>
-StageAutoFocus::StartOverAllAutoFocus(async::Lifeguard guard)
-{
-    auto storage = StageSettingStorage::GetInstance();
-    if (storage) {
-        m_step =
-          std::get<int>(storage->GetSettings(StageConfigKeys::FOCUS_STEP));
-        m_total_steps =
-          std::get<int>(storage->GetSettings(StageConfigKeys::FOCUS_NUMOFSTEP));
-        m_start_pos = m_step * int(m_total_steps / 2);
-        m_init_x_pos =
-          std::get<int>(storage->GetSettings(StageConfigKeys::INIT_X_POS));
-    }
-    auto timer = ds::async::Timer();
-    m_cancel = false;
-    m_overall_focusing = true;
-
-    std::string path = PATH_TO_FOCUS + "/overall";
-    co_await InitSetup(guard(), false, path);
-    co_await m_move->GetNotBusy(guard());
-    co_await CenterPosition(guard(), false, path);
-    co_await m_move->GetNotBusy(guard());
-    co_await OverallFocusing(guard(), path);
-    co_await m_move->GetNotBusy(guard());
-
-    // temporary because the overall focusing is not finished yet.
-    m_send_progress = 100;
-    co_await timer.AsyncSleepFor(guard(), 200ms);
-    m_automode->SetNeedRefocus(false);
-    SetState(StageDSState::focus_idle);
-    //co_await StartAutoFocus(guard(), false);
-
-    co_return;
-}
-asio::awaitable<void>
-StageAutoFocus::CancelAutoFocus(async::Lifeguard guard)
-{
-    m_cancel = true;
-    m_cond.Notify();
-    co_await m_move->StopMove(guard(), MotorRole::mtr_x);
-    co_await m_move->StopMove(guard(), MotorRole::mtr_y);
-    co_await m_move->GetNotBusy(guard());
-    co_await m_move->MoveLastPos(guard(),
-                                 m_move->GetLastPos(MotorRole::mtr_x),
-                                 m_move->GetLastPos(MotorRole::mtr_y));
-    co_await m_move->GetNotBusy(guard());
-    co_await m_pump->StopPump(guard());
-
-    SetState(StageDSState::focus_idle);
-}
-void
-StageAutoFocus::SetState(uint32_t state)
-{
-    if (StageDSState::focus_busy == state)
-        m_state &= ~(StageDSState::idle | StageDSState::focus_idle);
-    if (StageDSState::focus_idle == state)
-        m_state &= ~(StageDSState::idle | StageDSState::focus_busy);
-
-    m_state |= state;
-}
-bool
-StageAutoFocus::IsState(uint32_t state) const
-{
-    if (m_state & state)
-        return true;
-    else
-        return false;
-}
-
-}
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <numeric>
+#include <opencv2/opencv.hpp>
+#include <spdlog/spdlog.h>
+#include <chrono>
+#include "label_strings.h"
+#include "stage_autofocus.h"
+#include "stage_change.h"
+#include "stage_settings.h"
+#include "stage_utility.h"
+
+namespace ds::depthscan {
+
+constexpr auto FOCUS = Method_Focus::ROI_LINE; /// ROI
+constexpr int  FOCUS_TEMPLATE_OFFSET = 8; // template shift, both axes
+// full size: FOCUS_WATER_ENTRY_TH and FOCUS_WATER_EXIT_TH were tuned there
+constexpr int  FLOW_CHANGE_LEVEL = 0;
+
+static cv::Mat
+CovertGaussianBlur(const cv::Mat& image, auto kernelSize = (9, 9))
+{
+    cv::Mat imageBlur;
+    cv::GaussianBlur(image, imageBlur, kernelSize, 0);
+    return imageBlur;
+}
+static double
+calculateSlope(const std::vector<double>& x, const std::vector<double>& y)
+{
+    int n = x.size();
+    if (n != y.size() || n == 0) {
+        throw std::invalid_argument(
+          "Vectors x and y must have the same non-zero length");
+    }
+
+    double sum_x = std::accumulate(x.begin(), x.end(), 0.0);
+    double sum_y = std::accumulate(y.begin(), y.end(), 0.0);
+    double sum_xx = std::inner_product(x.begin(), x.end(), x.begin(), 0.0);
+    double sum_xy = std::inner_product(x.begin(), x.end(), y.begin(), 0.0);
+
+    double slope = (n * sum_xy - sum_x * sum_y) / (n * sum_xx - sum_x * sum_x);
+    return slope;
+}
+static std::vector<int>
+find_local_minima(const std::vector<double>& values, int order)
+{
+    std::vector<int> local_minima_indices;
+
+    for (int i = order; i < values.size() - order; ++i) {
+        bool is_local_minima = true;
+
+        for (int j = 1; j <= order; ++j) {
+            if (values[i] >= values[i - j] || values[i] >= values[i + j]) {
+                is_local_minima = false;
+                break;
+            }
+        }
+
+        if (is_local_minima) {
+            std::vector<double> x = { static_cast<double>(i - order),
+                                      static_cast<double>(i),
+                                      static_cast<double>(i + order) };
+            std::vector<double> y = { values[i - order],
+                                      values[i],
+                                      values[i + order] };
+            double slope = calculateSlope(x, y);
+            // spdlog::info("slope[{}] : {}", i, slope);
+            if (std::abs(slope) >= 0.000001)
+                local_minima_indices.push_back(i);
+        }
+    }
+
+    return local_minima_indices;
+}
+static std::vector<int>
+find_local_maxima(const std::vector<double>& values, int order)
+{
+    std::vector<int> local_maxima_indices;
+
+    for (int i = order; i < values.size() - order; ++i) {
+
+        std::vector<double> x = { static_cast<double>(i - order),
+                                  static_cast<double>(i),
+                                  static_cast<double>(i + order) };
+        std::vector<double> y = { values[i - order],
+                                  values[i],
+                                  values[i + order] };
+        double slope = calculateSlope(x, y);
+
+        if (slope > 0.005) {
+            // spdlog::info("slope[{}] : {}", i, slope);
+            local_maxima_indices.push_back(i);
+        }
+    }
+
+    return local_maxima_indices;
+}
+
+static int
+CalculateCalibration(int idx, bool fine, int width)
+{
+    int calibration = 0;
+    int center_idx = width / 2 ;
+
+    calibration = (idx - center_idx);
+
+    if (fine) {
+        calibration = std::clamp(calibration, -50, 50);
+    } else {
+        calibration = std::clamp(calibration, -(width / 2), (width / 2));
+    }
+    return calibration;
+}
+static void
+SaveCenteringImages(const std::string path,const cv::Mat& img,
+                    int pos,
+                    int num)
+{
+    StageDateTimeFormat Time;
+    std::string TimeStamp = Time.GetTime();
+
+    StageFileHandle File(path);
+    StageProcessImage Image;
+
+    Image.SaveImages(
+      File.GetFileName(TimeStamp, ".png", pos, num, "C"), img, 0);
+}
+
+static cv::Mat
+CovertGaussianBlur(const cv::Mat& image, cv::Size kernelSize = cv::Size(31, 31))
+{
+    cv::Mat imageBlur;
+    cv::GaussianBlur(image, imageBlur, kernelSize, 5.0, 5.0, cv::BORDER_DEFAULT);
+    return imageBlur;
+}
+static auto
+FocusingImageRegions(
+  const cv::Mat& src, int x, int y, int width, int height, int offset)
+{
+    StageProcessImage Image;
+
+    return std::make_pair(
+      Image.CropImage(src, x, y, width, height),
+      Image.CropImage(src, x + offset, y + offset, width, height));
+}
+static void
+SaveFocusingImages(const std::string path,const cv::Mat& image, int pos, int num, double angle)
+{
+    StageDateTimeFormat Time;
+    std::string TimeStamp = Time.GetTime();
+
+    StageFileHandle File(path);
+    StageProcessImage Image;
+
+    Image.SaveImages(
+      File.GetFileName(TimeStamp, ".png", pos, num), image, angle);
+}
+
+static bool
+IsFocusMethodROI(Method_Focus method)
+{
+    if (FOCUS == method)
+        return true;
+    else
+        return false;
+}
+static cv::Rect
+FocusingRect(const cv::Size& size, int center_idx)
+{
+    const int height = size.height;
+    const int width = size.width;
+
+    if (IsFocusMethodROI(Method_Focus::ROI_CHANNEL)) {
+        return cv::Rect(0, height / 2 - 700, width - 8, 1400); //
+    } else if (IsFocusMethodROI(Method_Focus::ROI_LINE)) {
+        return cv::Rect(center_idx - (CHANNEL_WIDTH / 2) - LINE_ROI_OFFSET,
+                        height / 2,
+                        LINE_ROI_OFFSET * 2,
+                        200);
+    } else if (IsFocusMethodROI(Method_Focus::ROI_MARKER)) {
+        return cv::Rect(0, height - 410, 800, 400);
+    } else if (IsFocusMethodROI(Method_Focus::ROI_EXTERNAL)) {
+        return cv::Rect(1000, 500, 200, 500);
+    } else {
+        return cv::Rect(0, 0, width - 8, height - 8);
+    }
+}
+static std::pair<cv::Mat, cv::Mat>
+FocusingRegions(const cv::Mat& src, int center_idx)
+{
+    const auto roi = FocusingRect(src.size(), center_idx);
+    return FocusingImageRegions(src,
+                                roi.x,
+                                roi.y,
+                                roi.width,
+                                roi.height,
+                                FOCUS_TEMPLATE_OFFSET);
+}
+/// The FOCUS ROI and its neighbours, cols x rows of the same size centred
+/// on it. Tiles whose shifted template would leave the frame are dropped.
+static std::vector<cv::Rect>
+FocusingTiles(const cv::Size& size, int center_idx, int cols, int rows)
+{
+    const auto     base = FocusingRect(size, center_idx);
+    const cv::Rect frame(0,
+                         0,
+                         size.width - FOCUS_TEMPLATE_OFFSET,
+                         size.height - FOCUS_TEMPLATE_OFFSET);
+    std::vector<cv::Rect> tiles;
+    for (int row = 0; row < rows; row++) {
+        for (int col = 0; col < cols; col++) {
+            cv::Rect tile =
+              base + cv::Point((2 * col - (cols - 1)) * base.width / 2,
+                               (2 * row - (rows - 1)) * base.height / 2);
+            if ((tile & frame) == tile)
+                tiles.push_back(tile);
+        }
+    }
+    if (tiles.empty() and not (base & frame).empty())
+        tiles.push_back(base & frame);
+    return tiles;
+}
+/// Template value of every tile, the tiles spread over the cores. Same
+/// metric as the single ROI: the tile and its copy shifted by
+/// FOCUS_TEMPLATE_OFFSET are cropped and blurred each on its own, then
+/// compared by normalised cross correlation.
+static std::vector<double>
+ScoreFocusTiles(const cv::Mat& src, const std::vector<cv::Rect>& tiles)
+{
+    std::vector<double> scores(tiles.size(), 0.0);
+    cv::parallel_for_(
+      cv::Range(0, int(tiles.size())), [&](const cv::Range& range) {
+          for (int t = range.start; t < range.end; t++) {
+              const auto& tile = tiles[t];
+              auto [roi_source, tmplate] =
+                FocusingImageRegions(src,
+                                     tile.x,
+                                     tile.y,
+                                     tile.width,
+                                     tile.height,
+                                     FOCUS_TEMPLATE_OFFSET);
+              cv::Mat blurred_src =
+                CovertGaussianBlur(roi_source, cv::Size(31, 31));
+              cv::Mat blurred_tmpl =
+                CovertGaussianBlur(tmplate, cv::Size(31, 31));
+              cv::Mat result;
+              cv::matchTemplate(
+                blurred_src, blurred_tmpl, result, cv::TM_CCOEFF_NORMED);
+              scores[t] =
+                std::round(cv::mean(result)[0] * 100000.0) / 100000.0;
+          }
+      });
+    return scores;
+}
+/// One curve from the per tile curves over the first count positions:
+/// the median of the tiles, or their mean weighted by the depth of each
+/// tile's dip, so a flat tile (debris, empty channel) hardly counts.
+/// False, values untouched, when there are no tiles.
+static bool
+AggregateTiles(const std::vector<std::vector<double>>& tiles,
+               int count,
+               bool weighted,
+               std::vector<double>& values)
+{
+    if (tiles.empty())
+        return false;
+    std::vector<double> weights(tiles.size(), 1.0);
+    if (weighted) {
+        for (std::size_t t = 0; t < tiles.size(); t++) {
+            auto [lo, hi] = std::minmax_element(tiles[t].begin(),
+                                                tiles[t].begin() + count);
+            weights[t] = *hi - *lo;
+        }
+    }
+    const double total = std::accumulate(weights.begin(), weights.end(), 0.0);
+
+    std::vector<double> column(tiles.size());
+    for (int i = 0; i < count; i++) {
+        if (weighted and total > 0.0) {
+            double sum = 0.0;
+            for (std::size_t t = 0; t < tiles.size(); t++)
+                sum += weights[t] * tiles[t][i];
+            values[i] = sum / total;
+            continue;
+        }
+        for (std::size_t t = 0; t < tiles.size(); t++)
+            column[t] = tiles[t][i];
+        auto mid = column.begin() + column.size() / 2;
+        std::nth_element(column.begin(), mid, column.end());
+        double median = *mid;
+        if (column.size() % 2 == 0)
+            median = (median + *std::max_element(column.begin(), mid)) / 2.0;
+        values[i] = median;
+    }
+    return true;
+}
+static bool
+IsFinal(int final_num, int now_step)
+{
+    if (now_step >= (final_num - 1))
+        return true;
+    else
+        return false;
+}
+static int
+DetermineIndex(const std::vector<int>& local_indices,
+               const std::vector<double>& templates,
+               bool minMethod)
+{
+    int idx = 0;
+    if (local_indices.size() >= 2) {
+        std::vector<std::pair<int, double>> sorted_ma;
+        for (int index : local_indices) {
+            sorted_ma.emplace_back(index, templates[index]);
+        }
+        if (minMethod) {
+            std::sort(sorted_ma.begin(),
+                      sorted_ma.end(),
+                      [](const std::pair<int, double>& a,
+                         const std::pair<int, double>& b) {
+                          return a.second < b.second;
+                      });
+        } else {
+            std::sort(sorted_ma.begin(),
+                      sorted_ma.end(),
+                      [](const std::pair<int, double>& a,
+                         const std::pair<int, double>& b) {
+                          return a.second > b.second;
+                      });
+        }
+        idx = sorted_ma[0].first;
+        // int second_idx = sorted_ma[1].first;
+        //  int decision_idx    = (min_idx + second_min_idx) / 2;
+
+    } else {
+        auto element_iter =
+          std::min_element(templates.begin(), templates.end() - 1);
+
+        if (minMethod)
+            element_iter =
+              std::min_element(templates.begin(), templates.end() - 1);
+        else
+            element_iter =
+              std::max_element(templates.begin(), templates.end() - 1);
+
+        if (element_iter != templates.end()) {
+            idx = std::distance(templates.begin(), element_iter);
+        }
+    }
+    spdlog::info("local:({})", idx);
+    return idx;
+}
+static std::tuple<int, int, int, int>
+FinalizeFocus(const std::vector<double>& templates,
+              const std::vector<double>& positions,
+              bool overall)
+{
+    auto local_minima_indices = find_local_minima(templates, 3);
+    int decision_min_idx =
+      DetermineIndex(local_minima_indices, templates, true);
+    // decision_idx += 15; /// 15steps is external mark
+
+    auto local_maxima_indices = find_local_maxima(templates, 2);
+    int decision_max_idx =
+      DetermineIndex(local_maxima_indices, templates, false);
+
+    int decision_idx = 0;
+
+    if (IsFocusMethodROI(Method_Focus::ROI_LINE)) {
+        if (overall)
+            decision_idx = decision_min_idx + 4;
+        else
+            // decision_idx = decision_max_idx+0;
+            decision_idx = decision_min_idx + 3;
+    }
+    else if (IsFocusMethodROI(Method_Focus::ROI_MARKER)) {
+        //if (decision_min_idx > 35)
+        //    decision_idx = decision_min_idx - 35;
+        decision_idx = decision_min_idx + 70;
+    } else {
+            decision_idx += decision_min_idx;
+    }
+    int decision_pos = 0;
+    if (decision_idx >= positions.size()) {
+        decision_pos =
+          positions[positions.size() - 2] + (decision_idx - positions.size()) * 256;
+        spdlog::info(
+          "over:({},{},{})", decision_idx, positions.size(), decision_pos);
+        decision_idx = positions.size() - 1;
+    } else if (decision_idx < 0) {
+        decision_idx = 0;
+        decision_pos = positions[decision_idx];
+    } else {
+        decision_pos = positions[decision_idx];
+    }
+
+    return { decision_min_idx, decision_max_idx, decision_idx, decision_pos };
+}
+/// Width of the dip around min_idx at half its depth, in samples.
+static int
+CurveWidth(const std::vector<double>& templates, int min_idx, int count)
+{
+    if (count <= 0 or min_idx >= count)
+        return 0;
+    const double top =
+      *std::max_element(templates.begin(), templates.begin() + count);
+    const double half = (templates[min_idx] + top) / 2.0;
+    int lo = min_idx;
+    int hi = min_idx;
+    while (lo > 0 and templates[lo - 1] < half)
+        lo--;
+    while (hi + 1 < count and templates[hi + 1] < half)
+        hi++;
+    return hi - lo + 1;
+}
+static void
+SaveFocusCsv(const std::string& path,
+             const std::vector<double>& values,
+             const std::vector<double>& positions,
+             const std::vector<std::vector<double>>& tiles,
+             int min_idx,
+             int second_min_idx,
+             int decision_idx,
+             int decision_pos,
+             int length)
+{
+    std::ofstream file(path);
+
+    if (not file.is_open()) {
+        throw std::runtime_error("Failed to open file");
+    }
+
+    // one column per tile when the value is aggregated
+    const bool per_tile = tiles.size() > 1;
+    file << "Index,Position,Value";
+    for (size_t t = 0; per_tile and t < tiles.size(); t++)
+        file << ",Tile" << t;
+    file << "\n";
+
+    for (size_t i = 0; i < length; i++) {
+        file << i << "," << positions[i] << "," << values[i];
+        for (size_t t = 0; per_tile and t < tiles.size(); t++)
+            file << "," << tiles[t][i];
+        file << "\n";
+    }
+    file << "First:" << min_idx << ",Second:" << second_min_idx
+         << ",Decision:" << decision_idx << "," << decision_pos << "\n";
+    file.close();
+}
+static void
+SaveFocusLog(const std::string& path,
+             int num,
+             bool bubble,
+             int min_idx,
+             int max_idx,
+             int x_pos,
+             int y_pos)
+{
+    std::ofstream file(path, std::ios::app);
+
+    if (not file.is_open()) {
+        throw std::runtime_error("Failed to open file");
+    }
+
+    file << num << "," << bubble << "," << min_idx << "," << max_idx << ","
+         << x_pos << "," << y_pos << "\n";
+    file.close();
+}
+static std::tuple<cv::Mat, int>
+DetectVerticalLines(const cv::Mat& image, const int width)
+{
+    cv::Mat vertical_kernel =
+      cv::getStructuringElement(cv::MORPH_RECT, cv::Size(20, 30));
+    cv::Mat vertical_lines;
+    cv::morphologyEx(image, vertical_lines, cv::MORPH_OPEN, vertical_kernel);
+
+    cv::Mat vertical_edge;
+    cv::Canny(vertical_lines, vertical_edge, 50, 100, 3, false);
+    std::vector<cv::Vec4i> lines;
+
+    // cv::HoughLinesP(vertical_edge, lines, 1, CV_PI / 180, 50, 100, 10);
+    cv::HoughLinesP(vertical_edge, lines, 1, CV_PI / 180, 100, 150, 10);
+    cv::Mat output;
+    cv::cvtColor(image, output, cv::COLOR_GRAY2BGR);
+
+    int line_color_size = 8;
+
+    std::vector<int> y_coords;
+    if (not lines.empty()) {
+        for (const auto& line : lines) {
+            if (std::abs(line[0] - line[2]) < 10) {
+                cv::line(output,
+                         cv::Point(line[0], line[1]),
+                         cv::Point(line[2], line[3]),
+                         cv::Scalar(0, 0, 255), /* red */
+                         line_color_size);
+                y_coords.push_back((line[0] + line[2]) / 2);
+            }
+        }
+        spdlog::info("edge coords: ({},{})", lines.size(), y_coords.size());
+        std::sort(y_coords.begin(), y_coords.end());
+        std::vector<std::vector<int>> clusters;
+        std::vector<int> current_cluster;
+        for (int x : y_coords) {
+            if (current_cluster.empty()) {
+                current_cluster.push_back(x);
+            } else {
+                if (x - current_cluster.back() < 50) {
+                    current_cluster.push_back(x);
+                } else {
+                    clusters.push_back(current_cluster);
+                    current_cluster.clear();
+                    current_cluster.push_back(x);
+                }
+            }
+        }
+        if (not current_cluster.empty()) {
+            clusters.push_back(current_cluster);
+        }
+
+        std::vector<int> edges;
+        for (const auto& cluster : clusters) {
+            int _edge = cluster[cluster.size() / 2]; // take the middle value
+            edges.push_back(_edge);
+        }
+        for (const auto& edge : edges) {
+            cv::line(output,
+                     cv::Point(edge, 0),
+                     cv::Point(edge, image.rows),
+                     cv::Scalar(255, 0, 0), /* blue */
+                     line_color_size);
+        }
+        spdlog::info("edge: {}", edges.size());
+        std::sort(edges.begin(), edges.end());
+        int left_edge = -1;
+        int right_edge = -1;
+        if (edges.size() >= 2) {
+            left_edge = edges.front();
+            right_edge = edges.back();
+            if ((right_edge - left_edge) < 10) {
+                right_edge = -1;
+            }
+        } else if (edges.size() == 1) {
+            int edge = edges[0];
+            if (edge < width / 2) {
+                left_edge = edge;
+            } else {
+                right_edge = edge;
+            }
+        }
+        spdlog::info("left_edge: {}, right_edge: {}, size: {}, width: {}",
+                     left_edge,
+                     right_edge,
+                     y_coords.size(),
+                       width);
+        std::vector<int> decision_lines;
+        if (left_edge != -1) {
+            cv::line(output,
+                     cv::Point(left_edge, 0),
+                     cv::Point(left_edge, image.rows),
+                     cv::Scalar(0, 255, 0), /* green */
+                     line_color_size);
+            decision_lines.push_back(left_edge);
+        }
+        if (right_edge != -1) {
+            cv::line(output,
+                     cv::Point(right_edge, 0),
+                     cv::Point(right_edge, image.rows),
+                     cv::Scalar(0, 255, 0), /* green */
+                     line_color_size);
+            decision_lines.push_back(right_edge);
+        }
+        int center = 0;
+        int center_idx = width / 2;
+        int edge_idx = center_idx;
+        if (decision_lines.size() >= 2) {
+            if (abs(decision_lines[0] - decision_lines[1]) < (CHANNEL_WIDTH / 2))
+            {
+                if (decision_lines[0] < center_idx) {
+                    edge_idx -= CHANNEL_WIDTH / 2;
+                    if (edge_idx < decision_lines[0])
+                        center = width / 2 - (decision_lines[0] - edge_idx);
+                    else
+                        center = width / 2;
+                } else {
+                    edge_idx += CHANNEL_WIDTH / 2;
+                    if (edge_idx > decision_lines[0])
+                        center = width / 2 + (edge_idx - decision_lines[0]);
+                    else
+                        center = width / 2;
+                }
+            } else {
+                center = (decision_lines[1] + decision_lines[0]) / 2;
+                if (center > center_idx)
+                    center = center_idx - (center - center_idx);
+                else
+                    center = center_idx + (center_idx - center);
+            }
+
+        } else if (decision_lines.size() == 1) {
+
+
+            if (right_edge != -1) {
+                edge_idx += CHANNEL_WIDTH / 2;
+                if (edge_idx > decision_lines[0])
+                    center = width / 2 + (edge_idx - decision_lines[0]);
+                else
+                    center = width / 2;
+
+            } else {
+                edge_idx -= CHANNEL_WIDTH / 2;
+                if (edge_idx < decision_lines[0])
+                    center = width / 2 - (decision_lines[0] - edge_idx);
+                else
+                    center = width / 2;
+            }
+        } else {
+            spdlog::info(" no edge detected");
+            center = width / 2;
+        }
+        spdlog::info("center : {} ", center);
+        return { output, center };
+    } else {
+        spdlog::info(" no line detected");
+        return { output, width / 2 }; // no changed.
+    }
+}
+StageAutoFocus::StageAutoFocus(const StationId& station)
+  : m_station(station)
+  , m_cancel(false)
+  , m_frame(ui::CreateAsyncModel<StageFrame>(station))
+  , m_move(ui::CreateAsyncModel<StageMove>(station))
+  , m_pump(ui::CreateAsyncModel<StagePump>(station))
+  , m_automode(ui::CreateAsyncModel<StageAutoMode>(station))
+  , m_state(StageDSState::focus_idle)
+  , m_center_idx(0)
+  , m_need_water(false)
+  , m_min_idx(0)
+  , m_max_idx(0)
+  , m_overall_focusing(false)
+  , m_stop(false)
+  , m_need_focusing(false)
+  , m_ok_user_water(false)
+  , m_tiles_x(1)
+  , m_tiles_y(1)
+  , m_weighted(false)
+  , m_focus_map(m_station)
+{
+
+    auto storage = StageSettingStorage::GetInstance(m_station);
+    if (storage) {
+        m_step =
+          std::get<int>(storage->GetSettings(StageConfigKeys::FOCUS_STEP));
+        m_total_steps =
+          std::get<int>(storage->GetSettings(StageConfigKeys::FOCUS_NUMOFSTEP));
+        m_start_pos = m_step * int(m_total_steps / 2);
+        m_init_x_pos =
+          std::get<int>(storage->GetSettings(StageConfigKeys::INIT_X_POS));
+
+    }
+    m_sweep_steps = m_total_steps;
+}
+StageAutoFocus::~StageAutoFocus() {}
+
+void
+StageAutoFocus::Initiate() noexcept
+{
+}
+
+
+asio::awaitable<void>
+StageAutoFocus::InitSetup(async::Lifeguard guard,
+                          bool fine,
+                          std::string path) ///< ready
+{
+    m_send_progress = 0;
+    m_send_label = LabelStrings::Waiting;
+    SetState(StageDSState::focus_busy);
+
+    co_await m_move->GetNotBusy(guard());
+    m_send_label = LabelStrings::Start;
+    m_num_focus = 0;
+    m_need_water = false;
+    if (not fine) {
+        StageLogSession::Begin(path);
+
+        int x_pos=0;
+        int y_pos=0;
+        auto storage = StageSettingStorage::GetInstance(m_station);
+        if (storage) {
+            x_pos = std::get<int>(storage->GetSettings("last_x_pos"));
+            y_pos = std::get<int>(storage->GetSettings("last_y_pos"));
+        }
+        co_await m_move->MoveLastPos(guard(), x_pos, y_pos);
+    }
+
+    co_return;
+}
+
+asio::awaitable<void>
+StageAutoFocus::CenterPosition(async::Lifeguard guard,
+                               bool fine,
+                               std::string path) // Get frame and processing the frame
+{
+    bool done = false;
+    StageProcessImage Image;
+
+    auto timer = ds::async::Timer();
+
+    while (not done and not m_cancel) {
+        auto frame =
+          co_await m_frame->GetAsyncFrameAfterMove(guard(), &m_cancel);
+        if (frame) {
+            m_send_label = LabelStrings::Checking;
+            // 1. Image pre-process
+            const int height = frame->height;
+            const int width = frame->width;
+            // gray
+
+            cv::Mat src = frame->CreateGray();
+            // 2. ROI & Crop
+            const int roi_start_x = 0;
+            const int roi_start_y = 0;
+            const int roi_width = width ;
+            const int roi_height = height;
+            spdlog::info("w,h=({},{})", width, height);
+            cv::Mat source = Image.ImageRegions(
+              src, roi_start_x, roi_start_y, roi_width, roi_height, ROTATE);
+
+            cv::Mat binary;
+            cv::threshold(source, binary, 100, 255, cv::THRESH_BINARY_INV);
+            SaveCenteringImages(path, binary, 0, 0);
+            // 3. Vertical line detect
+            auto [img_centering, center_idx] =
+              DetectVerticalLines(source, width);
+
+            // 4. compute the calibration
+            int calibration = CalculateCalibration(center_idx, fine, width);
+
+            m_center_idx = center_idx - calibration;
+
+            // save images; x_pos and y_pos are used below only when the
+            // registers confirmed them
+            auto stage = co_await m_move->GetTelemetry(guard());
+            int y_pos = int(stage.axes[MotorRole::mtr_y].position);
+            int x_pos = int(stage.axes[MotorRole::mtr_x].position);
+            if (stage.valid) {
+                spdlog::info("x,y=({},{})", x_pos, y_pos);
+                SaveCenteringImages(path, img_centering, x_pos, m_num_focus);
+            }
+
+            // 5. y centering, only from a position the registers confirmed
+            if (not stage.valid) {
+                spdlog::error("centering: position unknown, not moved, "
+                              "no focus map and last position kept");
+            } else if (calibration != 0) {
+                y_pos += (calibration * MICRO_STEP_MUILPLIER);
+                co_await m_move->MoveTo(guard(), MotorRole::mtr_y, y_pos);
+                m_move->SetLastPos(MotorRole::mtr_y, y_pos);
+                spdlog::info("offset,y=({},{})", calibration, y_pos);
+            }
+            // 5-1. Detect the line thickness
+            if ((not fine) and IsFocusMethodROI(Method_Focus::ROI_LINE)) {
+
+                cv::Mat line_binary = Image.ImageRegions(
+                  binary,
+                  m_center_idx - (CHANNEL_WIDTH / 2) - LINE_ROI_OFFSET,
+                  height / 2,
+                  LINE_ROI_OFFSET * 2,
+                  200,
+                  ROTATE);                
+
+                // 5-2. 각 열의 픽셀 합산 (히스토그램)
+                std::vector<int> vertical_hist(line_binary.cols, 0);
+                for (int col = 0; col < line_binary.cols; ++col) {
+                    for (int row = 0; row < line_binary.rows; ++row) {
+                        if (line_binary.at<uchar>(row, col) > 0)
+                            vertical_hist[col]++;
+                    }
+                }
+                SaveCenteringImages(path, line_binary, 0, 0);
+                // 5-3. 라인 두께 측정 (임계값 이상인 연속 구간의 길이)
+                int threshold = static_cast<int>(line_binary.rows *
+                                   0.5); // 전체 픽셀의 50% 이상을 라인으로 간주
+                int start = -1, end = -1;
+                for (int col = 0; col < line_binary.cols; ++col) {
+                    if (vertical_hist[col] > threshold) {
+                        if (start == -1)
+                            start = col;
+                        end = col;
+                    }
+                }
+                if (start != -1 && end != -1) {
+                    int thickness = end - start + 1;
+                    spdlog::info("thickness: {}", thickness);
+                    if (thickness < 15*2) {
+                        m_need_water = false;
+                    } else {
+                        m_need_water = true;
+                        m_send_label = LabelStrings::FillWithWater;
+                    }
+                } else {
+                    spdlog::info("thickness is not found" );
+                    m_need_water = false;
+                }
+            }
+
+            // 6. x move
+            auto storage = StageSettingStorage::GetInstance(m_station);
+            if (storage) {
+                m_init_x_pos = std::get<int>(
+                  storage->GetSettings(StageConfigKeys::INIT_X_POS));
+            }
+            if (m_overall_focusing)
+                m_pos = BIG_FOCUS_START_POS;
+            else
+                m_pos = m_init_x_pos - m_start_pos;
+            m_sweep_steps = m_total_steps;
+            m_focus_key.clear();
+
+            // 6-1. a narrower sweep where this cell focused before
+            if (not fine and not m_overall_focusing and storage and
+                stage.valid) {
+                m_focus_key = StageFocusMap::Key(
+                  storage->GetCameraName(),
+                  std::get<std::string>(
+                    storage->GetSettings(StageConfigKeys::CHIP_TYPE)),
+                  y_pos);
+                auto window = m_focus_map.Predict(
+                  m_focus_key, m_step, m_total_steps, m_pos);
+                if (window) {
+                    m_pos = window->start;
+                    m_sweep_steps = window->steps;
+                }
+                spdlog::info("focus map: {} sweeps {} of {} steps from {}",
+                             m_focus_key,
+                             m_sweep_steps,
+                             m_total_steps,
+                             m_pos);
+            }
+
+            if (fine) {
+                // finish the fine auto-focus mode.
+                if (stage.valid) {
+                    m_move->SetLastPos(MotorRole::mtr_x, x_pos);
+                    m_move->SetLastPos(MotorRole::mtr_y, y_pos);
+                }
+                m_send_label = LabelStrings::Completed;
+            } else {
+                co_await m_move->GetNotBusy(guard());
+                if (IsFocusMethodROI(Method_Focus::ROI_MARKER) ||
+                    IsFocusMethodROI(Method_Focus::ROI_EXTERNAL)) {    
+                    co_await m_move->MoveInitPos(guard());
+                    co_await m_move->GetNotBusy(guard());
+                }
+                co_await m_move->MoveTo(guard(), MotorRole::mtr_x, m_pos);
+            }
+            if (storage and stage.valid) {
+                storage->SaveSettingToJson(StageConfigKeys::LAST_Y_POS, y_pos);
+            }
+            done = true;
+        }
+        co_await timer.AsyncSleepFor(guard(), 1ms);
+        // co_return;
+    }
+    co_return;
+}
+
+asio::awaitable<void>
+StageAutoFocus::SearchFlow(async::Lifeguard guard)
+{
+    StageProcessImage Image;
+
+    StageChangeDetector change({ ChangeMode::ncc, FLOW_CHANGE_LEVEL });
+
+    bool done = false;
+    float clean_speed = 2.0f;
+    auto storage = StageSettingStorage::GetInstance(m_station);
+    if (storage) {
+        clean_speed =
+          std::get<float>(storage->GetSettings(StageConfigKeys::CLEAN_SPEED));
+    }
+    auto timer = ds::async::Timer();
+    if (not co_await m_pump->StartPump(
+          guard(), MotorDir::pump_dir_clean, clean_speed)) {
+        spdlog::error("search flow: pump did not start, no flow to search");
+        co_return;
+    }
+
+    m_templates.clear();
+    while (not done and not m_cancel) {
+        auto frame = co_await m_frame->GetAsyncFrame(guard());
+        if (frame) {
+            // 1. Preprocessing
+            cv::Mat src = frame->CreateGray();
+            // 2. ROI & Crop
+            cv::Mat gray = Image.ImageRegions(
+              src, 0, 0, frame->width, frame->height, ROTATE);
+            // 3. Template matching against the last frame
+            double meanValue =
+              std::round(change.Update(gray).ncc * 100000.0) / 100000.0;
+
+            //spdlog::info("similarity [{}]", meanValue);
+            m_templates.push_back(meanValue);
+
+            if (meanValue < FOCUS_WATER_ENTRY_TH) {
+
+                co_await m_pump->StopPump(guard());
+
+                done = true;
+            }
+        }
+        co_await timer.AsyncSleepFor(guard(), 1ms);
+    }
+    change.LogCost("search flow");
+    co_return;
+}
+
+asio::awaitable<void>
+StageAutoFocus::PumpUntilFlow(async::Lifeguard guard)
+{
+    StageProcessImage Image;
+
+    StageChangeDetector change({ ChangeMode::ncc, FLOW_CHANGE_LEVEL });
+
+    bool done = false;
+    int clean_speed = 2;
+    auto storage = StageSettingStorage::GetInstance(m_station);
+    if (storage) {
+        clean_speed = std::get<float>(storage->GetSettings("clean_speed"));
+    }
+    auto timer = ds::async::Timer();
+    if (not co_await m_pump->StartPump(
+          guard(), MotorDir::pump_dir_clean, clean_speed)) {
+        spdlog::error("pump until flow: pump did not start");
+        co_return;
+    }
+    m_send_label = LabelStrings::DrainTheWater;
+    m_templates.clear();
+    while (not done) {
+        auto frame = co_await m_frame->GetAsyncFrame(guard());
+        if (frame) {
+            // 1. Preprocessing
+            cv::Mat src = frame->CreateGray();
+            // 2. ROI & Crop
+            cv::Mat gray = Image.ImageRegions(
+              src, 0, 0, frame->width, frame->height, ROTATE);
+            // 3. Template matching against the last frame
+            double meanValue =
+              std::round(change.Update(gray).ncc * 100000.0) / 100000.0;
+
+            //spdlog::info("similarity [{}]", meanValue);
+            m_templates.push_back(meanValue);
+
+            if (meanValue < FOCUS_WATER_EXIT_TH) {
+
+                co_await m_pump->StopPump(guard());
+
+                done = true;
+            }
+        }
+        co_await timer.AsyncSleepFor(guard(), 1ms);
+    }
+    change.LogCost("pump flow");
+    co_return;
+}
+
+asio::awaitable<void>
+StageAutoFocus::Focusing(async::Lifeguard guard, std::string path)
+{
+    StageDateTimeFormat Time;
+    std::string TimeStamp = Time.GetTime();
+    StageFileHandle File(path);
+
+    int swept = 0;
+    int sweeps = 0;
+    std::vector<cv::Rect> tiles; // on the first frame, its size is needed
+    std::chrono::microseconds scoring{ 0 };
+    while (not m_cancel) {
+        m_templates.assign(m_sweep_steps, 0.0); //< Do not use vector.clear()
+        m_positions.assign(m_sweep_steps, 0.0); //< Do not use vector.clear()
+        for (auto& curve : m_tile_templates)
+            curve.assign(m_sweep_steps, 0.0);
+
+        ProgressCalculator progress(m_sweep_steps);
+
+        // the sweep visits sweep_steps - 1 positions, one frame each
+        std::vector<SequencePoint> points;
+        for (int i = 0; (i + 1) < m_sweep_steps; i++) {
+            points.push_back({ m_pos + i * m_step, 0ms, true });
+        }
+
+        auto on_arrival = [&](std::size_t, int pos) -> asio::awaitable<bool> {
+            // nullptr on cancel or a stalled camera, either ends the sweep
+            auto frame =
+              co_await m_frame->GetAsyncFrameAfterMove(guard(), &m_cancel);
+            if (not frame)
+                co_return false;
+
+            m_pos = pos;
+            m_send_progress = progress.GetPogress(m_num_focus);
+            if (m_send_progress == 100)
+                m_send_progress = 99;
+            m_send_label = LabelStrings::Focusing;
+            // 1. Image pre-process
+            cv::Mat src = frame->CreateGray();
+
+            // 2. Tiles, the FOCUS ROI alone by default
+            if (tiles.empty()) {
+                tiles = FocusingTiles(
+                  src.size(), m_center_idx, m_tiles_x, m_tiles_y);
+                m_tile_templates.assign(
+                  tiles.size(), std::vector<double>(m_sweep_steps, 0.0));
+                // the frame cannot hold the ROI and its shifted template
+                if (tiles.empty())
+                    co_return false;
+            }
+            // 3. Save images
+            SaveFocusingImages(path, src, m_pos, m_num_focus, ROTATE);
+
+            // 4. Template matching, every tile in parallel
+            const auto start = std::chrono::steady_clock::now();
+            auto scores = ScoreFocusTiles(src, tiles);
+            scoring += std::chrono::duration_cast<std::chrono::microseconds>(
+              std::chrono::steady_clock::now() - start);
+
+            // save the template values
+            for (std::size_t t = 0; t < scores.size(); t++)
+                m_tile_templates[t][m_num_focus] = scores[t];
+            m_positions[m_num_focus] = m_pos;
+            m_num_focus++;
+            co_return not m_cancel;
+        };
+        const bool swept_all = co_await m_move->RunSequence(
+          guard(), MotorRole::mtr_x, points, on_arrival, &m_cancel);
+        swept += m_sweep_steps - 1;
+        sweeps++;
+        if (m_cancel)
+            break;
+        if (not swept_all) {
+            spdlog::error("focus: sweep not completed, focusing skipped");
+            break;
+        }
+
+        if (not AggregateTiles(
+              m_tile_templates, m_sweep_steps - 1, m_weighted, m_templates)) {
+            spdlog::error("focus: no tile fits the frame, focusing skipped");
+            break;
+        }
+        auto [min_idx, max_idx, decision_idx, decision_pos] =
+          FinalizeFocus(m_templates, m_positions,false);
+
+        // a predicted window has to bracket the minimum, else widen it
+        const bool bracketed = min_idx >= FOCUS_MAP_EDGE and
+                               min_idx + 1 + FOCUS_MAP_EDGE < m_sweep_steps;
+        if (not bracketed and m_sweep_steps < m_total_steps) {
+            m_focus_map.Miss(m_focus_key);
+            const int center = int(m_positions[min_idx]);
+            m_sweep_steps = std::min(m_total_steps, 2 * m_sweep_steps - 2);
+            const int full_start = m_init_x_pos - m_start_pos;
+            m_pos = m_sweep_steps < m_total_steps
+                      ? ClampFocusWindow(
+                          { center - (m_sweep_steps - 2) / 2 * m_step,
+                            m_sweep_steps },
+                          m_step,
+                          m_total_steps,
+                          full_start)
+                          .start
+                      : full_start;
+            spdlog::info("focus map: minimum at {} of {}, widen to {} steps",
+                         min_idx,
+                         m_sweep_steps - 1,
+                         m_sweep_steps);
+            m_num_focus = 0;
+            co_await m_move->MoveTo(guard(), MotorRole::mtr_x, m_pos);
+            co_await m_move->GetNotBusy(guard());
+            continue;
+        }
+
+        m_min_idx = min_idx;
+        m_max_idx = max_idx;
+
+        if (not m_focus_key.empty() and bracketed)
+            m_focus_map.Record(
+              m_focus_key,
+              FocusMapEntry{ int(m_positions[min_idx]),
+                             decision_pos,
+                             CurveWidth(m_templates, min_idx, m_sweep_steps - 1),
+                             m_sweep_steps < m_total_steps ? 1 : 0,
+                             0 });
+        spdlog::info("focus: {} steps in {} sweeps, full sweep {}",
+                     swept,
+                     sweeps,
+                     m_total_steps - 1);
+        spdlog::info("focus: {} tiles, {} us scoring per frame",
+                     tiles.size(),
+                     swept ? scoring.count() / swept : 0);
+
+        m_move->SetLastPos(MotorRole::mtr_x, decision_pos);
+
+        co_await m_move->MoveTo(guard(), MotorRole::mtr_x, decision_pos);
+        co_await m_move->GetNotBusy(guard());
+
+        std::string save_file;
+
+        save_file = File.GetFileName(TimeStamp, ".csv", "focus");
+        
+        m_num_focus = 0;
+        SaveFocusCsv(save_file,
+                     m_templates,
+                     m_positions,
+                     m_tile_templates,
+                     min_idx,
+                     max_idx,
+                     decision_idx,
+                     decision_pos,
+                     m_sweep_steps - 1);
+        break;
+    }
+    co_return;
+}
+
+asio::awaitable<void>
+StageAutoFocus::OverallFocusing(async::Lifeguard guard, std::string path)
+{
+    const int final_num = BIG_FOCUS_TOTAL_STEPS;
+    const int step_size = BIG_FOCUS_STEP;
+
+    m_templates.resize(final_num, 0.0); //< Do not use vector.clear()
+    m_positions.resize(final_num, 0.0); //< Do not use vector.clear()
+
+    StageDateTimeFormat Time;
+    std::string TimeStamp = Time.GetTime();
+    StageFileHandle File(path);
+
+    auto timer = ds::async::Timer();
+
+    while (not IsFinal(final_num, m_num_focus) and not m_cancel) {
+        auto frame = co_await m_frame->GetAsyncFrame(guard());
+        if (frame) {
+            m_send_label = LabelStrings::Focusing;
+            // 1. Image pre-process
+            const int height = frame->height;
+            const int width = frame->width;
+            // gray
+            cv::Mat src = frame->CreateGray();
+            // blur
+            // cv::Mat blurred = CovertGaussianBlur(src);
+            //cv::Mat blurred = src;
+
+            // 2. Crop
+            auto [roi_source, tmplate] = FocusingRegions(src, m_center_idx);
+
+            // 3. Save images
+            if (m_num_focus == 0) {
+                SaveFocusingImages(
+                  path, roi_source, m_pos, m_num_focus, ROTATE);
+            }
+            SaveFocusingImages(path, roi_source, m_pos, m_num_focus, ROTATE);
+
+            cv::Mat blurred_src =
+              CovertGaussianBlur(roi_source, cv::Size(31, 31));
+            cv::Mat blurred_tmpl =
+              CovertGaussianBlur(tmplate, cv::Size(31, 31));
+            // 4. Template matching
+            cv::Mat result;
+            cv::matchTemplate(
+              blurred_src, blurred_tmpl, result, cv::TM_CCOEFF_NORMED);
+            double meanValue =
+              std::round(cv::mean(result)[0] * 100000.0) / 100000.0;
+
+            // save the template values
+            m_templates[m_num_focus] = meanValue;
+            m_positions[m_num_focus] = m_pos;
+
+            m_pos += step_size;
+            m_num_focus++;
+            co_await m_move->MoveTo(guard(), MotorRole::mtr_x, m_pos);
+
+        }
+        co_await timer.AsyncSleepFor(guard(), 1ms);
+        // co_return;
+    }
+    if (not m_cancel) {
+        auto [min_idx, max_idx, decision_idx, decision_pos] =
+          FinalizeFocus(m_templates, m_positions,true);
+
+        m_init_x_pos = decision_pos;
+        auto storage = StageSettingStorage::GetInstance(m_station);
+        if (storage) {
+            storage->SaveSettingToJson(StageConfigKeys::INIT_X_POS,
+                                       m_init_x_pos);
+            storage->SaveSettingToJson(StageConfigKeys::LAST_X_POS,
+                                       m_init_x_pos);
+        }
+
+        spdlog::info("init_x_pos: {}", m_init_x_pos);
+
+        m_move->SetLastPos(MotorRole::mtr_x, decision_pos);
+
+        co_await m_move->MoveTo(guard(), MotorRole::mtr_x, decision_pos);
+        co_await m_move->GetNotBusy(guard());
+
+        std::string save_file;
+
+        save_file = File.GetFileName(TimeStamp, ".csv", "focus");
+
+        m_num_focus = 0;
+        SaveFocusCsv(save_file,
+                     m_templates,
+                     m_positions,
+                     {},
+                     min_idx,
+                     max_idx,
+                     decision_idx,
+                     decision_pos,
+                     final_num - 1);
+    }
+    co_return;
+}
+asio::awaitable<void>
+StageAutoFocus::SaveLog(async::Lifeguard guard, std::string path)
+{
+    bool done = false;
+    StageProcessImage Image;
+
+    while (not done and not m_cancel) {
+        auto frame =
+          co_await m_frame->GetAsyncFrameAfterMove(guard(), &m_cancel);
+        if (frame) {
+            const int height = frame->height;
+            const int width = frame->width;
+
+            cv::Mat src = frame->CreateGray();
+
+            cv::Mat source = Image.ImageRegions(
+              src, 0, 0, width, height, ROTATE);
+
+            int x_focus_pos = m_move->GetLastPos(MotorRole::mtr_x);
+            int y_focus_pos = m_move->GetLastPos(MotorRole::mtr_y);
+
+            auto storage = StageSettingStorage::GetInstance(m_station);
+            if (storage) {
+                storage->SaveSettingToJson(StageConfigKeys::LAST_X_POS,
+                                           x_focus_pos);
+                storage->SaveSettingToJson(StageConfigKeys::LAST_Y_POS,
+                                           y_focus_pos);
+            }
+
+            SaveFocusingImages(path, source, x_focus_pos, 999, 0);
+            std::string last_img_path =
+              StationPath(m_station, PATH_TO_FOCUS) + "/last";
+            StageLogSession::Begin(last_img_path);
+            SaveFocusingImages(last_img_path, source, x_focus_pos, 999, 0);
+
+            static int count = 0;
+
+            std::string save_path =
+              StationPath(m_station, PATH_TO_HISTORY) + "/focus";
+            StageFileHandle File(save_path);
+            std::string save_file =
+              File.GetFileName("0000", ".csv", "focus_log");
+            if ((m_max_idx < m_positions.size()) and
+                (m_min_idx < m_positions.size())) {
+
+                SaveFocusLog(save_file,
+                             ++count,
+                             m_need_water,
+                             m_positions[m_min_idx],
+                             m_positions[m_max_idx],
+                             x_focus_pos,
+                             y_focus_pos);
+            } else {
+                SaveFocusLog(
+                  save_file, ++count, 0, 0, 0, x_focus_pos, y_focus_pos);
+            }
+            m_num_focus = 0;
+            done = true;
+        }
+    }
+    co_return;
+}
+
+asio::awaitable<void>
+StageAutoFocus::StartAutoFocus(async::Lifeguard guard, bool fine)
+{   
+    auto storage = StageSettingStorage::GetInstance(m_station);
+    if (storage) {
+        m_step =
+          std::get<int>(storage->GetSettings(StageConfigKeys::FOCUS_STEP));
+        m_total_steps =
+          std::get<int>(storage->GetSettings(StageConfigKeys::FOCUS_NUMOFSTEP));
+        m_start_pos = m_step * int(m_total_steps / 2);
+        m_init_x_pos =
+          std::get<int>(storage->GetSettings(StageConfigKeys::INIT_X_POS));
+        m_tiles_x = std::max(1,
+          std::get<int>(storage->GetSettings(StageConfigKeys::FOCUS_TILES_X)));
+        m_tiles_y = std::max(1,
+          std::get<int>(storage->GetSettings(StageConfigKeys::FOCUS_TILES_Y)));
+        m_weighted = std::get<std::string>(storage->GetSettings(
+                       StageConfigKeys::FOCUS_AGGREGATE)) == "weighted";
+    }
+    auto timer = ds::async::Timer();
+    m_ok_user_water = false;
+    m_cancel = false;
+
+    m_overall_focusing = false;
+    std::string path = StationPath(m_station, PATH_TO_FOCUS) + "/regular";
+
+    co_await InitSetup(guard(), fine, path);
+    co_await m_move->GetNotBusy(guard());
+    co_await CenterPosition(guard(), fine, path);
+    co_await m_move->GetNotBusy(guard());
+
+    if (IsFocusMethodROI(Method_Focus::ROI_LINE) and (m_need_water)) {
+        while (not m_ok_user_water and not m_cancel) {
+            co_await timer.AsyncSleepFor(guard(), 500ms);
+        }        
+        co_await SearchFlow(guard());
+    }
+    m_ok_user_water = false;
+    co_await Focusing(guard(), path);
+    co_await m_move->GetNotBusy(guard());
+
+    if (IsFocusMethodROI(Method_Focus::ROI_MARKER) ||
+        IsFocusMethodROI(Method_Focus::ROI_EXTERNAL)) {
+        co_await m_move->MoveLastPos(guard(),
+                                     m_move->GetLastPos(MotorRole::mtr_x),
+                                     m_move->GetLastPos(MotorRole::mtr_y));
+    }
+    co_await CenterPosition(guard(), true, path);
+    co_await m_move->GetNotBusy(guard());
+    if (not m_cancel)
+        co_await SaveLog(guard(), path);
+    if (IsFocusMethodROI(Method_Focus::ROI_LINE) and (m_need_water) and
+        (not m_cancel))
+        co_await PumpUntilFlow(guard());
+    m_send_progress = 100;
+    co_await timer.AsyncSleepFor(guard(), 200ms);
+    m_automode->SetNeedRefocus(false);
+    SetState(StageDSState::focus_idle);
+    co_return;
+}
+asio::awaitable<void>
+StageAutoFocus::StartOverAllAutoFocus(async::Lifeguard guard)
+{
+    auto storage = StageSettingStorage::GetInstance(m_station);
+    if (storage) {
+        m_step =
+          std::get<int>(storage->GetSettings(StageConfigKeys::FOCUS_STEP));
+        m_total_steps =
+          std::get<int>(storage->GetSettings(StageConfigKeys::FOCUS_NUMOFSTEP));
+        m_start_pos = m_step * int(m_total_steps / 2);
+        m_init_x_pos =
+          std::get<int>(storage->GetSettings(StageConfigKeys::INIT_X_POS));
+    }
+    auto timer = ds::async::Timer();
+    m_cancel = false;
+    m_overall_focusing = true;
+
+    std::string path = StationPath(m_station, PATH_TO_FOCUS) + "/overall";
+    co_await InitSetup(guard(), false, path);
+    co_await m_move->GetNotBusy(guard());
+    co_await CenterPosition(guard(), false, path);
+    co_await m_move->GetNotBusy(guard());
+    co_await OverallFocusing(guard(), path);
+    co_await m_move->GetNotBusy(guard());
+
+    // temporary because the overall focusing is not finished yet.
+    m_send_progress = 100;
+    co_await timer.AsyncSleepFor(guard(), 200ms);
+    m_automode->SetNeedRefocus(false);
+    SetState(StageDSState::focus_idle);
+    //co_await StartAutoFocus(guard(), false);
+
+    co_return;
+}
+asio::awaitable<void>
+StageAutoFocus::CancelAutoFocus(async::Lifeguard guard)
+{
+    m_cancel = true;
+    m_cond.Notify();
+    co_await m_move->StopMove(guard(), MotorRole::mtr_x);
+    co_await m_move->StopMove(guard(), MotorRole::mtr_y);
+    co_await m_move->GetNotBusy(guard());
+    co_await m_move->MoveLastPos(guard(),
+                                 m_move->GetLastPos(MotorRole::mtr_x),
+                                 m_move->GetLastPos(MotorRole::mtr_y));
+    co_await m_move->GetNotBusy(guard());
+    co_await m_pump->StopPump(guard());
+
+    SetState(StageDSState::focus_idle);
+}
+void
+StageAutoFocus::SetState(uint32_t state)
+{
+    if (StageDSState::focus_busy == state)
+        m_state &= ~(StageDSState::idle | StageDSState::focus_idle);
+    if (StageDSState::focus_idle == state)
+        m_state &= ~(StageDSState::idle | StageDSState::focus_busy);
+
+    m_state |= state;
+}
+bool
+StageAutoFocus::IsState(uint32_t state) const
+{
+    if (m_state & state)
+        return true;
+    else
+        return false;
+}
+
+}
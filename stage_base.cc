@@ -1,568 +1,912 @@
-
-#include <iostream>
-
-#include "serial.h"
-#include "stage_base.h"
-#include "stage_settings.h"
-#include <spdlog/spdlog.h>
-
-namespace ds::depthscan {
-
-static int
-ConvertVolt2Dac(double voltage)
-{
-    double dac = (voltage / 3.3) * 255; // 8bit
-    return (int)dac;
-}
-static void
-LoadMotorConfigDac(auto& dac)
-{
-    dac.insert(std::pair<int, int>(1, ConvertVolt2Dac(3.3)));  // 3.3V
-    dac.insert(std::pair<int, int>(2, ConvertVolt2Dac(2.0)));  // 2.0V
-    dac.insert(std::pair<int, int>(3, ConvertVolt2Dac(0.0)));  // 0V
-    dac.insert(std::pair<int, int>(4, ConvertVolt2Dac(0.0)));  // 0V
-    dac.insert(std::pair<int, int>(5, ConvertVolt2Dac(0.0)));  // 0V
-    dac.insert(std::pair<int, int>(6, ConvertVolt2Dac(2.0)));  // 3.3V
-    dac.insert(std::pair<int, int>(7, ConvertVolt2Dac(3.3)));  // 3.3V
-    dac.insert(std::pair<int, int>(8, ConvertVolt2Dac(2.0)));  // 2.0V
-    dac.insert(std::pair<int, int>(9, ConvertVolt2Dac(0.0)));  // 0V
-    dac.insert(std::pair<int, int>(10, ConvertVolt2Dac(0.0))); // 0V
-    dac.insert(std::pair<int, int>(11, ConvertVolt2Dac(0.0))); // 0V
-    dac.insert(std::pair<int, int>(12, ConvertVolt2Dac(2.0))); // 3.3V
-}
-
-static std::tuple<uint8_t,
-                  uint8_t,
-                  uint8_t,
-                  uint8_t,
-                  uint8_t,
-                  uint8_t,
-                  uint8_t,
-                  uint8_t,
-                  uint8_t>
-GetMotorConfig(uint8_t mtr)
-{
-    switch (mtr) {
-        case (MotorRole::mtr_x): {
-            return std::make_tuple(XMotorConfig::mask_upper,
-                                   XMotorConfig::mask_home,
-                                   XMotorConfig::mask_lower,
-                                   XMotorConfig::mask_alarm,
-                                   XMotorConfig::mask_limit_xor,
-                                   XMotorConfig::delay_x,
-                                   XMotorConfig::puls_x,
-                                   XMotorConfig::dir_x,
-                                   XMotorConfig::onep_x);
-            break;
-        }
-        case (MotorRole::mtr_y): {
-            return std::make_tuple(YMotorConfig::mask_upper,
-                                   YMotorConfig::mask_home,
-                                   YMotorConfig::mask_lower,
-                                   YMotorConfig::mask_alarm,
-                                   YMotorConfig::mask_limit_xor,
-                                   YMotorConfig::delay_x,
-                                   YMotorConfig::puls_x,
-                                   YMotorConfig::dir_x,
-                                   YMotorConfig::onep_x);
-            break;
-        }
-        case (MotorRole::mtr_p): {
-            return std::make_tuple(PumpConfig::mask_upper,
-                                   PumpConfig::mask_home,
-                                   PumpConfig::mask_lower,
-                                   PumpConfig::mask_alarm,
-                                   PumpConfig::mask_limit_xor,
-                                   PumpConfig::delay_x,
-                                   PumpConfig::puls_x,
-                                   PumpConfig::dir_x,
-                                   PumpConfig::onep_x);
-            break;
-        }
-        default: {
-            return std::make_tuple(XMotorConfig::mask_upper,
-                                   XMotorConfig::mask_home,
-                                   XMotorConfig::mask_lower,
-                                   XMotorConfig::mask_alarm,
-                                   XMotorConfig::mask_limit_xor,
-                                   XMotorConfig::delay_x,
-                                   XMotorConfig::puls_x,
-                                   XMotorConfig::dir_x,
-                                   XMotorConfig::onep_x);
-            break;
-        }
-    }
-}
-
-Stage::Stage()
-  : m_state(idle)
-  , m_saved_power(0)
-  , m_init_x_pos(0)
-  , m_init_y_pos(0)
-  , m_last_x_pos(0)
-  , m_last_y_pos(0)
-  , m_avalon(nullptr)
-  , m_camera_name("U3-300xSE-C")
-
-{
-    auto storage = StageSettingStorage::GetInstance();
-    
-    if (storage) {
-        storage->LoadSettingsFromJson(m_camera_name);
-        m_init_x_pos =
-          std::get<int>(storage->GetSettings(StageConfigKeys::INIT_X_POS));
-        m_init_y_pos =
-          std::get<int>(storage->GetSettings(StageConfigKeys::INIT_Y_POS));
-        m_last_x_pos =
-          std::get<int>(storage->GetSettings(StageConfigKeys::LAST_X_POS));
-        m_last_y_pos =
-          std::get<int>(storage->GetSettings(StageConfigKeys::LAST_Y_POS));
-    }
-    // if you dont want to call this,
-    //  remove this line
-    m_avalon = serial::GetAvalon("main");
-        
-    LoadMotorConfigDac(m_dac);
-}
-
-Stage::~Stage()
-{
-}
-void
-Stage::Initiate() noexcept
-{
-    static bool called = false;
-    if (m_avalon and not called) {
-        called = true;
-        //if you dont want to call this,
-        // remove this line
-        Start<&Stage::ValidCheck>(NewLife());
-    }
-}
-
-asio::awaitable<void>
-Stage::InitConfig(async::Lifeguard guard)
-{
-    co_await SetLEDCh(guard(), 65535);           // all on
-    co_await SetLEDPeriod(guard(), 20);         // 20ms, 50FPS
-    co_await SetLEDCamOff(guard(), 1);          // 1ms
-    co_await SetLEDOn(guard(), 1);              // 1ms
-
-    co_await InitDacConfig(guard(), m_dac);
-    co_await InitMotorConfig(guard());
-    co_await MoveHome(guard());
-    co_await MoveLastPos(guard(),m_last_x_pos,m_last_y_pos);
-
-    auto storage = StageSettingStorage::GetInstance();
-    if (storage->GetCameraName() != "U3-300xSE-C") {
-        m_camera_name = storage->GetCameraName();
-        storage->LoadSettingsFromJson(m_camera_name);
-        m_init_x_pos =
-          std::get<int>(storage->GetSettings(StageConfigKeys::INIT_X_POS));
-        m_init_y_pos =
-          std::get<int>(storage->GetSettings(StageConfigKeys::INIT_Y_POS));
-        m_last_x_pos =
-          std::get<int>(storage->GetSettings(StageConfigKeys::LAST_X_POS));
-        m_last_y_pos =
-          std::get<int>(storage->GetSettings(StageConfigKeys::LAST_Y_POS));
-        co_await MoveLastPos(guard(), m_last_x_pos, m_last_y_pos);
-    }
-
-
-    co_return;
-}
-asio::awaitable<void>
-Stage::InitDacConfig(async::Lifeguard guard,auto& dac)
-{
-    uint32_t              data    = 0;
-    uint32_t              address = ADDR_DS_CONFIG;
-    std::vector<uint32_t> writeBuffer;
-
-    for (auto iter = dac.begin(); iter != dac.end(); iter++) {
-        data = (unsigned int)(0xf << 12) | (unsigned int)(iter->first << 8) |
-               (unsigned int)(iter->second & 0xff);
-
-        writeBuffer.clear();
-        writeBuffer.push_back(data);
-        co_await m_avalon->AsyncWrite(guard(), address, writeBuffer);
-    }
-    co_return;
-}
-asio::awaitable<void>
-Stage::SetAccel(async::Lifeguard guard,uint8_t mtr, uint32_t accel)
-{
-    std::vector<uint32_t> writeBuffer;
-    uint32_t              data    = accel;
-    uint32_t              address = ADDR_STEPPER0_ACCEL + CH_OFFSET * mtr;
-
-    if (0 == data)
-        data = 1;
-
-    writeBuffer.push_back(data);
-    co_await m_avalon->AsyncWrite(guard(), address, writeBuffer);
-    co_return;
-}
-asio::awaitable<void>
-Stage::SetInitSpeed(async::Lifeguard guard,uint8_t mtr, uint32_t speed)
-{
-    std::vector<uint32_t> writeBuffer;
-    uint32_t              data    = speed;
-    uint32_t              address = ADDR_STEPPER0_INIT + CH_OFFSET * mtr;
-
-    if (0 == data)
-        data = 1;
-
-    writeBuffer.push_back(data);
-    co_await m_avalon->AsyncWrite(guard(), address, writeBuffer);
-    co_return;
-}
-
-asio::awaitable<void>
-Stage::SetMotorConfig(async::Lifeguard guard,
-                      uint8_t mtr,
-                      uint8_t mask_upper,
-                      uint8_t mask_home,
-                      uint8_t mask_lower,
-                      uint8_t maks_alarm,
-                      uint8_t limit_xor,
-                      uint8_t delay,
-                      uint8_t pulx,
-                      uint8_t dirx,
-                      uint8_t onepulse)
-{
-    std::vector<uint32_t> writeBuffer;
-    uint32_t              data    = 0;
-    uint32_t              address = ADDR_STEPPER0_CONF + CH_OFFSET * mtr;
-
-    data = (unsigned int)(mask_upper) | (unsigned int)(mask_home << 4) |
-           (unsigned int)(mask_lower << 8) | (unsigned int)(maks_alarm << 12) |
-           (unsigned int)(limit_xor << 16) | (unsigned int)(delay << 20) |
-           (unsigned int)(pulx << 28) | (unsigned int)(dirx << 29) |
-           (unsigned int)(onepulse << 31);
-
-    writeBuffer.push_back(data);
-    co_await m_avalon->AsyncWrite(guard(), address, writeBuffer);
-    co_return;
-}
-
-asio::awaitable<void>
-Stage::InitMotorConfig(async::Lifeguard guard)
-{
-    uint8_t i = 0;
-
-    for (i = MotorRole::mtr_1; i < MotorRole::mtr_max; i++) {
-
-        auto [upper, home, lower, alarm, limit_xor, delay, pulx, dirx, one] =
-          GetMotorConfig(i);
-        co_await SetMotorConfig(guard(),
-          i, upper, home, lower, alarm, limit_xor, delay, pulx, dirx, one);
-        co_await SetAccel(guard(), i, 200 * MICRO_STEP);
-        co_await SetInitSpeed(guard(), i, 200 * MICRO_STEP);
-        co_await SetDriveSpeed(guard(), i, 200 * MICRO_STEP);
-        co_await Stop(guard(), i);
-    }
-    co_return;
-}
-asio::awaitable<void>
-Stage::MoveHome(async::Lifeguard guard)
-{
-    // Move to home position
-    co_await SetPos(guard(), MotorRole::mtr_x, 0);
-    co_await SetPos(guard(), MotorRole::mtr_y, 0);
-    co_await Go(guard(),
-                   MotorRole::mtr_x,
-                            MotorDir::motdir_cw,
-                            SingleMode::mode_home,
-                            0,
-                            0,
-                            200 * MICRO_STEP);
-    co_await Go(guard(),
-                   MotorRole::mtr_y,
-                            MotorDir::motdir_cw,
-                            SingleMode::mode_home,
-                            0,
-                            0,
-                            200 * MICRO_STEP);
-
-    bool done = false;
-    auto timer = ds::async::Timer();
-    while (not done)
-    {
-        done = co_await IsHome(guard(), MotorRole::mtr_x | MotorRole::mtr_y);
-        co_await timer.AsyncSleepFor(guard(), 1ms);
-    }
-    co_return;
-}
-
-asio::awaitable<void>
-Stage::MoveInitPos(async::Lifeguard guard)
-{
-    auto storage = StageSettingStorage::GetInstance();
-    if (storage) {
-        storage->LoadSettingsFromJson(m_camera_name);
-        m_init_x_pos =
-          std::get<int>(storage->GetSettings(StageConfigKeys::INIT_X_POS));
-        m_init_y_pos =
-          std::get<int>(storage->GetSettings(StageConfigKeys::INIT_Y_POS));
-    }
-    co_await SetPos(guard(), MotorRole::mtr_x, m_init_x_pos);
-    co_await SetPos(guard(), MotorRole::mtr_y, m_init_y_pos);
-    co_await Go(guard(),
-                MotorRole::mtr_x,
-                MotorDir::motdir_cw,
-                SingleMode::mode_cnt,
-                0,
-                0,
-                200 * MICRO_STEP);
-    co_await Go(guard(),
-                MotorRole::mtr_y,
-                MotorDir::motdir_cw,
-                SingleMode::mode_cnt,
-                0,
-                0,
-                200 * MICRO_STEP);
-    bool done = false;
-    while (not done) {
-        done = co_await GetNotBusy(guard());
-    }
-}
-
-asio::awaitable<void>
-Stage::MoveLastPos(async::Lifeguard guard,int x, int y)
-{
-    co_await SetPos(guard(), MotorRole::mtr_x, x);
-    co_await SetPos(guard(), MotorRole::mtr_y, y);
-    co_await Go(guard(),
-                MotorRole::mtr_x,
-                MotorDir::motdir_cw,
-                SingleMode::mode_cnt,
-                0,
-                0,
-                200 * MICRO_STEP);
-    co_await Go(guard(),
-                MotorRole::mtr_y,
-                MotorDir::motdir_cw,
-                SingleMode::mode_cnt,
-                0,
-                0,
-                200 * MICRO_STEP);
-    bool done = false;
-    while (not done) {
-        done = co_await GetNotBusy(guard());
-    }
-}
-asio::awaitable<void>
-Stage::PowerOn(async::Lifeguard guard,uint8_t mtr)
-{
-    std::vector<uint32_t> writeBuffer;
-    uint32_t              address     = ADDR_DS_POWER;
-    uint32_t              saved_power = LoadSavedPowerMode();
-
-    saved_power |= (1 << mtr);
-    SavePowerMode(saved_power);
-    writeBuffer.push_back(saved_power);
-
-    co_await m_avalon->AsyncWrite(guard(), address, writeBuffer);
-    co_return;
-}
-asio::awaitable<void>
-Stage::PowerOff(async::Lifeguard guard,uint8_t mtr)
-{
-    std::vector<uint32_t> writeBuffer;
-    uint32_t              address     = ADDR_DS_POWER;
-    uint32_t              saved_power = LoadSavedPowerMode();
-
-    saved_power &= ~(1 << mtr);
-    SavePowerMode(saved_power);
-    writeBuffer.push_back(saved_power);
-
-    co_await m_avalon->AsyncWrite(guard(), address, writeBuffer);
-    co_return;
-}
-
-asio::awaitable<void>
-Stage::SingleMode(async::Lifeguard guard,uint8_t mtr,
-                  uint8_t mode,
-                  uint32_t retry,
-                  uint32_t bound)
-{
-    std::vector<uint32_t> writeBuffer;
-    uint32_t              address = ADDR_STEPPER0_MODE + CH_OFFSET * mtr;
-    uint32_t              data    = 0;
-
-    if (retry > 0xF)
-        retry = 0xF;
-    if (bound > 0xFFFF)
-        bound = 0xFFFF;
-
-    data = (unsigned int)(mode) | (unsigned int)(retry << 4) |
-           (unsigned int)(bound << 16);
-
-    writeBuffer.push_back(data);
-
-    co_await m_avalon->AsyncWrite(guard(), address, writeBuffer);
-    co_return;
-}
-asio::awaitable<void>
-Stage::Go(async::Lifeguard guard,
-             uint8_t mtr,
-             uint8_t  dir,
-             uint8_t  mode,
-             uint32_t retry,
-             uint32_t bound,
-             uint32_t speed)
-{
-    co_await PowerOn(guard(), mtr);
-    co_await SingleMode(guard(), mtr, mode, retry, bound);
-    //co_await SetAccel(guard,mtr, 100 * MICRO_STEP);
-    co_await SetInitSpeed(guard(), mtr, speed);
-    co_await SetDriveSpeed(guard(), mtr, speed);
-    if (mtr == mtr_p)
-        co_await SetDir(guard(), mtr, dir);
-
-    std::vector<uint32_t> writeBuffer;
-    uint32_t              address = ADDR_STEPPER0_CTRL;
-    uint32_t              data    = ((1 << ctrl_start) << mtr);
-
-    writeBuffer.push_back(data);
-
-    co_await m_avalon->AsyncWrite(guard(), address, writeBuffer);
-    co_return;
-}
-asio::awaitable<void>
-Stage::Stop(async::Lifeguard guard,uint8_t mtr)
-{
-    co_await PowerOff(guard(), mtr);
-    std::vector<uint32_t> writeBuffer;
-    uint32_t              address = ADDR_STEPPER0_CTRL;
-    uint32_t              data    = ((1 << ctrl_stop) << mtr);
-
-    writeBuffer.push_back(data);
-    spdlog::info("cmd stop: {}", mtr);
-    co_await m_avalon->AsyncWrite(guard(), address, writeBuffer);
-    co_return;
-}
-int
-Stage::ReadStatus([[maybe_unused]] uint8_t mtr) const
-{
-    return false;
-}
-asio::awaitable<void>
-Stage::SetDir(async::Lifeguard guard,uint8_t mtr, uint8_t dir)
-{
-    auto [upper, home, lower, alarm, limit_xor, delay, pulx, dirx, one] =
-      GetMotorConfig(mtr);
-
-    if (dir == motdir_cw)
-        co_await SetMotorConfig(guard(),
-          mtr, upper, home, lower, alarm, limit_xor, delay, pulx, 0, one);
-    else
-        co_await SetMotorConfig(guard(),
-          mtr, upper, home, lower, alarm, limit_xor, delay, pulx, 1, one);
-
-    co_return;
-}
-asio::awaitable<void>
-Stage::SetDriveSpeed(async::Lifeguard guard,uint8_t mtr, uint32_t speed)
-{
-    std::vector<uint32_t> writeBuffer;
-    uint32_t              address = ADDR_STEPPER0_LAST + CH_OFFSET * mtr;
-    uint32_t              data    = speed;
-
-    if (0 == data)
-        data = 1;
-
-    writeBuffer.push_back(data);
-
-    co_await m_avalon->AsyncWrite(guard(), address, writeBuffer);
-    co_return;
-}
-asio::awaitable<bool>
-Stage::GetNotBusy(async::Lifeguard guard)
-{
-    bool result = false;
-
-    std::vector<uint32_t> data =
-      co_await m_avalon->AsyncRead(guard(), ADDR_STEPPER0_STAT, 1);
-    if (not data.empty()) {
-        uint32_t mot_mask = (1u << mtr_x) | (1u << mtr_y);
-        uint32_t bit_mask = ((mot_mask << stat_busy) & 0x1f);
-        uint32_t status   = (data.at(0) & bit_mask) >> stat_busy;
-        if (status & mot_mask)
-            result = false;
-        else
-            result = true;
-    } else {
-        result = false;
-    }
-
-    co_return result;
-}
-
-asio::awaitable<bool>
-Stage::IsHome(async::Lifeguard guard,uint8_t mtr)
-{
-    std::vector<uint32_t> data =
-      co_await m_avalon->AsyncRead(guard(), ADDR_STEPPER0_STAT, 1);
-    if (not data.empty()) {
-        uint32_t mot_mask = (1 << mtr_x) | (1 << mtr_y);
-        uint32_t bit_mask = ((mot_mask << stat_home) & 0xf000u);
-        uint32_t status   = (data.at(0) & bit_mask) >> stat_home;
-        if (status == mot_mask)
-            co_return true;
-        else
-            co_return false;
-    }
-    co_return false;
-}
-asio::awaitable<void>
-Stage::SetPos(async::Lifeguard guard,uint8_t mtr, long long pos)
-{
-    std::vector<uint32_t> writeBuffer;
-    uint32_t              address;
-    uint32_t              pos_L = (pos & 0xFFFFFFFF);
-    uint32_t              pos_H = (pos >> 32) & 0xFFFFFFFF;
-
-    address = ADDR_STEPPER0_DEST_L + CH_OFFSET * mtr;
-    writeBuffer.push_back(pos_L);
-    co_await m_avalon->AsyncWrite(guard(), address, writeBuffer);
-
-    writeBuffer.clear();
-    address = ADDR_STEPPER0_DEST_H + CH_OFFSET * mtr;
-    writeBuffer.push_back(pos_H);
-    co_await m_avalon->AsyncWrite(guard(), address, writeBuffer);
-    co_return;
-}
-
-asio::awaitable<int>
-Stage::GetPos(async::Lifeguard guard,uint8_t mtr)
-{
-    uint32_t address;
-
-    address = ADDR_STEPPER0_POS_L + 8 * mtr;
-    std::vector<uint32_t> data;
-    bool                  done = false;
-    while (not done) {
-        data = co_await m_avalon->AsyncRead(guard(), address, 1);
-        if (data.size()) {
-            done = true;
-            co_return data.at(0);
-        }
-    }
-}
-asio::awaitable<void>
-Stage::ValidCheck(async::Lifeguard guard)
-{
-    co_await m_avalon->AsyncPing(guard());
-    std::vector<uint32_t> data =
-      co_await m_avalon->AsyncRead(guard(), ADDR_SYS_BASE, 1);
-
-    if (not data.empty()) {
-        if (data.at(0) == 0xabcd1234) {
-            co_await InitConfig(guard());
-        }
-    }
-    
-    co_return;
-}
+
+#include <iostream>
+
+#include <asio/experimental/awaitable_operators.hpp>
+#include <camera.h>
+#include "serial.h"
+#include "stage_base.h"
+#include "stage_settings.h"
+#include <spdlog/spdlog.h>
+
+using namespace asio::experimental::awaitable_operators;
+
+namespace ds::depthscan {
+
+StageEvents&
+StageEvents::Get(const StationId& station)
+{
+    static std::mutex s_mutex;
+    static std::map<StationId, std::unique_ptr<StageEvents>> s_stations;
+
+    std::lock_guard<std::mutex> lock(s_mutex);
+    auto& events = s_stations[station];
+    if (not events)
+        events = std::make_unique<StageEvents>();
+    return *events;
+}
+void
+StageEvents::MarkMoveStarted()
+{
+    m_move_pending = true;
+}
+bool
+StageEvents::MarkMoveDone()
+{
+    if (not m_move_pending.exchange(false))
+        return false;
+    m_move_done = Clock::now().time_since_epoch().count();
+    return true;
+}
+void
+StageEvents::MarkParamChanged()
+{
+    m_param_changed = Clock::now().time_since_epoch().count();
+}
+bool
+StageEvents::IsMovePending() const
+{
+    return m_move_pending;
+}
+StageEvents::Clock::time_point
+StageEvents::LastMoveDone() const
+{
+    return Clock::time_point(Clock::duration(m_move_done.load()));
+}
+StageEvents::Clock::time_point
+StageEvents::LastParamChanged() const
+{
+    return Clock::time_point(Clock::duration(m_param_changed.load()));
+}
+
+StageAxisState&
+StageAxisState::Get(const StationId& station)
+{
+    static std::mutex s_mutex;
+    static std::map<StationId, std::unique_ptr<StageAxisState>> s_stations;
+
+    std::lock_guard<std::mutex> lock(s_mutex);
+    auto& state = s_stations[station];
+    if (not state)
+        state = std::make_unique<StageAxisState>();
+    return *state;
+}
+std::optional<int>
+StageAxisState::GetDest(uint8_t mtr)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (mtr >= MOTION_AXES)
+        return std::nullopt;
+    return m_dest[mtr];
+}
+void
+StageAxisState::Started(uint8_t mtr, std::optional<int> dest)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (mtr < MOTION_AXES)
+        m_dest[mtr] = dest;
+}
+void
+StageAxisState::StoppedAll()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_dest.fill(std::nullopt);
+}
+
+static int
+ConvertVolt2Dac(double voltage)
+{
+    double dac = (voltage / 3.3) * 255; // 8bit
+    return (int)dac;
+}
+static void
+LoadMotorConfigDac(auto& dac)
+{
+    dac.insert(std::pair<int, int>(1, ConvertVolt2Dac(3.3)));  // 3.3V
+    dac.insert(std::pair<int, int>(2, ConvertVolt2Dac(2.0)));  // 2.0V
+    dac.insert(std::pair<int, int>(3, ConvertVolt2Dac(0.0)));  // 0V
+    dac.insert(std::pair<int, int>(4, ConvertVolt2Dac(0.0)));  // 0V
+    dac.insert(std::pair<int, int>(5, ConvertVolt2Dac(0.0)));  // 0V
+    dac.insert(std::pair<int, int>(6, ConvertVolt2Dac(2.0)));  // 3.3V
+    dac.insert(std::pair<int, int>(7, ConvertVolt2Dac(3.3)));  // 3.3V
+    dac.insert(std::pair<int, int>(8, ConvertVolt2Dac(2.0)));  // 2.0V
+    dac.insert(std::pair<int, int>(9, ConvertVolt2Dac(0.0)));  // 0V
+    dac.insert(std::pair<int, int>(10, ConvertVolt2Dac(0.0))); // 0V
+    dac.insert(std::pair<int, int>(11, ConvertVolt2Dac(0.0))); // 0V
+    dac.insert(std::pair<int, int>(12, ConvertVolt2Dac(2.0))); // 3.3V
+}
+
+static std::tuple<uint8_t,
+                  uint8_t,
+                  uint8_t,
+                  uint8_t,
+                  uint8_t,
+                  uint8_t,
+                  uint8_t,
+                  uint8_t,
+                  uint8_t>
+GetMotorConfig(uint8_t mtr)
+{
+    switch (mtr) {
+        case (MotorRole::mtr_x): {
+            return std::make_tuple(XMotorConfig::mask_upper,
+                                   XMotorConfig::mask_home,
+                                   XMotorConfig::mask_lower,
+                                   XMotorConfig::mask_alarm,
+                                   XMotorConfig::mask_limit_xor,
+                                   XMotorConfig::delay_x,
+                                   XMotorConfig::puls_x,
+                                   XMotorConfig::dir_x,
+                                   XMotorConfig::onep_x);
+            break;
+        }
+        case (MotorRole::mtr_y): {
+            return std::make_tuple(YMotorConfig::mask_upper,
+                                   YMotorConfig::mask_home,
+                                   YMotorConfig::mask_lower,
+                                   YMotorConfig::mask_alarm,
+                                   YMotorConfig::mask_limit_xor,
+                                   YMotorConfig::delay_x,
+                                   YMotorConfig::puls_x,
+                                   YMotorConfig::dir_x,
+                                   YMotorConfig::onep_x);
+            break;
+        }
+        case (MotorRole::mtr_p): {
+            return std::make_tuple(PumpConfig::mask_upper,
+                                   PumpConfig::mask_home,
+                                   PumpConfig::mask_lower,
+                                   PumpConfig::mask_alarm,
+                                   PumpConfig::mask_limit_xor,
+                                   PumpConfig::delay_x,
+                                   PumpConfig::puls_x,
+                                   PumpConfig::dir_x,
+                                   PumpConfig::onep_x);
+            break;
+        }
+        default: {
+            return std::make_tuple(XMotorConfig::mask_upper,
+                                   XMotorConfig::mask_home,
+                                   XMotorConfig::mask_lower,
+                                   XMotorConfig::mask_alarm,
+                                   XMotorConfig::mask_limit_xor,
+                                   XMotorConfig::delay_x,
+                                   XMotorConfig::puls_x,
+                                   XMotorConfig::dir_x,
+                                   XMotorConfig::onep_x);
+            break;
+        }
+    }
+}
+
+Stage::Stage(const StationId& station)
+  : m_station(station)
+  , m_events(&StageEvents::Get(m_station))
+  , m_telemetry(&StageTelemetry::Get(m_station))
+  , m_pump_state(&StagePumpState::Get(m_station))
+  , m_axis_state(&StageAxisState::Get(m_station))
+  , m_state(idle)
+  , m_saved_power(0)
+  , m_init_x_pos(0)
+  , m_init_y_pos(0)
+  , m_last_x_pos(0)
+  , m_last_y_pos(0)
+  , m_planner(station)
+  , m_link(nullptr)
+  , m_camera_name("U3-300xSE-C")
+
+{
+    auto storage = StageSettingStorage::GetInstance(m_station);
+    
+    if (storage) {
+        storage->LoadSettingsFromJson(m_camera_name);
+        m_init_x_pos =
+          std::get<int>(storage->GetSettings(StageConfigKeys::INIT_X_POS));
+        m_init_y_pos =
+          std::get<int>(storage->GetSettings(StageConfigKeys::INIT_Y_POS));
+        m_last_x_pos =
+          std::get<int>(storage->GetSettings(StageConfigKeys::LAST_X_POS));
+        m_last_y_pos =
+          std::get<int>(storage->GetSettings(StageConfigKeys::LAST_Y_POS));
+    }
+    // if you dont want to call this,
+    //  remove this line
+    m_link = GetStageLink(m_station);
+        
+    LoadMotorConfigDac(m_dac);
+}
+
+Stage::~Stage()
+{
+}
+void
+Stage::Initiate() noexcept
+{
+    // one ValidCheck per station, whichever Stage of it comes first
+    static std::mutex                    s_mutex;
+    static std::unordered_set<StationId> s_checked;
+
+    std::lock_guard<std::mutex> lock(s_mutex);
+    if (m_link and s_checked.insert(m_station).second) {
+        //if you dont want to call this,
+        // remove this line
+        Start<&Stage::ValidCheck>(NewLife());
+    }
+}
+
+asio::awaitable<void>
+Stage::InitConfig(async::Lifeguard guard)
+{
+    using Clock = std::chrono::steady_clock;
+    m_bringup_start = Clock::now();
+
+    // 1. the camera specific profile first, so the stage moves only once
+    auto storage = StageSettingStorage::GetInstance(m_station);
+    if (storage->GetCameraName() != "U3-300xSE-C") {
+        m_camera_name = storage->GetCameraName();
+        const auto swap = Clock::now();
+        storage->LoadSettingsFromJson(m_camera_name);
+        spdlog::info("settings: switched to {} in {} us",
+                     m_camera_name,
+                     std::chrono::duration_cast<std::chrono::microseconds>(
+                       Clock::now() - swap)
+                       .count());
+        m_init_x_pos =
+          std::get<int>(storage->GetSettings(StageConfigKeys::INIT_X_POS));
+        m_init_y_pos =
+          std::get<int>(storage->GetSettings(StageConfigKeys::INIT_Y_POS));
+        m_last_x_pos =
+          std::get<int>(storage->GetSettings(StageConfigKeys::LAST_X_POS));
+        m_last_y_pos =
+          std::get<int>(storage->GetSettings(StageConfigKeys::LAST_Y_POS));
+    }
+
+    // 2. configuration, batched where the registers are contiguous
+    co_await InitLEDConfig(guard());
+    co_await InitDacConfig(guard(), m_dac);
+    co_await InitMotorConfig(guard());
+    const auto configured = Clock::now();
+
+    // 3. both waits run together: first camera frame and homing
+    const bool camera_ok = co_await (WarmCamera(guard()) && MoveHome(guard()));
+    const auto homed     = Clock::now();
+
+    co_await MoveLastPos(guard(), m_last_x_pos, m_last_y_pos);
+    const auto placed = Clock::now();
+
+    auto ms = [](Clock::duration d) {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(d)
+          .count();
+    };
+    spdlog::info("bring-up: stage at ({}, {}) in {} ms, config {} ms, "
+                 "home {} ms, move {} ms",
+                 m_last_x_pos,
+                 m_last_y_pos,
+                 ms(placed - m_bringup_start),
+                 ms(configured - m_bringup_start),
+                 ms(homed - configured),
+                 ms(placed - homed));
+    if (camera_ok)
+        spdlog::info("bring-up: ready in {} ms", ms(placed - m_bringup_start));
+    else
+        spdlog::error("bring-up: stage ready in {} ms, camera failed",
+                      ms(placed - m_bringup_start));
+    co_return;
+}
+asio::awaitable<void>
+Stage::InitLEDConfig(async::Lifeguard guard)
+{
+    auto ticks = [](double ms) {
+        return uint32_t(CLOCK_HZ * (ms / 1000.0)) - 1u;
+    };
+
+    co_await SetLEDCh(guard(), 65535); // all on
+    // HZ, CAM_OFF, ON and OFF are contiguous, one burst:
+    // 20ms period (50FPS), camera off 1ms, LED on 1ms
+    co_await m_link->AsyncWrite(
+      guard(),
+      ADDR_DS_LED_HZ,
+      { ticks(20), ticks(1), ticks(1), ticks(1) + 64u },
+      LinkWrite::idempotent);
+    co_return;
+}
+asio::awaitable<bool>
+Stage::WarmCamera(async::Lifeguard guard)
+{
+    auto camera = ds::camera::GetCamera(m_station);
+    if (not camera) {
+        spdlog::error("bring-up: no camera on station {}", m_station);
+        co_return false;
+    }
+
+    asio::steady_timer timer(co_await asio::this_coro::executor,
+                             BRINGUP_CAMERA_TIMEOUT);
+    auto first = co_await (camera->AsyncGetFrame(guard())
+                           || timer.async_wait(asio::use_awaitable));
+    if (first.index() != 0) {
+        spdlog::error("bring-up: no camera frame within {} s",
+                      BRINGUP_CAMERA_TIMEOUT.count());
+        co_return false;
+    }
+    spdlog::info("bring-up: camera first frame after {} ms",
+                 std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now() - m_bringup_start)
+                   .count());
+    co_return true;
+}
+asio::awaitable<void>
+Stage::InitDacConfig(async::Lifeguard guard,auto& dac)
+{
+    uint32_t              data    = 0;
+    uint32_t              address = ADDR_DS_CONFIG;
+    std::vector<uint32_t> writeBuffer;
+
+    for (auto iter = dac.begin(); iter != dac.end(); iter++) {
+        data = (unsigned int)(0xf << 12) | (unsigned int)(iter->first << 8) |
+               (unsigned int)(iter->second & 0xff);
+
+        writeBuffer.clear();
+        writeBuffer.push_back(data);
+        co_await m_link->AsyncWrite(guard(), address, writeBuffer);
+    }
+    co_return;
+}
+asio::awaitable<void>
+Stage::SetAccel(async::Lifeguard guard,uint8_t mtr, uint32_t accel)
+{
+    std::vector<uint32_t> writeBuffer;
+    uint32_t              data    = accel;
+    uint32_t              address = ADDR_STEPPER0_ACCEL + CH_OFFSET * mtr;
+
+    if (0 == data)
+        data = 1;
+
+    writeBuffer.push_back(data);
+    co_await m_link->AsyncWrite(
+      guard(), address, writeBuffer, LinkWrite::idempotent);
+    co_return;
+}
+asio::awaitable<void>
+Stage::SetInitSpeed(async::Lifeguard guard,uint8_t mtr, uint32_t speed)
+{
+    std::vector<uint32_t> writeBuffer;
+    uint32_t              data    = speed;
+    uint32_t              address = ADDR_STEPPER0_INIT + CH_OFFSET * mtr;
+
+    if (0 == data)
+        data = 1;
+
+    writeBuffer.push_back(data);
+    co_await m_link->AsyncWrite(
+      guard(), address, writeBuffer, LinkWrite::idempotent);
+    co_return;
+}
+
+asio::awaitable<void>
+Stage::SetMotorConfig(async::Lifeguard guard,
+                      uint8_t mtr,
+                      uint8_t mask_upper,
+                      uint8_t mask_home,
+                      uint8_t mask_lower,
+                      uint8_t maks_alarm,
+                      uint8_t limit_xor,
+                      uint8_t delay,
+                      uint8_t pulx,
+                      uint8_t dirx,
+                      uint8_t onepulse)
+{
+    std::vector<uint32_t> writeBuffer;
+    uint32_t              data    = 0;
+    uint32_t              address = ADDR_STEPPER0_CONF + CH_OFFSET * mtr;
+
+    data = (unsigned int)(mask_upper) | (unsigned int)(mask_home << 4) |
+           (unsigned int)(mask_lower << 8) | (unsigned int)(maks_alarm << 12) |
+           (unsigned int)(limit_xor << 16) | (unsigned int)(delay << 20) |
+           (unsigned int)(pulx << 28) | (unsigned int)(dirx << 29) |
+           (unsigned int)(onepulse << 31);
+
+    writeBuffer.push_back(data);
+    co_await m_link->AsyncWrite(
+      guard(), address, writeBuffer, LinkWrite::idempotent);
+    co_return;
+}
+
+asio::awaitable<void>
+Stage::InitMotorConfig(async::Lifeguard guard)
+{
+    uint8_t  i = 0;
+    uint32_t stop = 0;
+    uint32_t power = LoadSavedPowerMode();
+
+    for (i = MotorRole::mtr_1; i < MotorRole::mtr_max; i++) {
+
+        auto [upper, home, lower, alarm, limit_xor, delay, pulx, dirx, one] =
+          GetMotorConfig(i);
+        co_await SetMotorConfig(guard(),
+          i, upper, home, lower, alarm, limit_xor, delay, pulx, dirx, one);
+        // ACCEL, INIT and LAST (drive) are contiguous
+        co_await m_link->AsyncWrite(
+          guard(),
+          ADDR_STEPPER0_ACCEL + CH_OFFSET * i,
+          { 200 * MICRO_STEP, 200 * MICRO_STEP, 200 * MICRO_STEP },
+          LinkWrite::idempotent);
+        power &= ~(1u << i);
+        stop |= ((1u << ctrl_stop) << i);
+    }
+
+    // Stop on every motor, one power and one control write
+    SavePowerMode(power);
+    co_await m_link->AsyncWrite(
+      guard(), ADDR_DS_POWER, { power }, LinkWrite::idempotent);
+    spdlog::info("cmd stop: all");
+    if (not co_await m_link->AsyncWrite(guard(), ADDR_STEPPER0_CTRL, { stop }))
+        spdlog::error("cmd stop: all failed, motors may still run");
+    m_telemetry->Invalidate();
+    m_axis_state->StoppedAll();
+    m_pump_state->Stopped();
+    co_return;
+}
+asio::awaitable<void>
+Stage::MoveHome(async::Lifeguard guard)
+{
+    // Move to home position, X and Y started by the same control write
+    const uint32_t axes = (1u << mtr_x) | (1u << mtr_y);
+
+    co_await SetPos(guard(), MotorRole::mtr_x, 0);
+    co_await SetPos(guard(), MotorRole::mtr_y, 0);
+    m_events->MarkMoveStarted();
+    SavePowerMode(LoadSavedPowerMode() | axes);
+    co_await m_link->AsyncWrite(guard(),
+                                ADDR_DS_POWER,
+                                { LoadSavedPowerMode() },
+                                LinkWrite::idempotent);
+    for (auto mtr : { MotorRole::mtr_x, MotorRole::mtr_y }) {
+        co_await SingleMode(guard(), mtr, SingleMode::mode_home, 0, 0);
+        // INIT and LAST (drive) are contiguous
+        co_await m_link->AsyncWrite(guard(),
+                                    ADDR_STEPPER0_INIT + CH_OFFSET * mtr,
+                                    { 200 * MICRO_STEP, 200 * MICRO_STEP },
+                                    LinkWrite::idempotent);
+    }
+    const bool started = co_await m_link->AsyncWrite(
+      guard(), ADDR_STEPPER0_CTRL, { axes << ctrl_start });
+    m_telemetry->Invalidate();
+    m_axis_state->Stopped(mtr_x);
+    m_axis_state->Stopped(mtr_y);
+    if (not started) {
+        spdlog::error("cmd home: start failed, not waiting for home");
+        co_return;
+    }
+
+    bool done = false;
+    auto timer = ds::async::Timer();
+    while (not done)
+    {
+        done = co_await IsHome(guard(), MotorRole::mtr_x | MotorRole::mtr_y);
+        co_await timer.AsyncSleepFor(guard(), 1ms);
+    }
+    co_return;
+}
+
+asio::awaitable<void>
+Stage::MoveInitPos(async::Lifeguard guard)
+{
+    auto storage = StageSettingStorage::GetInstance(m_station);
+    if (storage) {
+        storage->LoadSettingsFromJson(m_camera_name);
+        m_init_x_pos =
+          std::get<int>(storage->GetSettings(StageConfigKeys::INIT_X_POS));
+        m_init_y_pos =
+          std::get<int>(storage->GetSettings(StageConfigKeys::INIT_Y_POS));
+    }
+    co_await MoveTo(guard(), MotorRole::mtr_x, m_init_x_pos);
+    co_await MoveTo(guard(), MotorRole::mtr_y, m_init_y_pos);
+    bool done = false;
+    while (not done) {
+        done = co_await GetNotBusy(guard());
+    }
+}
+
+asio::awaitable<void>
+Stage::MoveLastPos(async::Lifeguard guard,int x, int y)
+{
+    co_await MoveTo(guard(), MotorRole::mtr_x, x);
+    co_await MoveTo(guard(), MotorRole::mtr_y, y);
+    bool done = false;
+    while (not done) {
+        done = co_await GetNotBusy(guard());
+    }
+}
+asio::awaitable<PlannedMove>
+Stage::MoveTo(async::Lifeguard guard, uint8_t mtr, int pos)
+{
+    // 1. start: the last destination of the station, else the position
+    //    register; an unknown start gets the slow profile of a zero distance
+    std::optional<int> from = m_axis_state->GetDest(mtr);
+    if (not from)
+        from = co_await GetPos(guard(), mtr);
+    PlannedMove move{ mtr, from ? (long long)pos - *from : 0, {} };
+    move.profile = m_planner.Plan(mtr, move.distance);
+
+    // 2. go, GoProfile records pos as the new destination
+    co_await SetPos(guard(), mtr, pos);
+    move.started = co_await GoProfile(
+      guard(), mtr, SingleMode::mode_cnt, move.profile, pos);
+    co_return move;
+}
+asio::awaitable<void>
+Stage::PowerOn(async::Lifeguard guard,uint8_t mtr)
+{
+    std::vector<uint32_t> writeBuffer;
+    uint32_t              address     = ADDR_DS_POWER;
+    uint32_t              saved_power = LoadSavedPowerMode();
+
+    saved_power |= (1 << mtr);
+    SavePowerMode(saved_power);
+    writeBuffer.push_back(saved_power);
+
+    co_await m_link->AsyncWrite(
+      guard(), address, writeBuffer, LinkWrite::idempotent);
+    co_return;
+}
+asio::awaitable<void>
+Stage::PowerOff(async::Lifeguard guard,uint8_t mtr)
+{
+    std::vector<uint32_t> writeBuffer;
+    uint32_t              address     = ADDR_DS_POWER;
+    uint32_t              saved_power = LoadSavedPowerMode();
+
+    saved_power &= ~(1 << mtr);
+    SavePowerMode(saved_power);
+    writeBuffer.push_back(saved_power);
+
+    co_await m_link->AsyncWrite(
+      guard(), address, writeBuffer, LinkWrite::idempotent);
+    if (mtr == mtr_p)
+        m_pump_state->Stopped();
+    co_return;
+}
+
+asio::awaitable<void>
+Stage::SingleMode(async::Lifeguard guard,uint8_t mtr,
+                  uint8_t mode,
+                  uint32_t retry,
+                  uint32_t bound)
+{
+    std::vector<uint32_t> writeBuffer;
+    uint32_t              address = ADDR_STEPPER0_MODE + CH_OFFSET * mtr;
+    uint32_t              data    = 0;
+
+    if (retry > 0xF)
+        retry = 0xF;
+    if (bound > 0xFFFF)
+        bound = 0xFFFF;
+
+    data = (unsigned int)(mode) | (unsigned int)(retry << 4) |
+           (unsigned int)(bound << 16);
+
+    writeBuffer.push_back(data);
+
+    co_await m_link->AsyncWrite(
+      guard(), address, writeBuffer, LinkWrite::idempotent);
+    co_return;
+}
+asio::awaitable<bool>
+Stage::Go(async::Lifeguard guard,
+             uint8_t mtr,
+             uint8_t  dir,
+             uint8_t  mode,
+             uint32_t retry,
+             uint32_t bound,
+             uint32_t speed)
+{
+    if ((mtr == mtr_x) or (mtr == mtr_y))
+        m_events->MarkMoveStarted();
+    // StagePump confirms its own starts once this returns
+    if (mtr == mtr_p)
+        m_pump_state->Stopped();
+    co_await PowerOn(guard(), mtr);
+    co_await SingleMode(guard(), mtr, mode, retry, bound);
+    //co_await SetAccel(guard,mtr, 100 * MICRO_STEP);
+    co_await SetInitSpeed(guard(), mtr, speed);
+    co_await SetDriveSpeed(guard(), mtr, speed);
+    if (mtr == mtr_p)
+        co_await SetDir(guard(), mtr, dir);
+
+    std::vector<uint32_t> writeBuffer;
+    uint32_t              address = ADDR_STEPPER0_CTRL;
+    uint32_t              data    = ((1 << ctrl_start) << mtr);
+
+    writeBuffer.push_back(data);
+
+    const bool started =
+      co_await m_link->AsyncWrite(guard(), address, writeBuffer);
+    m_telemetry->Invalidate();
+    m_axis_state->Started(mtr);
+    if (not started)
+        spdlog::error("cmd go: {} failed", mtr);
+    co_return started;
+}
+asio::awaitable<bool>
+Stage::GoProfile(async::Lifeguard guard,
+                 uint8_t mtr,
+                 uint8_t mode,
+                 const MotionProfile& profile,
+                 std::optional<int> dest)
+{
+    if ((mtr == mtr_x) or (mtr == mtr_y))
+        m_events->MarkMoveStarted();
+    co_await PowerOn(guard(), mtr);
+    co_await SingleMode(guard(), mtr, mode, 0, 0);
+    co_await SetAccel(guard(), mtr, profile.accel);
+    co_await SetInitSpeed(guard(), mtr, profile.init_speed);
+    co_await SetDriveSpeed(guard(), mtr, profile.drive_speed);
+
+    std::vector<uint32_t> writeBuffer;
+    uint32_t              address = ADDR_STEPPER0_CTRL;
+    uint32_t              data    = ((1 << ctrl_start) << mtr);
+
+    writeBuffer.push_back(data);
+
+    const bool started =
+      co_await m_link->AsyncWrite(guard(), address, writeBuffer);
+    m_telemetry->Invalidate();
+    m_axis_state->Started(mtr, started ? dest : std::nullopt);
+    if (not started)
+        spdlog::error("cmd go: {} failed", mtr);
+    co_return started;
+}
+asio::awaitable<bool>
+Stage::Trigger(async::Lifeguard guard, uint8_t mtr)
+{
+    if ((mtr == mtr_x) or (mtr == mtr_y))
+        m_events->MarkMoveStarted();
+
+    std::vector<uint32_t> writeBuffer;
+    uint32_t              address = ADDR_STEPPER0_CTRL;
+    uint32_t              data    = ((1 << ctrl_start) << mtr);
+
+    writeBuffer.push_back(data);
+
+    const bool started =
+      co_await m_link->AsyncWrite(guard(), address, writeBuffer);
+    m_telemetry->Invalidate();
+    m_axis_state->Started(mtr);
+    if (not started)
+        spdlog::error("cmd trigger: {} failed", mtr);
+    co_return started;
+}
+asio::awaitable<bool>
+Stage::Stop(async::Lifeguard guard,uint8_t mtr)
+{
+    co_await PowerOff(guard(), mtr);
+    std::vector<uint32_t> writeBuffer;
+    uint32_t              address = ADDR_STEPPER0_CTRL;
+    uint32_t              data    = ((1 << ctrl_stop) << mtr);
+
+    writeBuffer.push_back(data);
+    spdlog::info("cmd stop: {}", mtr);
+    const bool stopped =
+      co_await m_link->AsyncWrite(guard(), address, writeBuffer);
+    m_telemetry->Invalidate();
+    m_axis_state->Stopped(mtr);
+    if (not stopped)
+        spdlog::error("cmd stop: {} failed, it may still run", mtr);
+    // a stopped move is over, frames after it show the stage at rest
+    if (stopped and ((mtr == mtr_x) or (mtr == mtr_y)))
+        m_events->MarkMoveDone();
+    co_return stopped;
+}
+int
+Stage::ReadStatus([[maybe_unused]] uint8_t mtr) const
+{
+    return false;
+}
+asio::awaitable<void>
+Stage::SetDir(async::Lifeguard guard,uint8_t mtr, uint8_t dir)
+{
+    auto [upper, home, lower, alarm, limit_xor, delay, pulx, dirx, one] =
+      GetMotorConfig(mtr);
+
+    if (dir == motdir_cw)
+        co_await SetMotorConfig(guard(),
+          mtr, upper, home, lower, alarm, limit_xor, delay, pulx, 0, one);
+    else
+        co_await SetMotorConfig(guard(),
+          mtr, upper, home, lower, alarm, limit_xor, delay, pulx, 1, one);
+
+    co_return;
+}
+asio::awaitable<bool>
+Stage::SetDriveSpeed(async::Lifeguard guard,uint8_t mtr, uint32_t speed)
+{
+    std::vector<uint32_t> writeBuffer;
+    uint32_t              address = ADDR_STEPPER0_LAST + CH_OFFSET * mtr;
+    uint32_t              data    = speed;
+
+    if (0 == data)
+        data = 1;
+
+    writeBuffer.push_back(data);
+
+    co_return co_await m_link->AsyncWrite(
+      guard(), address, writeBuffer, LinkWrite::idempotent);
+}
+asio::awaitable<bool>
+Stage::GetNotBusy(async::Lifeguard guard)
+{
+    bool result = false;
+
+    std::vector<uint32_t> data =
+      co_await m_link->AsyncRead(guard(), ADDR_STEPPER0_STAT, 1);
+    if (not data.empty()) {
+        uint32_t mot_mask = (1u << mtr_x) | (1u << mtr_y);
+        uint32_t bit_mask = ((mot_mask << stat_busy) & 0x1f);
+        uint32_t status   = (data.at(0) & bit_mask) >> stat_busy;
+        if (status & mot_mask) {
+            result = false;
+        } else {
+            result = true;
+            // final positions for the GetPos calls that follow a move
+            if (m_events->MarkMoveDone())
+                co_await ReadTelemetry(guard());
+        }
+    } else {
+        result = false;
+    }
+
+    co_return result;
+}
+
+asio::awaitable<std::optional<bool>>
+Stage::IsIdle(async::Lifeguard guard, uint8_t mtr)
+{
+    std::vector<uint32_t> data =
+      co_await m_link->AsyncRead(guard(), ADDR_STEPPER0_STAT, 1);
+    if (data.empty())
+        co_return std::nullopt;
+    const uint32_t busy = (data.at(0) >> stat_busy) & 0x1f;
+    // the telemetry stays invalid since the start, the next read refreshes
+    if (not (busy & ((1u << mtr_x) | (1u << mtr_y))))
+        m_events->MarkMoveDone();
+    co_return not (busy & (1u << mtr));
+}
+
+asio::awaitable<bool>
+Stage::IsHome(async::Lifeguard guard,uint8_t mtr)
+{
+    std::vector<uint32_t> data =
+      co_await m_link->AsyncRead(guard(), ADDR_STEPPER0_STAT, 1);
+    if (not data.empty()) {
+        uint32_t mot_mask = (1 << mtr_x) | (1 << mtr_y);
+        uint32_t bit_mask = ((mot_mask << stat_home) & 0xf000u);
+        uint32_t status   = (data.at(0) & bit_mask) >> stat_home;
+        if (status == mot_mask) {
+            // homing ends here, not in GetNotBusy
+            m_events->MarkMoveDone();
+            co_return true;
+        }
+        else
+            co_return false;
+    }
+    co_return false;
+}
+asio::awaitable<void>
+Stage::SetPos(async::Lifeguard guard,uint8_t mtr, long long pos)
+{
+    std::vector<uint32_t> writeBuffer;
+    uint32_t              address;
+    uint32_t              pos_L = (pos & 0xFFFFFFFF);
+    uint32_t              pos_H = (pos >> 32) & 0xFFFFFFFF;
+
+    // DEST_L and DEST_H are contiguous, one burst
+    address = ADDR_STEPPER0_DEST_L + CH_OFFSET * mtr;
+    writeBuffer.push_back(pos_L);
+    writeBuffer.push_back(pos_H);
+    co_await m_link->AsyncWrite(
+      guard(), address, writeBuffer, LinkWrite::idempotent);
+    co_return;
+}
+
+asio::awaitable<std::optional<int>>
+Stage::GetPos(async::Lifeguard guard,uint8_t mtr)
+{
+    if (mtr >= TELEMETRY_AXES)
+        co_return std::nullopt;
+
+    auto snapshot = co_await GetTelemetry(guard());
+    if (not snapshot.valid)
+        co_return std::nullopt;
+    co_return int(snapshot.axes[mtr].position);
+}
+asio::awaitable<std::chrono::microseconds>
+Stage::GetElapsed(async::Lifeguard guard, uint8_t mtr)
+{
+    if (mtr >= TELEMETRY_AXES)
+        co_return std::chrono::microseconds(0);
+
+    auto snapshot = co_await GetTelemetry(guard());
+    co_return std::chrono::microseconds(
+      (unsigned long long)(snapshot.axes[mtr].elapsed) * 1000000ull /
+      CLOCK_HZ);
+}
+asio::awaitable<TelemetrySnapshot>
+Stage::GetTelemetry(async::Lifeguard guard,
+                    std::chrono::milliseconds max_age)
+{
+    if (not m_telemetry->IsFresh(max_age) and
+        not co_await ReadTelemetry(guard()))
+        co_return TelemetrySnapshot{};
+    co_return m_telemetry->Last();
+}
+asio::awaitable<bool>
+Stage::ReadTelemetry(async::Lifeguard guard)
+{
+    const uint64_t generation = m_telemetry->Generation();
+    std::vector<uint32_t> data = co_await m_link->AsyncRead(
+      guard(), ADDR_STEPPER0_STAT, TELEMETRY_WORDS);
+    if (data.size() < TELEMETRY_WORDS) {
+        spdlog::error("telemetry read: {} of {} words",
+                      data.size(),
+                      TELEMETRY_WORDS);
+        co_return false;
+    }
+
+    auto word = [&](uint32_t address) {
+        return data[(address - ADDR_STEPPER0_STAT) / 4];
+    };
+    auto dword = [&](uint32_t address) {
+        return (long long)(((uint64_t)word(address + 4) << 32) |
+                           word(address));
+    };
+
+    TelemetrySnapshot snapshot;
+    snapshot.stamp = TelemetrySnapshot::Clock::now();
+    snapshot.stat = word(ADDR_STEPPER0_STAT);
+    snapshot.valid = true;
+    for (uint8_t mtr = 0; mtr < TELEMETRY_AXES; mtr++) {
+        auto& axis = snapshot.axes[mtr];
+        axis.position = dword(ADDR_STEPPER0_POS_L + 8 * mtr);
+        axis.encoder = dword(ADDR_STEPPER0_ENC_L + 8 * mtr);
+        axis.elapsed = word(ADDR_STEPPER0_ELAPSED + 4 * mtr);
+        axis.busy = snapshot.stat & ((1u << stat_busy) << mtr);
+        axis.home = snapshot.stat & ((1u << stat_home) << mtr);
+    }
+    if (not m_telemetry->Store(snapshot, generation)) {
+        spdlog::warn("telemetry read: dropped, a move started meanwhile");
+        co_return false;
+    }
+    co_return true;
+}
+asio::awaitable<LinkBenchResult>
+Stage::BenchLink(async::Lifeguard guard, int count, bool scratch_writes)
+{
+    if (not m_link)
+        co_return LinkBenchResult();
+    // the read is the telemetry burst; FREE0 takes the writes only when
+    // asked for, on a bench controller nothing else drives
+    co_return co_await m_link->Bench(
+      guard(),
+      scratch_writes ? std::optional<uint32_t>(ADDR_DS_FREE0) : std::nullopt,
+      ADDR_STEPPER0_STAT,
+      TELEMETRY_WORDS,
+      count);
+}
+asio::awaitable<void>
+Stage::ValidCheck(async::Lifeguard guard)
+{
+    co_await m_link->AsyncPing(guard());
+    std::vector<uint32_t> data =
+      co_await m_link->AsyncRead(guard(), ADDR_SYS_BASE, 1);
+
+    if (not data.empty()) {
+        if (data.at(0) == 0xabcd1234) {
+            co_await InitConfig(guard());
+        } else {
+            spdlog::warn("bring-up: skipped, controller id 0x{:x}",
+                         data.at(0));
+        }
+    }
+    
+    co_return;
+}
 } // ds namespace
\ No newline at end of file
@@ -1,312 +1,491 @@
-#pragma once
-
-#include <chrono>
-#include <cstdint>
-#include <map>
-#include <nlohmann/json.hpp>
-#include <tuple>
-#include <variant>
-#include <mutex>
-#include "async.h"
-#include "serial.h"
-#include "ui.h"
-#include "stage_settings.h"
-
-namespace ds::depthscan {
-using namespace std::literals::chrono_literals;
-
-constexpr auto MICRO_STEP = 256;
-constexpr auto POS_MAX    = 2000000;
-constexpr auto POS_MIN    = -2000000;
-constexpr auto CH_OFFSET  = 32;
-
-class StageDSAddress
-{
-public:
-    //< System 0x00000000 ~ 0x000000FF
-    static constexpr uint32_t ADDR_SYS_BASE      = 0x00000000;
-    static constexpr uint32_t ADDR_SYS_ID        = (ADDR_SYS_BASE + 0x00);
-    static constexpr uint32_t ADDR_SYS_TIMESTAMP = (ADDR_SYS_BASE + 0x04);
-    ; //< Depth Scan 0x00000100 ~ 0x000001FF
-    static constexpr uint32_t ADDR_DS_BASE    = 0x00000100;
-    static constexpr uint32_t ADDR_DS_VERSION = (ADDR_DS_BASE + 0x00);
-    static constexpr uint32_t ADDR_DS_STAT    = (ADDR_DS_BASE + 0x04);
-    static constexpr uint32_t ADDR_DS_POWER   = (ADDR_DS_BASE + 0x08);
-    static constexpr uint32_t ADDR_DS_CONFIG  = (ADDR_DS_BASE + 0x0C);
-    static constexpr uint32_t ADDR_DS_FREE0   = (ADDR_DS_BASE + 0x10);
-    static constexpr uint32_t ADDR_DS_FREE1   = (ADDR_DS_BASE + 0x14);
-    static constexpr uint32_t ADDR_DS_FREE2   = (ADDR_DS_BASE + 0x18);
-    static constexpr uint32_t ADDR_DS_FREE3   = (ADDR_DS_BASE + 0x1C);
-    static constexpr uint32_t ADDR_DS_LED_CH  = (ADDR_DS_BASE + 0x20);
-    static constexpr uint32_t ADDR_DS_LED_HZ  = (ADDR_DS_BASE + 0x30);
-    static constexpr uint32_t ADDR_DS_LED_CAM_OFF = (ADDR_DS_BASE + 0x34);
-    static constexpr uint32_t ADDR_DS_LED_ON = (ADDR_DS_BASE + 0x38);
-    static constexpr uint32_t ADDR_DS_LED_OFF = (ADDR_DS_BASE + 0x3C);
-    //< Stepper 0 0x00000200 ~ 0x000002FF
-    static constexpr uint32_t ADDR_STEPPER0_BASE = 0x00000200;
-    static constexpr uint32_t ADDR_STEPPER0_STAT = (ADDR_STEPPER0_BASE + 0x00);
-    static constexpr uint32_t ADDR_STEPPER0_CTRL = (ADDR_STEPPER0_BASE + 0x04);
-    static constexpr uint32_t ADDR_STEPPER0_ELAPSED =
-      (ADDR_STEPPER0_BASE + 0x10);
-    static constexpr uint32_t ADDR_STEPPER0_POS_L = (ADDR_STEPPER0_BASE + 0x40);
-    static constexpr uint32_t ADDR_STEPPER0_POS_H = (ADDR_STEPPER0_BASE + 0x44);
-    static constexpr uint32_t ADDR_STEPPER0_ENC_L = (ADDR_STEPPER0_BASE + 0x60);
-    static constexpr uint32_t ADDR_STEPPER0_ENC_H = (ADDR_STEPPER0_BASE + 0x64);
-
-    static constexpr uint32_t ADDR_STEPPER0_CONF  = (ADDR_STEPPER0_BASE + 0x80);
-    static constexpr uint32_t ADDR_STEPPER0_ENC   = (ADDR_STEPPER0_BASE + 0x84);
-    static constexpr uint32_t ADDR_STEPPER0_MODE  = (ADDR_STEPPER0_BASE + 0x88);
-    static constexpr uint32_t ADDR_STEPPER0_ACCEL = (ADDR_STEPPER0_BASE + 0x8C);
-    static constexpr uint32_t ADDR_STEPPER0_INIT  = (ADDR_STEPPER0_BASE + 0x90);
-    static constexpr uint32_t ADDR_STEPPER0_LAST  = (ADDR_STEPPER0_BASE + 0x94);
-    static constexpr uint32_t ADDR_STEPPER0_DEST_L =
-      (ADDR_STEPPER0_BASE + 0x98);
-    static constexpr uint32_t ADDR_STEPPER0_DEST_H =
-      (ADDR_STEPPER0_BASE + 0x9C);
-};
-class StageDSState
-{
-public:
-    static constexpr uint32_t idle        = 0b00000001;
-    static constexpr uint32_t home_busy   = 0b00000010;
-    static constexpr uint32_t home_idle   = 0b00000100;
-    static constexpr uint32_t focus_busy  = 0b00001000;
-    static constexpr uint32_t focus_idle  = 0b00010000;
-    static constexpr uint32_t move_busy_x = 0b00100000;
-    static constexpr uint32_t move_idle_x = 0b01000000;
-    static constexpr uint32_t move_busy_y = 0b10000000;
-    static constexpr uint32_t move_idle_y = 0b100000000;
-    static constexpr uint32_t pump_busy   = 0b1000000000;
-    static constexpr uint32_t pump_idle   = 0b10000000000;
-    static constexpr uint32_t clean_busy  = 0b100000000000;
-    static constexpr uint32_t clean_idle  = 0b1000000000000;
-    static constexpr uint32_t auto_busy   = 0b10000000000000;
-    static constexpr uint32_t auto_idle   = 0b100000000000000;
-    static constexpr uint32_t home_done   = 0b1000000000000000;
-    static constexpr uint32_t exposure    = 0b10000000000000000;
-};
-
-class MotorRole
-{
-public:
-    static constexpr uint8_t mtr_1   = 0;
-    static constexpr uint8_t mtr_2   = 1;
-    static constexpr uint8_t mtr_3   = 2;
-    static constexpr uint8_t mtr_4   = 3;
-    static constexpr uint8_t mtr_5   = 4;
-    static constexpr uint8_t mtr_x   = mtr_1;
-    static constexpr uint8_t mtr_y   = mtr_2;
-    static constexpr uint8_t mtr_p   = mtr_4;
-    static constexpr uint8_t mtr_t   = mtr_3;
-    static constexpr uint8_t mtr_r   = mtr_5;
-    static constexpr uint8_t mtr_max = mtr_5 + 1;
-};
-class SingleMode
-{
-public:
-    static constexpr uint8_t mode_inf  = 0;
-    static constexpr uint8_t mode_rel  = 1;
-    static constexpr uint8_t mode_cnt  = 2;
-    static constexpr uint8_t mode_enc  = 3;
-    static constexpr uint8_t mode_home = 4;
-    static constexpr uint8_t mode_max  = mode_home + 1;
-};
-
-class XMotorConfig
-{
-public:
-    static constexpr uint8_t mask_upper     = 0x4;
-    static constexpr uint8_t mask_home      = 0x1;
-    static constexpr uint8_t mask_lower     = 0x2;
-    static constexpr uint8_t mask_alarm     = 0x8;
-    static constexpr uint8_t mask_limit_xor = 0xf;
-    static constexpr uint8_t delay_x        = 0x8;
-    static constexpr uint8_t puls_x         = 0x0;
-    static constexpr uint8_t dir_x          = 0x0;
-    static constexpr uint8_t onep_x         = 0x1;
-};
-
-class YMotorConfig
-{
-public:
-    static constexpr uint8_t mask_upper     = 0x4;
-    static constexpr uint8_t mask_home      = 0x1;
-    static constexpr uint8_t mask_lower     = 0x2;
-    static constexpr uint8_t mask_alarm     = 0x8;
-    static constexpr uint8_t mask_limit_xor = 0xf;
-    static constexpr uint8_t delay_x        = 0x8;
-    static constexpr uint8_t puls_x         = 0x0;
-    static constexpr uint8_t dir_x          = 0x0;
-    static constexpr uint8_t onep_x         = 0x1;
-};
-
-class PumpConfig
-{
-public:
-    static constexpr uint8_t mask_upper     = 0x4;
-    static constexpr uint8_t mask_home      = 0x1;
-    static constexpr uint8_t mask_lower     = 0x2;
-    static constexpr uint8_t mask_alarm     = 0x8;
-    static constexpr uint8_t mask_limit_xor = 0x8;
-    static constexpr uint8_t delay_x        = 0x8;
-    static constexpr uint8_t puls_x         = 0x0;
-    static constexpr uint8_t dir_x          = 0x0;
-    static constexpr uint8_t onep_x         = 0x1;
-};
-class MotorCon
-{
-public:
-    static constexpr uint8_t ctrl_start = 0;
-    static constexpr uint8_t ctrl_stop  = 8;
-};
-class MotorStat
-{
-public:
-    static constexpr uint8_t stat_busy = 0;
-    static constexpr uint8_t stat_home = 12;
-};
-class MotorDir
-{
-public:
-    static constexpr uint8_t motdir_cw      = 0x1;
-    static constexpr uint8_t motdir_ccw     = 0x2;
-    static constexpr uint8_t pump_dir_clean = motdir_ccw;
-    static constexpr uint8_t pump_dir_prime = motdir_ccw;
-};
-
-class Stage
-  : public async::Model<Stage>
-  , public StageDSState
-  , public MotorRole
-  , public SingleMode
-  , public MotorStat
-  , public MotorCon
-  , public MotorDir
-  , public StageDSAddress
-{
-    ds::async::RawCondition m_cond;
-
-public:
-    Stage();
-    ~Stage();
-
-    void                  Initiate() noexcept override;
-    asio::awaitable<void> InitMotorConfig(async::Lifeguard guard);
-    asio::awaitable<void> MoveHome(async::Lifeguard guard);
-    asio::awaitable<void> MoveInitPos(async::Lifeguard guard);
-    asio::awaitable<void> MoveLastPos(async::Lifeguard guard,int x,int y);
-
-    asio::awaitable<void> SingleMode(async::Lifeguard guard,
-                                     uint8_t mtr,
-                                     uint8_t  mode,
-                                     uint32_t retry,
-                                     uint32_t bound);
-    asio::awaitable<void> Go(async::Lifeguard guard,
-                                uint8_t mtr,
-                                uint8_t  dir,
-                                uint8_t  mode,
-                                uint32_t retry,
-                                uint32_t bound,
-                                uint32_t speed);
-    asio::awaitable<void> Stop(async::Lifeguard guard,uint8_t mtr);
-    int                   ReadStatus(uint8_t mtr) const;
-    asio::awaitable<void> SetDir(async::Lifeguard guard,uint8_t mtr,
-                                 uint8_t dir);
-    asio::awaitable<void> SetDriveSpeed(async::Lifeguard guard,uint8_t mtr,
-                                        uint32_t speed);
-    asio::awaitable<bool> GetNotBusy(async::Lifeguard guard);
-    asio::awaitable<bool> IsHome(async::Lifeguard guard,uint8_t mtr);
-    asio::awaitable<void> SetPos(async::Lifeguard guard,uint8_t mtr,
-                                 long long pos);
-    asio::awaitable<int> GetPos(async::Lifeguard guard,uint8_t mtr);
-
-    asio::awaitable<void> ValidCheck(async::Lifeguard guard);
-
-    asio::awaitable<void> SetLEDCh(async::Lifeguard guard, uint16_t value)
-    {
-        if (m_avalon) {
-            uint32_t base = (0xC0u << 16);
-            int ch = 17; // channel
-            int ld = 21; // load
-            uint32_t setValue = base | (2 << ch) | (1 << ld) | value;
-            co_await m_avalon->AsyncWrite(
-              guard(), ADDR_DS_LED_CH, { setValue - 1u }); // 3 ch
-        }
-        co_return;
-    }
-    asio::awaitable<void> SetLEDPeriod(async::Lifeguard guard, uint32_t value)
-    {
-        if (m_avalon) {         
-            double setValue = 32000000 * (value / 1000.0) ;
-
-            co_await m_avalon->AsyncWrite(
-              guard(), ADDR_DS_LED_HZ, { uint32_t(setValue) - 1u });
-        }
-        co_return;
-    }
-    asio::awaitable<void> SetLEDCamOff(async::Lifeguard guard, uint32_t value)
-    {
-        if (m_avalon) {
-            double setValue = 32000000 * (value / 1000.0);
-            co_await m_avalon->AsyncWrite(
-              guard(), ADDR_DS_LED_CAM_OFF, { uint32_t(setValue) - 1u });
-        }
-        co_return;
-    }
-    asio::awaitable<void> SetLEDOn(async::Lifeguard guard, uint32_t value)
-    {
-        if (m_avalon) {
-            double ontime = 32000000 * (value / 1000.0);
-            co_await m_avalon->AsyncWrite(
-              guard(), ADDR_DS_LED_ON, { uint32_t(ontime) - 1u });
-            co_await m_avalon->AsyncWrite(
-              guard(), ADDR_DS_LED_OFF, { uint32_t(ontime + 64.0) - 1u });
-        }
-        co_return;
-    }
-
-
-    unsigned int LoadSavedPowerMode(void) const { return m_saved_power; }
-    void SavePowerMode(unsigned int bit_mode) { m_saved_power = bit_mode; }
-
-protected:
-
-    asio::awaitable<void> InitDacConfig(async::Lifeguard guard,auto& dac);
-    asio::awaitable<void> SetAccel(async::Lifeguard guard,
-                                    uint8_t mtr,
-                                    uint32_t accel);
-    asio::awaitable<void> SetInitSpeed(async::Lifeguard guard,uint8_t mtr,
-                                       uint32_t speed);
-    asio::awaitable<void> SetMotorConfig(async::Lifeguard guard,uint8_t mtr,
-                                         uint8_t mask_upper,
-                                         uint8_t mask_home,
-                                         uint8_t mask_lower,
-                                         uint8_t maks_alarm,
-                                         uint8_t limit_xor,
-                                         uint8_t delay,
-                                         uint8_t pulx,
-                                         uint8_t dirx,
-                                         uint8_t onepulse);
-    asio::awaitable<void> PowerOn(async::Lifeguard guard,uint8_t mtr);
-    asio::awaitable<void> PowerOff(async::Lifeguard guard,uint8_t mtr);
-    void SetInitPos(const int x, const int y) { 
-        m_init_x_pos = x;
-        m_init_y_pos = y;
-    }
-
-private:
-    uint32_t                m_state;
-    uint32_t                m_saved_power;
-    int                     m_init_x_pos;  
-    int                     m_init_y_pos;   
-    int                     m_last_x_pos;
-    int                     m_last_y_pos; 
-    std::map<int, int>      m_dac; // dac motor config
-    asio::awaitable<void> InitConfig(async::Lifeguard guard);
-
-    std::shared_ptr<serial::Avalon> m_avalon;  
-    std::string m_camera_name;
-
-};
-
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <atomic>
+#include <map>
+#include <nlohmann/json.hpp>
+#include <tuple>
+#include <variant>
+#include <mutex>
+#include <optional>
+#include <unordered_set>
+#include "async.h"
+#include "serial.h"
+#include "ui.h"
+#include "stage_link.h"
+#include "stage_motion.h"
+#include "stage_telemetry.h"
+#include "stage_settings.h"
+#include "stage_station.h"
+
+namespace ds::depthscan {
+using namespace std::literals::chrono_literals;
+
+constexpr auto MICRO_STEP = 256;
+constexpr auto POS_MAX    = 2000000;
+constexpr auto POS_MIN    = -2000000;
+constexpr auto CH_OFFSET  = 32;
+constexpr auto CLOCK_HZ   = 32000000; // controller clock, LED and ELAPSED
+constexpr auto TELEMETRY_MAX_AGE = 100ms;
+constexpr auto BRINGUP_CAMERA_TIMEOUT = 10s; // first frame after power-up
+
+class StageDSAddress
+{
+public:
+    //< System 0x00000000 ~ 0x000000FF
+    static constexpr uint32_t ADDR_SYS_BASE      = 0x00000000;
+    static constexpr uint32_t ADDR_SYS_ID        = (ADDR_SYS_BASE + 0x00);
+    static constexpr uint32_t ADDR_SYS_TIMESTAMP = (ADDR_SYS_BASE + 0x04);
+    ; //< Depth Scan 0x00000100 ~ 0x000001FF
+    static constexpr uint32_t ADDR_DS_BASE    = 0x00000100;
+    static constexpr uint32_t ADDR_DS_VERSION = (ADDR_DS_BASE + 0x00);
+    static constexpr uint32_t ADDR_DS_STAT    = (ADDR_DS_BASE + 0x04);
+    static constexpr uint32_t ADDR_DS_POWER   = (ADDR_DS_BASE + 0x08);
+    static constexpr uint32_t ADDR_DS_CONFIG  = (ADDR_DS_BASE + 0x0C);
+    static constexpr uint32_t ADDR_DS_FREE0   = (ADDR_DS_BASE + 0x10);
+    static constexpr uint32_t ADDR_DS_FREE1   = (ADDR_DS_BASE + 0x14);
+    static constexpr uint32_t ADDR_DS_FREE2   = (ADDR_DS_BASE + 0x18);
+    static constexpr uint32_t ADDR_DS_FREE3   = (ADDR_DS_BASE + 0x1C);
+    static constexpr uint32_t ADDR_DS_LED_CH  = (ADDR_DS_BASE + 0x20);
+    static constexpr uint32_t ADDR_DS_LED_HZ  = (ADDR_DS_BASE + 0x30);
+    static constexpr uint32_t ADDR_DS_LED_CAM_OFF = (ADDR_DS_BASE + 0x34);
+    static constexpr uint32_t ADDR_DS_LED_ON = (ADDR_DS_BASE + 0x38);
+    static constexpr uint32_t ADDR_DS_LED_OFF = (ADDR_DS_BASE + 0x3C);
+    //< Stepper 0 0x00000200 ~ 0x000002FF
+    static constexpr uint32_t ADDR_STEPPER0_BASE = 0x00000200;
+    static constexpr uint32_t ADDR_STEPPER0_STAT = (ADDR_STEPPER0_BASE + 0x00);
+    static constexpr uint32_t ADDR_STEPPER0_CTRL = (ADDR_STEPPER0_BASE + 0x04);
+    static constexpr uint32_t ADDR_STEPPER0_ELAPSED =
+      (ADDR_STEPPER0_BASE + 0x10);
+    static constexpr uint32_t ADDR_STEPPER0_POS_L = (ADDR_STEPPER0_BASE + 0x40);
+    static constexpr uint32_t ADDR_STEPPER0_POS_H = (ADDR_STEPPER0_BASE + 0x44);
+    static constexpr uint32_t ADDR_STEPPER0_ENC_L = (ADDR_STEPPER0_BASE + 0x60);
+    static constexpr uint32_t ADDR_STEPPER0_ENC_H = (ADDR_STEPPER0_BASE + 0x64);
+
+    static constexpr uint32_t ADDR_STEPPER0_CONF  = (ADDR_STEPPER0_BASE + 0x80);
+    static constexpr uint32_t ADDR_STEPPER0_ENC   = (ADDR_STEPPER0_BASE + 0x84);
+    static constexpr uint32_t ADDR_STEPPER0_MODE  = (ADDR_STEPPER0_BASE + 0x88);
+    static constexpr uint32_t ADDR_STEPPER0_ACCEL = (ADDR_STEPPER0_BASE + 0x8C);
+    static constexpr uint32_t ADDR_STEPPER0_INIT  = (ADDR_STEPPER0_BASE + 0x90);
+    static constexpr uint32_t ADDR_STEPPER0_LAST  = (ADDR_STEPPER0_BASE + 0x94);
+    static constexpr uint32_t ADDR_STEPPER0_DEST_L =
+      (ADDR_STEPPER0_BASE + 0x98);
+    static constexpr uint32_t ADDR_STEPPER0_DEST_H =
+      (ADDR_STEPPER0_BASE + 0x9C);
+    //< STAT ~ ENC_H of every axis, one burst read
+    static constexpr uint32_t TELEMETRY_WORDS =
+      (ADDR_STEPPER0_CONF - ADDR_STEPPER0_STAT) / 4;
+};
+class StageDSState
+{
+public:
+    static constexpr uint32_t idle        = 0b00000001;
+    static constexpr uint32_t home_busy   = 0b00000010;
+    static constexpr uint32_t home_idle   = 0b00000100;
+    static constexpr uint32_t focus_busy  = 0b00001000;
+    static constexpr uint32_t focus_idle  = 0b00010000;
+    static constexpr uint32_t move_busy_x = 0b00100000;
+    static constexpr uint32_t move_idle_x = 0b01000000;
+    static constexpr uint32_t move_busy_y = 0b10000000;
+    static constexpr uint32_t move_idle_y = 0b100000000;
+    static constexpr uint32_t pump_busy   = 0b1000000000;
+    static constexpr uint32_t pump_idle   = 0b10000000000;
+    static constexpr uint32_t clean_busy  = 0b100000000000;
+    static constexpr uint32_t clean_idle  = 0b1000000000000;
+    static constexpr uint32_t auto_busy   = 0b10000000000000;
+    static constexpr uint32_t auto_idle   = 0b100000000000000;
+    static constexpr uint32_t home_done   = 0b1000000000000000;
+    static constexpr uint32_t exposure    = 0b10000000000000000;
+};
+
+class MotorRole
+{
+public:
+    static constexpr uint8_t mtr_1   = 0;
+    static constexpr uint8_t mtr_2   = 1;
+    static constexpr uint8_t mtr_3   = 2;
+    static constexpr uint8_t mtr_4   = 3;
+    static constexpr uint8_t mtr_5   = 4;
+    static constexpr uint8_t mtr_x   = mtr_1;
+    static constexpr uint8_t mtr_y   = mtr_2;
+    static constexpr uint8_t mtr_p   = mtr_4;
+    static constexpr uint8_t mtr_t   = mtr_3;
+    static constexpr uint8_t mtr_r   = mtr_5;
+    static constexpr uint8_t mtr_max = mtr_5 + 1;
+};
+class SingleMode
+{
+public:
+    static constexpr uint8_t mode_inf  = 0;
+    static constexpr uint8_t mode_rel  = 1;
+    static constexpr uint8_t mode_cnt  = 2;
+    static constexpr uint8_t mode_enc  = 3;
+    static constexpr uint8_t mode_home = 4;
+    static constexpr uint8_t mode_max  = mode_home + 1;
+};
+
+class XMotorConfig
+{
+public:
+    static constexpr uint8_t mask_upper     = 0x4;
+    static constexpr uint8_t mask_home      = 0x1;
+    static constexpr uint8_t mask_lower     = 0x2;
+    static constexpr uint8_t mask_alarm     = 0x8;
+    static constexpr uint8_t mask_limit_xor = 0xf;
+    static constexpr uint8_t delay_x        = 0x8;
+    static constexpr uint8_t puls_x         = 0x0;
+    static constexpr uint8_t dir_x          = 0x0;
+    static constexpr uint8_t onep_x         = 0x1;
+};
+
+class YMotorConfig
+{
+public:
+    static constexpr uint8_t mask_upper     = 0x4;
+    static constexpr uint8_t mask_home      = 0x1;
+    static constexpr uint8_t mask_lower     = 0x2;
+    static constexpr uint8_t mask_alarm     = 0x8;
+    static constexpr uint8_t mask_limit_xor = 0xf;
+    static constexpr uint8_t delay_x        = 0x8;
+    static constexpr uint8_t puls_x         = 0x0;
+    static constexpr uint8_t dir_x          = 0x0;
+    static constexpr uint8_t onep_x         = 0x1;
+};
+
+class PumpConfig
+{
+public:
+    static constexpr uint8_t mask_upper     = 0x4;
+    static constexpr uint8_t mask_home      = 0x1;
+    static constexpr uint8_t mask_lower     = 0x2;
+    static constexpr uint8_t mask_alarm     = 0x8;
+    static constexpr uint8_t mask_limit_xor = 0x8;
+    static constexpr uint8_t delay_x        = 0x8;
+    static constexpr uint8_t puls_x         = 0x0;
+    static constexpr uint8_t dir_x          = 0x0;
+    static constexpr uint8_t onep_x         = 0x1;
+};
+class MotorCon
+{
+public:
+    static constexpr uint8_t ctrl_start = 0;
+    static constexpr uint8_t ctrl_stop  = 8;
+};
+class MotorStat
+{
+public:
+    static constexpr uint8_t stat_busy = 0;
+    static constexpr uint8_t stat_home = 12;
+};
+class MotorDir
+{
+public:
+    static constexpr uint8_t motdir_cw      = 0x1;
+    static constexpr uint8_t motdir_ccw     = 0x2;
+    static constexpr uint8_t pump_dir_clean = motdir_ccw;
+    static constexpr uint8_t pump_dir_prime = motdir_ccw;
+};
+
+/// Host-side timestamps of the events a frame consumer may need to wait out
+/// (see StageFrame::GetAsyncFrameAfter), one set per station.
+class StageEvents
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /// Lives as long as the process.
+    static StageEvents& Get(const StationId& station);
+
+    void MarkMoveStarted();
+    bool MarkMoveDone(); ///< true on the pending -> done edge
+    void MarkParamChanged();
+
+    bool              IsMovePending() const;
+    Clock::time_point LastMoveDone() const;
+    Clock::time_point LastParamChanged() const;
+
+private:
+    std::atomic<bool>       m_move_pending{ false };
+    std::atomic<Clock::rep> m_move_done{ 0 };
+    std::atomic<Clock::rep> m_param_changed{ 0 };
+};
+
+/// What the pump motor was last told, one per station and shared by every
+/// StagePump. Any stop of the pump axis, through a StagePump or Stage
+/// itself, clears it, so no pump takes a motor another one stopped for
+/// running. The delivered volume is integrated here for the same reason.
+class StagePumpState
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /// Lives as long as the process.
+    static StagePumpState& Get(const StationId& station);
+
+    /// Drive speed the motor runs at in dir, 0 unless a StagePump started
+    /// it that way and nothing stopped it since.
+    uint32_t RunningSpeed(uint8_t dir);
+    uint32_t GetSpeed(); ///< 0 when stopped
+    void     Started(uint8_t dir, uint32_t speed); ///< after Go
+    void     Changed(uint32_t speed);              ///< on the fly
+    void     Stopped();
+    double   GetDelivered(); ///< uL since the last ResetDelivered
+    void     ResetDelivered();
+
+private:
+    void Integrate(); ///< with m_mutex held
+
+    std::mutex        m_mutex;
+    uint8_t           m_dir{ 0 };
+    uint32_t          m_speed{ 0 };
+    double            m_delivered{ 0.0 };
+    Clock::time_point m_integrated{ Clock::now() };
+};
+
+/// Last destination of each axis, shared by the Stage objects of a station
+/// (StageMove, StagePump, StageIllumination, ...). Any start or stop of an
+/// axis from any of them invalidates its entry.
+class StageAxisState
+{
+public:
+    /// Lives as long as the process.
+    static StageAxisState& Get(const StationId& station);
+
+    /// Destination of the last MoveTo, unset once anything else moved or
+    /// stopped the axis.
+    std::optional<int> GetDest(uint8_t mtr);
+    void Started(uint8_t mtr, std::optional<int> dest = std::nullopt);
+    void Stopped(uint8_t mtr) { Started(mtr); }
+    void StoppedAll();
+
+private:
+    std::mutex                                  m_mutex;
+    std::array<std::optional<int>, MOTION_AXES> m_dest;
+};
+
+class Stage
+  : public async::Model<Stage>
+  , public StageDSState
+  , public MotorRole
+  , public SingleMode
+  , public MotorStat
+  , public MotorCon
+  , public MotorDir
+  , public StageDSAddress
+{
+    ds::async::RawCondition m_cond;
+
+public:
+    explicit Stage(const StationId& station);
+    ~Stage();
+
+    const StationId& GetStation() const { return m_station; }
+
+    void                  Initiate() noexcept override;
+    asio::awaitable<void> InitMotorConfig(async::Lifeguard guard);
+    asio::awaitable<void> MoveHome(async::Lifeguard guard);
+    asio::awaitable<void> MoveInitPos(async::Lifeguard guard);
+    asio::awaitable<void> MoveLastPos(async::Lifeguard guard,int x,int y);
+
+    asio::awaitable<void> SingleMode(async::Lifeguard guard,
+                                     uint8_t mtr,
+                                     uint8_t  mode,
+                                     uint32_t retry,
+                                     uint32_t bound);
+    /// Go, GoProfile, Trigger and Stop return false when the control write
+    /// failed; the axis position is unknown then.
+    asio::awaitable<bool> Go(async::Lifeguard guard,
+                                uint8_t mtr,
+                                uint8_t  dir,
+                                uint8_t  mode,
+                                uint32_t retry,
+                                uint32_t bound,
+                                uint32_t speed);
+    /// dest is recorded as the axis destination once the move started.
+    asio::awaitable<bool> GoProfile(async::Lifeguard guard,
+                                    uint8_t mtr,
+                                    uint8_t mode,
+                                    const MotionProfile& profile,
+                                    std::optional<int> dest = std::nullopt);
+    /// Restart a powered axis with the destination and profile already in
+    /// the registers. DEST_L/DEST_H are latched on start, so the next
+    /// destination can be written while the current move runs.
+    asio::awaitable<bool> Trigger(async::Lifeguard guard, uint8_t mtr);
+    /// Planned mode_cnt move to pos. The distance is taken from the last
+    /// MoveTo destination of the axis on this station (StageAxisState); the
+    /// position is read when any Stage has moved or stopped the axis since.
+    asio::awaitable<PlannedMove> MoveTo(async::Lifeguard guard,
+                                        uint8_t mtr,
+                                        int pos);
+    asio::awaitable<bool> Stop(async::Lifeguard guard,uint8_t mtr);
+    int                   ReadStatus(uint8_t mtr) const;
+    MotionProfile         PlanMove(uint8_t mtr, long long distance) const
+    {
+        return m_planner.Plan(mtr, distance);
+    }
+    asio::awaitable<std::chrono::microseconds> GetElapsed(
+      async::Lifeguard guard,
+      uint8_t mtr);
+    asio::awaitable<void> SetDir(async::Lifeguard guard,uint8_t mtr,
+                                 uint8_t dir);
+    asio::awaitable<bool> SetDriveSpeed(async::Lifeguard guard,uint8_t mtr,
+                                        uint32_t speed);
+    asio::awaitable<bool> GetNotBusy(async::Lifeguard guard);
+    /// One STAT read, no telemetry: whether mtr is idle, nullopt when the
+    /// read failed. Marks the move done once X and Y are both idle.
+    asio::awaitable<std::optional<bool>> IsIdle(async::Lifeguard guard,
+                                                uint8_t mtr);
+    asio::awaitable<bool> IsHome(async::Lifeguard guard,uint8_t mtr);
+    asio::awaitable<void> SetPos(async::Lifeguard guard,uint8_t mtr,
+                                 long long pos);
+    /// Position from the telemetry snapshot, read only when it is stale.
+    /// nullopt when the registers could not be read.
+    asio::awaitable<std::optional<int>> GetPos(async::Lifeguard guard,
+                                               uint8_t mtr);
+    /// Not valid when the snapshot is stale and the read failed, or a move
+    /// started while it was under way.
+    asio::awaitable<TelemetrySnapshot> GetTelemetry(
+      async::Lifeguard guard,
+      std::chrono::milliseconds max_age = TELEMETRY_MAX_AGE);
+
+    asio::awaitable<void> ValidCheck(async::Lifeguard guard);
+    /// Write / burst read round trips on the stage link, see StageLink::Bench.
+    /// Read-only unless scratch_writes is set, which also writes the FREE0
+    /// scratch register and is for bench controllers only.
+    asio::awaitable<LinkBenchResult> BenchLink(async::Lifeguard guard,
+                                               int                count,
+                                               bool scratch_writes = false);
+    LinkStats GetLinkStats() const
+    {
+        return m_link ? m_link->GetStats() : LinkStats();
+    }
+
+    asio::awaitable<void> SetLEDCh(async::Lifeguard guard, uint16_t value)
+    {
+        if (m_link) {
+            uint32_t base = (0xC0u << 16);
+            int ch = 17; // channel
+            int ld = 21; // load
+            uint32_t setValue = base | (2 << ch) | (1 << ld) | value;
+            co_await m_link->AsyncWrite(
+              guard(), ADDR_DS_LED_CH, { setValue - 1u }); // 3 ch
+        }
+        co_return;
+    }
+    /// Level of one LED channel, same word layout as SetLEDCh with the
+    /// channel number in the channel field.
+    static uint32_t LEDLevelWord(uint8_t channel, uint16_t level)
+    {
+        uint32_t base = (0xC0u << 16);
+        int ch = 17; // channel
+        int ld = 21; // load
+        return base | (uint32_t(channel & 0xF) << ch) | (1u << ld) | level;
+    }
+    asio::awaitable<void> WriteLEDWords(async::Lifeguard guard,
+                                        const std::vector<uint32_t>& words)
+    {
+        if (m_link) {
+            for (auto word : words)
+                co_await m_link->AsyncWrite(guard(), ADDR_DS_LED_CH, { word });
+        }
+        co_return;
+    }
+    asio::awaitable<void> SetLEDPeriod(async::Lifeguard guard, uint32_t value)
+    {
+        if (m_link) {         
+            double setValue = CLOCK_HZ * (value / 1000.0) ;
+
+            co_await m_link->AsyncWrite(guard(),
+                                        ADDR_DS_LED_HZ,
+                                        { uint32_t(setValue) - 1u },
+                                        LinkWrite::idempotent);
+        }
+        co_return;
+    }
+    asio::awaitable<void> SetLEDCamOff(async::Lifeguard guard, uint32_t value)
+    {
+        if (m_link) {
+            double setValue = CLOCK_HZ * (value / 1000.0);
+            co_await m_link->AsyncWrite(guard(),
+                                        ADDR_DS_LED_CAM_OFF,
+                                        { uint32_t(setValue) - 1u },
+                                        LinkWrite::idempotent);
+        }
+        co_return;
+    }
+    asio::awaitable<void> SetLEDOn(async::Lifeguard guard, uint32_t value)
+    {
+        if (m_link) {
+            double ontime = CLOCK_HZ * (value / 1000.0);
+            co_await m_link->AsyncWrite(guard(),
+                                        ADDR_DS_LED_ON,
+                                        { uint32_t(ontime) - 1u },
+                                        LinkWrite::idempotent);
+            co_await m_link->AsyncWrite(guard(),
+                                        ADDR_DS_LED_OFF,
+                                        { uint32_t(ontime + 64.0) - 1u },
+                                        LinkWrite::idempotent);
+        }
+        co_return;
+    }
+
+
+    unsigned int LoadSavedPowerMode(void) const { return m_saved_power; }
+    void SavePowerMode(unsigned int bit_mode) { m_saved_power = bit_mode; }
+
+protected:
+
+    asio::awaitable<void> InitDacConfig(async::Lifeguard guard,auto& dac);
+    asio::awaitable<void> SetAccel(async::Lifeguard guard,
+                                    uint8_t mtr,
+                                    uint32_t accel);
+    asio::awaitable<void> SetInitSpeed(async::Lifeguard guard,uint8_t mtr,
+                                       uint32_t speed);
+    asio::awaitable<void> SetMotorConfig(async::Lifeguard guard,uint8_t mtr,
+                                         uint8_t mask_upper,
+                                         uint8_t mask_home,
+                                         uint8_t mask_lower,
+                                         uint8_t maks_alarm,
+                                         uint8_t limit_xor,
+                                         uint8_t delay,
+                                         uint8_t pulx,
+                                         uint8_t dirx,
+                                         uint8_t onepulse);
+    asio::awaitable<void> PowerOn(async::Lifeguard guard,uint8_t mtr);
+    asio::awaitable<void> PowerOff(async::Lifeguard guard,uint8_t mtr);
+    void SetInitPos(const int x, const int y) { 
+        m_init_x_pos = x;
+        m_init_y_pos = y;
+    }
+
+private:
+    StationId               m_station;
+    StageEvents*            m_events;
+    StageTelemetry*         m_telemetry;
+    StagePumpState*         m_pump_state;
+    StageAxisState*         m_axis_state;
+    uint32_t                m_state;
+    uint32_t                m_saved_power;
+    int                     m_init_x_pos;  
+    int                     m_init_y_pos;   
+    int                     m_last_x_pos;
+    int                     m_last_y_pos; 
+    std::map<int, int>      m_dac; // dac motor config
+    StageMotionPlanner      m_planner;
+    asio::awaitable<void> InitConfig(async::Lifeguard guard);
+    asio::awaitable<void> InitLEDConfig(async::Lifeguard guard);
+    /// First camera frame, awaited together with the homing of InitConfig.
+    /// False when there is no camera or no frame within
+    /// BRINGUP_CAMERA_TIMEOUT.
+    asio::awaitable<bool> WarmCamera(async::Lifeguard guard);
+    asio::awaitable<bool> ReadTelemetry(async::Lifeguard guard);
+
+    std::shared_ptr<StageLink> m_link;  
+    std::string m_camera_name;
+
+    std::chrono::steady_clock::time_point m_bringup_start;
+
+};
+
 } // namespace ds
\ No newline at end of file
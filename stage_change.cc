@@ -0,0 +1,142 @@
+#include <algorithm>
+#include <cmath>
+#include <spdlog/spdlog.h>
+#include "stage_change.h"
+
+namespace ds::depthscan {
+
+constexpr int CHANGE_SPAN = 1 << 16; // pixels whose 8-bit squares fit 32 bits
+
+/// Sum and sum of squares of an 8-bit image, and its cross sum with last
+/// when given, in one pass.
+static void
+Accumulate(const cv::Mat& image,
+           const cv::Mat* last,
+           uint64_t& sum,
+           uint64_t& sq,
+           uint64_t& cross)
+{
+    sum = sq = cross = 0;
+    for (int y = 0; y < image.rows; y++) {
+        const uchar* a = image.ptr<uchar>(y);
+        const uchar* b = last ? last->ptr<uchar>(y) : nullptr;
+        for (int x0 = 0; x0 < image.cols; x0 += CHANGE_SPAN) {
+            const int x1 = std::min(image.cols, x0 + CHANGE_SPAN);
+            uint32_t  s = 0, q = 0, c = 0;
+            for (int x = x0; x < x1; x++) {
+                s += a[x];
+                q += uint32_t(a[x]) * a[x];
+            }
+            if (b) {
+                for (int x = x0; x < x1; x++)
+                    c += uint32_t(a[x]) * b[x];
+            }
+            sum += s;
+            sq += q;
+            cross += c;
+        }
+    }
+}
+
+StageChangeDetector::StageChangeDetector(ChangeOptions options)
+  : m_options(options)
+  , m_last(-1)
+  , m_last_mean(0.0)
+  , m_last_sum(0)
+  , m_last_sq(0)
+{
+    m_options.level = std::max(m_options.level, 0);
+    m_scratch.resize(std::max(m_options.level - 1, 0));
+}
+
+void
+StageChangeDetector::Reset()
+{
+    m_last = -1;
+}
+
+ChangeScore
+StageChangeDetector::Update(const cv::Mat& gray)
+{
+    const auto start = std::chrono::steady_clock::now();
+
+    // 1. decimate into the free history buffer, its size is kept
+    const int now = m_last == 0 ? 1 : 0;
+    cv::Mat&  level = m_history[now];
+    if (m_options.level == 0) {
+        level = gray; // no copy, as the flow checks kept their last frame
+    } else {
+        const cv::Mat* in = &gray;
+        for (int i = 0; i < m_options.level; i++) {
+            cv::Mat& out =
+              i + 1 == m_options.level ? level : m_scratch[std::size_t(i)];
+            cv::pyrDown(*in, out);
+            in = &out;
+        }
+    }
+
+    // 2. against the last frame, a new history on a size change
+    ChangeScore score;
+    const bool same = m_last >= 0 and
+                      m_history[m_last].size() == level.size() and
+                      m_history[m_last].type() == level.type();
+    const bool fused = level.type() == CV_8UC1 and not level.empty() and
+                       (m_options.modes & (ChangeMode::ncc |
+                                           ChangeMode::mean_diff));
+    if (fused) {
+        // 8-bit: the mean and the NCC from one pass
+        const bool    ncc = same and (m_options.modes & ChangeMode::ncc);
+        const double  n = double(level.total());
+        uint64_t      sum, sq, cross;
+        Accumulate(level, ncc ? &m_history[m_last] : nullptr, sum, sq, cross);
+        score.mean = double(sum) / n;
+        if (ncc) {
+            const double a = double(sum), b = double(m_last_sum);
+            const double cov = double(cross) - a * b / n;
+            const double den = std::sqrt(
+              std::max(double(sq) - a * a / n, 0.0) *
+              std::max(double(m_last_sq) - b * b / n, 0.0));
+            // a flat frame has no correlation, as with matchTemplate
+            score.ncc = den > 0.0 ? std::clamp(cov / den, -1.0, 1.0) : 0.0;
+        }
+        m_last_sum = sum;
+        m_last_sq = sq;
+    } else if (m_options.modes & ChangeMode::mean_diff) {
+        score.mean = cv::mean(level)[0];
+    }
+    if (same) {
+        const cv::Mat& last = m_history[m_last];
+        if ((m_options.modes & ChangeMode::ncc) and not fused) {
+            cv::Mat result;
+            cv::matchTemplate(level, last, result, cv::TM_CCOEFF_NORMED);
+            score.ncc = cv::mean(result)[0];
+        }
+        if (m_options.modes & ChangeMode::mean_diff)
+            score.mean_diff = score.mean - m_last_mean;
+        if (m_options.modes & ChangeMode::sad)
+            score.sad =
+              cv::norm(level, last, cv::NORM_L1) / double(level.total());
+    }
+    m_last = now;
+    m_last_mean = score.mean;
+
+    const auto cost = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+    m_cost.frames++;
+    m_cost.total += cost;
+    m_cost.max = std::max(m_cost.max, cost);
+    return score;
+}
+
+void
+StageChangeDetector::LogCost(const char* name) const
+{
+    spdlog::info("{} change: {} frames at level {}, {} us mean, {} us max",
+                 name,
+                 m_cost.frames,
+                 m_options.level,
+                 m_cost.Mean().count(),
+                 m_cost.max.count());
+}
+
+} // namespace ds::depthscan
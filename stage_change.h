@@ -0,0 +1,77 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+namespace ds::depthscan {
+
+/// What StageChangeDetector::Update computes, any combination.
+class ChangeMode
+{
+public:
+    static constexpr uint8_t ncc       = 0x1; ///< normalised cross correlation
+    static constexpr uint8_t mean_diff = 0x2; ///< this mean - last mean
+    static constexpr uint8_t sad       = 0x4; ///< mean absolute difference
+};
+
+struct ChangeOptions
+{
+    uint8_t modes{ ChangeMode::ncc };
+    int     level{ 0 }; ///< pyramid level compared, each halves both sides
+};
+
+/// Change of one frame against the last. Unasked modes keep the values of
+/// an unchanged frame, as does the first frame of a history.
+struct ChangeScore
+{
+    double ncc{ 1.0 };
+    double mean_diff{ 0.0 };
+    double sad{ 0.0 };
+    double mean{ 0.0 }; ///< of this frame, with ChangeMode::mean_diff
+};
+
+struct ChangeCost
+{
+    uint64_t                  frames{ 0 };
+    std::chrono::microseconds total{ 0 };
+    std::chrono::microseconds max{ 0 };
+
+    std::chrono::microseconds Mean() const
+    {
+        return frames ? total / frames : std::chrono::microseconds(0);
+    }
+};
+
+/// Frame to frame change detection shared by the flow searches and the
+/// record filters. The caller hands in the gray image or the strip it
+/// watches; the detector decimates it to the options' pyramid level and
+/// keeps that as the history, in two buffers that are reused once sized.
+/// At level 0 the history shares the caller's image, which must not be
+/// written afterwards. On 8-bit images the NCC is the one of
+/// cv::TM_CCOEFF_NORMED, from one pass that reuses the last frame's sums.
+class StageChangeDetector
+{
+public:
+    explicit StageChangeDetector(ChangeOptions options = {});
+
+    /// Scores gray against the last frame, then keeps it as the last.
+    ChangeScore Update(const cv::Mat& gray);
+    /// The next Update starts a new history.
+    void Reset();
+
+    const ChangeCost& GetCost() const { return m_cost; }
+    void              LogCost(const char* name) const;
+
+private:
+    ChangeOptions        m_options;
+    cv::Mat              m_history[2]; ///< at the options' level
+    int                  m_last;       ///< into m_history, -1 for none
+    double               m_last_mean;
+    uint64_t             m_last_sum; ///< of the last 8-bit frame
+    uint64_t             m_last_sq;
+    std::vector<cv::Mat> m_scratch; ///< levels between 0 and the last
+    ChangeCost           m_cost;
+};
+
+} // namespace ds::depthscan
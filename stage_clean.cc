@@ -1,112 +1,242 @@
-#include "label_strings.h"
-#include "stage_clean.h"
-#include "stage_settings.h"
-#include "stage_utility.h"
-
-namespace ds::depthscan {
-
-StageClean::StageClean()
-  : m_state(StageDSState::clean_idle)
-  , m_clean_secods(0)
-  , m_clean_steps(0)
-  , m_clean_speed(0)
-  , m_send_progress(0)
-  , m_cancel(true)
-  , m_pump(ui::CreateAsyncModel<StagePump>())
-{
-    auto storage = StageSettingStorage::GetInstance();
-    if (storage) {
-        m_clean_secods =
-          std::get<int>(storage->GetSettings(StageConfigKeys::CLEAN_SECONDS));
-        m_clean_speed =
-          std::get<float>(storage->GetSettings(StageConfigKeys::CLEAN_SPEED));
-    }
-}
-StageClean::~StageClean()
-{
-    Terminate();
-}
-
-void
-StageClean::Initiate() noexcept
-{
-}
-
-
-asio::awaitable<void>
-StageClean::StartClean(async::Lifeguard guard)
-{
-    SetState(StageDSState::clean_busy);
-    m_start_now    = std::chrono::high_resolution_clock::now();
-    m_progress_now = m_start_now;
-    m_send_label = LabelStrings::Cleaning;
-    m_send_progress = 0;
-    m_cancel = false;
-
-    co_await m_pump->StartPump(
-      guard(), MotorDir::pump_dir_clean, m_clean_speed);
-    co_await DoClean(guard());
-
-    co_return;
-}
-asio::awaitable<void>
-StageClean::CancelClean(async::Lifeguard guard)
-{
-    co_await m_pump->StopPump(guard());
-    SetState(StageDSState::clean_idle);
-    m_cancel = true;
-    co_return;
-}
-
-asio::awaitable<void>
-StageClean::DoClean(async::Lifeguard guard)
-{
-    auto timer = ds::async::Timer();
-    bool done = false;
-    while (not done and not m_cancel) {
-
-        std::chrono::high_resolution_clock::time_point end =
-          std::chrono::high_resolution_clock::now();
-
-        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
-          end - m_start_now);
-
-        auto total_time = (m_clean_secods * 1000);
-
-        if (duration.count() >= total_time) {
-            m_send_progress = 100;
-            m_send_label = LabelStrings::Completed;
-            co_await m_pump->StopPump(guard());
-            done = true;
-        } else {
-            ProgressCalculator progress(total_time);
-
-            m_send_progress = progress.GetPogress(duration.count());
-            m_send_label.clear();
-            m_send_label << "Cleaning...(" << duration.count()/1000 << " / "
-                         << total_time/1000 << " sec)";
-
-        }
-        co_await timer.AsyncSleepFor(guard(), 100ms);
-    }
-    co_return;
-}
-void
-StageClean::SetState(uint32_t state)
-{
-    if (StageDSState::clean_busy == state)
-        this->m_state &= ~(StageDSState::idle | StageDSState::clean_idle);
-    if (StageDSState::clean_idle == state)
-        this->m_state &= ~(StageDSState::idle | StageDSState::clean_busy);
-
-    this->m_state |= state;
-}
-bool
-StageClean::IsState(uint32_t state) const
-{
-    if (this->m_state & state)
-        return true;
-    else
-        return false;
-}
+#include <algorithm>
+#include <spdlog/spdlog.h>
+#include "label_strings.h"
+#include "stage_clean.h"
+#include "stage_settings.h"
+#include "stage_utility.h"
+
+namespace ds::depthscan {
+
+CleanSchedule
+BuildCleanSchedule(const nlohmann::json& profile, int repeat)
+{
+    CleanSchedule schedule;
+    std::chrono::milliseconds at{ 0 };
+
+    auto add = [&](std::chrono::milliseconds when, uint8_t dir, float flow) {
+        uint32_t speed = flow > 0.0f ? StagePump::FlowToSpeed(flow) : 0;
+        auto& steps = schedule.steps;
+        // skip writes that would not change the register
+        if (not steps.empty() and steps.back().dir == dir and
+            steps.back().speed == speed)
+            return;
+        steps.push_back({ when, dir, speed });
+    };
+
+    for (int r = 0; r < std::max(repeat, 1); r++) {
+        for (const auto& segment : profile) {
+            const float flow = segment.value("flow", 0.0f);
+            const float to = segment.value("to", flow);
+            const auto length =
+              std::chrono::milliseconds(segment.value("ms", 0));
+            const uint8_t dir = segment.value("dir", std::string("ccw")) ==
+                                    "cw"
+                                  ? MotorDir::motdir_cw
+                                  : MotorDir::pump_dir_clean;
+            if (length.count() <= 0)
+                continue;
+
+            if (to == flow) {
+                add(at, dir, flow);
+            } else {
+                const int n = std::max<int>(1, length / CLEAN_RAMP_INTERVAL);
+                for (int i = 0; i < n; i++)
+                    add(at + length * i / n, dir, flow + (to - flow) * i / n);
+            }
+            at += length;
+        }
+    }
+    schedule.steps.push_back({ at, MotorDir::pump_dir_clean, 0 });
+    schedule.total = at;
+    return schedule;
+}
+
+/// An array of segment objects whose keys, where present, have the types
+/// BuildCleanSchedule reads them as.
+static bool
+IsCleanProfile(const nlohmann::json& profile)
+{
+    if (not profile.is_array())
+        return false;
+    for (const auto& segment : profile) {
+        if (not segment.is_object())
+            return false;
+        for (const char* key : { "flow", "to", "ms" }) {
+            if (segment.contains(key) and not segment[key].is_number())
+                return false;
+        }
+        if (segment.contains("dir") and not segment["dir"].is_string())
+            return false;
+    }
+    return true;
+}
+
+StageClean::StageClean(const StationId& station)
+  : m_station(station)
+  , m_state(StageDSState::clean_idle)
+  , m_clean_secods(0)
+  , m_clean_steps(0)
+  , m_clean_speed(0)
+  , m_send_progress(0)
+  , m_run(0)
+  , m_running(false)
+  , m_cancel(true)
+  , m_pump(ui::CreateAsyncModel<StagePump>(station))
+{
+    auto storage = StageSettingStorage::GetInstance(m_station);
+    if (storage) {
+        m_clean_secods =
+          std::get<int>(storage->GetSettings(StageConfigKeys::CLEAN_SECONDS));
+        m_clean_speed =
+          std::get<float>(storage->GetSettings(StageConfigKeys::CLEAN_SPEED));
+
+        auto profile = nlohmann::json::parse(
+          std::get<std::string>(
+            storage->GetSettings(StageConfigKeys::CLEAN_PROFILE)),
+          nullptr,
+          false);
+        int repeat =
+          std::get<int>(storage->GetSettings(StageConfigKeys::CLEAN_REPEAT));
+        if (not IsCleanProfile(profile)) {
+            spdlog::warn("clean: malformed clean_profile, using clean_speed "
+                         "for clean_seconds");
+            profile = nlohmann::json::array();
+        }
+        if (profile.empty()) {
+            profile.push_back(
+              { { "flow", m_clean_speed }, { "ms", m_clean_secods * 1000 } });
+        }
+        m_schedule = BuildCleanSchedule(profile, repeat);
+    }
+}
+StageClean::~StageClean()
+{
+    Terminate();
+}
+
+void
+StageClean::Initiate() noexcept
+{
+}
+
+
+asio::awaitable<void>
+StageClean::StartClean(async::Lifeguard guard)
+{
+    SetState(StageDSState::clean_busy);
+    m_start_now = std::chrono::steady_clock::now();
+    m_send_label = LabelStrings::Cleaning;
+    m_send_progress = 0;
+    m_cancel = false;
+    m_running = true;
+    m_run++;
+
+    spdlog::info("clean: {} writes over {} ms",
+                 m_schedule.steps.size(),
+                 m_schedule.total.count());
+    co_await DoClean(guard());
+
+    co_return;
+}
+asio::awaitable<void>
+StageClean::CancelClean(async::Lifeguard guard)
+{
+    m_cancel = true;
+    m_running = false;
+    co_await m_pump->StopPump(guard());
+    SetState(StageDSState::clean_idle);
+    co_return;
+}
+
+asio::awaitable<void>
+StageClean::DoClean(async::Lifeguard guard)
+{
+    auto timer = ds::async::Timer();
+    const uint32_t run = m_run;
+    auto alive = [&]() { return not m_cancel and run == m_run; };
+
+    for (const auto& step : m_schedule.steps) {
+        // sleep to the deadline, not by a period, so writes do not drift
+        const auto deadline = m_start_now + step.at;
+        auto now = std::chrono::steady_clock::now();
+        while (alive() and now < deadline) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+              deadline - now);
+            co_await timer.AsyncSleepFor(
+              guard(),
+              std::clamp(left, std::chrono::milliseconds(1), CLEAN_MAX_SLEEP));
+            now = std::chrono::steady_clock::now();
+        }
+        if (not alive())
+            co_return;
+
+        const bool written =
+          co_await m_pump->SetSpeed(guard(), step.dir, step.speed);
+        // a cancel during the write may have stopped the pump before it
+        if (alive() and not written) {
+            spdlog::error("clean: write at {} ms failed, aborted",
+                          step.at.count());
+            m_running = false;
+            co_await m_pump->StopPump(guard());
+            SetState(StageDSState::clean_idle);
+            co_return;
+        }
+        if (not alive()) {
+            if (run == m_run)
+                co_await m_pump->StopPump(guard());
+            co_return;
+        }
+    }
+    // the last step pauses, the stop also powers the pump down
+    co_await m_pump->StopPump(guard());
+
+    m_running = false;
+    m_send_progress = 100;
+    m_send_label = LabelStrings::Completed;
+    co_return;
+}
+int
+StageClean::GetProgress() const
+{
+    if (not m_running or m_schedule.total.count() <= 0)
+        return m_send_progress;
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - m_start_now);
+    ProgressCalculator progress(int(m_schedule.total.count()));
+    return std::min(progress.GetPogress(int(elapsed.count())), 99);
+}
+wxString
+StageClean::GetLabel() const
+{
+    if (not m_running)
+        return m_send_label;
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(
+      std::chrono::steady_clock::now() - m_start_now);
+    auto total =
+      std::chrono::duration_cast<std::chrono::seconds>(m_schedule.total);
+    wxString label;
+    label << "Cleaning...(" << elapsed.count() << " / " << total.count()
+          << " sec)";
+    return label;
+}
+void
+StageClean::SetState(uint32_t state)
+{
+    if (StageDSState::clean_busy == state)
+        this->m_state &= ~(StageDSState::idle | StageDSState::clean_idle);
+    if (StageDSState::clean_idle == state)
+        this->m_state &= ~(StageDSState::idle | StageDSState::clean_busy);
+
+    this->m_state |= state;
+}
+bool
+StageClean::IsState(uint32_t state) const
+{
+    if (this->m_state & state)
+        return true;
+    else
+        return false;
+}
 } // namespace ds
\ No newline at end of file
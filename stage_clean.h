@@ -1,40 +1,69 @@
-#pragma once
-#include "ui.h"
-#include "async.h"
-#include "stage_base.h"
-#include "stage_pump.h"
-
-
-namespace ds::depthscan {
-class StageClean 
-  : public async::Model<StageClean>
-{
-public:
-    StageClean();
-    ~StageClean();
-
-    void Initiate() noexcept override;
-
-    void                  SetState(uint32_t state);
-    bool                  IsState(uint32_t state) const;
-    asio::awaitable<void> StartClean(async::Lifeguard guard);
-    asio::awaitable<void> CancelClean(async::Lifeguard guard);
-    asio::awaitable<void> DoClean(async::Lifeguard guard);
-    int                   GetProgress() const { return m_send_progress; }
-    wxString              GetLabel() const { return m_send_label;}
-
-private:
-    std::shared_ptr<StagePump>   m_pump;
-
-    std::chrono::high_resolution_clock::time_point m_start_now;
-    std::chrono::high_resolution_clock::time_point m_progress_now;
-
-    uint32_t           m_state;
-    uint32_t           m_clean_secods;
-    uint32_t           m_clean_steps;
-    float              m_clean_speed;
-    int                m_send_progress;
-    wxString           m_send_label;
-    bool               m_cancel;
-};
+#pragma once
+#include <chrono>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include "ui.h"
+#include "async.h"
+#include "stage_base.h"
+#include "stage_pump.h"
+
+
+namespace ds::depthscan {
+
+constexpr auto CLEAN_RAMP_INTERVAL = 50ms;  // write spacing inside a ramp
+constexpr auto CLEAN_MAX_SLEEP     = 1000ms; // cancel latency bound
+
+/// One precomputed pump register write of a cleaning run.
+struct CleanStep
+{
+    std::chrono::milliseconds at; ///< deadline from the start of the run
+    uint8_t                   dir;
+    uint32_t                  speed; ///< drive speed register, 0 pauses
+};
+struct CleanSchedule
+{
+    std::vector<CleanStep>    steps; ///< sorted by at, last one stops
+    std::chrono::milliseconds total{ 0 };
+};
+
+/// Compile clean_profile segments, repeated `repeat` times:
+///   [{ "flow": ml/min, "ms": duration, "to": ml/min, "dir": "cw" | "ccw" }]
+/// "to" ramps linearly from flow, "flow": 0 is a pause, "dir" defaults to
+/// the cleaning direction.
+CleanSchedule BuildCleanSchedule(const nlohmann::json& profile, int repeat);
+class StageClean 
+  : public async::Model<StageClean>
+{
+public:
+    explicit StageClean(const StationId& station);
+    ~StageClean();
+
+    void Initiate() noexcept override;
+
+    void                  SetState(uint32_t state);
+    bool                  IsState(uint32_t state) const;
+    asio::awaitable<void> StartClean(async::Lifeguard guard);
+    asio::awaitable<void> CancelClean(async::Lifeguard guard);
+    asio::awaitable<void> DoClean(async::Lifeguard guard);
+    /// Both follow from the schedule and the clock, nothing is polled.
+    int                   GetProgress() const;
+    wxString              GetLabel() const;
+
+private:
+    StationId m_station;
+    std::shared_ptr<StagePump>   m_pump;
+
+    CleanSchedule                         m_schedule;
+    std::chrono::steady_clock::time_point m_start_now;
+    uint32_t                              m_run; ///< bumped per start
+    bool                                  m_running;
+
+    uint32_t           m_state;
+    uint32_t           m_clean_secods;
+    uint32_t           m_clean_steps;
+    float              m_clean_speed;
+    int                m_send_progress;
+    wxString           m_send_label;
+    bool               m_cancel;
+};
 } // namespace ds
\ No newline at end of file
@@ -0,0 +1,173 @@
+#include <cstring>
+#include "stage_codec.h"
+
+namespace ds::depthscan {
+
+void
+DeltaBackground::Reset(const cv::Mat& key)
+{
+    key.convertTo(m_model, CV_16U, 256.0);
+}
+void
+DeltaBackground::Update(const cv::Mat& gray)
+{
+    for (int y = 0; y < gray.rows; y++) {
+        const uchar* src = gray.ptr<uchar>(y);
+        uint16_t*    model = m_model.ptr<uint16_t>(y);
+        for (int x = 0; x < gray.cols; x++) {
+            int diff = (int(src[x]) << 8) - int(model[x]);
+            model[x] = uint16_t(int(model[x]) + (diff >> DELTA_BACKGROUND_SHIFT));
+        }
+    }
+}
+bool
+DeltaBackground::Residual(const cv::Mat& gray, cv::Mat& residual) const
+{
+    if (not Fits(gray.size()))
+        return false;
+    residual.create(gray.size(), CV_8U);
+    for (int y = 0; y < gray.rows; y++) {
+        const uchar*    src = gray.ptr<uchar>(y);
+        const uint16_t* model = m_model.ptr<uint16_t>(y);
+        uchar*          dst = residual.ptr<uchar>(y);
+        for (int x = 0; x < gray.cols; x++) {
+            // modulo 256 keeps it lossless, zigzag keeps it small
+            auto d = int8_t(uint8_t(src[x] - ((model[x] + 128) >> 8)));
+            dst[x] = uchar((d << 1) ^ (d >> 7));
+        }
+    }
+    return true;
+}
+bool
+DeltaBackground::Restore(const cv::Mat& residual, cv::Mat& gray) const
+{
+    if (not Fits(residual.size()))
+        return false;
+    gray.create(residual.size(), CV_8U);
+    for (int y = 0; y < residual.rows; y++) {
+        const uchar*    src = residual.ptr<uchar>(y);
+        const uint16_t* model = m_model.ptr<uint16_t>(y);
+        uchar*          dst = gray.ptr<uchar>(y);
+        for (int x = 0; x < residual.cols; x++) {
+            auto d = uint8_t((src[x] >> 1) ^ -(src[x] & 1));
+            dst[x] = uchar(((model[x] + 128) >> 8) + d);
+        }
+    }
+    return true;
+}
+
+void
+EncodeFrame(RecordCodec codec,
+            const cv::Mat& gray,
+            int level,
+            DeltaBackground& background,
+            std::vector<uchar>& payload)
+{
+    const std::vector<int> params{ cv::IMWRITE_PNG_COMPRESSION, level };
+    payload.clear();
+    switch (codec) {
+        case RecordCodec::raw:
+            payload.assign(gray.datastart, gray.dataend);
+            break;
+        case RecordCodec::png:
+            cv::imencode(".png", gray, payload, params);
+            break;
+        case RecordCodec::delta:
+            // first frame, or the size changed: a new keyframe
+            cv::Mat residual;
+            if (not background.Residual(gray, residual)) {
+                cv::imencode(".png", gray, payload, params);
+                background.Reset(gray);
+                break;
+            }
+            if (cv::countNonZero(residual) > 0)
+                cv::imencode(".png", residual, payload, params);
+            background.Update(gray);
+            break;
+    }
+}
+bool
+DecodeFrame(RecordCodec codec,
+            const uchar* payload,
+            std::size_t bytes,
+            const RecordFrameHeader& header,
+            DeltaBackground& background,
+            cv::Mat& gray)
+{
+    const cv::Size size(int(header.width), int(header.height));
+    auto decode = [&]() {
+        return cv::imdecode(
+          cv::Mat(1, int(bytes), CV_8U, const_cast<uchar*>(payload)),
+          cv::IMREAD_GRAYSCALE);
+    };
+    switch (codec) {
+        case RecordCodec::raw:
+            if (bytes != header.width * header.height)
+                return false;
+            cv::Mat(size, CV_8U, const_cast<uchar*>(payload)).copyTo(gray);
+            return true;
+        case RecordCodec::png:
+            gray = decode();
+            return gray.size() == size;
+        case RecordCodec::delta: {
+            // the encoder keyed every frame that did not fit the background
+            if (not background.Fits(size)) {
+                gray = decode();
+                if (gray.size() != size)
+                    return false;
+                background.Reset(gray);
+                return true;
+            }
+            cv::Mat residual =
+              bytes ? decode() : cv::Mat::zeros(size, CV_8U);
+            if (residual.size() != size or
+                not background.Restore(residual, gray))
+                return false;
+            background.Update(gray);
+            return true;
+        }
+    }
+    return false;
+}
+bool
+DecodeChunk(const char* data,
+            std::size_t bytes,
+            std::vector<RecordFrameHeader>& headers,
+            std::vector<cv::Mat>& frames)
+{
+    RecordChunkHeader chunk;
+    if (bytes < sizeof(chunk))
+        return false;
+    std::memcpy(&chunk, data, sizeof(chunk));
+    if (chunk.bytes > bytes - sizeof(chunk))
+        return false;
+    // every frame has at least its header in the payload, checked before
+    // chunk.frames sizes anything
+    if (chunk.frames > chunk.bytes / sizeof(RecordFrameHeader))
+        return false;
+
+    headers.resize(chunk.frames);
+    frames.resize(chunk.frames);
+    DeltaBackground background;
+    std::size_t     at = sizeof(chunk);
+    const auto      end = sizeof(chunk) + chunk.bytes;
+    for (uint32_t i = 0; i < chunk.frames; i++) {
+        if (at + sizeof(RecordFrameHeader) > end)
+            return false;
+        std::memcpy(&headers[i], data + at, sizeof(RecordFrameHeader));
+        at += sizeof(RecordFrameHeader);
+        if (at + headers[i].bytes > end)
+            return false;
+        if (not DecodeFrame(RecordCodec(chunk.codec),
+                            reinterpret_cast<const uchar*>(data + at),
+                            headers[i].bytes,
+                            headers[i],
+                            background,
+                            frames[i]))
+            return false;
+        at += headers[i].bytes;
+    }
+    return true;
+}
+
+} // namespace ds::depthscan
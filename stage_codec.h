@@ -0,0 +1,97 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+namespace ds::depthscan {
+
+// Why not chunked .dsf datasets: the HDF5 writer is inside the camera
+// library and only takes frames from its own recorder. The .dsr is
+// append-only, so a crash loses at most the chunks in flight, and every
+// chunk encodes and decodes alone, which is what the writer and reader
+// thread pools need. The camera's .dsf stays the default output.
+constexpr uint32_t RECORD_MAGIC   = 0x46525344; // "DSRF"
+constexpr uint32_t RECORD_VERSION = 2;          // chunked
+constexpr auto     RECORD_EXTENSION = ".dsr";
+constexpr int      DELTA_BACKGROUND_SHIFT = 3;  // background follows 1/8
+
+enum struct RecordCodec : uint32_t
+{
+    raw = 0,  ///< 8-bit gray as is
+    png = 1,  ///< lossless, cv::imencode per frame
+    delta = 2 ///< first frame of a chunk as png, then residuals, lossless
+};
+
+#pragma pack(push, 1)
+struct RecordFileHeader
+{
+    uint32_t magic{ RECORD_MAGIC };
+    uint32_t version{ RECORD_VERSION };
+};
+/// Followed by `frames` RecordFrameHeader + payload pairs, `bytes` in all.
+struct RecordChunkHeader
+{
+    uint64_t first;  ///< index of the first frame
+    uint32_t frames;
+    uint32_t codec;  ///< RecordCodec
+    uint64_t bytes;
+};
+struct RecordFrameHeader
+{
+    uint64_t index;     ///< camera frame id, a gap is a dropped frame
+    int64_t  timestamp; ///< arrival, us since the recorder was armed
+    uint32_t width;
+    uint32_t height;
+    uint32_t bytes;     ///< stored payload, width * height when raw
+};
+#pragma pack(pop)
+
+/// Running background of the delta codec. The encoder and the decoder
+/// update it from the same exact frames in integer arithmetic, so both
+/// sides hold the same model without it ever being stored.
+class DeltaBackground
+{
+public:
+    void Reset(const cv::Mat& key);
+    void Update(const cv::Mat& gray);
+    bool Empty() const { return m_model.empty(); }
+    /// A frame of another size needs a new keyframe.
+    bool Fits(const cv::Size& size) const
+    {
+        return not m_model.empty() and m_model.size() == size;
+    }
+
+    /// zigzag(gray - background), small values where nothing moved.
+    /// Both return false when the frame does not fit the model.
+    bool Residual(const cv::Mat& gray, cv::Mat& residual) const;
+    bool Restore(const cv::Mat& residual, cv::Mat& gray) const;
+
+private:
+    cv::Mat m_model; ///< CV_16U, 8.8 fixed point
+};
+
+/// Payload of one frame. A delta frame with no residual is stored empty; a
+/// frame that does not fit the background starts a new keyframe.
+void EncodeFrame(RecordCodec codec,
+                 const cv::Mat& gray,
+                 int level,
+                 DeltaBackground& background,
+                 std::vector<uchar>& payload);
+/// Inverse of EncodeFrame, frames of a chunk in order from a reset
+/// background. A header of another size than the background is such a
+/// keyframe. Returns false for a damaged payload, or a residual that does
+/// not fit the background.
+bool DecodeFrame(RecordCodec codec,
+                 const uchar* payload,
+                 std::size_t bytes,
+                 const RecordFrameHeader& header,
+                 DeltaBackground& background,
+                 cv::Mat& gray);
+/// Every frame of a chunk as written by StageFrameWriter, data starting
+/// at the chunk header.
+bool DecodeChunk(const char* data,
+                 std::size_t bytes,
+                 std::vector<RecordFrameHeader>& headers,
+                 std::vector<cv::Mat>& frames);
+
+} // namespace ds::depthscan
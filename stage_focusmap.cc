@@ -0,0 +1,134 @@
+#include <algorithm>
+#include <fstream>
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+#include "stage_base.h"
+#include "stage_focusmap.h"
+
+namespace ds::depthscan {
+
+StageFocusMap::StageFocusMap(const StationId& station)
+  : m_path(StationPath(station,
+                       "c:/ltis/depthscan/resources/settings/focus_map.json"))
+{
+    Load();
+}
+
+std::string
+StageFocusMap::Key(const std::string& camera, const std::string& chip, int y)
+{
+    // floor division, so cells do not double up around 0
+    int cell = y >= 0 ? y / FOCUS_MAP_Y_BIN
+                      : -((-y + FOCUS_MAP_Y_BIN - 1) / FOCUS_MAP_Y_BIN);
+    return camera + "/" + chip + "/" + std::to_string(cell);
+}
+
+FocusWindow
+ClampFocusWindow(FocusWindow window, int step, int total_steps, int full_start)
+{
+    // 1. allowed positions: the full sweep, within the stage limits
+    const long long full_span = (long long)(total_steps - 2) * step;
+    long long lo = std::min<long long>(full_start, full_start + full_span);
+    long long hi = std::max<long long>(full_start, full_start + full_span);
+    lo = std::max<long long>(lo, POS_MIN);
+    hi = std::min<long long>(hi, POS_MAX);
+
+    // 2. the window's first and last position inside them, a window wider
+    //    than the range starts at its low end
+    const long long span = (long long)(window.steps - 2) * step;
+    long long start = window.start;
+    start = std::min(start, hi - std::max(span, 0LL));
+    start = std::max(start, lo - std::min(span, 0LL));
+    window.start = int(start);
+    return window;
+}
+
+std::optional<FocusWindow>
+StageFocusMap::Predict(const std::string& key,
+                       int step,
+                       int total_steps,
+                       int full_start) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_entries.find(key);
+    if (it == m_entries.end())
+        return std::nullopt;
+
+    const auto& entry = it->second;
+    int half = std::max(FOCUS_MAP_MIN_HALF, 2 * entry.width);
+    half <<= std::min(entry.misses, 8);
+    // the sweep visits steps - 1 positions, see StageAutoFocus::Focusing
+    const int steps = 2 * half + 2;
+    if (steps >= total_steps)
+        return std::nullopt;
+    return ClampFocusWindow(
+      { entry.min_x - half * step, steps }, step, total_steps, full_start);
+}
+
+void
+StageFocusMap::Record(const std::string& key, const FocusMapEntry& entry)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto& kept = m_entries[key];
+    kept.min_x = entry.min_x;
+    kept.decision_x = entry.decision_x;
+    kept.width = entry.width;
+    kept.hits += entry.hits;
+    kept.misses = 0;
+    Save();
+}
+void
+StageFocusMap::Miss(const std::string& key)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_entries.find(key);
+    if (it == m_entries.end())
+        return;
+    it->second.misses++;
+    Save();
+}
+
+void
+StageFocusMap::Load()
+{
+    std::ifstream file(m_path);
+    if (not file.is_open())
+        return;
+    try {
+        nlohmann::json document;
+        file >> document;
+        for (auto& [key, value] : document.items()) {
+            FocusMapEntry entry;
+            entry.min_x = value.value("min_x", 0);
+            entry.decision_x = value.value("decision_x", 0);
+            entry.width = value.value("width", 0);
+            entry.hits = value.value("hits", 0);
+            entry.misses = value.value("misses", 0);
+            m_entries[key] = entry;
+        }
+    } catch (const std::exception& e) {
+        spdlog::error("focus map: {} in {}", e.what(), m_path);
+        m_entries.clear();
+    }
+    spdlog::info("focus map: {} cells from {}", m_entries.size(), m_path);
+}
+void
+StageFocusMap::Save() const
+{
+    nlohmann::json document;
+    for (const auto& [key, entry] : m_entries) {
+        document[key] = { { "min_x", entry.min_x },
+                          { "decision_x", entry.decision_x },
+                          { "width", entry.width },
+                          { "hits", entry.hits },
+                          { "misses", entry.misses } };
+    }
+    std::ofstream file(m_path);
+    if (not file.is_open()) {
+        spdlog::error("focus map: cannot write {}", m_path);
+        return;
+    }
+    file << document.dump(4);
+}
+
+} // namespace ds::depthscan
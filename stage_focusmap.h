@@ -0,0 +1,70 @@
+#pragma once
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include "stage_station.h"
+
+namespace ds::depthscan {
+
+constexpr auto FOCUS_MAP_Y_BIN    = 50 * 256; // micro steps per Y cell
+constexpr auto FOCUS_MAP_MIN_HALF = 10;       // sweep steps either side
+constexpr auto FOCUS_MAP_EDGE     = 4; // a minimum this close to an end
+                                       // was not bracketed
+
+/// Where the focus of one camera / chip type / Y cell was found before.
+struct FocusMapEntry
+{
+    int min_x{ 0 };      ///< position of the curve minimum
+    int decision_x{ 0 }; ///< position the stage was left at
+    int width{ 0 };      ///< dip width at half depth, in sweep steps
+    int hits{ 0 };       ///< predicted sweeps that bracketed the minimum
+    int misses{ 0 };     ///< since the last hit, each doubles the window
+};
+
+/// First position and step count of a sweep.
+struct FocusWindow
+{
+    int start;
+    int steps;
+};
+/// window moved, not narrowed, into the full sweep of total_steps from
+/// full_start and into the stage limits. A sweep visits steps - 1
+/// positions, step apart.
+FocusWindow ClampFocusWindow(FocusWindow window,
+                             int step,
+                             int total_steps,
+                             int full_start);
+
+/// Persistent map of earlier focus results, kept next to stage.json and
+/// rewritten on every update. A prediction is a window around the last
+/// minimum, a few curve widths wide; misses widen it until it is no
+/// smaller than the full sweep, then no prediction is made.
+class StageFocusMap
+{
+public:
+    explicit StageFocusMap(const StationId& station);
+
+    static std::string Key(const std::string& camera,
+                           const std::string& chip,
+                           int y);
+
+    /// Window around the last minimum, clamped to the full sweep that
+    /// starts at full_start.
+    std::optional<FocusWindow> Predict(const std::string& key,
+                                       int step,
+                                       int total_steps,
+                                       int full_start) const;
+    void Record(const std::string& key, const FocusMapEntry& entry);
+    void Miss(const std::string& key);
+
+private:
+    void Load();
+    void Save() const; ///< with m_mutex held
+
+    mutable std::mutex                   m_mutex;
+    std::string                          m_path;
+    std::map<std::string, FocusMapEntry> m_entries;
+};
+
+} // namespace ds::depthscan
@@ -1,147 +1,279 @@
-#include "stage_frame.h"
-
-namespace ds::depthscan {
-//std::shared_ptr<ds::camera::Camera> StageFrame::s_mainCamera = nullptr;
-StageFrame::StageFrame()
-  : m_camera(nullptr)
-{
-    //if (s_mainCamera == nullptr) {
-    //    s_mainCamera = ds::camera::GetCamera("main");
-    //}
-    //m_camera = s_mainCamera;
-    m_camera = ds::camera::GetCamera("main");
-}
-void
-StageFrame::Initiate() noexcept
-{
-}
-
-StageFrame::~StageFrame()
-{
-}
-
-asio::awaitable<std::shared_ptr<const ds::camera::Frame>>
-StageFrame::GetAsyncFrame(async::Lifeguard guard) const
-{
-    co_return co_await m_camera->AsyncGetFrame(guard());
-}
-bool
-TemplateFilter::ShouldRecord(const ds::camera::Frame* frame) 
-{
-    cv::Mat gray = frame->CreateGray();
-    cv::Mat roi = gray(cv::Rect(0, int(gray.rows / 4), gray.cols, 100));
-    if (m_first) {
-        m_first = false;
-        m_record = false;
-        m_template = roi.clone();
-        m_that_gray = gray.clone();
-        //spdlog::info("similarity [{}]", m_meanValue);
-    }
-    cv::Mat result;
-    //auto start = std::chrono::high_resolution_clock::now();
-    cv::matchTemplate(roi, m_template, result, cv::TM_CCOEFF_NORMED);
-    m_meanValue = std::round(cv::mean(result)[0] * 100000.0) / 100000.0;
-    //auto end = std::chrono::high_resolution_clock::now();
-    //auto duration =
-    //  std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-    //spdlog::info(
-    //  " duration [{}] us", m_meanValue, duration.count());
-    if (m_meanValue < m_threshold)
-    {
-        StageProcessImage Image;
-        StageDateTimeFormat Time;
-        std::string TimeStamp = Time.GetTime();
-        StageFileHandle File(PATH_TO_AUTOMODE);
-        //spdlog::info("similarity [{}]", m_meanValue);
-        Image.SaveImages(
-            File.GetFileName(TimeStamp, ".png", "this", "entry"), gray, 0);
-        Image.SaveImages(File.GetFileName(TimeStamp, ".png", "prev", " entry"),
-                         m_that_gray,
-            0);
-        m_record = true;
-    } 
-    m_template = roi.clone();
-    m_that_gray = gray.clone();
-    
-
-    return m_record;
-}
-void
-BrightnessFilter::SaveImages(const std::string& event_type, const cv::Mat& gray) const
-{
-    StageProcessImage Image;
-    StageDateTimeFormat Time;
-    std::string TimeStamp = Time.GetTime();
-    StageFileHandle File(PATH_TO_AUTOMODE);
-
-    Image.SaveImages(
-      File.GetFileName(TimeStamp, ".png", "this", event_type.c_str()), gray, 0);
-    Image.SaveImages(
-      File.GetFileName(TimeStamp, ".png", "prev", event_type.c_str()),
-      m_that_gray,
-      0);
-}
-bool
-BrightnessFilter::ShouldRecord(const ds::camera::Frame* frame)
-{
-    if (m_finished)  return false;
-
-    cv::Mat gray =
-      m_record
-        ? frame->CreateSubGray(100, frame->height - 100, frame->width - 100, 30)
-        : frame->CreateSubGray(100, 200, frame->width - 100, 30);
- 
-    double currentBrightness = cv::mean(gray)[0];
-    double brightnessDiff = currentBrightness - m_that_brigtness;
-
-    if (m_first) {
-        m_first = false;
-        m_record = false;
-        m_finished = false;
-        m_no_check = false;
-        m_that_brigtness = currentBrightness;
-        m_that_gray = gray.clone();
-        m_idx = 0;
-        return false;
-    } 
-    m_idx++;
-    //if (abs(brightnessDiff) > 2)
-    //    spdlog::info(" br[{}] [{},{}] ",m_idx, int(m_that_brigtness),int(currentBrightness));
-    if (m_no_check) {
-        m_record = true;
-    } else if (!m_record) {
-        if (brightnessDiff >= m_threshold_entry) {
-            SaveImages("entry_1", gray);
-            m_record = true;
-            m_no_check = true;
-        }
-    } else if (brightnessDiff <= m_threshold_exit) {
-        cv::Mat gray_front = frame->CreateSubGray(
-          100, 100, frame->width - 100, 30);
-        double currentBrightness_front = cv::mean(gray_front)[0];
-        double brightnessDiff_front =
-          currentBrightness_front - currentBrightness;
-        //spdlog::info(" br[{}] [{},{},{}] ",
-        //             m_idx,
-        //             int(m_that_brigtness),
-        //             int(currentBrightness),
-        //             int(currentBrightness_front));
-        if (brightnessDiff_front <= m_threshold_exit_2nd) {
-            m_record = false;
-            m_finished = true;  
-            SaveImages("exit_1", gray);
-            SaveImages("exit_f", gray_front);
-            spdlog::info("exit:{}_{}_{}",
-                         int(m_that_brigtness),
-                         int(currentBrightness),
-                         int(currentBrightness_front));
-        } 
-   
-     } 
-    
-    m_that_brigtness = currentBrightness;
-    m_that_gray = gray.clone();
-
-    return m_record;
-}
+#include <optional>
+#include <asio/experimental/awaitable_operators.hpp>
+#include "stage_frame.h"
+#include "stage_statistics.h"
+
+namespace ds::depthscan {
+
+using namespace asio::experimental::awaitable_operators;
+
+//std::shared_ptr<ds::camera::Camera> StageFrame::s_mainCamera = nullptr;
+constexpr auto FRAME_INTERVAL = 20ms; // LED period, see Stage::InitConfig
+constexpr auto FRAME_AFTER_TIMEOUT = 2s; // camera stalled, give up
+
+StageFrame::StageFrame(const StationId& station)
+  : m_station(station)
+  , m_events(&StageEvents::Get(m_station))
+  , m_camera(nullptr)
+  , m_interval(FRAME_INTERVAL)
+{
+    //if (s_mainCamera == nullptr) {
+    //    s_mainCamera = ds::camera::GetCamera("main");
+    //}
+    //m_camera = s_mainCamera;
+    m_camera = ds::camera::GetCamera(m_station);
+}
+void
+StageFrame::Initiate() noexcept
+{
+}
+
+StageFrame::~StageFrame()
+{
+}
+
+asio::awaitable<std::shared_ptr<const ds::camera::Frame>>
+StageFrame::GetAsyncFrame(async::Lifeguard guard) const
+{
+    auto frame = co_await m_camera->AsyncGetFrame(guard());
+
+    auto now = StageEvents::Clock::now();
+    auto delta = now - m_delivered;
+    if (delta < 10 * FRAME_INTERVAL)
+        m_interval = (m_interval * 7 + delta) / 8;
+    m_delivered = now;
+
+    co_return frame;
+}
+asio::awaitable<std::shared_ptr<const ds::camera::Frame>>
+StageFrame::GetAsyncFrameAfter(async::Lifeguard guard,
+                               StageEvents::Clock::time_point since,
+                               const bool* cancel) const
+{
+    const auto deadline = StageEvents::Clock::now() + FRAME_AFTER_TIMEOUT;
+    std::optional<uint64_t> first; // id of the first frame after since
+
+    while (not (cancel and *cancel)) {
+        const auto left = deadline - StageEvents::Clock::now();
+        if (left <= StageEvents::Clock::duration::zero()) {
+            spdlog::error("frame after event: none in {} ms",
+                          FRAME_AFTER_TIMEOUT / 1ms);
+            break;
+        }
+        asio::steady_timer timer(co_await asio::this_coro::executor, left);
+        auto result = co_await (GetAsyncFrame(guard()) ||
+                                timer.async_wait(asio::use_awaitable));
+        if (result.index() != 0)
+            continue; // the deadline check above reports it
+        auto frame = std::get<0>(std::move(result));
+        if (not frame or m_delivered < since)
+            continue;
+
+        const uint64_t id = CameraFrameId(*frame);
+        if (not first)
+            first = id;
+        else if (id > *first)
+            co_return frame;
+    }
+    co_return nullptr;
+}
+asio::awaitable<std::shared_ptr<const ds::camera::Frame>>
+StageFrame::GetAsyncFrameAfterMove(async::Lifeguard guard,
+                                   const bool* cancel) const
+{
+    co_return co_await GetAsyncFrameAfter(
+      guard(), m_events->LastMoveDone(), cancel);
+}
+asio::awaitable<std::shared_ptr<const ds::camera::Frame>>
+StageFrame::GetAsyncFrameAfterChange(async::Lifeguard guard,
+                                     const bool* cancel) const
+{
+    co_return co_await GetAsyncFrameAfter(
+      guard(), m_events->LastParamChanged(), cancel);
+}
+void
+StageFrame::ArmRecording(std::shared_ptr<ds::camera::RecordFilter> filter,
+                         const std::filesystem::path& path,
+                         const std::string& gname,
+                         const RecordOptions& options)
+{
+    if (not options.Enabled()) {
+        if (options.Triggered())
+            spdlog::warn("pre/post-trigger frames need record_format dsr, "
+                         "recording {} without them",
+                         path.string());
+        m_camera->ArmRecording(filter, path, gname);
+        return;
+    }
+    if (not m_recorder)
+        m_recorder = ui::CreateAsyncModel<StageRecorder>(m_station);
+    m_recorder->Arm(filter, path, options);
+}
+void
+StageFrame::StopRecording()
+{
+    if (m_recorder and m_recorder->IsActive()) {
+        auto memory = m_recorder->GetMemory();
+        m_recorder->Stop();
+        spdlog::info("record memory: ring peak {} kB, queue peak {} kB, "
+                     "cap {} kB, dropped {}, missed {}",
+                     memory.ring_peak >> 10,
+                     memory.queue_peak >> 10,
+                     memory.max_bytes >> 10,
+                     memory.dropped,
+                     memory.missed);
+        return;
+    }
+    m_camera->StopRecording();
+}
+bool
+TemplateFilter::ShouldRecord(const ds::camera::Frame* frame) 
+{
+    cv::Mat gray = frame->CreateGray();
+    cv::Mat roi = gray(cv::Rect(0, int(gray.rows / 4), gray.cols, 100));
+    if (m_first) {
+        m_first = false;
+        m_record = false;
+        m_change.Reset();
+        m_that_gray = gray.clone(); // not the constructor's template
+        //spdlog::info("similarity [{}]", m_meanValue);
+    }
+    m_meanValue =
+      std::round(m_change.Update(roi).ncc * 100000.0) / 100000.0;
+    if (m_meanValue < m_threshold)
+    {
+        StageProcessImage Image;
+        StageDateTimeFormat Time;
+        std::string TimeStamp = Time.GetTime();
+        StageFileHandle File(m_log_folder);
+        //spdlog::info("similarity [{}]", m_meanValue);
+        Image.SaveImages(
+            File.GetFileName(TimeStamp, ".png", "this", "entry"), gray, 0);
+        Image.SaveImages(File.GetFileName(TimeStamp, ".png", "prev", " entry"),
+                         m_that_gray,
+            0);
+        if (not m_record)
+            m_change.LogCost("template filter");
+        m_record = true;
+    } 
+    // into the same buffer every frame
+    gray.copyTo(m_that_gray);
+    
+
+    return m_record;
+}
+void
+BrightnessFilter::SaveImages(const std::string& event_type, const cv::Mat& gray) const
+{
+    StageProcessImage Image;
+    StageDateTimeFormat Time;
+    std::string TimeStamp = Time.GetTime();
+    StageFileHandle File(m_log_folder);
+
+    Image.SaveImages(
+      File.GetFileName(TimeStamp, ".png", "this", event_type.c_str()), gray, 0);
+    Image.SaveImages(
+      File.GetFileName(TimeStamp, ".png", "prev", event_type.c_str()),
+      m_that_gray,
+      0);
+}
+void
+BrightnessFilter::AppendIndex(const ds::camera::Frame& frame,
+                              double brightness,
+                              double motion,
+                              IndexEvent event)
+{
+    if (not m_index)
+        return;
+    RecordIndexEntry entry{
+        CameraFrameId(frame),
+        std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - m_armed)
+          .count(),
+        float(brightness),
+        float(motion),
+        uint8_t(event),
+        uint8_t(m_record)
+    };
+    m_index->Append(entry);
+}
+bool
+BrightnessFilter::ShouldRecord(const ds::camera::Frame* frame)
+{
+    if (m_finished)  return false;
+
+    cv::Mat gray =
+      m_record
+        ? frame->CreateSubGray(100, frame->height - 100, frame->width - 100, 30)
+        : frame->CreateSubGray(100, 200, frame->width - 100, 30);
+ 
+    if (m_first)
+        m_change.Reset();
+    // strip mean, its change and the motion in one pass
+    const auto change = m_change.Update(gray);
+    double currentBrightness = change.mean;
+    double brightnessDiff = change.mean_diff;
+    IndexEvent event = IndexEvent::none;
+
+    if (m_first) {
+        m_first = false;
+        m_record = false;
+        m_finished = false;
+        m_no_check = false;
+        m_that_brigtness = currentBrightness;
+        m_that_gray = gray.clone(); // not the constructor's template
+        m_idx = 0;
+        m_armed = std::chrono::steady_clock::now();
+        AppendIndex(*frame, currentBrightness, 0.0, event);
+        return false;
+    } 
+    m_idx++;
+    double motion = change.sad;
+    //if (abs(brightnessDiff) > 2)
+    //    spdlog::info(" br[{}] [{},{}] ",m_idx, int(m_that_brigtness),int(currentBrightness));
+    if (m_no_check) {
+        if (m_manual_entry)
+            event = IndexEvent::entry;
+        m_manual_entry = false;
+        m_record = true;
+    } else if (!m_record) {
+        if (brightnessDiff >= m_threshold_entry) {
+            SaveImages("entry_1", gray);
+            m_record = true;
+            m_no_check = true;
+            event = IndexEvent::entry;
+        }
+    } else if (brightnessDiff <= m_threshold_exit) {
+        cv::Mat gray_front = frame->CreateSubGray(
+          100, 100, frame->width - 100, 30);
+        const auto front = ComputeExposureStatistics(gray_front);
+        double currentBrightness_front = front.mean;
+        double brightnessDiff_front =
+          currentBrightness_front - currentBrightness;
+        //spdlog::info(" br[{}] [{},{},{}] ",
+        //             m_idx,
+        //             int(m_that_brigtness),
+        //             int(currentBrightness),
+        //             int(currentBrightness_front));
+        if (front.Valid() and brightnessDiff_front <= m_threshold_exit_2nd) {
+            m_record = false;
+            m_finished = true;  
+            event = IndexEvent::exit;
+            SaveImages("exit_1", gray);
+            SaveImages("exit_f", gray_front);
+            m_change.LogCost("brightness filter");
+            spdlog::info("exit:{}_{}_{}",
+                         int(m_that_brigtness),
+                         int(currentBrightness),
+                         int(currentBrightness_front));
+        } 
+   
+     } 
+    
+    m_that_brigtness = currentBrightness;
+    gray.copyTo(m_that_gray);
+    AppendIndex(*frame, currentBrightness, motion, event);
+
+    return m_record;
+}
 } // namespace ds
\ No newline at end of file
@@ -1,185 +1,260 @@
-#pragma once
-#include "async.h"
-#include "ui.h"
-#include "stage_base.h"
-#include <camera.h>
-#include "camera/record_filter.h"
-#include <opencv2/opencv.hpp>
-#include <spdlog/spdlog.h>
-#include "stage_utility.h"
-#include "stage_settings.h"
-
-namespace ds::depthscan {
-
-class ds::camera::Camera;
-class ds::camera::RecordFilter;
-struct ds::camera::Frame;
-
-
-class TemplateFilter : public ds::camera::RecordFilter
-{
-
-public:
-    TemplateFilter()
-      : m_threshold(0.8)
-    {
-    }
-    TemplateFilter(const cv::Mat& templateImg,
-                   double threshold = 0.8)
-      : m_template(templateImg)
-      , m_that_gray(templateImg)
-      , m_threshold(threshold)
-      , m_meanValue(1.0)
-      , m_first(true)
-      , m_record(false)
-    {
-    }
-    bool ShouldRecord(const ds::camera::Frame* frame) override;
-    void SetFirst()
-    {
-        m_first = true;
-        m_record = false;
-        m_meanValue = 1.0;
-    }
-
-private:
-    bool m_first;
-    bool m_record;
-   
-    cv::Mat m_template;
-    cv::Mat m_that_gray;
-    double m_threshold;
-    double m_meanValue;
-};
-class BrightnessFilter : public ds::camera::RecordFilter
-{
-
-public:
-    BrightnessFilter()
-      : m_threshold_entry(0.8)
-    {
-    }
-    BrightnessFilter(const cv::Mat& templateImg,
-                     double threshold_entry = 10.0,
-                     double threshold_exit = -10.0,
-                     double threshold_exit2 = 20.0)
-    : m_that_gray(templateImg)
-      , m_threshold_entry(threshold_entry)
-      , m_threshold_exit(threshold_exit)
-      , m_threshold_exit_2nd(threshold_exit2)
-      , m_first(true)
-      , m_record(false)
-      , m_that_brigtness(0.0)
-      , m_finished(false)
-      , m_no_check(false)
-      , m_idx(0)
-    {
-    }
-    void SaveImages(const std::string& event_type, const cv::Mat& gray) const;
-    bool ShouldRecord(const ds::camera::Frame* frame) override;
-    void ManualRecord() {
-        m_record = true;
-        m_no_check = true;
-        m_finished = false;
-        m_first = false;
-        m_idx = 0;
-        spdlog::info("Manual Record");
-    }
-    void SetFirst()
-    {
-        m_first = true;
-        m_record = false;
-    }
-    void SetNoCheck(bool no_check) { m_no_check = no_check; }
-
-private:
-    bool m_first;
-    bool m_record;
-    bool m_finished;
-    bool m_no_check;
-
-    int m_idx;
-
-    double m_that_brigtness;
-    double m_threshold_entry;
-    double m_threshold_exit;
-    double m_threshold_exit_2nd;
-    cv::Mat m_that_gray;
-};
-
-
-class StageFrame : public async::Model<StageFrame>
-{
-public:
-    StageFrame();
-    ~StageFrame();
-
-    void Initiate() noexcept override;
-
-    std::shared_ptr<ds::camera::Camera> GetCamera() const
-    { return m_camera;
-    }
-
-    asio::awaitable<std::shared_ptr<const ds::camera::Frame>> GetAsyncFrame(
-      async::Lifeguard guard) const;
-
-
-    void ArmRecording(std::shared_ptr<ds::camera::RecordFilter> filter,
-                      const std::filesystem::path& path,
-                      const std::string& gname)
-    {
-        m_camera->ArmRecording(filter, path, gname);
-    }
-
-    void StopRecording() { m_camera->StopRecording(); }
-  
-    ds::camera::CameraState GetState() const noexcept { return m_camera->GetState(); } 
-    std::string GetCameraName() const noexcept
-    {
-        return m_camera->GetCameraName();
-    }
-
-private:
-    std::shared_ptr<ds::camera::Camera> m_camera;
-    std::shared_ptr<const ds::camera::Frame> m_frame;
-    async::RawCondition m_cond;
-    //static std::shared_ptr<ds::camera::Camera> s_mainCamera;
-};
-
-class StageLED : public async::Model<StageLED>
-{
-public:
-    StageLED()
-        :m_stage(ui::CreateAsyncModel<Stage>())
-    {
-
-    }
-    ~StageLED(){};
-
-    asio::awaitable<void> SetLEDCh(async::Lifeguard guard, uint32_t value)
-    {
-        co_await m_stage->SetLEDCh(guard(), value);
-        co_return;
-    }
-    asio::awaitable<void> SetLEDPeriod(async::Lifeguard guard, uint32_t value)
-    {
-        co_await m_stage->SetLEDPeriod(guard(), value);
-        co_return;
-    }
-    asio::awaitable<void> SetLEDCamOff(async::Lifeguard guard, uint32_t value)
-    {
-        co_await m_stage->SetLEDCamOff(guard(), value);
-        co_return;
-    }
-    asio::awaitable<void> SetLEDOn(async::Lifeguard guard, uint32_t value)
-    {
-        co_await m_stage->SetLEDOn(guard(), value);
-        co_return;
-    }
-
-
-private:
-    std::shared_ptr<Stage> m_stage;
-    async::RawCondition m_cond;
-};
+#pragma once
+#include "async.h"
+#include "ui.h"
+#include "stage_base.h"
+#include <camera.h>
+#include "camera/record_filter.h"
+#include <opencv2/opencv.hpp>
+#include <spdlog/spdlog.h>
+#include "stage_utility.h"
+#include "stage_settings.h"
+#include "stage_recorder.h"
+#include "stage_index.h"
+#include "stage_change.h"
+
+namespace ds::depthscan {
+
+class ds::camera::Camera;
+class ds::camera::RecordFilter;
+struct ds::camera::Frame;
+
+
+class TemplateFilter : public ds::camera::RecordFilter
+{
+
+public:
+    TemplateFilter()
+      : m_threshold(0.8)
+      , m_change({ ChangeMode::ncc, TEMPLATE_CHANGE_LEVEL })
+    {
+    }
+    TemplateFilter(const cv::Mat& templateImg,
+                   double threshold = 0.8)
+      : m_that_gray(templateImg)
+      , m_threshold(threshold)
+      , m_meanValue(1.0)
+      , m_first(true)
+      , m_record(false)
+      , m_change({ ChangeMode::ncc, TEMPLATE_CHANGE_LEVEL })
+    {
+    }
+    bool ShouldRecord(const ds::camera::Frame* frame) override;
+    void SetFirst()
+    {
+        m_first = true;
+        m_record = false;
+        m_meanValue = 1.0;
+    }
+    /// Where entry images go, the station's automode folder.
+    void SetLogFolder(std::string folder) { m_log_folder = std::move(folder); }
+
+private:
+    // full size strip: m_threshold was tuned there
+    static constexpr int TEMPLATE_CHANGE_LEVEL = 0;
+
+    bool m_first;
+    bool m_record;
+   
+    cv::Mat m_that_gray; ///< whole last frame, saved with an entry
+    std::string m_log_folder{ PATH_TO_AUTOMODE };
+    double m_threshold;
+    double m_meanValue;
+    StageChangeDetector m_change; ///< of the strip
+};
+class BrightnessFilter : public ds::camera::RecordFilter
+{
+
+public:
+    BrightnessFilter()
+      : m_threshold_entry(0.8)
+    {
+    }
+    BrightnessFilter(const cv::Mat& templateImg,
+                     double threshold_entry = 10.0,
+                     double threshold_exit = -10.0,
+                     double threshold_exit2 = 20.0)
+    : m_that_gray(templateImg)
+      , m_threshold_entry(threshold_entry)
+      , m_threshold_exit(threshold_exit)
+      , m_threshold_exit_2nd(threshold_exit2)
+      , m_first(true)
+      , m_record(false)
+      , m_that_brigtness(0.0)
+      , m_finished(false)
+      , m_no_check(false)
+      , m_idx(0)
+    {
+    }
+    void SaveImages(const std::string& event_type, const cv::Mat& gray) const;
+    bool ShouldRecord(const ds::camera::Frame* frame) override;
+    void ManualRecord() {
+        m_record = true;
+        m_no_check = true;
+        m_finished = false;
+        m_first = false;
+        m_idx = 0;
+        m_manual_entry = true;
+        spdlog::info("Manual Record");
+    }
+    void SetFirst()
+    {
+        m_first = true;
+        m_record = false;
+    }
+    void SetNoCheck(bool no_check) { m_no_check = no_check; }
+    /// Where event images go, the station's automode folder.
+    void SetLogFolder(std::string folder) { m_log_folder = std::move(folder); }
+    /// Side index for the next recording, one entry per frame seen.
+    void SetIndex(std::shared_ptr<StageFrameIndex> index)
+    {
+        m_index = std::move(index);
+    }
+
+private:
+    void AppendIndex(const ds::camera::Frame& frame,
+                     double brightness,
+                     double motion,
+                     IndexEvent event);
+
+    bool m_first;
+    bool m_record;
+    bool m_finished;
+    bool m_no_check;
+
+    int m_idx;
+    bool     m_manual_entry{ false };
+    std::shared_ptr<StageFrameIndex>      m_index;
+    std::chrono::steady_clock::time_point m_armed;
+    std::string                           m_log_folder{ PATH_TO_AUTOMODE };
+
+    double m_that_brigtness;
+    double m_threshold_entry;
+    double m_threshold_exit;
+    double m_threshold_exit_2nd;
+    cv::Mat m_that_gray;
+    StageChangeDetector m_change{ { ChangeMode::mean_diff | ChangeMode::sad,
+                                    0 } }; ///< of the strip
+};
+
+
+class StageFrame : public async::Model<StageFrame>
+{
+public:
+    explicit StageFrame(const StationId& station);
+    ~StageFrame();
+
+    void Initiate() noexcept override;
+
+    std::shared_ptr<ds::camera::Camera> GetCamera() const
+    { return m_camera;
+    }
+    const StationId& GetStation() const { return m_station; }
+
+    asio::awaitable<std::shared_ptr<const ds::camera::Frame>> GetAsyncFrame(
+      async::Lifeguard guard) const;
+    /// First frame exposed entirely after `since`, by camera frame id: the
+    /// first frame taken after it may have been exposed in part before, any
+    /// later id was not. nullptr once *cancel is set, or when no such frame
+    /// comes within FRAME_AFTER_TIMEOUT.
+    asio::awaitable<std::shared_ptr<const ds::camera::Frame>>
+    GetAsyncFrameAfter(async::Lifeguard guard,
+                       StageEvents::Clock::time_point since,
+                       const bool* cancel = nullptr) const;
+    /// Call once the stage reported idle (StageMove::GetNotBusy).
+    asio::awaitable<std::shared_ptr<const ds::camera::Frame>>
+    GetAsyncFrameAfterMove(async::Lifeguard guard,
+                           const bool* cancel = nullptr) const;
+    asio::awaitable<std::shared_ptr<const ds::camera::Frame>>
+    GetAsyncFrameAfterChange(async::Lifeguard guard,
+                             const bool* cancel = nullptr) const;
+
+    void SetExposureTime(std::chrono::nanoseconds exposure)
+    {
+        m_camera->SetExposureTime(exposure);
+        m_events->MarkParamChanged();
+    }
+
+
+    /// The camera recorder writes the .dsf, gname its table. Only with
+    /// record_format "dsr" the recording goes through StageRecorder into
+    /// <path>.dsr, which has no groups, and pre/post-trigger frames apply.
+    void ArmRecording(std::shared_ptr<ds::camera::RecordFilter> filter,
+                      const std::filesystem::path& path,
+                      const std::string& gname,
+                      const RecordOptions& options = {});
+
+    void StopRecording();
+  
+    ds::camera::CameraState GetState() const noexcept
+    {
+        if (m_recorder and m_recorder->IsActive())
+            return m_recorder->GetState();
+        return m_camera->GetState();
+    }
+    RecorderMemory GetRecorderMemory() const
+    {
+        return m_recorder ? m_recorder->GetMemory() : RecorderMemory{};
+    }
+    /// Arrival time of the last frame of this instance and the running
+    /// frame interval (see GetAsyncFrame).
+    StageEvents::Clock::time_point GetLastDelivered() const
+    {
+        return m_delivered;
+    }
+    StageEvents::Clock::duration GetFrameInterval() const { return m_interval; }
+    std::string GetCameraName() const noexcept
+    {
+        return m_camera->GetCameraName();
+    }
+
+private:
+    StationId    m_station;
+    StageEvents* m_events;
+    std::shared_ptr<ds::camera::Camera> m_camera;
+    std::shared_ptr<const ds::camera::Frame> m_frame;
+    std::shared_ptr<StageRecorder> m_recorder; ///< created on first use
+    async::RawCondition m_cond;
+
+    // delivery time of the last frame and the running frame interval
+    mutable StageEvents::Clock::time_point m_delivered;
+    mutable StageEvents::Clock::duration   m_interval;
+    //static std::shared_ptr<ds::camera::Camera> s_mainCamera;
+};
+
+class StageLED : public async::Model<StageLED>
+{
+public:
+    explicit StageLED(const StationId& station)
+        :m_stage(ui::CreateAsyncModel<Stage>(station))
+    {
+
+    }
+    ~StageLED(){};
+
+    asio::awaitable<void> SetLEDCh(async::Lifeguard guard, uint32_t value)
+    {
+        co_await m_stage->SetLEDCh(guard(), value);
+        co_return;
+    }
+    asio::awaitable<void> SetLEDPeriod(async::Lifeguard guard, uint32_t value)
+    {
+        co_await m_stage->SetLEDPeriod(guard(), value);
+        co_return;
+    }
+    asio::awaitable<void> SetLEDCamOff(async::Lifeguard guard, uint32_t value)
+    {
+        co_await m_stage->SetLEDCamOff(guard(), value);
+        co_return;
+    }
+    asio::awaitable<void> SetLEDOn(async::Lifeguard guard, uint32_t value)
+    {
+        co_await m_stage->SetLEDOn(guard(), value);
+        co_return;
+    }
+
+
+private:
+    std::shared_ptr<Stage> m_stage;
+    async::RawCondition m_cond;
+};
 } // namespace ds
\ No newline at end of file
@@ -0,0 +1,204 @@
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+#if defined(__x86_64__) || defined(_M_X64) // SSE2 and 64 bit moves
+#include <emmintrin.h>
+#define STAGE_HISTOGRAM_SSE2 1
+#endif
+#include "stage_histogram.h"
+
+namespace ds::depthscan {
+
+namespace {
+/// 64 bit like the result, 8 KiB a band still stays in L1.
+struct HistogramTables
+{
+    alignas(64) uint64_t bins[HISTOGRAM_TABLES][HISTOGRAM_BINS];
+};
+} // namespace
+
+/// Pixels [begin, end) of a row on the step grid, pixel k of the run into
+/// table k % HISTOGRAM_TABLES.
+static void
+AccumulateRow(const uint8_t* row,
+              const uint8_t* mask,
+              int begin,
+              int end,
+              int step,
+              uint32_t weight,
+              HistogramTables& tables)
+{
+    auto& t = tables.bins;
+    int   x = begin;
+#ifdef STAGE_HISTOGRAM_SSE2
+    // 16 pixels per load; the bins are scattered, so the bytes are taken
+    // out of the two 64 bit halves of the register, not read again
+    auto count16 = [&](__m128i v) {
+        uint64_t lo = uint64_t(_mm_cvtsi128_si64(v));
+        uint64_t hi = uint64_t(_mm_cvtsi128_si64(_mm_unpackhi_epi64(v, v)));
+        for (int k = 0; k < 8; k++, lo >>= 8)
+            t[k % HISTOGRAM_TABLES][lo & 0xff] += weight;
+        for (int k = 0; k < 8; k++, hi >>= 8)
+            t[k % HISTOGRAM_TABLES][hi & 0xff] += weight;
+    };
+    if (step == 1) {
+        const __m128i zero = _mm_setzero_si128();
+        for (; x + 16 <= end; x += 16) {
+            const __m128i v =
+              _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + x));
+            if (not mask) {
+                count16(v);
+                continue;
+            }
+            // a fully masked block is skipped, a fully open one counted
+            // whole, a partial one pixel by pixel
+            const __m128i m =
+              _mm_loadu_si128(reinterpret_cast<const __m128i*>(mask + x));
+            const int skipped = _mm_movemask_epi8(_mm_cmpeq_epi8(m, zero));
+            if (skipped == 0xffff)
+                continue;
+            if (skipped == 0) {
+                count16(v);
+                continue;
+            }
+            for (int k = 0; k < 16; k++) {
+                if (mask[x + k])
+                    t[k % HISTOGRAM_TABLES][row[x + k]] += weight;
+            }
+        }
+    }
+#endif
+    if (not mask and step == 1) {
+        for (; x + 4 <= end; x += 4) {
+            t[0][row[x]] += weight;
+            t[1][row[x + 1]] += weight;
+            t[2][row[x + 2]] += weight;
+            t[3][row[x + 3]] += weight;
+        }
+        for (; x < end; x++)
+            t[0][row[x]] += weight;
+        return;
+    }
+    int k = 0;
+    for (; x < end; x += step) {
+        if (not mask or mask[x])
+            t[k][row[x]] += weight;
+        k = (k + 1) % HISTOGRAM_TABLES;
+    }
+}
+static int
+AlignToStep(int x, int step)
+{
+    return ((x + step - 1) / step) * step;
+}
+
+std::array<uint64_t, HISTOGRAM_BINS>
+GrayHistogram::Cumulative() const
+{
+    std::array<uint64_t, HISTOGRAM_BINS> cumulative{};
+    uint64_t                             sum = 0;
+    for (int i = 0; i < HISTOGRAM_BINS; i++) {
+        sum += bins[i];
+        cumulative[i] = sum;
+    }
+    return cumulative;
+}
+uint64_t
+GrayHistogram::CountBelow(int level) const
+{
+    level = std::clamp(level, 0, HISTOGRAM_BINS);
+    uint64_t sum = 0;
+    for (int i = 0; i < level; i++)
+        sum += bins[i];
+    return sum;
+}
+int
+GrayHistogram::Percentile(double fraction) const
+{
+    if (count == 0)
+        return 0;
+    const double target = std::clamp(fraction, 0.0, 1.0) * double(count);
+    uint64_t     sum = 0;
+    for (int i = 0; i < HISTOGRAM_BINS; i++) {
+        sum += bins[i];
+        if (sum and double(sum) >= target)
+            return i;
+    }
+    return HISTOGRAM_BINS - 1;
+}
+
+GrayHistogram
+ComputeHistogram(const cv::Mat& gray, const HistogramOptions& options)
+{
+    if (gray.type() != CV_8UC1) {
+        throw std::invalid_argument("histogram needs a CV_8UC1 image");
+    }
+    if (not options.mask.empty() and
+        (options.mask.type() != CV_8UC1 or
+         options.mask.size() != gray.size())) {
+        throw std::invalid_argument("histogram mask must match the image");
+    }
+    const int step = std::max(options.subsample, 1);
+    const cv::Rect roi =
+      options.roi & cv::Rect(0, 0, gray.cols, gray.rows);
+    const uint32_t weight = std::max(options.roi_weight, 1u);
+
+    // column split of a row into [0, roi) [roi] [roi, cols), on the grid
+    const int roi_begin = AlignToStep(roi.x, step);
+    const int roi_end =
+      std::min(AlignToStep(roi.x + roi.width, step), gray.cols);
+
+    // 1. bands of sampled rows, one only for small frames
+    const int rows = (gray.rows + step - 1) / step;
+    const int64_t pixels = int64_t(rows) * ((gray.cols + step - 1) / step);
+    int bands = 1;
+    if (pixels >= HISTOGRAM_PARALLEL_PIXELS) {
+        bands = options.threads > 0 ? options.threads : cv::getNumThreads();
+        bands = std::clamp(bands, 1, std::max(rows, 1));
+    }
+
+    // 2. every band counts into its own tables
+    std::vector<HistogramTables> tables(std::size_t(bands), HistogramTables{});
+    auto count_band = [&](int band) {
+        auto&     local = tables[std::size_t(band)];
+        const int first = int(int64_t(rows) * band / bands);
+        const int last = int(int64_t(rows) * (band + 1) / bands);
+        for (int i = first; i < last; i++) {
+            const int      y = i * step;
+            const uint8_t* row = gray.ptr<uint8_t>(y);
+            const uint8_t* mask =
+              options.mask.empty() ? nullptr : options.mask.ptr<uint8_t>(y);
+            if (roi.empty() or y < roi.y or y >= (roi.y + roi.height)) {
+                AccumulateRow(row, mask, 0, gray.cols, step, 1, local);
+            } else {
+                AccumulateRow(row, mask, 0, roi_begin, step, 1, local);
+                AccumulateRow(
+                  row, mask, roi_begin, roi_end, step, weight, local);
+                AccumulateRow(
+                  row, mask, roi_end, gray.cols, step, 1, local);
+            }
+        }
+    };
+    if (bands == 1) {
+        count_band(0);
+    } else {
+        cv::parallel_for_(cv::Range(0, bands), [&](const cv::Range& range) {
+            for (int band = range.start; band < range.end; band++)
+                count_band(band);
+        });
+    }
+
+    // 3. merge
+    GrayHistogram histogram;
+    for (const auto& local : tables) {
+        for (int k = 0; k < HISTOGRAM_TABLES; k++) {
+            for (int i = 0; i < HISTOGRAM_BINS; i++)
+                histogram.bins[i] += local.bins[k][i];
+        }
+    }
+    for (int i = 0; i < HISTOGRAM_BINS; i++)
+        histogram.count += histogram.bins[i];
+    return histogram;
+}
+
+} // namespace ds::depthscan
@@ -0,0 +1,47 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <opencv2/opencv.hpp>
+
+namespace ds::depthscan {
+
+constexpr int HISTOGRAM_BINS = 256;
+constexpr int HISTOGRAM_TABLES = 4; // interleaved sub-histograms per pass
+constexpr int HISTOGRAM_PARALLEL_PIXELS = 1 << 20; // sampled pixels before
+                                                   // rows are split up
+
+struct HistogramOptions
+{
+    int subsample{ 1 };       ///< use every n-th pixel of every n-th row
+    cv::Rect roi{};           ///< weighted region, empty for none
+    uint32_t roi_weight{ 1 }; ///< count of each pixel inside roi
+    cv::Mat mask{};           ///< CV_8UC1 of the image size, 0 skips a pixel
+    int threads{ 0 };         ///< row bands, 0 for cv::getNumThreads()
+};
+
+/// Integer 8-bit histogram. Weighted pixels count roi_weight times, in the
+/// bins and in count alike; 64 bit bins hold any roi_weight on any frame.
+struct GrayHistogram
+{
+    std::array<uint64_t, HISTOGRAM_BINS> bins{};
+    uint64_t count{ 0 };
+
+    /// Entry i holds the count of bins [0, i].
+    std::array<uint64_t, HISTOGRAM_BINS> Cumulative() const;
+    /// Count of bins [0, level).
+    uint64_t CountBelow(int level) const;
+    /// Lowest level with at least fraction (0..1) of the count at or below
+    /// it, 0 for an empty histogram.
+    int Percentile(double fraction) const;
+};
+
+/// Histogram of an 8-bit gray image. Consecutive pixels go to separate
+/// sub-histograms, so runs of one level do not wait on their own
+/// increment. Unsampled rows are read 16 pixels a load with SSE2, and
+/// blocks a mask closes completely are skipped. Large frames are split
+/// into row bands that are counted in parallel and merged, so no band
+/// shares a table with another.
+GrayHistogram
+ComputeHistogram(const cv::Mat& gray, const HistogramOptions& options = {});
+
+} // namespace ds::depthscan
@@ -0,0 +1,240 @@
+#include <optional>
+#include <stdexcept>
+#include <asio/experimental/awaitable_operators.hpp>
+#include <spdlog/spdlog.h>
+#include "stage_illumination.h"
+#include "stage_recorder.h"
+#include "stage_utility.h"
+
+namespace ds::depthscan {
+
+using namespace asio::experimental::awaitable_operators;
+
+StageIllumination::StageIllumination(const StationId& station)
+  : m_station(station)
+  , m_stage(ui::CreateAsyncModel<Stage>(station))
+  , m_frame(ui::CreateAsyncModel<StageFrame>(station))
+  , m_running(false)
+  , m_stop(false)
+  , m_run(0)
+  , m_sequence(0)
+  , m_mixed(0)
+  , m_overrun(0)
+{
+}
+StageIllumination::~StageIllumination()
+{
+}
+void
+StageIllumination::Initiate() noexcept
+{
+}
+
+void
+StageIllumination::SetChannels(uint32_t channel_mask)
+{
+    std::vector<Pattern> patterns;
+    for (int ch = 0; ch < LED_CHANNELS; ch++) {
+        if (channel_mask & (1u << ch)) {
+            Pattern pattern{};
+            pattern[ch] = LED_LEVEL_ON;
+            patterns.push_back(pattern);
+        }
+    }
+    SetPatterns(patterns);
+}
+void
+StageIllumination::SetPatterns(const std::vector<Pattern>& patterns)
+{
+    m_patterns = patterns;
+    m_writes.assign(m_patterns.size(), {});
+
+    // only the channels that differ from the previous step are written
+    for (std::size_t i = 0; i < m_patterns.size(); i++) {
+        const auto& prev =
+          m_patterns[(i + m_patterns.size() - 1) % m_patterns.size()];
+        const auto& next = m_patterns[i];
+        for (int ch = 0; ch < LED_CHANNELS; ch++) {
+            if (next[ch] != prev[ch] or m_patterns.size() == 1)
+                m_writes[i].push_back(Stage::LEDLevelWord(ch, next[ch]));
+        }
+    }
+}
+
+asio::awaitable<void>
+StageIllumination::StartSequence(async::Lifeguard guard)
+{
+    if (m_running or m_patterns.empty())
+        co_return;
+
+    m_stop = false;
+    m_running = true;
+    m_run++;
+    m_sequence = 0;
+    m_mixed = 0;
+    m_overrun = 0;
+    m_streams.assign(m_patterns.size(), {});
+
+    // the first step sets every channel, the old state is unknown
+    std::vector<uint32_t> first;
+    for (int ch = 0; ch < LED_CHANNELS; ch++)
+        first.push_back(Stage::LEDLevelWord(ch, m_patterns[0][ch]));
+    co_await m_stage->WriteLEDWords(guard(), first);
+
+    Start<&StageIllumination::Sequence>(NewLife());
+    if (not m_record_folder.empty())
+        Start<&StageIllumination::Record>(NewLife());
+    co_return;
+}
+asio::awaitable<void>
+StageIllumination::StopSequence(async::Lifeguard guard)
+{
+    m_stop = true;
+    m_cond.Notify();
+    asio::steady_timer timer(co_await asio::this_coro::executor,
+                             LED_STOP_TIMEOUT);
+    auto stopped =
+      co_await (m_cond.AsyncWait(guard(), [this]() { return not m_running; }) ||
+                timer.async_wait(asio::use_awaitable));
+    if (stopped.index() != 0)
+        spdlog::error("illumination: sequence still running after {} s",
+                      LED_STOP_TIMEOUT.count());
+    co_await m_stage->SetLEDCh(guard(), 65535); // all on, see InitConfig
+    co_return;
+}
+
+asio::awaitable<void>
+StageIllumination::Sequence(async::Lifeguard guard)
+{
+    const std::size_t steps = m_patterns.size();
+    std::size_t step = 0;
+    auto since = StageEvents::Clock::now(); // the first pattern is written
+    std::optional<uint64_t> last;           // camera id of the last frame
+
+    while (not m_stop) {
+        // 1. the frame in flight at the switch is skipped, see the class;
+        //    a single pattern is never switched, every frame counts
+        auto frame =
+          steps == 1
+            ? co_await m_frame->GetAsyncFrame(guard())
+            : co_await m_frame->GetAsyncFrameAfter(guard(), since, &m_stop);
+        if (not frame or m_stop)
+            continue;
+        const uint64_t id = CameraFrameId(*frame);
+        if (last and id > *last + 1)
+            m_mixed += id - *last - 1;
+        last = id;
+
+        // 2. tagged with the step it was exposed under
+        Route({ frame, int(step), m_sequence, m_frame->GetLastDelivered() });
+        m_sequence++;
+        if (steps == 1)
+            continue;
+
+        // 3. the next step, from after the writes
+        step = (step + 1) % steps;
+        co_await m_stage->WriteLEDWords(guard(), m_writes[step]);
+        since = StageEvents::Clock::now();
+    }
+
+    m_running = false;
+    m_cond.Notify();
+    spdlog::info("illumination: {} frames, {} mixed, {} overrun",
+                 m_sequence,
+                 m_mixed,
+                 m_overrun);
+    co_return;
+}
+void
+StageIllumination::Route(ChannelFrame&& frame)
+{
+    auto& stream = m_streams[std::size_t(frame.channel)];
+    if (stream.size() >= LED_STREAM_DEPTH) {
+        stream.pop_front();
+        m_overrun++;
+    }
+    stream.push_back(std::move(frame));
+    m_cond.Notify();
+}
+
+asio::awaitable<ChannelFrame>
+StageIllumination::GetAsyncChannelFrame(async::Lifeguard guard, int channel)
+{
+    if (channel < 0 or channel >= int(m_streams.size()))
+        throw std::out_of_range("no such illumination step");
+
+    co_await m_cond.AsyncWait(guard(), [this, channel]() {
+        return not m_streams[channel].empty() or not m_running;
+    });
+    if (m_streams[channel].empty())
+        co_return ChannelFrame{};
+
+    ChannelFrame frame = std::move(m_streams[channel].front());
+    m_streams[channel].pop_front();
+    co_return frame;
+}
+
+asio::awaitable<void>
+StageIllumination::Record(async::Lifeguard guard)
+{
+    const uint32_t run = m_run;
+    const auto     started = StageEvents::Clock::now();
+    auto current = [&]() { return m_running and run == m_run; };
+
+    // 1. one writer per step, the ring budget shared between them
+    std::vector<std::unique_ptr<StageFrameWriter>> writers;
+    try {
+        std::filesystem::create_directories(m_record_folder);
+        const auto stamp = StageDateTimeFormat().GetTime();
+        const auto options = RecordWriterOptions(m_station);
+        for (std::size_t i = 0; i < m_streams.size(); i++) {
+            writers.push_back(std::make_unique<StageFrameWriter>(
+              m_record_folder / (stamp + "_step" + std::to_string(i) +
+                                 RECORD_EXTENSION),
+              RecordOptions{}.max_bytes / m_streams.size(),
+              options));
+        }
+    } catch (const std::exception& e) {
+        spdlog::error("illumination: no recording, {}", e.what());
+        co_return;
+    }
+
+    // 2. drain every stream into its writer until the sequence stops
+    while (true) {
+        co_await m_cond.AsyncWait(guard(), [&]() {
+            if (not current())
+                return true;
+            for (const auto& stream : m_streams) {
+                if (not stream.empty())
+                    return true;
+            }
+            return false;
+        });
+        if (run != m_run)
+            break; // a new start reset the streams
+        for (std::size_t i = 0; i < m_streams.size(); i++) {
+            for (auto& item : m_streams[i]) {
+                writers[i]->Push(
+                  { item.frame,
+                    CameraFrameId(*item.frame),
+                    std::chrono::duration_cast<std::chrono::microseconds>(
+                      item.delivered - started) });
+            }
+            m_streams[i].clear();
+        }
+        if (not m_running)
+            break;
+    }
+
+    for (std::size_t i = 0; i < writers.size(); i++) {
+        writers[i]->Close();
+        spdlog::info("illumination: step {} {} frames, {} dropped, {}",
+                     i,
+                     writers[i]->GetWritten(),
+                     writers[i]->GetDropped(),
+                     writers[i]->GetPath().string());
+    }
+    co_return;
+}
+
+} // namespace ds::depthscan
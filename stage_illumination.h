@@ -0,0 +1,100 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <vector>
+#include "async.h"
+#include "ui.h"
+#include "stage_base.h"
+#include "stage_frame.h"
+#include "stage_writer.h"
+
+namespace ds::depthscan {
+
+constexpr int  LED_CHANNELS = 4;      // LED_Ch::LED_CH1 ~ LED_CH4
+constexpr auto LED_LEVEL_ON = 0xFFFE; // what SetLEDCh(65535) writes
+// a sequence blocked on the camera gives up after FRAME_AFTER_TIMEOUT
+constexpr auto LED_STOP_TIMEOUT = std::chrono::seconds(3);
+constexpr auto LED_STREAM_DEPTH = 16; // frames held per step
+
+/// Frame of a multiplexed run with the pattern it was exposed under.
+struct ChannelFrame
+{
+    std::shared_ptr<const ds::camera::Frame> frame; ///< nullptr once stopped
+    int                                      channel{ -1 }; ///< step index
+    uint64_t                       sequence{ 0 }; ///< run frames before it
+    StageEvents::Clock::time_point delivered{};
+};
+
+/// Alternates LED patterns frame by frame and routes every frame, tagged
+/// with its step, into a bounded stream per step. The switch is timed by
+/// the host, so the frame in flight when the writes finish may be exposed
+/// under both patterns; it is skipped, counted as mixed, and the step
+/// holds until the next frame by camera id. That frame started exposing
+/// after the writes as long as exposure and readout fit in one frame
+/// interval. Each switch so discards one frame: with n steps a step gets
+/// one frame in 2n, half the rate of a switch that needed no skip.
+class StageIllumination : public async::Model<StageIllumination>
+{
+public:
+    using Pattern = std::array<uint16_t, LED_CHANNELS>; ///< level per channel
+
+    explicit StageIllumination(const StationId& station);
+    ~StageIllumination();
+
+    void Initiate() noexcept override;
+
+    /// One step per set bit of channel_mask, that channel alone fully on.
+    void SetChannels(uint32_t channel_mask);
+    void SetPatterns(const std::vector<Pattern>& patterns);
+    int  GetStepCount() const { return int(m_patterns.size()); }
+
+    asio::awaitable<void> StartSequence(async::Lifeguard guard);
+    /// Stops after the current frame, or LED_STOP_TIMEOUT at most, and
+    /// turns every channel back on.
+    asio::awaitable<void> StopSequence(async::Lifeguard guard);
+    bool                  IsRunning() const { return m_running; }
+
+    /// Next frame of one step, in arrival order; frame is nullptr once
+    /// the sequence stopped and the stream is empty. A full stream drops
+    /// its oldest frame (GetOverrunCount). Throws for an unknown step.
+    asio::awaitable<ChannelFrame> GetAsyncChannelFrame(async::Lifeguard guard,
+                                                       int channel);
+    /// Each step of the next sequences is written to
+    /// <folder>/<time>_step<i>.dsr; empty for none. The writer is then
+    /// the consumer of the streams.
+    void SetRecordFolder(std::filesystem::path folder)
+    {
+        m_record_folder = std::move(folder);
+    }
+
+    uint64_t GetFrameCount() const { return m_sequence; }
+    uint64_t GetMixedCount() const { return m_mixed; }
+    uint64_t GetOverrunCount() const { return m_overrun; }
+
+private:
+    asio::awaitable<void> Sequence(async::Lifeguard guard);
+    asio::awaitable<void> Record(async::Lifeguard guard);
+    void                  Route(ChannelFrame&& frame);
+
+    StationId m_station;
+    std::shared_ptr<Stage>      m_stage;
+    std::shared_ptr<StageFrame> m_frame;
+    async::RawCondition         m_cond;
+
+    std::vector<Pattern>               m_patterns;
+    std::vector<std::vector<uint32_t>> m_writes; ///< into step i, precomputed
+    std::vector<std::deque<ChannelFrame>> m_streams; ///< per step
+    std::filesystem::path                 m_record_folder;
+
+    bool     m_running;
+    bool     m_stop;
+    uint32_t m_run;      ///< bumped per start
+    uint64_t m_sequence; ///< frames under a single pattern
+    uint64_t m_mixed;    ///< frames skipped across a pattern change
+    uint64_t m_overrun;  ///< frames pushed out of a full stream
+};
+
+} // namespace ds::depthscan
@@ -0,0 +1,101 @@
+#include <utility>
+#include <spdlog/spdlog.h>
+#include "stage_index.h"
+
+namespace ds::depthscan {
+
+StageFrameIndex::StageFrameIndex(const std::filesystem::path& path)
+  : m_path(path)
+  , m_file(path, std::ios::binary | std::ios::trunc)
+  , m_closing(false)
+{
+    if (not m_file.is_open()) {
+        spdlog::error("cannot open index {}", path.string());
+        m_closing = true;
+        return;
+    }
+    RecordIndexHeader header;
+    m_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    m_pending.reserve(INDEX_FLUSH);
+    m_thread = std::thread(&StageFrameIndex::Work, this);
+}
+StageFrameIndex::~StageFrameIndex()
+{
+    Close();
+}
+
+void
+StageFrameIndex::Append(const RecordIndexEntry& entry)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_closing)
+            return;
+        m_pending.push_back(entry);
+        if (m_pending.size() < INDEX_FLUSH)
+            return;
+        m_queue.push_back(std::exchange(m_pending, {}));
+        m_pending.reserve(INDEX_FLUSH);
+    }
+    m_wake.notify_one();
+}
+void
+StageFrameIndex::Close()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_closing and not m_thread.joinable())
+            return;
+        if (not m_pending.empty())
+            m_queue.push_back(std::exchange(m_pending, {}));
+        m_closing = true;
+    }
+    m_wake.notify_one();
+    if (m_thread.joinable())
+        m_thread.join();
+    if (m_file.is_open())
+        m_file.close();
+}
+void
+StageFrameIndex::Work()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_wake.wait(lock, [this]() { return m_closing or not m_queue.empty(); });
+        if (m_queue.empty())
+            return; // closing and drained
+        auto batch = std::move(m_queue.front());
+        m_queue.pop_front();
+
+        lock.unlock();
+        m_file.write(reinterpret_cast<const char*>(batch.data()),
+                     std::streamsize(batch.size() * sizeof(RecordIndexEntry)));
+        m_file.flush();
+        if (not m_file)
+            spdlog::error("index write failed: {}", m_path.string());
+        lock.lock();
+    }
+}
+
+std::vector<RecordIndexEntry>
+StageFrameIndex::Load(const std::filesystem::path& path)
+{
+    std::vector<RecordIndexEntry> entries;
+    std::ifstream                 file(path, std::ios::binary);
+    RecordIndexHeader             header;
+    if (not file.read(reinterpret_cast<char*>(&header), sizeof(header)) or
+        header.magic != INDEX_MAGIC or header.version != INDEX_VERSION)
+        return entries;
+
+    std::error_code ec;
+    auto size = std::filesystem::file_size(path, ec);
+    if (ec or size < sizeof(header))
+        return entries;
+    // a partial trailing entry from an interrupted write is ignored
+    entries.resize((size - sizeof(header)) / sizeof(RecordIndexEntry));
+    file.read(reinterpret_cast<char*>(entries.data()),
+              std::streamsize(entries.size() * sizeof(RecordIndexEntry)));
+    return entries;
+}
+
+} // namespace ds::depthscan
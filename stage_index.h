@@ -0,0 +1,78 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ds::depthscan {
+
+constexpr uint32_t INDEX_MAGIC     = 0x49525344; // "DSRI"
+constexpr uint32_t INDEX_VERSION   = 2; // frame is the camera frame id
+constexpr auto     INDEX_EXTENSION = ".dsi";
+constexpr auto     INDEX_FLUSH     = 64; // entries buffered per write
+
+enum struct IndexEvent : uint8_t
+{
+    none = 0,
+    entry = 1, ///< sample reached the channel strip
+    exit = 2   ///< sample left
+};
+
+#pragma pack(push, 1)
+struct RecordIndexHeader
+{
+    uint32_t magic{ INDEX_MAGIC };
+    uint32_t version{ INDEX_VERSION };
+};
+/// One per frame the filter saw, recorded or not.
+struct RecordIndexEntry
+{
+    uint64_t frame;      ///< camera frame id, RecordFrameHeader::index
+    int64_t  timestamp;  ///< us since the filter was armed
+    float    brightness; ///< strip mean
+    float    motion;     ///< strip mean absolute difference to the last frame
+    uint8_t  event;      ///< IndexEvent
+    uint8_t  recorded;   ///< the filter let the frame through
+    uint16_t reserved{ 0 };
+};
+#pragma pack(pop)
+
+/// Side index of a recording, appended by the record filter as frames
+/// pass. Entries are buffered and every INDEX_FLUSH of them handed to the
+/// index's own writer thread, so the camera thread never waits on the
+/// disk; a run cut short still leaves everything up to the last batch.
+class StageFrameIndex
+{
+public:
+    explicit StageFrameIndex(const std::filesystem::path& path);
+    ~StageFrameIndex();
+
+    void Append(const RecordIndexEntry& entry);
+    void Close();
+
+    const std::filesystem::path& GetPath() const { return m_path; }
+
+    /// Entries of an index file, empty when it cannot be read.
+    static std::vector<RecordIndexEntry> Load(
+      const std::filesystem::path& path);
+
+private:
+    void Work();
+
+    std::filesystem::path m_path;
+    std::ofstream         m_file; ///< written by m_thread only
+
+    std::mutex                                m_mutex;
+    std::condition_variable                   m_wake;
+    std::vector<RecordIndexEntry>             m_pending; ///< being appended
+    std::deque<std::vector<RecordIndexEntry>> m_queue;   ///< for the thread
+    bool                                      m_closing;
+    std::thread                               m_thread;
+};
+
+} // namespace ds::depthscan
@@ -0,0 +1,411 @@
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <optional>
+#include <asio/experimental/awaitable_operators.hpp>
+#include <spdlog/spdlog.h>
+#include "stage_link.h"
+
+namespace ds::depthscan {
+
+using namespace asio::experimental::awaitable_operators;
+
+LinkRegion
+GetLinkRegion(uint32_t address)
+{
+    switch ((address >> 8) & 0xF) {
+        case 0:
+            return LinkRegion::sys;
+        case 1:
+            return LinkRegion::ds;
+        case 2:
+            return LinkRegion::stepper;
+        default:
+            return LinkRegion::other;
+    }
+}
+const char*
+GetLinkRegionName(LinkRegion region)
+{
+    switch (region) {
+        case LinkRegion::sys:
+            return "sys";
+        case LinkRegion::ds:
+            return "ds";
+        case LinkRegion::stepper:
+            return "stepper";
+        default:
+            return "other";
+    }
+}
+
+void
+LinkHistogram::Add(std::chrono::microseconds latency)
+{
+    const long long us = std::max<long long>(latency.count(), 1);
+    int idx = 0;
+    while ((idx + 1) < LINK_BUCKETS and (1ll << (idx + 1)) <= us)
+        idx++;
+    buckets[idx]++;
+    count++;
+    total += latency;
+    max = std::max(max, latency);
+}
+void
+LinkHistogram::Merge(const LinkHistogram& other)
+{
+    for (int i = 0; i < LINK_BUCKETS; i++)
+        buckets[i] += other.buckets[i];
+    count += other.count;
+    total += other.total;
+    max = std::max(max, other.max);
+}
+std::chrono::microseconds
+LinkHistogram::Percentile(double p) const
+{
+    if (count == 0)
+        return std::chrono::microseconds(0);
+
+    const double rank = std::clamp(p, 0.0, 1.0) * double(count);
+    double seen = 0.0;
+    for (int i = 0; i < LINK_BUCKETS; i++) {
+        if (buckets[i] == 0)
+            continue;
+        if ((seen + double(buckets[i])) >= rank) {
+            const double lo = double(1ll << i);
+            const double frac = (rank - seen) / double(buckets[i]);
+            const double us = std::min(lo + lo * frac, double(max.count()));
+            return std::chrono::microseconds((long long)std::llround(us));
+        }
+        seen += double(buckets[i]);
+    }
+    return max;
+}
+
+LinkRegionStats
+LinkStats::Total() const
+{
+    LinkRegionStats total;
+    for (const auto& region : regions) {
+        total.latency.Merge(region.latency);
+        total.reads += region.reads;
+        total.writes += region.writes;
+        total.words += region.words;
+        total.retries += region.retries;
+        total.timeouts += region.timeouts;
+        total.failures += region.failures;
+    }
+    return total;
+}
+
+double
+LinkBenchResult::TransactionsPerSecond() const
+{
+    if (elapsed.count() <= 0)
+        return 0.0;
+    return double(transactions) * 1e6 / double(elapsed.count());
+}
+double
+LinkBenchResult::BytesPerSecond() const
+{
+    if (elapsed.count() <= 0)
+        return 0.0;
+    return double(words * 4) * 1e6 / double(elapsed.count());
+}
+
+static asio::awaitable<std::optional<std::vector<uint32_t>>>
+ReadOnce(serial::Avalon& avalon,
+         async::Lifeguard guard,
+         uint32_t address,
+         uint32_t count,
+         std::chrono::milliseconds timeout)
+{
+    asio::steady_timer timer(co_await asio::this_coro::executor, timeout);
+    auto result = co_await (avalon.AsyncRead(guard(), address, count) ||
+                            timer.async_wait(asio::use_awaitable));
+    if (result.index() != 0)
+        co_return std::nullopt;
+    co_return std::get<0>(std::move(result));
+}
+static asio::awaitable<bool>
+WriteOnce(serial::Avalon& avalon,
+          async::Lifeguard guard,
+          uint32_t address,
+          const std::vector<uint32_t>& data,
+          std::chrono::milliseconds timeout)
+{
+    asio::steady_timer timer(co_await asio::this_coro::executor, timeout);
+    auto result = co_await (avalon.AsyncWrite(guard(), address, data) ||
+                            timer.async_wait(asio::use_awaitable));
+    co_return result.index() == 0;
+}
+
+StageLink::StageLink(std::shared_ptr<serial::Avalon> avalon,
+                     LinkOptions options)
+  : m_avalon(std::move(avalon))
+  , m_options(options)
+  , m_synced(true)
+  , m_window_start(Clock::now())
+  , m_window_busy(0)
+{
+}
+
+asio::awaitable<bool>
+StageLink::Resync(async::Lifeguard guard)
+{
+    const auto options = m_options;
+
+    // 1. a reply still under way lands and is discarded by the ping
+    auto timer = ds::async::Timer();
+    co_await timer.AsyncSleepFor(guard(), options.timeout);
+    asio::steady_timer ping_timer(co_await asio::this_coro::executor,
+                                  options.timeout);
+    auto ping = co_await (m_avalon->AsyncPing(guard()) ||
+                          ping_timer.async_wait(asio::use_awaitable));
+
+    // 2. in step again only if the known register reads back
+    bool synced = false;
+    if (ping.index() == 0) {
+        auto id = co_await ReadOnce(
+          *m_avalon, guard(), options.sync_address, 1, options.timeout);
+        synced = id and not id->empty() and id->front() == options.sync_value;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stats.resyncs++;
+    }
+    m_synced = synced;
+    if (synced)
+        spdlog::warn("link resync: in step again");
+    else
+        spdlog::error("link resync: failed, nothing is sent until it works");
+    co_return synced;
+}
+
+asio::awaitable<bool>
+StageLink::AsyncWrite(async::Lifeguard guard,
+                      uint32_t address,
+                      std::vector<uint32_t> data,
+                      LinkWrite kind)
+{
+    const auto options = m_options;
+    const auto start = Clock::now();
+    const int retries = kind == LinkWrite::idempotent ? options.retries : 0;
+    int attempts = 0;
+    int timeouts = 0;
+    bool done = false;
+
+    // a completed write is never re-sent, a timed out one only when
+    // sending it twice does no harm
+    while (not done and attempts <= retries) {
+        if (not m_synced and not co_await Resync(guard()))
+            break;
+        attempts++;
+        done = co_await WriteOnce(
+          *m_avalon, guard(), address, data, options.timeout);
+        if (not done) {
+            timeouts++;
+            m_synced = false;
+        }
+    }
+    Record(address, true, uint32_t(data.size()), start,
+           std::max(attempts, 1), timeouts, not done);
+    if (not done)
+        spdlog::error("link write 0x{:x} failed after {} timeouts{}",
+                      address,
+                      timeouts,
+                      kind == LinkWrite::once ? ", not retried" : "");
+    co_return done;
+}
+asio::awaitable<std::vector<uint32_t>>
+StageLink::AsyncRead(async::Lifeguard guard, uint32_t address, uint32_t count)
+{
+    const auto options = m_options;
+    const auto start = Clock::now();
+    int attempts = 0;
+    int timeouts = 0;
+    std::vector<uint32_t> data;
+
+    while (data.size() < count and attempts <= options.retries) {
+        if (not m_synced and not co_await Resync(guard()))
+            break;
+        attempts++;
+        auto result = co_await ReadOnce(
+          *m_avalon, guard(), address, count, options.timeout);
+        if (result) {
+            data = std::move(*result);
+        } else {
+            timeouts++;
+            m_synced = false;
+        }
+    }
+    const bool failed = data.size() < count;
+    Record(address, false, uint32_t(data.size()), start,
+           std::max(attempts, 1), timeouts, failed);
+    if (failed) {
+        spdlog::error("link read 0x{:x}: {} of {} words after {} attempts",
+                      address,
+                      data.size(),
+                      count,
+                      attempts);
+        data.clear();
+    }
+    co_return data;
+}
+asio::awaitable<void>
+StageLink::AsyncPing(async::Lifeguard guard)
+{
+    co_await m_avalon->AsyncPing(guard());
+    co_return;
+}
+
+asio::awaitable<LinkBenchResult>
+StageLink::Bench(async::Lifeguard guard,
+                 std::optional<uint32_t> write_address,
+                 uint32_t read_address,
+                 uint32_t read_words,
+                 int count)
+{
+    LinkBenchResult bench;
+    const auto begin = Clock::now();
+
+    for (int i = 0; i < count; i++) {
+        auto start = Clock::now();
+        if (write_address) {
+            co_await AsyncWrite(guard(),
+                                *write_address,
+                                { uint32_t(i) },
+                                LinkWrite::idempotent);
+            bench.latency.Add(
+              std::chrono::duration_cast<std::chrono::microseconds>(
+                Clock::now() - start));
+            bench.words += 1;
+            bench.transactions++;
+        }
+
+        start = Clock::now();
+        auto data = co_await AsyncRead(guard(), read_address, read_words);
+        bench.latency.Add(std::chrono::duration_cast<std::chrono::microseconds>(
+          Clock::now() - start));
+        bench.words += data.size();
+        if (data.size() < read_words)
+            bench.failures++;
+        bench.transactions++;
+    }
+    bench.elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      Clock::now() - begin);
+
+    spdlog::info("link bench: {} tx in {} us, {:.1f} tx/s, {:.1f} kB/s, "
+                 "{} failures",
+                 bench.transactions,
+                 bench.elapsed.count(),
+                 bench.TransactionsPerSecond(),
+                 bench.BytesPerSecond() / 1000.0,
+                 bench.failures);
+    spdlog::info("link bench: p50 {} us, p90 {} us, p99 {} us, max {} us",
+                 bench.latency.Percentile(0.50).count(),
+                 bench.latency.Percentile(0.90).count(),
+                 bench.latency.Percentile(0.99).count(),
+                 bench.latency.max.count());
+    LogStats();
+    co_return bench;
+}
+
+LinkStats
+StageLink::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    LinkStats stats = m_stats;
+    // a window that ran long without traffic reads as idle
+    const auto elapsed = Clock::now() - m_window_start;
+    if (elapsed >= 2 * m_options.window)
+        stats.utilisation = 0.0;
+    return stats;
+}
+void
+StageLink::LogStats() const
+{
+    const auto stats = GetStats();
+    for (int i = 0; i < LINK_REGIONS; i++) {
+        const auto& region = stats.regions[i];
+        if (region.latency.count == 0)
+            continue;
+        spdlog::info("link {}: {} rd, {} wr, {} words, p50 {} us, p99 {} us, "
+                     "{} retries, {} timeouts, {} failures",
+                     GetLinkRegionName(LinkRegion(i)),
+                     region.reads,
+                     region.writes,
+                     region.words,
+                     region.latency.Percentile(0.50).count(),
+                     region.latency.Percentile(0.99).count(),
+                     region.retries,
+                     region.timeouts,
+                     region.failures);
+    }
+    spdlog::info("link utilisation {:.1f}%, {} resyncs",
+                 stats.utilisation * 100.0,
+                 stats.resyncs);
+}
+void
+StageLink::ResetStats()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stats = LinkStats();
+    m_window_start = Clock::now();
+    m_window_busy = Clock::duration(0);
+}
+void
+StageLink::Record(uint32_t address,
+                  bool write,
+                  uint32_t words,
+                  Clock::time_point start,
+                  int attempts,
+                  int timeouts,
+                  bool failed)
+{
+    const auto now = Clock::now();
+    const auto latency =
+      std::chrono::duration_cast<std::chrono::microseconds>(now - start);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto& region = m_stats.regions[int(GetLinkRegion(address))];
+    region.latency.Add(latency);
+    if (write)
+        region.writes++;
+    else
+        region.reads++;
+    region.words += words;
+    region.retries += attempts - 1;
+    region.timeouts += timeouts;
+    if (failed)
+        region.failures++;
+
+    // 1. busy time of this window, 2. close the window once it is full
+    m_window_busy += now - start;
+    const auto elapsed = now - m_window_start;
+    if (elapsed >= m_options.window) {
+        m_stats.utilisation =
+          std::min(1.0, double(m_window_busy.count()) / elapsed.count());
+        m_window_start = now;
+        m_window_busy = Clock::duration(0);
+    }
+}
+
+std::shared_ptr<StageLink>
+GetStageLink(const std::string& name)
+{
+    static std::mutex s_mutex;
+    static std::map<std::string, std::shared_ptr<StageLink>> s_links;
+
+    std::lock_guard<std::mutex> lock(s_mutex);
+    auto& link = s_links[name];
+    if (not link) {
+        auto avalon = serial::GetAvalon(name);
+        if (not avalon)
+            return nullptr;
+        link = std::make_shared<StageLink>(avalon);
+    }
+    return link;
+}
+
+} // namespace ds::depthscan
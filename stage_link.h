@@ -0,0 +1,162 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+#include "async.h"
+#include "serial.h"
+
+namespace ds::depthscan {
+
+/// Register regions of the Avalon map, by address bits 8 ~ 11.
+enum struct LinkRegion : uint8_t
+{
+    sys,     ///< 0x000 ~ 0x0FF
+    ds,      ///< 0x100 ~ 0x1FF
+    stepper, ///< 0x200 ~ 0x2FF
+    other,
+    max
+};
+constexpr int LINK_REGIONS = int(LinkRegion::max);
+constexpr int LINK_BUCKETS = 24; // 1us ~ 16s, power of two buckets
+
+LinkRegion  GetLinkRegion(uint32_t address);
+const char* GetLinkRegionName(LinkRegion region);
+
+/// Round trip latency histogram, bucket i holds [2^i, 2^(i+1)) us.
+struct LinkHistogram
+{
+    std::array<uint64_t, LINK_BUCKETS> buckets{};
+    uint64_t count{ 0 };
+    std::chrono::microseconds total{ 0 };
+    std::chrono::microseconds max{ 0 };
+
+    void Add(std::chrono::microseconds latency);
+    void Merge(const LinkHistogram& other);
+    /// p in [0, 1], interpolated inside the bucket
+    std::chrono::microseconds Percentile(double p) const;
+};
+
+struct LinkRegionStats
+{
+    LinkHistogram latency;
+    uint64_t      reads{ 0 };
+    uint64_t      writes{ 0 };
+    uint64_t      words{ 0 };    ///< payload words moved
+    uint64_t      retries{ 0 };
+    uint64_t      timeouts{ 0 };
+    uint64_t      failures{ 0 }; ///< calls that gave up after the retries
+};
+
+struct LinkStats
+{
+    std::array<LinkRegionStats, LINK_REGIONS> regions{};
+    double   utilisation{ 0.0 }; ///< busy share of the last window, 0 ~ 1
+    uint64_t resyncs{ 0 };       ///< after timeouts, failed ones included
+
+    LinkRegionStats Total() const;
+};
+
+struct LinkOptions
+{
+    std::chrono::milliseconds timeout{ 200 };  ///< per attempt
+    int                       retries{ 2 };    ///< extra attempts
+    std::chrono::milliseconds window{ 1000 };  ///< utilisation window
+    uint32_t sync_address{ 0x000 };      ///< read back after a resync
+    uint32_t sync_value{ 0xabcd1234 };   ///< what it holds, the SYS_ID
+};
+
+/// Whether a timed out write may be sent again. Only plain register
+/// values are; a start bit or a latch would fire twice.
+enum struct LinkWrite : uint8_t
+{
+    once,
+    idempotent
+};
+
+struct LinkBenchResult
+{
+    int                       transactions{ 0 };
+    uint64_t                  words{ 0 };
+    uint64_t                  failures{ 0 };
+    std::chrono::microseconds elapsed{ 0 };
+    LinkHistogram             latency;
+
+    double TransactionsPerSecond() const;
+    double BytesPerSecond() const;
+};
+
+/// serial::Avalon with per call timeouts, bounded retries and latency
+/// accounting. A read that still comes back short after the retries
+/// returns an empty vector, like a failed Avalon read; callers keep their
+/// own empty checks instead of spinning on the link.
+///
+/// A timed out transaction may still be answered. Its late reply must not
+/// pass for the answer of the next one, so a timeout marks the link out
+/// of sync, and nothing more is sent until a resync drained it and read
+/// back sync_value. Reads are retried; writes only when idempotent.
+class StageLink
+{
+public:
+    explicit StageLink(std::shared_ptr<serial::Avalon> avalon,
+                       LinkOptions options = {});
+
+    /// False when the write did not go through; a start or stop bit may
+    /// or may not have reached the register then.
+    asio::awaitable<bool> AsyncWrite(async::Lifeguard guard,
+                                     uint32_t address,
+                                     std::vector<uint32_t> data,
+                                     LinkWrite kind = LinkWrite::once);
+    asio::awaitable<std::vector<uint32_t>> AsyncRead(async::Lifeguard guard,
+                                                     uint32_t address,
+                                                     uint32_t count);
+    asio::awaitable<void> AsyncPing(async::Lifeguard guard);
+
+    /// Read bursts, alternating with a write when a write address is
+    /// given, logs throughput and percentiles. The write address must be a
+    /// scratch register nothing else uses.
+    asio::awaitable<LinkBenchResult> Bench(
+      async::Lifeguard guard,
+      std::optional<uint32_t> write_address,
+      uint32_t read_address,
+      uint32_t read_words,
+      int count);
+
+    LinkStats   GetStats() const;
+    void        ResetStats();
+    void        LogStats() const; ///< one line per region with traffic
+    LinkOptions GetOptions() const { return m_options; }
+    void        SetOptions(const LinkOptions& options) { m_options = options; }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    /// Waits out a late reply, pings and reads back sync_value.
+    asio::awaitable<bool> Resync(async::Lifeguard guard);
+
+    void Record(uint32_t address,
+                bool write,
+                uint32_t words,
+                Clock::time_point start,
+                int attempts,
+                int timeouts,
+                bool failed);
+
+    std::shared_ptr<serial::Avalon> m_avalon;
+    LinkOptions                     m_options;
+    bool                            m_synced; ///< false after a timeout
+
+    mutable std::mutex m_mutex;
+    LinkStats          m_stats;
+    Clock::time_point  m_window_start;
+    Clock::duration    m_window_busy;
+};
+
+/// One StageLink per Avalon port, shared by every Stage on that port.
+std::shared_ptr<StageLink> GetStageLink(const std::string& name);
+
+} // namespace ds::depthscan
@@ -0,0 +1,259 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <spdlog/spdlog.h>
+#include "stage_logsession.h"
+#include "stage_settings.h"
+
+namespace ds::depthscan {
+
+namespace fs = std::filesystem;
+
+namespace {
+/// Deletes retired runs below root on its own thread, on every Wake and
+/// otherwise every LOG_RETENTION_PERIOD.
+class LogRetention
+{
+public:
+    explicit LogRetention(const fs::path& root)
+      : m_root(root)
+      , m_thread(&LogRetention::Run, this)
+    {
+    }
+    ~LogRetention()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cv.notify_one();
+        if (m_thread.joinable())
+            m_thread.join();
+    }
+    void Wake()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_wake = true;
+        }
+        m_cv.notify_one();
+    }
+
+private:
+    void Run()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (not m_stop) {
+            m_wake = false;
+            lock.unlock();
+            Sweep();
+            lock.lock();
+            m_cv.wait_for(lock, LOG_RETENTION_PERIOD, [this] {
+                return m_wake or m_stop;
+            });
+        }
+    }
+    void Sweep()
+    {
+        struct Run
+        {
+            fs::path            path;
+            fs::file_time_type  time;
+            uint64_t            bytes;
+        };
+        std::vector<Run> runs;
+        std::error_code  ec;
+        // a stop does not wait for a whole sweep, it is checked per run
+        for (fs::directory_iterator it(m_root, ec), end;
+             not ec and it != end and not m_stop;
+             it.increment(ec)) {
+            std::error_code entry_ec;
+            Run run{ it->path(), it->last_write_time(entry_ec), 0 };
+            for (fs::recursive_directory_iterator file(run.path, entry_ec), last;
+                 not entry_ec and file != last;
+                 file.increment(entry_ec)) {
+                std::error_code size_ec;
+                const auto size = file->file_size(size_ec);
+                if (not size_ec)
+                    run.bytes += size;
+            }
+            runs.push_back(std::move(run));
+        }
+
+        // newest first, the oldest go once the sum is over the limit
+        std::sort(runs.begin(), runs.end(), [](const Run& a, const Run& b) {
+            return a.time > b.time;
+        });
+        const auto now = fs::file_time_type::clock::now();
+        uint64_t   kept = 0;
+        int        removed = 0;
+        for (const auto& run : runs) {
+            if (m_stop)
+                break;
+            if (now - run.time <= LOG_RETENTION_AGE and
+                kept + run.bytes <= LOG_RETENTION_BYTES) {
+                kept += run.bytes;
+                continue;
+            }
+            std::error_code remove_ec;
+            fs::remove_all(run.path, remove_ec);
+            if (remove_ec) {
+                spdlog::error("log retention: {} {}",
+                              run.path.string(),
+                              remove_ec.message());
+                kept += run.bytes;
+            } else {
+                removed++;
+            }
+        }
+        if (removed)
+            spdlog::info("log retention: removed {} runs, {} MB kept",
+                         removed,
+                         kept >> 20);
+    }
+
+    const fs::path          m_root; ///< a copy, the global may go first
+    std::mutex              m_mutex;
+    std::condition_variable m_cv;
+    bool                    m_wake{ false };
+    std::atomic<bool>       m_stop{ false }; ///< set under m_mutex
+    std::thread             m_thread; ///< last, it uses the members above
+};
+
+std::mutex                                              g_sessions_mutex;
+std::map<std::string, std::shared_ptr<StageLogSession>> g_sessions;
+std::unique_ptr<LogRetention>                           g_retention;
+int g_retention_users = 0; ///< StartRetention calls not yet stopped
+
+/// Local time to the second, only for the name of a retired run.
+std::string
+LocalStamp()
+{
+    const auto now = std::chrono::floor<std::chrono::seconds>(
+      std::chrono::system_clock::now());
+    return std::format(
+      "{:%Y%m%d_%H%M%S}",
+      std::chrono::zoned_time{ std::chrono::current_zone(), now });
+}
+/// What the folder holds, entry by entry; false when something stays.
+bool
+ClearFolder(const std::string& folder)
+{
+    bool            cleared = true;
+    std::error_code ec;
+    for (fs::directory_iterator it(folder, ec), end; not ec and it != end;
+         it.increment(ec)) {
+        std::error_code remove_ec;
+        fs::remove_all(it->path(), remove_ec);
+        if (remove_ec) {
+            spdlog::error("log session: cannot delete {}: {}",
+                          it->path().string(),
+                          remove_ec.message());
+            cleared = false;
+        }
+    }
+    return cleared and not ec;
+}
+} // namespace
+
+StageLogSession::StageLogSession(const std::string& folder)
+  : m_folder(folder)
+  , m_prefix(folder)
+{
+    std::error_code ec;
+    if (not fs::exists(m_folder, ec)) {
+        fs::create_directories(m_folder, ec);
+    }
+    if (not fs::is_directory(m_folder, ec)) {
+        throw std::invalid_argument("Path '" + m_folder +
+                                    "' is not a directory");
+    }
+    if (not m_prefix.empty() and m_prefix.back() != '/' and
+        m_prefix.back() != '\\') {
+        m_prefix += '/';
+    }
+}
+
+std::shared_ptr<StageLogSession>
+StageLogSession::Begin(const std::string& folder)
+{
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+    static uint32_t             serial = 0;
+
+    // 1. the last run moves aside whole, one rename whatever it holds
+    std::error_code ec;
+    if (fs::exists(folder, ec) and not fs::is_empty(folder, ec)) {
+        const fs::path retired =
+          fs::path(PATH_TO_RETIRED) /
+          std::format("{}_{}_{}",
+                      fs::path(folder).filename().string(),
+                      LocalStamp(),
+                      ++serial);
+        fs::create_directories(PATH_TO_RETIRED, ec);
+        fs::rename(folder, retired, ec);
+        // a file of the last run must not pass for one of this run
+        if (ec) {
+            spdlog::warn("log session: cannot retire {}: {}, deleting",
+                         folder,
+                         ec.message());
+            if (not ClearFolder(folder))
+                spdlog::error("log session: {} still holds files of the "
+                              "last run",
+                              folder);
+        }
+    }
+
+    // 2. sessions below the folder may have lost theirs, Get makes them anew
+    const std::string below = folder + "/";
+    for (auto it = g_sessions.begin(); it != g_sessions.end();) {
+        if (it->first.starts_with(below))
+            it = g_sessions.erase(it);
+        else
+            ++it;
+    }
+    auto session = std::shared_ptr<StageLogSession>(new StageLogSession(folder));
+    g_sessions[folder] = session;
+    if (g_retention)
+        g_retention->Wake();
+    return session;
+}
+
+std::shared_ptr<StageLogSession>
+StageLogSession::Get(const std::string& folder)
+{
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+    auto&                       session = g_sessions[folder];
+    if (not session)
+        session.reset(new StageLogSession(folder));
+    return session;
+}
+
+void
+StageLogSession::StartRetention()
+{
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+    if (g_retention_users++ == 0)
+        g_retention = std::make_unique<LogRetention>(PATH_TO_RETIRED);
+}
+void
+StageLogSession::StopRetention()
+{
+    std::unique_ptr<LogRetention> retention;
+    {
+        // the last station to stop ends it, the others keep it running
+        std::lock_guard<std::mutex> lock(g_sessions_mutex);
+        if (g_retention_users == 0 or --g_retention_users > 0)
+            return;
+        retention = std::move(g_retention);
+    }
+    // joins outside the lock, a sweep under way runs to its end
+    retention.reset();
+}
+
+} // namespace ds::depthscan
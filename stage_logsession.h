@@ -0,0 +1,61 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <format>
+#include <iterator>
+#include <memory>
+#include <string>
+
+namespace ds::depthscan {
+
+constexpr uint64_t LOG_RETENTION_BYTES = 2ull << 30; // of all retired runs
+constexpr auto LOG_RETENTION_AGE = std::chrono::hours(24 * 7);
+constexpr auto LOG_RETENTION_PERIOD = std::chrono::minutes(10);
+constexpr std::size_t LOG_NAME_RESERVE = 96; // time, fields and extension
+
+/// The log folder of one run. Begin moves what the folder holds to
+/// PATH_TO_RETIRED in a single rename, so a workflow start does not scale
+/// with the files of the last run; when the rename fails the files are
+/// deleted one by one instead. Between StartRetention and StopRetention a
+/// background thread deletes retired runs older than LOG_RETENTION_AGE or
+/// past LOG_RETENTION_BYTES, newest kept. The folder is created once per
+/// session, not per file.
+class StageLogSession
+{
+public:
+    /// A new run in folder.
+    static std::shared_ptr<StageLogSession> Begin(const std::string& folder);
+    /// The running session of folder, begun without retiring anything
+    /// when there is none.
+    static std::shared_ptr<StageLogSession> Get(const std::string& folder);
+
+    /// Retention of PATH_TO_RETIRED, reference counted: every station
+    /// starts it, the thread ends with the last StopRetention.
+    static void StartRetention();
+    static void StopRetention();
+
+    const std::string& GetFolder() const { return m_folder; }
+
+    /// folder/time_arg1_arg2...extension
+    template<typename... Args>
+    std::string GetFileName(const std::string& time,
+                            const std::string& extension,
+                            const Args&... args) const
+    {
+        std::string name;
+        name.reserve(m_prefix.size() + LOG_NAME_RESERVE);
+        name += m_prefix;
+        name += time;
+        (std::format_to(std::back_inserter(name), "_{}", args), ...);
+        name += extension;
+        return name;
+    }
+
+private:
+    explicit StageLogSession(const std::string& folder);
+
+    std::string m_folder;
+    std::string m_prefix; ///< m_folder with a trailing separator
+};
+
+} // namespace ds::depthscan
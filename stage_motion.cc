@@ -0,0 +1,84 @@
+#include <algorithm>
+#include <cmath>
+#include "stage_base.h"
+#include "stage_motion.h"
+#include "stage_settings.h"
+
+namespace ds::depthscan {
+
+static_assert(MOTION_AXES == MotorRole::mtr_max);
+
+static uint32_t
+GetStepSetting(const StationId& station, const char* key, int fallback)
+{
+    auto storage = StageSettingStorage::GetInstance(station);
+    int value = fallback;
+    if (storage) {
+        try {
+            value = std::get<int>(storage->GetSettings(key));
+        } catch (const std::exception&) {
+            value = fallback;
+        }
+    }
+    return uint32_t(std::max(value, 1)) * MICRO_STEP;
+}
+
+StageMotionPlanner::StageMotionPlanner(const StationId& station)
+{
+    // the flat 200 steps/s used so far is the proven start speed
+    MotionLimits stage{
+        GetStepSetting(station, StageConfigKeys::MOTION_MIN_SPEED, 200),
+        GetStepSetting(station, StageConfigKeys::MOTION_MAX_SPEED, 1000),
+        GetStepSetting(station, StageConfigKeys::MOTION_ACCEL, 2000)
+    };
+    stage.max_speed = std::max(stage.max_speed, stage.min_speed);
+
+    m_limits.fill({ 200 * MICRO_STEP, 200 * MICRO_STEP, 200 * MICRO_STEP });
+    m_limits[MotorRole::mtr_x] = stage;
+    m_limits[MotorRole::mtr_y] = stage;
+}
+
+void
+StageMotionPlanner::SetLimits(uint8_t mtr, const MotionLimits& limits)
+{
+    if (mtr < MOTION_AXES)
+        m_limits[mtr] = limits;
+}
+MotionLimits
+StageMotionPlanner::GetLimits(uint8_t mtr) const
+{
+    return m_limits.at(mtr);
+}
+
+MotionProfile
+StageMotionPlanner::Plan(uint8_t mtr, long long distance) const
+{
+    const MotionLimits& limits = m_limits.at(mtr);
+    const double d = std::abs(double(distance));
+    const double v0 = limits.min_speed;
+    const double vmax = limits.max_speed;
+    const double a = limits.accel;
+
+    MotionProfile profile;
+    profile.accel = limits.accel;
+    profile.init_speed = limits.min_speed;
+
+    double seconds = 0.0;
+    const double ramp = (vmax * vmax - v0 * v0) / (2.0 * a); // one side
+    if (d == 0.0) {
+        profile.drive_speed = limits.min_speed;
+    } else if (2.0 * ramp <= d) {
+        // 1. trapezoid: accelerate, cruise, decelerate
+        profile.drive_speed = limits.max_speed;
+        seconds = 2.0 * (vmax - v0) / a + (d - 2.0 * ramp) / vmax;
+    } else {
+        // 2. triangle: turn around at the peak reached over half the way
+        double peak = std::sqrt(v0 * v0 + a * d);
+        profile.drive_speed = uint32_t(peak);
+        seconds = 2.0 * (peak - v0) / a;
+    }
+    profile.predicted = std::chrono::microseconds(std::llround(seconds * 1e6));
+    return profile;
+}
+
+} // namespace ds::depthscan
@@ -0,0 +1,54 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include "stage_station.h"
+
+namespace ds::depthscan {
+
+constexpr int MOTION_AXES = 5; // MotorRole::mtr_max
+
+/// Mechanical limits of one axis, in micro steps (per second / per second^2).
+struct MotionLimits
+{
+    uint32_t min_speed; ///< start/stop speed the motor follows without ramp
+    uint32_t max_speed; ///< cruise speed cap
+    uint32_t accel;
+};
+
+/// Register values of one move and the time it is expected to take.
+struct MotionProfile
+{
+    uint32_t accel{ 1 };
+    uint32_t init_speed{ 1 };
+    uint32_t drive_speed{ 1 };
+    std::chrono::microseconds predicted{ 0 };
+};
+
+/// A point to point move as Stage::MoveTo started it.
+struct PlannedMove
+{
+    uint8_t       mtr;
+    long long     distance;
+    MotionProfile profile;
+    bool          started{ false }; ///< the start write went through
+};
+
+/// Trapezoidal profile planner: ramps from min_speed with the axis accel and
+/// cruises at max_speed, or turns around at the peak speed reachable within
+/// half the distance when the move is too short to reach cruise.
+class StageMotionPlanner
+{
+public:
+    explicit StageMotionPlanner(const StationId& station = STATION_MAIN);
+
+    void         SetLimits(uint8_t mtr, const MotionLimits& limits);
+    MotionLimits GetLimits(uint8_t mtr) const;
+
+    MotionProfile Plan(uint8_t mtr, long long distance) const;
+
+private:
+    std::array<MotionLimits, MOTION_AXES> m_limits;
+};
+
+} // namespace ds::depthscan
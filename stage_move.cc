@@ -1,194 +1,339 @@
-
-#include "ds/depthscan/stage_move.h"
-#include "ds/depthscan/stage_settings.h"
-
-constexpr auto move_speed = 200;
-constexpr auto move_max   = 2000000;
-constexpr auto move_min   = -2000000;
-
-namespace ds::depthscan {
-
-StageMove::StageMove()
-  : m_last_x_pos(0)
-  , m_last_y_pos(0)
-  , m_stage(ui::CreateAsyncModel<Stage>())
-  , m_state(StageDSState::move_idle_x | StageDSState::move_idle_y)
-{
-
-    try {
-        auto storage = StageSettingStorage::GetInstance();
-        if (storage)
-        {
-            m_last_x_pos =
-              std::get<int>(storage->GetSettings(StageConfigKeys::LAST_X_POS));
-            m_last_y_pos =
-              std::get<int>(storage->GetSettings(StageConfigKeys::LAST_Y_POS));
-        }
-
-    } catch (const std::exception& e) {
-        throw std::runtime_error(std::string("No instance : ") + e.what());
-    }
-}
-StageMove::~StageMove() {}
-
-void
-StageMove::Initiate() noexcept
-{
-}
-
-
-asio::awaitable<void>
-StageMove::MoveInitPos(async::Lifeguard guard)
-{
-    SetState(StageDSState::home_busy);
-    co_await m_stage->MoveInitPos(guard());
-    SetState(StageDSState::home_done);
-    co_return;
-}
-
-asio::awaitable<void>
-StageMove::MoveLastPos(async::Lifeguard guard,int x,int y)
-{
-    SetState(StageDSState::home_busy);
-    co_await m_stage->MoveLastPos(guard(),x,y);
-    SetState(StageDSState::home_done);
-    co_return;
-}
-
-asio::awaitable<void>
-StageMove::Move(async::Lifeguard guard,uint8_t mtr,
-                uint8_t mode,
-                uint32_t speed,
-                int pos)
-{
-    co_await m_stage->SetPos(guard(), mtr, pos);
-
-    co_await m_stage->Go(
-          guard(), mtr, MotorDir::motdir_cw, mode, 0, 0, speed);
-
-
-    if (mtr & MotorRole::mtr_x)
-        SetState(StageDSState::move_busy_x);
-    if (mtr & MotorRole::mtr_y)
-        SetState(StageDSState::move_busy_y);
-    co_return;
-}
-
-asio::awaitable<void>
-StageMove::StopMove(async::Lifeguard guard, uint8_t mtr)
-{
-    co_await m_stage->Stop(guard(), mtr);
-
-    if (mtr & MotorRole::mtr_x)
-        SetState(StageDSState::move_idle_x);
-    if (mtr & MotorRole::mtr_y)
-        SetState(StageDSState::move_idle_y);
-    co_return;
-}
-
-asio::awaitable<void>
-StageMove ::MoveHome(async::Lifeguard guard)
-{
-
-    co_await m_stage->SetPos(guard(), MotorRole::mtr_x, 0);
-    co_await m_stage->SetPos(guard(), MotorRole::mtr_y, 0);
-    co_await m_stage->Go(guard(),
-                            MotorRole::mtr_x,
-                                        MotorDir::motdir_cw,
-                                        SingleMode::mode_home,
-                                        0,
-                                        0,
-                                        200 * MICRO_STEP);
-    co_await m_stage->Go(guard(),
-                            MotorRole::mtr_y,
-                                        MotorDir::motdir_cw,
-                                        SingleMode::mode_home,
-                                        0,
-                                        0,
-                                        200 * MICRO_STEP);
-
-    SetState(StageDSState::home_busy);
-    co_return;
-}
-asio::awaitable<void>
-StageMove::StopHome(async::Lifeguard guard)
-{
-    co_await m_stage->Stop(guard(), MotorRole::mtr_x);
-    co_await m_stage->Stop(guard(), MotorRole::mtr_y);
-
-    SetState(StageDSState::home_idle);
-    co_return;
-}
-asio::awaitable<void>
-StageMove::DoneHome(async::Lifeguard guard)
-{
-    bool done = false;
-
-    while (not done) {
-        done = co_await m_stage->IsHome(guard(),
-                                        MotorRole::mtr_x |
-                                                    MotorRole::mtr_y);
-    }
-    SetState(StageDSState::home_done);
-    co_return;
-}
-asio::awaitable<void>
-StageMove::GetNotBusy(async::Lifeguard guard)
-{
-    bool done = false;
-    auto timer = ds::async::Timer();
-    while (not done) {
-        done = co_await m_stage->GetNotBusy(guard());
-        if (!done)
-            co_await timer.AsyncSleepFor(guard(), 10ms);
-    }
-    co_return;
-}
-
-asio::awaitable<bool>
-StageMove::IsBusy(async::Lifeguard guard)
-{
-    co_return co_await m_stage->GetNotBusy(guard());
-}
-
-asio::awaitable<int>
-StageMove::GetPos(async::Lifeguard guard,uint8_t mtr)
-{
-    int pos = co_await m_stage->GetPos(guard(), mtr);
-    co_return pos;
-}
-
-void
-StageMove::SetState(uint32_t state)
-{
-    if (StageDSState::move_busy_x == state)
-        this->m_state &= ~StageDSState::move_idle_x;
-    if (StageDSState::move_idle_x == state)
-        this->m_state &= ~StageDSState::move_busy_x;
-    if (StageDSState::move_busy_y == state)
-        this->m_state &= ~StageDSState::move_idle_y;
-    if (StageDSState::move_idle_y == state)
-        this->m_state &= ~StageDSState::move_busy_y;
-    if (StageDSState::home_busy == state)
-        this->m_state &= ~(StageDSState::home_idle | StageDSState::home_done);
-    if (StageDSState::home_idle == state)
-        this->m_state &= ~(StageDSState::home_busy | StageDSState::home_done);
-    if (StageDSState::home_done == state)
-        this->m_state &= ~(StageDSState::home_busy | StageDSState::home_idle);
-
-    this->m_state |= state;
-}
-bool
-StageMove::IsState(uint32_t state) const
-{
-    if (this->m_state & state)
-        return true;
-    else
-        return false;
-}
-uint32_t
-StageMove::GetState() const
-{
-    return this->m_state;
-}
+
+#include "ds/depthscan/stage_move.h"
+#include "ds/depthscan/stage_settings.h"
+#include <spdlog/spdlog.h>
+
+constexpr auto move_speed = 200;
+constexpr auto move_max   = 2000000;
+constexpr auto move_min   = -2000000;
+
+namespace ds::depthscan {
+
+StageMove::StageMove(const StationId& station)
+  : m_station(station)
+  , m_last_x_pos(0)
+  , m_last_y_pos(0)
+  , m_stage(ui::CreateAsyncModel<Stage>(station))
+  , m_state(StageDSState::move_idle_x | StageDSState::move_idle_y)
+{
+
+    try {
+        auto storage = StageSettingStorage::GetInstance(m_station);
+        if (storage)
+        {
+            m_last_x_pos =
+              std::get<int>(storage->GetSettings(StageConfigKeys::LAST_X_POS));
+            m_last_y_pos =
+              std::get<int>(storage->GetSettings(StageConfigKeys::LAST_Y_POS));
+        }
+
+    } catch (const std::exception& e) {
+        throw std::runtime_error(std::string("No instance : ") + e.what());
+    }
+}
+StageMove::~StageMove() {}
+
+void
+StageMove::Initiate() noexcept
+{
+}
+
+
+asio::awaitable<void>
+StageMove::MoveInitPos(async::Lifeguard guard)
+{
+    SetState(StageDSState::home_busy);
+    co_await m_stage->MoveInitPos(guard());
+    SetState(StageDSState::home_done);
+    co_return;
+}
+
+asio::awaitable<void>
+StageMove::MoveLastPos(async::Lifeguard guard,int x,int y)
+{
+    SetState(StageDSState::home_busy);
+    co_await m_stage->MoveLastPos(guard(),x,y);
+    SetState(StageDSState::home_done);
+    co_return;
+}
+
+asio::awaitable<void>
+StageMove::Move(async::Lifeguard guard,uint8_t mtr,
+                uint8_t mode,
+                uint32_t speed,
+                int pos)
+{
+    co_await m_stage->SetPos(guard(), mtr, pos);
+
+    if (not co_await m_stage->Go(
+          guard(), mtr, MotorDir::motdir_cw, mode, 0, 0, speed))
+        co_return;
+
+    if (mtr & MotorRole::mtr_x)
+        SetState(StageDSState::move_busy_x);
+    if (mtr & MotorRole::mtr_y)
+        SetState(StageDSState::move_busy_y);
+    co_return;
+}
+
+asio::awaitable<void>
+StageMove::MoveTo(async::Lifeguard guard, uint8_t mtr, int pos)
+{
+    auto move = co_await m_stage->MoveTo(guard(), mtr, pos);
+    if (not move.started)
+        co_return;
+
+    if (mtr == MotorRole::mtr_x) {
+        m_planned[0] = move;
+        SetState(StageDSState::move_busy_x);
+    }
+    if (mtr == MotorRole::mtr_y) {
+        m_planned[1] = move;
+        SetState(StageDSState::move_busy_y);
+    }
+    co_return;
+}
+asio::awaitable<bool>
+StageMove::RunSequence(async::Lifeguard guard,
+                       uint8_t mtr,
+                       const std::vector<SequencePoint>& points,
+                       SequenceHandler on_arrival,
+                       const bool* cancel)
+{
+    if (points.empty())
+        co_return true;
+
+    auto from = co_await m_stage->GetPos(guard(), mtr);
+    long long longest =
+      from ? std::abs((long long)points.front().pos - *from) : 0;
+    for (std::size_t i = 1; i < points.size(); i++) {
+        longest = std::max(
+          longest, std::abs((long long)points[i].pos - points[i - 1].pos));
+    }
+    auto profile = m_stage->PlanMove(mtr, longest);
+
+    if (mtr == MotorRole::mtr_x)
+        SetState(StageDSState::move_busy_x);
+    if (mtr == MotorRole::mtr_y)
+        SetState(StageDSState::move_busy_y);
+
+    auto timer = ds::async::Timer();
+    bool completed = true;
+
+    co_await m_stage->SetPos(guard(), mtr, points.front().pos);
+    if (not co_await m_stage->GoProfile(
+          guard(), mtr, SingleMode::mode_cnt, profile)) {
+        spdlog::error("sequence mtr{}: start failed, aborted", mtr);
+        co_await m_stage->Stop(guard(), mtr);
+        completed = false;
+    }
+
+    for (std::size_t i = 0; completed and i < points.size(); i++) {
+        // 1. pre-stage the next destination while this move runs
+        if ((i + 1) < points.size())
+            co_await m_stage->SetPos(guard(), mtr, points[i + 1].pos);
+
+        // 2. arrival, STAT only, bounded by the planned move time
+        const auto deadline = std::chrono::steady_clock::now() +
+                              profile.predicted + SEQUENCE_ARRIVAL_MARGIN;
+        bool idle = false;
+        while (not idle) {
+            if (cancel and *cancel) {
+                spdlog::info("sequence mtr{}: cancelled at point {}", mtr, i);
+                break;
+            }
+            if (std::chrono::steady_clock::now() > deadline) {
+                spdlog::error("sequence mtr{}: point {} not reached in {} us",
+                              mtr,
+                              i,
+                              (profile.predicted + SEQUENCE_ARRIVAL_MARGIN)
+                                .count());
+                break;
+            }
+            idle = (co_await m_stage->IsIdle(guard(), mtr)).value_or(false);
+            if (not idle)
+                co_await timer.AsyncSleepFor(guard(), 10ms);
+        }
+        if (not idle) {
+            co_await m_stage->Stop(guard(), mtr);
+            completed = false;
+            break;
+        }
+        if (points[i].dwell.count() > 0)
+            co_await timer.AsyncSleepFor(guard(), points[i].dwell);
+        if (points[i].trigger and on_arrival) {
+            if (not co_await on_arrival(i, points[i].pos)) {
+                completed = false;
+                break;
+            }
+        }
+
+        // 3. start the staged move
+        if ((i + 1) < points.size() and
+            not co_await m_stage->Trigger(guard(), mtr)) {
+            spdlog::error("sequence mtr{}: point {} not started, aborted",
+                          mtr,
+                          i + 1);
+            co_await m_stage->Stop(guard(), mtr);
+            completed = false;
+        }
+    }
+
+    if (mtr == MotorRole::mtr_x)
+        SetState(StageDSState::move_idle_x);
+    if (mtr == MotorRole::mtr_y)
+        SetState(StageDSState::move_idle_y);
+    co_return completed;
+}
+asio::awaitable<void>
+StageMove::ReportMoveTime(async::Lifeguard guard)
+{
+    // ELAPSED costs a telemetry read, only taken when it is logged
+    const bool report = spdlog::should_log(spdlog::level::debug);
+    for (auto& planned : m_planned) {
+        if (not planned)
+            continue;
+        if (not report) {
+            planned.reset();
+            continue;
+        }
+        auto measured = co_await m_stage->GetElapsed(guard(), planned->mtr);
+        spdlog::debug("move mtr{} {} steps: predicted {} us, measured {} us",
+                     planned->mtr,
+                     planned->distance,
+                     planned->profile.predicted.count(),
+                     measured.count());
+        planned.reset();
+    }
+    co_return;
+}
+
+asio::awaitable<void>
+StageMove::StopMove(async::Lifeguard guard, uint8_t mtr)
+{
+    co_await m_stage->Stop(guard(), mtr);
+
+    if (mtr & MotorRole::mtr_x)
+        SetState(StageDSState::move_idle_x);
+    if (mtr & MotorRole::mtr_y)
+        SetState(StageDSState::move_idle_y);
+    co_return;
+}
+
+asio::awaitable<void>
+StageMove ::MoveHome(async::Lifeguard guard)
+{
+
+    co_await m_stage->SetPos(guard(), MotorRole::mtr_x, 0);
+    co_await m_stage->SetPos(guard(), MotorRole::mtr_y, 0);
+    co_await m_stage->Go(guard(),
+                            MotorRole::mtr_x,
+                                        MotorDir::motdir_cw,
+                                        SingleMode::mode_home,
+                                        0,
+                                        0,
+                                        200 * MICRO_STEP);
+    co_await m_stage->Go(guard(),
+                            MotorRole::mtr_y,
+                                        MotorDir::motdir_cw,
+                                        SingleMode::mode_home,
+                                        0,
+                                        0,
+                                        200 * MICRO_STEP);
+
+    SetState(StageDSState::home_busy);
+    co_return;
+}
+asio::awaitable<void>
+StageMove::StopHome(async::Lifeguard guard)
+{
+    co_await m_stage->Stop(guard(), MotorRole::mtr_x);
+    co_await m_stage->Stop(guard(), MotorRole::mtr_y);
+
+    SetState(StageDSState::home_idle);
+    co_return;
+}
+asio::awaitable<void>
+StageMove::DoneHome(async::Lifeguard guard)
+{
+    bool done = false;
+
+    while (not done) {
+        done = co_await m_stage->IsHome(guard(),
+                                        MotorRole::mtr_x |
+                                                    MotorRole::mtr_y);
+    }
+    SetState(StageDSState::home_done);
+    co_return;
+}
+asio::awaitable<void>
+StageMove::GetNotBusy(async::Lifeguard guard)
+{
+    bool done = false;
+    auto timer = ds::async::Timer();
+    while (not done) {
+        done = co_await m_stage->GetNotBusy(guard());
+        if (!done)
+            co_await timer.AsyncSleepFor(guard(), 10ms);
+    }
+    co_await ReportMoveTime(guard());
+    co_return;
+}
+
+asio::awaitable<bool>
+StageMove::IsBusy(async::Lifeguard guard)
+{
+    co_return co_await m_stage->GetNotBusy(guard());
+}
+
+asio::awaitable<std::optional<int>>
+StageMove::GetPos(async::Lifeguard guard,uint8_t mtr)
+{
+    co_return co_await m_stage->GetPos(guard(), mtr);
+}
+asio::awaitable<TelemetrySnapshot>
+StageMove::GetTelemetry(async::Lifeguard guard,
+                        std::chrono::milliseconds max_age)
+{
+    co_return co_await m_stage->GetTelemetry(guard(), max_age);
+}
+asio::awaitable<LinkBenchResult>
+StageMove::BenchLink(async::Lifeguard guard, int count, bool scratch_writes)
+{
+    co_return co_await m_stage->BenchLink(guard(), count, scratch_writes);
+}
+
+void
+StageMove::SetState(uint32_t state)
+{
+    if (StageDSState::move_busy_x == state)
+        this->m_state &= ~StageDSState::move_idle_x;
+    if (StageDSState::move_idle_x == state)
+        this->m_state &= ~StageDSState::move_busy_x;
+    if (StageDSState::move_busy_y == state)
+        this->m_state &= ~StageDSState::move_idle_y;
+    if (StageDSState::move_idle_y == state)
+        this->m_state &= ~StageDSState::move_busy_y;
+    if (StageDSState::home_busy == state)
+        this->m_state &= ~(StageDSState::home_idle | StageDSState::home_done);
+    if (StageDSState::home_idle == state)
+        this->m_state &= ~(StageDSState::home_busy | StageDSState::home_done);
+    if (StageDSState::home_done == state)
+        this->m_state &= ~(StageDSState::home_busy | StageDSState::home_idle);
+
+    this->m_state |= state;
+}
+bool
+StageMove::IsState(uint32_t state) const
+{
+    if (this->m_state & state)
+        return true;
+    else
+        return false;
+}
+uint32_t
+StageMove::GetState() const
+{
+    return this->m_state;
+}
 } // namespace ds
\ No newline at end of file
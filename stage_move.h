@@ -1,63 +1,106 @@
-#pragma once
-
-#include "stage_base.h"
-#include "ui.h"
-
-namespace ds::depthscan {
-
-class StageMove 
-    : public async::Model<StageMove>
-{
-public:
-    StageMove();
-    ~StageMove();
-
-    void Initiate() noexcept override;
-
-    asio::awaitable<void> MoveInitPos(async::Lifeguard guard);
-    asio::awaitable<void> MoveLastPos(async::Lifeguard guard,int x,int y);
-    asio::awaitable<void> Move(async::Lifeguard guard,
-                               uint8_t mtr,
-                               uint8_t  mode,
-                               uint32_t speed,
-                               int pos);
-
-    asio::awaitable<void> StopMove(async::Lifeguard guard, uint8_t mtr);
-
-    asio::awaitable<void> MoveHome(async::Lifeguard guard);
-    asio::awaitable<void> StopHome(async::Lifeguard guard);
-    asio::awaitable<void> DoneHome(async::Lifeguard guard);
-    asio::awaitable<void> GetNotBusy(async::Lifeguard guard);
-    asio::awaitable<bool> IsBusy(async::Lifeguard guard);
-
-    asio::awaitable<int> GetPos(async::Lifeguard guard,uint8_t mtr);
-    void                 SetState(uint32_t state);
-    bool                 IsState(uint32_t state) const;
-    uint32_t             GetState() const;
-    int                  GetLastPos(uint8_t mtr) const
-    {
-        if (mtr == MotorRole::mtr_x)
-            return m_last_x_pos;
-        else if (mtr == MotorRole::mtr_y)
-            return m_last_y_pos;
-        else
-            return 0;
-    }
-    void                SetLastPos(uint8_t mtr, int pos)
-    {
-        if (mtr == MotorRole::mtr_x)
-            m_last_x_pos = pos;
-        else if (mtr == MotorRole::mtr_y)
-            m_last_y_pos = pos;
-    }
-
-private:
-    std::shared_ptr<Stage> m_stage;
-    async::RawCondition m_cond;
-
-    uint32_t           m_state;
-
-    int m_last_x_pos;
-    int m_last_y_pos;
-};
+#pragma once
+
+#include <functional>
+#include <optional>
+#include <vector>
+#include "stage_base.h"
+#include "ui.h"
+
+namespace ds::depthscan {
+
+struct SequencePoint
+{
+    int pos;
+    std::chrono::milliseconds dwell{ 0 }; ///< hold after arrival
+    bool trigger{ false };                ///< call on_arrival before moving on
+};
+/// Time an arrival may take beyond the planned move before a sequence gives
+/// up on it.
+constexpr auto SEQUENCE_ARRIVAL_MARGIN = std::chrono::milliseconds(500);
+/// Arrival handler of a sequenced move, return false to abort the sequence.
+using SequenceHandler =
+  std::function<asio::awaitable<bool>(std::size_t index, int pos)>;
+
+class StageMove 
+    : public async::Model<StageMove>
+{
+public:
+    explicit StageMove(const StationId& station);
+    ~StageMove();
+
+    void Initiate() noexcept override;
+
+    asio::awaitable<void> MoveInitPos(async::Lifeguard guard);
+    asio::awaitable<void> MoveLastPos(async::Lifeguard guard,int x,int y);
+    asio::awaitable<void> Move(async::Lifeguard guard,
+                               uint8_t mtr,
+                               uint8_t  mode,
+                               uint32_t speed,
+                               int pos);
+    /// Move with a per-move profile from the Stage motion planner.
+    asio::awaitable<void> MoveTo(async::Lifeguard guard, uint8_t mtr, int pos);
+    /// Visit the points in order. The next destination is written while the
+    /// current move runs and started as soon as the axis reports idle (and
+    /// dwell / on_arrival are done), so there is no host round trip between
+    /// consecutive moves. All moves share the profile of the longest step.
+    /// Arrival polls only STAT; a move not idle within its predicted time
+    /// plus SEQUENCE_ARRIVAL_MARGIN, or *cancel set, stops the axis and
+    /// ends the sequence with false.
+    asio::awaitable<bool> RunSequence(async::Lifeguard guard,
+                                      uint8_t mtr,
+                                      const std::vector<SequencePoint>& points,
+                                      SequenceHandler on_arrival,
+                                      const bool* cancel = nullptr);
+
+    asio::awaitable<void> StopMove(async::Lifeguard guard, uint8_t mtr);
+
+    asio::awaitable<void> MoveHome(async::Lifeguard guard);
+    asio::awaitable<void> StopHome(async::Lifeguard guard);
+    asio::awaitable<void> DoneHome(async::Lifeguard guard);
+    asio::awaitable<void> GetNotBusy(async::Lifeguard guard);
+    asio::awaitable<bool> IsBusy(async::Lifeguard guard);
+
+    asio::awaitable<std::optional<int>> GetPos(async::Lifeguard guard,
+                                               uint8_t mtr);
+    asio::awaitable<TelemetrySnapshot> GetTelemetry(
+      async::Lifeguard guard,
+      std::chrono::milliseconds max_age = TELEMETRY_MAX_AGE);
+    /// Times the link; writes hit the FREE0 scratch register only when
+    /// scratch_writes is set, which is for bench controllers only.
+    asio::awaitable<LinkBenchResult> BenchLink(async::Lifeguard guard,
+                                               int                count,
+                                               bool scratch_writes = false);
+    void                 SetState(uint32_t state);
+    bool                 IsState(uint32_t state) const;
+    uint32_t             GetState() const;
+    int                  GetLastPos(uint8_t mtr) const
+    {
+        if (mtr == MotorRole::mtr_x)
+            return m_last_x_pos;
+        else if (mtr == MotorRole::mtr_y)
+            return m_last_y_pos;
+        else
+            return 0;
+    }
+    void                SetLastPos(uint8_t mtr, int pos)
+    {
+        if (mtr == MotorRole::mtr_x)
+            m_last_x_pos = pos;
+        else if (mtr == MotorRole::mtr_y)
+            m_last_y_pos = pos;
+    }
+
+private:
+    asio::awaitable<void> ReportMoveTime(async::Lifeguard guard);
+
+    StationId m_station;
+    std::shared_ptr<Stage> m_stage;
+    std::optional<PlannedMove> m_planned[2]; // mtr_x, mtr_y
+    async::RawCondition m_cond;
+
+    uint32_t           m_state;
+
+    int m_last_x_pos;
+    int m_last_y_pos;
+};
 } // namespace ds
\ No newline at end of file
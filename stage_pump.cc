@@ -1,77 +1,220 @@
-#include "stage_pump.h"
-#include <spdlog/spdlog.h>
-
-namespace ds::depthscan {
-
-StagePump::StagePump()
-  : m_state(StageDSState::pump_idle)
-  , m_stage(ui::CreateAsyncModel<Stage>())
-{
-
-}
-
-StagePump::~StagePump() {}
-
-void
-StagePump::Initiate() noexcept
-{
-
-}
-
-asio::awaitable<void>
-StagePump::StartPump(async::Lifeguard guard, uint8_t dir, float ml_min)
-{
-    static float pre_speed = 0.0;
-
-    if (ml_min != pre_speed) {    
-        if (IsState(StageDSState::pump_busy))
-            co_await m_stage->Stop(guard(), MotorRole::mtr_p);
-        pre_speed = ml_min;
-    }
-
-    int speed = 0;
-
-    float x_rpm = 0.0;
-    float rpm   = 0.0;
-
-    rpm = ml_min * 11.11;
-    if (rpm != 0)
-        x_rpm = (60 / rpm);
-    else
-        x_rpm = (60 / 0.1);
-
-    speed = (200 * MICRO_STEP) / x_rpm;
-
-    co_await m_stage->Go(
-      guard(),
-      MotorRole::mtr_p, dir, SingleMode::mode_inf, 0, 0, speed);
-    SetState(StageDSState::pump_busy);
-
-    co_return;
-}
-asio::awaitable<void>
-StagePump::StopPump(async::Lifeguard guard)
-{
-    co_await m_stage->Stop(guard(), MotorRole::mtr_p);
-    SetState(StageDSState::pump_idle);
-    co_return;
-}
-void
-StagePump::SetState(uint32_t state)
-{
-    if (StageDSState::pump_busy == state)
-        this->m_state &= ~StageDSState::pump_idle;
-    if (StageDSState::pump_idle == state)
-        this->m_state &= ~StageDSState::pump_busy;
-
-    this->m_state |= state;
-}
-bool
-StagePump::IsState(uint32_t state) const
-{
-    if (m_state & state)
-        return true;
-    else
-        return false;
-}
+#include "stage_pump.h"
+#include <algorithm>
+#include <spdlog/spdlog.h>
+
+namespace ds::depthscan {
+
+// 11.11 rev/ml, 200 full steps per rev
+constexpr double PUMP_REV_PER_ML = 11.11;
+
+uint32_t
+StagePump::FlowToSpeed(float ml_min)
+{
+    float x_rpm = 0.0;
+    float rpm   = 0.0;
+
+    rpm = ml_min * PUMP_REV_PER_ML;
+    if (rpm != 0)
+        x_rpm = (60 / rpm);
+    else
+        x_rpm = (60 / 0.1);
+
+    return uint32_t((200 * MICRO_STEP) / x_rpm);
+}
+double
+StagePump::SpeedToMicroLitrePerSecond(uint32_t speed)
+{
+    double rev_per_s = double(speed) / (200.0 * MICRO_STEP);
+    return rev_per_s / PUMP_REV_PER_ML * 1000.0;
+}
+
+StagePumpState&
+StagePumpState::Get(const StationId& station)
+{
+    static std::mutex s_mutex;
+    static std::map<StationId, std::unique_ptr<StagePumpState>> s_stations;
+
+    std::lock_guard<std::mutex> lock(s_mutex);
+    auto& state = s_stations[station];
+    if (not state)
+        state = std::make_unique<StagePumpState>();
+    return *state;
+}
+uint32_t
+StagePumpState::RunningSpeed(uint8_t dir)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return dir == m_dir ? m_speed : 0;
+}
+uint32_t
+StagePumpState::GetSpeed()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_speed;
+}
+void
+StagePumpState::Started(uint8_t dir, uint32_t speed)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Integrate();
+    m_dir = dir;
+    m_speed = speed;
+}
+void
+StagePumpState::Changed(uint32_t speed)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Integrate();
+    m_speed = speed;
+}
+void
+StagePumpState::Stopped()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Integrate();
+    m_speed = 0;
+}
+double
+StagePumpState::GetDelivered()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Integrate();
+    return m_delivered;
+}
+void
+StagePumpState::ResetDelivered()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Integrate();
+    m_delivered = 0.0;
+}
+void
+StagePumpState::Integrate()
+{
+    const auto now = Clock::now();
+    const std::chrono::duration<double> dt = now - m_integrated;
+    m_delivered +=
+      StagePump::SpeedToMicroLitrePerSecond(m_speed) * dt.count();
+    m_integrated = now;
+}
+
+StagePump::StagePump(const StationId& station)
+  : m_station(station)
+  , m_stage(ui::CreateAsyncModel<Stage>(station))
+  , m_shared(&StagePumpState::Get(station))
+  , m_ml_min(0.0f)
+{
+
+}
+
+StagePump::~StagePump() {}
+
+void
+StagePump::Initiate() noexcept
+{
+
+}
+
+asio::awaitable<bool>
+StagePump::StartPump(async::Lifeguard guard, uint8_t dir, float ml_min)
+{
+    const uint32_t speed = FlowToSpeed(ml_min);
+    m_ml_min = ml_min;
+
+    // known to run the same way: ramp the drive speed, no stop
+    const uint32_t from = m_shared->RunningSpeed(dir);
+    if (from) {
+        auto timer = ds::async::Timer();
+        const long long step = ((long long)speed - from) / PUMP_RAMP_STEPS;
+        for (int i = 1; i <= PUMP_RAMP_STEPS; i++) {
+            uint32_t next = (i == PUMP_RAMP_STEPS)
+                              ? speed
+                              : uint32_t(from + step * i);
+            if (not co_await SetSpeed(guard(), dir, next))
+                co_return false;
+            if (i != PUMP_RAMP_STEPS)
+                co_await timer.AsyncSleepFor(guard(), PUMP_RAMP_INTERVAL);
+        }
+        spdlog::info("pump ramp {} -> {}", from, speed);
+        co_return true;
+    }
+
+    co_return co_await SetSpeed(guard(), dir, speed);
+}
+asio::awaitable<bool>
+StagePump::SetSpeed(async::Lifeguard guard, uint8_t dir, uint32_t speed)
+{
+    // 1. pause
+    if (speed == 0)
+        co_return co_await m_stage->Stop(guard(), MotorRole::mtr_p);
+
+    // 2. known to run the same way, on the fly; a failed write falls
+    //    through to the restart
+    if (m_shared->RunningSpeed(dir)) {
+        if (co_await m_stage->SetDriveSpeed(
+              guard(), MotorRole::mtr_p, speed)) {
+            m_shared->Changed(speed);
+            co_return true;
+        }
+        spdlog::error("pump speed {}: on the fly failed, restarting", speed);
+    }
+    // 3. (re)start: stopped, reversing, or not known to run; Go leaves the
+    //    shared state stopped until the start is confirmed here
+    if (m_shared->GetSpeed())
+        co_await m_stage->Stop(guard(), MotorRole::mtr_p);
+    if (not co_await m_stage->Go(
+          guard(),
+          MotorRole::mtr_p, dir, SingleMode::mode_inf, 0, 0, speed)) {
+        spdlog::error("pump start {}: failed, not running", speed);
+        co_return false;
+    }
+    m_shared->Started(dir, speed);
+    co_return true;
+}
+asio::awaitable<void>
+StagePump::StopPump(async::Lifeguard guard)
+{
+    co_await m_stage->Stop(guard(), MotorRole::mtr_p);
+    spdlog::info("pump stop: {:.1f} uL delivered", m_shared->GetDelivered());
+    co_return;
+}
+asio::awaitable<bool>
+StagePump::WaitVolume(async::Lifeguard guard, double micro_litre)
+{
+    auto timer = ds::async::Timer();
+    const double target = GetDeliveredVolume() + micro_litre;
+
+    double delivered = GetDeliveredVolume();
+    while (delivered < target) {
+        const uint32_t speed = m_shared->GetSpeed();
+        if (speed == 0)
+            co_return false;
+
+        // sleep about the time left at the current flow, 10ms ~ 100ms
+        double left =
+          (target - delivered) / SpeedToMicroLitrePerSecond(speed) * 1000.0;
+        auto wait = std::chrono::milliseconds(
+          std::clamp((long long)left, 10ll, 100ll));
+        co_await timer.AsyncSleepFor(guard(), wait);
+        delivered = GetDeliveredVolume();
+    }
+    co_return true;
+}
+double
+StagePump::GetDeliveredVolume()
+{
+    return m_shared->GetDelivered();
+}
+void
+StagePump::ResetVolume()
+{
+    m_shared->ResetDelivered();
+}
+bool
+StagePump::IsState(uint32_t state) const
+{
+    const uint32_t now = m_shared->GetSpeed() ? StageDSState::pump_busy
+                                              : StageDSState::pump_idle;
+    return (now & state) != 0;
+}
 }
\ No newline at end of file
@@ -1,29 +1,58 @@
-#pragma once
-
-#include "stage_base.h"
-#include "async.h"
-#include "ui.h"
-
-namespace ds::depthscan {
-class StagePump
-  : public async::Model<StagePump>
-{
-public:
-    StagePump();
-    ~StagePump();
-
-    void Initiate() noexcept override;
-
-    asio::awaitable<void> StartPump(async::Lifeguard guard,uint8_t dir,
-                                    float ml_min);
-    asio::awaitable<void> StopPump(async::Lifeguard guard);
-
-    void SetState(uint32_t state);
-    bool IsState(uint32_t state) const;
-
-private:
-    std::shared_ptr<Stage>  m_stage;
-    async::RawCondition m_cond;
-    uint32_t                m_state;
-};
+#pragma once
+
+#include <chrono>
+#include "stage_base.h"
+#include "async.h"
+#include "ui.h"
+
+namespace ds::depthscan {
+
+constexpr auto PUMP_RAMP_STEPS    = 4;    // drive speed writes per change
+constexpr auto PUMP_RAMP_INTERVAL = 20ms; // between two ramp writes
+
+class StagePump
+  : public async::Model<StagePump>
+{
+public:
+    explicit StagePump(const StationId& station);
+    ~StagePump();
+
+    void Initiate() noexcept override;
+
+    /// Start the pump, or change its flow on the fly when it is known to
+    /// run in the same direction (the drive speed is ramped, the motor
+    /// never stops). A motor not known to run gets a Go. False when a
+    /// control write failed; the pump is then not known to run.
+    asio::awaitable<bool> StartPump(async::Lifeguard guard,uint8_t dir,
+                                    float ml_min);
+    asio::awaitable<void> StopPump(async::Lifeguard guard);
+    /// Put a drive speed register value on the pump right away, no ramp.
+    /// 0 stops it, the same direction changes the speed without a stop.
+    /// False when the write failed, like StartPump.
+    asio::awaitable<bool> SetSpeed(async::Lifeguard guard,
+                                   uint8_t dir,
+                                   uint32_t speed);
+    /// Wait until micro_litre more have been delivered. false if the pump
+    /// stopped first.
+    asio::awaitable<bool> WaitVolume(async::Lifeguard guard,
+                                     double micro_litre);
+
+    /// uL since the last ResetVolume, by any pump of the station.
+    double GetDeliveredVolume();
+    void   ResetVolume();
+    float  GetFlowRate() const { return m_ml_min; }
+
+    static uint32_t FlowToSpeed(float ml_min);
+    static double   SpeedToMicroLitrePerSecond(uint32_t speed);
+
+    /// pump_busy or pump_idle of the station's pump motor.
+    bool IsState(uint32_t state) const;
+
+private:
+    StationId m_station;
+    std::shared_ptr<Stage>  m_stage;
+    StagePumpState*         m_shared;
+
+    float m_ml_min; ///< requested flow
+};
 }
\ No newline at end of file
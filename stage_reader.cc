@@ -0,0 +1,340 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <spdlog/spdlog.h>
+#include "stage_reader.h"
+
+namespace ds::depthscan {
+
+#ifdef _WIN32
+MappedFile::Mapping::~Mapping()
+{
+    if (data)
+        UnmapViewOfFile(data);
+    if (mapping)
+        CloseHandle(mapping);
+    if (file)
+        CloseHandle(file);
+}
+MappedFile::MappedFile(const std::filesystem::path& path)
+{
+    HANDLE file = CreateFileW(path.c_str(),
+                              GENERIC_READ,
+                              FILE_SHARE_READ,
+                              nullptr,
+                              OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL,
+                              nullptr);
+    if (file != INVALID_HANDLE_VALUE)
+        m_map.file = file;
+    LARGE_INTEGER size;
+    if (not m_map.file or not GetFileSizeEx(m_map.file, &size))
+        throw std::runtime_error("cannot open " + path.string());
+    m_map.size = std::size_t(size.QuadPart);
+    if (m_map.size == 0)
+        return;
+    m_map.mapping =
+      CreateFileMappingW(m_map.file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_map.mapping)
+        m_map.data = static_cast<const char*>(
+          MapViewOfFile(m_map.mapping, FILE_MAP_READ, 0, 0, 0));
+    if (not m_map.data)
+        throw std::runtime_error("cannot map " + path.string());
+}
+void
+MappedFile::Prefetch(std::size_t offset, std::size_t bytes) const
+{
+    if (offset >= m_map.size)
+        return;
+    WIN32_MEMORY_RANGE_ENTRY range{ const_cast<char*>(m_map.data + offset),
+                                    std::min(bytes, m_map.size - offset) };
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+}
+#else
+MappedFile::Mapping::~Mapping()
+{
+    if (data)
+        munmap(const_cast<char*>(data), size);
+    if (fd >= 0)
+        close(fd);
+}
+MappedFile::MappedFile(const std::filesystem::path& path)
+{
+    m_map.fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (m_map.fd < 0 or fstat(m_map.fd, &st) != 0)
+        throw std::runtime_error("cannot open " + path.string());
+    m_map.size = std::size_t(st.st_size);
+    if (m_map.size == 0)
+        return;
+    void* data = mmap(nullptr, m_map.size, PROT_READ, MAP_SHARED, m_map.fd, 0);
+    if (data == MAP_FAILED)
+        throw std::runtime_error("cannot map " + path.string());
+    m_map.data = static_cast<const char*>(data);
+}
+void
+MappedFile::Prefetch(std::size_t offset, std::size_t bytes) const
+{
+    if (offset >= m_map.size)
+        return;
+    // madvise wants a page aligned start
+    const std::size_t page = std::size_t(sysconf(_SC_PAGESIZE));
+    const std::size_t start = offset / page * page;
+    const std::size_t end = std::min(offset + bytes, m_map.size);
+    madvise(const_cast<char*>(m_map.data + start), end - start, MADV_WILLNEED);
+}
+#endif
+
+StageRecordReader::StageRecordReader(const std::filesystem::path& path)
+  : m_file(path)
+  , m_last(std::size_t(-1))
+{
+    RecordFileHeader header;
+    if (m_file.GetSize() < sizeof(header))
+        throw std::runtime_error("not a recording: " + path.string());
+    std::memcpy(&header, m_file.GetData(), sizeof(header));
+    if (header.magic != RECORD_MAGIC or header.version != RECORD_VERSION)
+        throw std::runtime_error("not a recording: " + path.string());
+
+    BuildIndex();
+    spdlog::info("record reader: {} frames in {} chunks, {}",
+                 m_frames.size(),
+                 m_chunks.size(),
+                 path.string());
+}
+
+void
+StageRecordReader::BuildIndex()
+{
+    const char*       data = m_file.GetData();
+    const std::size_t size = m_file.GetSize();
+    std::size_t       at = sizeof(RecordFileHeader);
+
+    // everything from the first bad record on is left out; sizes are
+    // compared against what is left, so no sum can wrap
+    while (size - at >= sizeof(RecordChunkHeader)) {
+        RecordChunkHeader chunk;
+        std::memcpy(&chunk, data + at, sizeof(chunk));
+        if (chunk.bytes > size - at - sizeof(chunk))
+            break; // cut short while recording
+        const std::size_t end = at + sizeof(chunk) + std::size_t(chunk.bytes);
+
+        // 1. every frame header and payload inside the chunk, exactly
+        const std::size_t chunk_index = m_chunks.size();
+        const std::size_t first = m_frames.size();
+        std::size_t       offset = at + sizeof(chunk);
+        bool              valid = true;
+        for (uint32_t slot = 0; slot < chunk.frames; slot++) {
+            RecordFrameHeader frame;
+            if (end - offset < sizeof(frame)) {
+                valid = false;
+                break;
+            }
+            std::memcpy(&frame, data + offset, sizeof(frame));
+            if (frame.bytes > end - offset - sizeof(frame)) {
+                valid = false;
+                break;
+            }
+            m_frames.push_back(FrameEntry{ chunk_index,
+                                           offset,
+                                           offset + sizeof(frame),
+                                           slot });
+            m_headers.push_back(frame);
+            offset += sizeof(frame) + frame.bytes;
+        }
+        if (not valid or offset != end) {
+            spdlog::error("record reader: bad record in chunk {} at {}, "
+                          "{} frames read",
+                          chunk_index,
+                          at,
+                          first);
+            m_frames.resize(first);
+            m_headers.resize(first);
+            break;
+        }
+        m_chunks.push_back(
+          ChunkEntry{ at, end - at, first, RecordCodec(chunk.codec) });
+        at = end;
+    }
+}
+
+const RecordFrameHeader&
+StageRecordReader::GetHeader(std::size_t i) const
+{
+    return m_headers.at(i);
+}
+
+cv::Mat
+StageRecordReader::View(const FrameEntry& entry) const
+{
+    const auto& header = m_headers[&entry - m_frames.data()];
+    if (uint64_t(header.bytes) !=
+        uint64_t(header.width) * header.height * CV_ELEM_SIZE(CV_8U)) {
+        spdlog::error("record reader: raw frame {} is {} bytes for {}x{}",
+                      &entry - m_frames.data(),
+                      header.bytes,
+                      header.width,
+                      header.height);
+        return cv::Mat();
+    }
+    return cv::Mat(int(header.height),
+                   int(header.width),
+                   CV_8U,
+                   const_cast<char*>(m_file.GetData() + entry.payload));
+}
+
+const StageRecordReader::Decoded&
+StageRecordReader::Decode(std::size_t chunk)
+{
+    // called with m_mutex held
+    auto it = std::find_if(m_decoded.begin(),
+                           m_decoded.end(),
+                           [chunk](const Decoded& d) { return d.chunk == chunk; });
+    if (it != m_decoded.end()) {
+        std::rotate(it, it + 1, m_decoded.end());
+        return m_decoded.back();
+    }
+
+    const auto&                    entry = m_chunks[chunk];
+    std::vector<RecordFrameHeader> headers;
+    Decoded                        decoded{ chunk, {} };
+    if (not DecodeChunk(m_file.GetData() + entry.offset,
+                        entry.bytes,
+                        headers,
+                        decoded.frames))
+        spdlog::error("record reader: chunk {} is damaged", chunk);
+
+    if (m_decoded.size() >= READER_CHUNKS)
+        m_decoded.erase(m_decoded.begin());
+    m_decoded.push_back(std::move(decoded));
+    return m_decoded.back();
+}
+
+cv::Mat
+StageRecordReader::GetFrame(std::size_t i)
+{
+    const auto& entry = m_frames.at(i);
+    const auto& chunk = m_chunks[entry.chunk];
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (i == m_last + 1) {
+        // sequential playback, have the next frames paged in by then
+        const std::size_t ahead = std::min(i + READER_PREFETCH,
+                                           m_frames.size() - 1);
+        const auto& next = m_frames[ahead];
+        const auto& last = m_chunks[next.chunk];
+        m_file.Prefetch(entry.header, last.offset + last.bytes - entry.header);
+    }
+    m_last = i;
+
+    if (chunk.codec == RecordCodec::raw)
+        return View(entry);
+    const auto& decoded = Decode(entry.chunk);
+    if (entry.slot >= decoded.frames.size())
+        return cv::Mat();
+    return decoded.frames[entry.slot];
+}
+
+cv::Mat
+StageRecordReader::GetPreview(std::size_t i, int step)
+{
+    step = std::max(1, step);
+    const auto& entry = m_frames.at(i);
+    if (m_chunks[entry.chunk].codec != RecordCodec::raw) {
+        cv::Mat gray = GetFrame(i);
+        cv::Mat preview;
+        if (not gray.empty())
+            cv::resize(gray,
+                       preview,
+                       cv::Size((gray.cols + step - 1) / step,
+                                (gray.rows + step - 1) / step),
+                       0,
+                       0,
+                       cv::INTER_NEAREST);
+        return preview;
+    }
+
+    cv::Mat view = View(entry);
+    if (view.empty())
+        return cv::Mat();
+    cv::Mat preview((view.rows + step - 1) / step,
+                    (view.cols + step - 1) / step,
+                    CV_8U);
+    for (int y = 0; y < preview.rows; y++) {
+        const uchar* src = view.ptr<uchar>(y * step);
+        uchar*       dst = preview.ptr<uchar>(y);
+        for (int x = 0; x < preview.cols; x++)
+            dst[x] = src[x * step];
+    }
+    return preview;
+}
+
+void
+StageRecordReader::Scan(std::size_t first,
+                        std::size_t last,
+                        const ScanFn& fn,
+                        int threads) const
+{
+    last = std::min(last, m_frames.size());
+    if (first >= last)
+        return;
+
+    // 1. split on chunk boundaries so every chunk is decoded once
+    const std::size_t chunk_first = m_frames[first].chunk;
+    const std::size_t chunk_last = m_frames[last - 1].chunk + 1;
+    const std::size_t chunks = chunk_last - chunk_first;
+    if (threads <= 0)
+        threads = int(std::max(1u, std::thread::hardware_concurrency()));
+    threads = int(std::min<std::size_t>(std::size_t(threads), chunks));
+
+    auto work = [&](std::size_t from, std::size_t to) {
+        std::vector<RecordFrameHeader> headers;
+        std::vector<cv::Mat>           frames;
+        for (std::size_t c = from; c < to; c++) {
+            const auto& chunk = m_chunks[c];
+            const bool  raw = chunk.codec == RecordCodec::raw;
+            if (not raw and not DecodeChunk(m_file.GetData() + chunk.offset,
+                                            chunk.bytes,
+                                            headers,
+                                            frames)) {
+                spdlog::error("record reader: chunk {} is damaged", c);
+                continue;
+            }
+            const std::size_t end =
+              c + 1 < m_chunks.size() ? m_chunks[c + 1].first : m_frames.size();
+            // 2. only the asked range of the first and last chunk
+            for (std::size_t i = std::max(chunk.first, first);
+                 i < std::min(end, last);
+                 i++) {
+                const auto& entry = m_frames[i];
+                if (raw)
+                    fn(i, m_headers[i], View(entry));
+                else if (entry.slot < frames.size())
+                    fn(i, m_headers[i], frames[entry.slot]);
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads; t++) {
+        const std::size_t from = chunk_first + chunks * t / threads;
+        const std::size_t to = chunk_first + chunks * (t + 1) / threads;
+        pool.emplace_back(work, from, to);
+    }
+    for (auto& thread : pool)
+        thread.join();
+}
+
+} // namespace ds::depthscan
@@ -0,0 +1,113 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "stage_codec.h"
+
+namespace ds::depthscan {
+
+constexpr auto READER_PREFETCH = 16; // frames ahead in sequential reads
+constexpr auto READER_CHUNKS   = 2;  // decoded chunks kept for playback
+
+/// Read-only mapping of a whole file.
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::filesystem::path& path);
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* GetData() const { return m_map.data; }
+    std::size_t GetSize() const { return m_map.size; }
+    /// Hint that [offset, offset + bytes) is read soon.
+    void Prefetch(std::size_t offset, std::size_t bytes) const;
+
+private:
+    /// What the constructor opened, released even when it throws.
+    struct Mapping
+    {
+        Mapping() = default;
+        ~Mapping();
+        Mapping(const Mapping&) = delete;
+        Mapping& operator=(const Mapping&) = delete;
+
+        const char* data{ nullptr };
+        std::size_t size{ 0 };
+#ifdef _WIN32
+        void* file{ nullptr };
+        void* mapping{ nullptr };
+#else
+        int fd{ -1 };
+#endif
+    };
+
+    Mapping m_map;
+};
+
+/// Random access to a .dsr recording. The offset of every frame is found
+/// once on open by walking the chunk headers, so seeking is a lookup.
+/// Raw frames are cv::Mat views into the mapping and stay valid as long
+/// as the reader; compressed chunks are decoded whole and the last few
+/// are kept.
+class StageRecordReader
+{
+public:
+    using ScanFn = std::function<void(std::size_t index,
+                                      const RecordFrameHeader& header,
+                                      const cv::Mat& gray)>;
+
+    explicit StageRecordReader(const std::filesystem::path& path);
+
+    std::size_t              GetFrameCount() const { return m_frames.size(); }
+    const RecordFrameHeader& GetHeader(std::size_t i) const;
+    /// Prefetches ahead while frames are asked for in order.
+    cv::Mat GetFrame(std::size_t i);
+    /// Every step-th row and column; raw frames only touch those rows.
+    cv::Mat GetPreview(std::size_t i, int step);
+    /// fn for every frame in [first, last), threads work on whole chunks
+    /// (0: one per core). fn is called concurrently, in order per thread.
+    void Scan(std::size_t first,
+              std::size_t last,
+              const ScanFn& fn,
+              int threads = 0) const;
+
+private:
+    struct FrameEntry
+    {
+        std::size_t chunk;   ///< into m_chunks
+        std::size_t header;  ///< file offset of the RecordFrameHeader
+        std::size_t payload; ///< file offset of the payload
+        uint32_t    slot;    ///< position in the chunk
+    };
+    struct ChunkEntry
+    {
+        std::size_t offset; ///< of the RecordChunkHeader
+        std::size_t bytes;  ///< header included
+        std::size_t first;  ///< into m_frames
+        RecordCodec codec;
+    };
+    struct Decoded
+    {
+        std::size_t          chunk;
+        std::vector<cv::Mat> frames;
+    };
+
+    void    BuildIndex();
+    /// Raw only; empty when the payload is not width * height bytes.
+    cv::Mat View(const FrameEntry& entry) const;
+    const Decoded& Decode(std::size_t chunk);
+
+    MappedFile                     m_file;
+    std::vector<FrameEntry>        m_frames;
+    std::vector<RecordFrameHeader> m_headers;
+    std::vector<ChunkEntry>        m_chunks;
+
+    std::mutex          m_mutex;
+    std::vector<Decoded> m_decoded; ///< most recent last
+    std::size_t         m_last;     ///< last frame asked for
+};
+
+} // namespace ds::depthscan
@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <utility>
+#include <spdlog/spdlog.h>
+#include "stage_recorder.h"
+#include "stage_settings.h"
+
+namespace ds::depthscan {
+
+WriterOptions
+RecordWriterOptions(const StationId& station)
+{
+    WriterOptions options;
+    auto storage = StageSettingStorage::GetInstance(station);
+    if (storage) {
+        options.threads = std::max(
+          1,
+          std::get<int>(storage->GetSettings(StageConfigKeys::RECORD_THREADS)));
+        options.chunk_frames = std::get<int>(
+          storage->GetSettings(StageConfigKeys::RECORD_CHUNK_FRAMES));
+        options.cache_chunks = std::get<int>(
+          storage->GetSettings(StageConfigKeys::RECORD_CACHE_CHUNKS));
+        const int level = std::get<int>(
+          storage->GetSettings(StageConfigKeys::RECORD_COMPRESSION));
+        options.codec = level > 0 ? RecordCodec::png : RecordCodec::raw;
+        options.level = std::clamp(level, 0, 9);
+        if (std::get<bool>(
+              storage->GetSettings(StageConfigKeys::RECORD_DELTA))) {
+            options.codec = RecordCodec::delta;
+            options.level = std::clamp(level, 1, 9);
+        }
+    }
+    return options;
+}
+
+FrameRing::FrameRing(std::size_t max_frames, std::size_t max_bytes)
+  : m_max_frames(max_frames)
+  , m_max_bytes(max_bytes)
+  , m_bytes(0)
+  , m_peak(0)
+{
+}
+void
+FrameRing::Push(RecordedFrame frame)
+{
+    if (m_max_frames == 0)
+        return;
+    m_bytes += FrameBytes(frame);
+    m_frames.push_back(std::move(frame));
+    while (m_frames.size() > m_max_frames)
+        Trim(m_bytes - FrameBytes(m_frames.front()));
+    Trim(m_max_bytes);
+    m_peak = std::max(m_peak, m_bytes);
+}
+void
+FrameRing::Trim(std::size_t max_bytes)
+{
+    while (not m_frames.empty() and m_bytes > max_bytes) {
+        m_bytes -= FrameBytes(m_frames.front());
+        m_frames.pop_front();
+    }
+}
+std::deque<RecordedFrame>
+FrameRing::Take()
+{
+    m_bytes = 0;
+    return std::exchange(m_frames, {});
+}
+
+StageRecorder::StageRecorder(const StationId& station)
+  : m_station(station)
+  , m_camera(ds::camera::GetCamera(m_station))
+  , m_active(false)
+  , m_stop(false)
+  , m_phase(Phase::finished)
+  , m_state(ds::camera::CameraState::arm)
+  , m_tail_left(0)
+  , m_missed(0)
+  , m_dropped(0)
+  , m_run(0)
+{
+}
+StageRecorder::~StageRecorder()
+{
+}
+void
+StageRecorder::Initiate() noexcept
+{
+}
+
+void
+StageRecorder::Arm(std::shared_ptr<ds::camera::RecordFilter> filter,
+                   const std::filesystem::path& path,
+                   const RecordOptions& options)
+{
+    if (m_active)
+        Stop();
+
+    m_filter = filter;
+    m_path = path;
+    m_path.replace_extension(RECORD_EXTENSION);
+    m_options = options;
+    m_ring = std::make_unique<FrameRing>(std::size_t(options.pre_trigger),
+                                         options.max_bytes);
+    m_writer.reset();
+    m_last_id.reset();
+    m_missed = 0;
+    m_dropped = 0;
+    m_tail_left = 0;
+    m_phase = Phase::armed;
+    m_state = ds::camera::CameraState::arm;
+    m_stop = false;
+    m_active = true;
+    m_run++;
+
+    Start<&StageRecorder::Run>(NewLife());
+}
+void
+StageRecorder::Stop()
+{
+    m_stop = true;
+    m_active = false;
+    if (m_writer) {
+        m_writer->Close();
+        m_dropped += m_writer->GetDropped();
+        spdlog::info("record closed: {} frames, {} dropped, {} missed by "
+                     "the camera, ratio {:.1f}, {}",
+                     m_writer->GetWritten(),
+                     m_writer->GetDropped(),
+                     m_missed,
+                     m_writer->GetRatio(),
+                     m_writer->GetPath().string());
+        m_writer.reset();
+    }
+    if (m_ring)
+        m_ring->Take();
+}
+RecorderMemory
+StageRecorder::GetMemory() const
+{
+    RecorderMemory memory;
+    memory.max_bytes = m_options.max_bytes;
+    memory.dropped = m_dropped;
+    memory.missed = m_missed;
+    if (m_ring) {
+        memory.ring_bytes = m_ring->GetBytes();
+        memory.ring_peak = m_ring->GetPeak();
+    }
+    if (m_writer) {
+        memory.queue_bytes = m_writer->GetQueueBytes();
+        memory.queue_peak = m_writer->GetQueuePeak();
+        memory.dropped += m_writer->GetDropped();
+    }
+    return memory;
+}
+
+void
+StageRecorder::Write(RecordedFrame frame)
+{
+    if (not m_writer) {
+        m_writer =
+          std::make_unique<StageFrameWriter>(m_path,
+                                             m_options.max_bytes,
+                                             m_options.writer);
+    }
+    m_writer->Push(std::move(frame));
+}
+
+asio::awaitable<void>
+StageRecorder::Run(async::Lifeguard guard)
+{
+    const auto armed = std::chrono::steady_clock::now();
+    const uint32_t run = m_run;
+    auto alive = [&]() { return not m_stop and run == m_run; };
+
+    while (alive() and m_phase != Phase::finished) {
+        auto frame = co_await m_camera->AsyncGetFrame(guard());
+        if (not frame or not alive())
+            continue;
+
+        // 0. a gap in the camera ids is a frame lost before it got here
+        const uint64_t id = CameraFrameId(*frame);
+        if (m_last_id and id > *m_last_id + 1)
+            m_missed += id - *m_last_id - 1;
+        m_last_id = id;
+
+        RecordedFrame item{
+            frame,
+            id,
+            std::chrono::duration_cast<std::chrono::microseconds>(
+              std::chrono::steady_clock::now() - armed)
+        };
+        const bool fire = m_filter->ShouldRecord(frame.get());
+
+        switch (m_phase) {
+            case Phase::armed:
+                if (fire) {
+                    // 1. the ring goes first, in order, then the trigger frame
+                    auto ring_bytes = m_ring->GetBytes();
+                    auto frames = m_ring->Take();
+                    spdlog::info("record trigger: {} pre-trigger frames, "
+                                 "{} kB (peak {} kB, cap {} kB)",
+                                 frames.size(),
+                                 ring_bytes >> 10,
+                                 m_ring->GetPeak() >> 10,
+                                 m_options.max_bytes >> 10);
+                    for (auto& pre : frames)
+                        Write(std::move(pre));
+                    Write(std::move(item));
+                    m_phase = Phase::recording;
+                    m_state = ds::camera::CameraState::recording;
+                } else {
+                    // 2. ring and write queue share the byte cap
+                    const std::size_t queued =
+                      m_writer ? m_writer->GetQueueBytes() : 0;
+                    m_ring->Push(std::move(item));
+                    m_ring->Trim(m_options.max_bytes -
+                                 std::min(queued, m_options.max_bytes));
+                }
+                break;
+            case Phase::recording:
+                if (fire) {
+                    Write(std::move(item));
+                } else if (m_options.post_trigger > 0) {
+                    Write(std::move(item));
+                    m_tail_left = m_options.post_trigger - 1;
+                    m_phase = m_tail_left ? Phase::tail : Phase::finished;
+                } else {
+                    m_phase = Phase::finished;
+                }
+                break;
+            case Phase::tail:
+                Write(std::move(item));
+                if (fire)
+                    m_phase = Phase::recording;
+                else if (--m_tail_left <= 0)
+                    m_phase = Phase::finished;
+                break;
+            case Phase::finished:
+                break;
+        }
+    }
+    // 3. back to arm once the tail is written, like the camera recorder;
+    // the filter is not asked again until the next Arm
+    if (m_phase == Phase::finished and run == m_run)
+        m_state = ds::camera::CameraState::arm;
+    co_return;
+}
+
+} // namespace ds::depthscan
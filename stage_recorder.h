@@ -0,0 +1,125 @@
+#pragma once
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include "async.h"
+#include "ui.h"
+#include <camera.h>
+#include "camera/record_filter.h"
+#include "stage_station.h"
+#include "stage_writer.h"
+
+namespace ds::depthscan {
+
+enum struct RecordFormat : uint8_t
+{
+    dsf, ///< the camera recorder, HDF5 group per sample
+    dsr  ///< StageRecorder, chunked, see stage_codec.h
+};
+
+struct RecordOptions
+{
+    RecordFormat format{ RecordFormat::dsf };
+    int          pre_trigger{ 0 };  ///< frames kept before the filter fires
+    int          post_trigger{ 0 }; ///< frames written after it lets go
+    std::size_t  max_bytes{ 256u << 20 }; ///< ring + write queue
+    WriterOptions writer;
+
+    /// .dsr only when asked for, the ring and the tail need it.
+    bool Enabled() const { return format == RecordFormat::dsr; }
+    bool Triggered() const { return pre_trigger > 0 or post_trigger > 0; }
+};
+
+/// Writer options from the record_* settings.
+WriterOptions RecordWriterOptions(const StationId& station);
+
+/// Last N frame handles before a trigger, bounded by count and bytes.
+class FrameRing
+{
+public:
+    FrameRing(std::size_t max_frames, std::size_t max_bytes);
+
+    void Push(RecordedFrame frame);
+    /// Evict oldest frames until at most max_bytes are held.
+    void Trim(std::size_t max_bytes);
+    std::deque<RecordedFrame> Take();
+
+    std::size_t GetBytes() const { return m_bytes; }
+    std::size_t GetPeak() const { return m_peak; }
+    std::size_t GetSize() const { return m_frames.size(); }
+
+private:
+    std::deque<RecordedFrame> m_frames;
+    std::size_t               m_max_frames;
+    std::size_t               m_max_bytes;
+    std::size_t               m_bytes;
+    std::size_t               m_peak;
+};
+
+struct RecorderMemory
+{
+    std::size_t ring_bytes{ 0 };
+    std::size_t ring_peak{ 0 };
+    std::size_t queue_bytes{ 0 };
+    std::size_t queue_peak{ 0 };
+    std::size_t max_bytes{ 0 };
+    uint64_t    dropped{ 0 }; ///< by the ring cap or the writer
+    uint64_t    missed{ 0 };  ///< gaps in the camera frame ids
+};
+
+/// Recording with a pre-trigger ring and a post-trigger tail, used by
+/// StageFrame::ArmRecording when record_format is "dsr". The filter
+/// decides like it does for the camera recorder until the tail is
+/// written; frames are written to <path>.dsr by a StageFrameWriter,
+/// indexed by their camera frame id.
+class StageRecorder : public async::Model<StageRecorder>
+{
+public:
+    explicit StageRecorder(const StationId& station);
+    ~StageRecorder();
+
+    void Initiate() noexcept override;
+
+    void Arm(std::shared_ptr<ds::camera::RecordFilter> filter,
+             const std::filesystem::path& path,
+             const RecordOptions& options);
+    void Stop();
+
+    bool                    IsActive() const { return m_active; }
+    ds::camera::CameraState GetState() const { return m_state; }
+    RecorderMemory          GetMemory() const;
+
+private:
+    enum struct Phase
+    {
+        armed,     ///< filling the ring
+        recording, ///< filter fires
+        tail,      ///< post-trigger frames
+        finished
+    };
+
+    asio::awaitable<void> Run(async::Lifeguard guard);
+    void                  Write(RecordedFrame frame);
+
+    StationId                                 m_station;
+    std::shared_ptr<ds::camera::Camera>       m_camera;
+    std::shared_ptr<ds::camera::RecordFilter> m_filter;
+    std::filesystem::path                     m_path;
+    RecordOptions                             m_options;
+
+    std::unique_ptr<FrameRing>        m_ring;
+    std::unique_ptr<StageFrameWriter> m_writer;
+
+    bool                    m_active;
+    bool                    m_stop;
+    Phase                   m_phase;
+    ds::camera::CameraState m_state;
+    int                     m_tail_left;
+    std::optional<uint64_t> m_last_id; ///< camera frame id
+    uint64_t                m_missed;
+    uint64_t                m_dropped; ///< from writers already closed
+    uint32_t                m_run;     ///< bumped per Arm
+};
+
+} // namespace ds::depthscan
@@ -1,246 +1,377 @@
-#include <iostream>
-#include <windows.h>
-#include <fstream>
-#include <wx/chartype.h>
-#include <spdlog/spdlog.h>
-#include "ds/depthscan/stage_settings.h"
-
-namespace ds::depthscan {
-
-std::string PATH_TO_FOCUS = "c:/ltis/depthscan/resources/log/focus";
-std::string PATH_TO_AUTOMODE = "c:/ltis/depthscan/resources/log/play";
-std::string PATH_TO_HISTORY = "c:/ltis/depthscan/resources/history";
-std::string PATH_TO_AUTOEXPOSURE = "c:/ltis/depthscan/resources/log/exposure";
-
-static nlohmann::json
-LoadConfig(const std::string& config_file)
-{
-    nlohmann::json config;
-
-    //if ((_waccess(_T(".\\setting"), 0)) == -1)
-    //    CreateDirectory(_T(".\\setting"), NULL);
-
-    //if ((_waccess(_T(".\\setting\\focus"), 0)) == -1)
-    //    CreateDirectory(_T(".\\setting\\focus"), NULL);
-
-    std::ifstream file(config_file);
-
-    if (!file.is_open()) {
-        nlohmann::json j;
-        std::ofstream  newFile(config_file);
-
-        j[StageConfigKeys::AUTO_DETECT] = false;
-        j[StageConfigKeys::CLEAN_SECONDS] = 120;
-        j[StageConfigKeys::CLEAN_SPEED] = 2;
-        j[StageConfigKeys::FOCUS_NUMOFSTEP] = 120;
-        j[StageConfigKeys::FOCUS_STEP] = 256;
-        j[StageConfigKeys::HIGH_SECONDS] = 10;
-        j[StageConfigKeys::HIGH_SPEED] = 0.3;
-        j[StageConfigKeys::INIT_X_POS] = 0;
-        j[StageConfigKeys::INIT_Y_POS] = 0;
-        j[StageConfigKeys::NORMAL_SECONDS] = 180;
-        j[StageConfigKeys::NORMAL_SPEED] = 0.1;
-        j[StageConfigKeys::REFOCUS] = false;
-        j[StageConfigKeys::LAST_X_POS] = 0;
-        j[StageConfigKeys::LAST_Y_POS] = 0;
-        j[StageConfigKeys::THRESHOLD_ENTRY] = 3.0f;
-        j[StageConfigKeys::THRESHOLD_EXIT] = -3.0f;
-        j[StageConfigKeys::THRESHOLD_EXIT2] = -20.0f;
-        newFile << j.dump(4);
-        newFile.close();
-        spdlog::info("Init json ");
-
-        std::ifstream file2(config_file);
-        file2 >> config;
-
-    } else {
-
-        file >> config;
-    }
-    return config;
-}
-static void
-UpdateStageSettings(const std::string& config_file,std::string cameraname)
-{
-    try {
-        nlohmann::json config = LoadConfig(config_file);
-        //nlohmann::json config = Resource::LoadSettings(config_file);
-        if (cameraname == "")
-            cameraname = "U3-300xSE-C";
-        auto& stage = config[cameraname];
-        bool auto_mode = stage[StageConfigKeys::AUTO_DETECT];
-        int init_x = stage[StageConfigKeys::INIT_X_POS];
-        int init_y = stage[StageConfigKeys::INIT_Y_POS];
-        int last_x = stage[StageConfigKeys::LAST_X_POS];
-        int last_y = stage[StageConfigKeys::LAST_Y_POS];
-        int clean_seconds = stage[StageConfigKeys::CLEAN_SECONDS];
-        float clean = stage[StageConfigKeys::CLEAN_SPEED];
-        int step = stage[StageConfigKeys::FOCUS_STEP];
-        int numofstep = stage[StageConfigKeys::FOCUS_NUMOFSTEP];
-        float high = stage[StageConfigKeys::HIGH_SPEED];
-        float normal = stage[StageConfigKeys::NORMAL_SPEED];
-        int prime_seconds = stage[StageConfigKeys::HIGH_SECONDS];
-        int camera_seconds = stage[StageConfigKeys::NORMAL_SECONDS];
-        bool re_focus = stage[StageConfigKeys::REFOCUS];
-        float threshold_entry = stage[StageConfigKeys::THRESHOLD_ENTRY];
-        float threshold_exit = stage[StageConfigKeys::THRESHOLD_EXIT];
-        float threshold_exit2 = stage[StageConfigKeys::THRESHOLD_EXIT2];
-
-        auto storage = StageSettingStorage::GetInstance();
-        // Validate the values
-        int abs_diff_step_x = abs(last_x - init_x) / step;
-        if (abs_diff_step_x >= int(numofstep/5)) {
-            init_x -= (int(numofstep/6) * step);
-            storage->SaveSettingToJson(StageConfigKeys::INIT_X_POS, init_x);
-        }
-
-
-        if (storage) {
-            storage->AddSettings(StageConfigKeys::AUTO_DETECT,
-                                 static_cast<SettingType>(auto_mode));
-            storage->AddSettings(StageConfigKeys::INIT_X_POS,
-                                 static_cast<SettingType>(init_x));
-            storage->AddSettings(StageConfigKeys::INIT_Y_POS,
-                                 static_cast<SettingType>(init_y));
-            storage->AddSettings(StageConfigKeys::LAST_X_POS,
-                                 static_cast<SettingType>(last_x));
-            storage->AddSettings(StageConfigKeys::LAST_Y_POS,
-                                 static_cast<SettingType>(last_y));
-            storage->AddSettings(StageConfigKeys::CLEAN_SECONDS,
-                                 static_cast<SettingType>(clean_seconds));
-            storage->AddSettings(StageConfigKeys::CLEAN_SPEED,
-                                 static_cast<SettingType>(clean));
-            storage->AddSettings(StageConfigKeys::FOCUS_STEP,
-                                 static_cast<SettingType>(step));
-            storage->AddSettings(StageConfigKeys::FOCUS_NUMOFSTEP,
-                                 static_cast<SettingType>(numofstep));
-            storage->AddSettings(StageConfigKeys::HIGH_SPEED,
-                                 static_cast<SettingType>(high));
-            storage->AddSettings(StageConfigKeys::NORMAL_SPEED,
-                                 static_cast<SettingType>(normal));
-            storage->AddSettings(StageConfigKeys::HIGH_SECONDS,
-                                 static_cast<SettingType>(prime_seconds));
-            storage->AddSettings(StageConfigKeys::NORMAL_SECONDS,
-                                 static_cast<SettingType>(camera_seconds));
-            storage->AddSettings(StageConfigKeys::REFOCUS,
-                                 static_cast<SettingType>(re_focus));
-            storage->AddSettings(StageConfigKeys::THRESHOLD_ENTRY,
-                                 static_cast<SettingType>(threshold_entry));
-            storage->AddSettings(StageConfigKeys::THRESHOLD_EXIT,
-                                 static_cast<SettingType>(threshold_exit));
-            storage->AddSettings(StageConfigKeys::THRESHOLD_EXIT2,
-                                 static_cast<SettingType>(threshold_exit2));
-        }
-
-    } catch (const std::exception& e) {
-        spdlog::error("json error {}", e.what());
-    }
-}
-
-std::shared_ptr<StageSettingStorage>
-StageSettingStorage::GetInstance()
-{
-    static auto shared = std::make_shared<StageSettingStorage>();
-    return shared;
-}
-void
-StageSettingStorage::AddSettings(const std::string& key,
-                                 const SettingType& value)
-{
-
-    if (key.empty())
-        throw std::invalid_argument("key cannot be empty");
-    try {
-        std::unique_lock<std::shared_mutex> lock(m_mutex);
-        m_settings[key] = value;
-    } catch (const std::exception& e) {
-        std::cerr << "Exception during AddSettings:" << e.what() << std::endl;
-    }
-}
-
-SettingType
-StageSettingStorage::GetSettings(const std::string& key)
-{
-    std::shared_lock<std::shared_mutex>lock(m_mutex);
-    if (m_settings.find(key) != m_settings.end()) {
-        return m_settings[key];
-    } else {
-        throw std::out_of_range("Stage Setting Key not found.");
-    }
-}
-
-void
-StageSettingStorage::LoadSettingsFromJson(std::string cameraname) const
-{
-    UpdateStageSettings(file_path, cameraname);
-}
-void
-StageSettingStorage::LoadCameraSettingsFromJson(std::string cameraname) 
-{
-    nlohmann::json config;
-    std::ifstream file("c:/ltis/depthscan/resources/settings/camera.json");
-
-    if (!file.is_open()) {
-        nlohmann::json j;
-        std::ofstream newFile(
-          "c:/ltis/depthscan/resources/settings/camera.json");
-
-        j["lens"] = 4;
-        j["pixel_size"] = 3.45;
-        j["exposure_time"] = 2000;
-
-        newFile << j.dump(4);
-        newFile.close();
-
-        std::ifstream file2("c:/ltis/depthscan/resources/settings/camera.json");
-        file2 >> config;
-
-    } else {
-
-        file >> config;
-    }
-
-    auto& cam = config[cameraname];
-    if (cam.empty())
-        spdlog::error("Camera settings for {} not found in JSON", cameraname);
-
-    m_lens = cam["lens"].get<int>();
-    m_pixel_size = cam["pixel_size"].get<float>();
-    m_exposure_time = cam["exposure_time"].get<int>();
-}
-template<typename T>
-void
-StageSettingStorage::SaveSettingToJson(const std::string& key, T value)
-{
-    try {
-        nlohmann::json config = LoadConfig(file_path);
-        // nlohmann::json config = Resource::LoadSettings("stage.json");
-
-        auto storage = StageSettingStorage::GetInstance();
-        if (storage) {
-            config[m_camera_name][key] = value;
-
-            std::ofstream file(file_path);
-            if (file.is_open()) {
-                file << config.dump(4);
-                file.close();
-            }
-        }
-
-    } catch (const std::exception& e) {
-        spdlog::error("json error {}", e.what());
-    }
-}
-template void
-StageSettingStorage::SaveSettingToJson<int>(const std::string& key, 
-                                              int value);
-template void
-StageSettingStorage::SaveSettingToJson<float>(const std::string& key,
-                                              float              value);
-template void
-StageSettingStorage::SaveSettingToJson<bool>(const std::string& key,
-                                             bool               value);
-template void
-StageSettingStorage::SaveSettingToJson<std::string>(const std::string& key,
-                                                    std::string        value);
+#include <iostream>
+#include <windows.h>
+#include <fstream>
+#include <chrono>
+#include <filesystem>
+#include <mutex>
+#include <wx/chartype.h>
+#include <spdlog/spdlog.h>
+#include "ds/depthscan/stage_settings.h"
+
+namespace ds::depthscan {
+
+std::string PATH_TO_FOCUS = "c:/ltis/depthscan/resources/log/focus";
+std::string PATH_TO_AUTOMODE = "c:/ltis/depthscan/resources/log/play";
+std::string PATH_TO_HISTORY = "c:/ltis/depthscan/resources/history";
+std::string PATH_TO_AUTOEXPOSURE = "c:/ltis/depthscan/resources/log/exposure";
+std::string PATH_TO_RETIRED = "c:/ltis/depthscan/resources/log_retired";
+
+static nlohmann::json
+LoadConfig(const std::string& config_file)
+{
+    nlohmann::json config;
+
+    //if ((_waccess(_T(".\\setting"), 0)) == -1)
+    //    CreateDirectory(_T(".\\setting"), NULL);
+
+    //if ((_waccess(_T(".\\setting\\focus"), 0)) == -1)
+    //    CreateDirectory(_T(".\\setting\\focus"), NULL);
+
+    std::ifstream file(config_file);
+
+    if (!file.is_open()) {
+        nlohmann::json j;
+        std::ofstream  newFile(config_file);
+
+        j[StageConfigKeys::AUTO_DETECT] = false;
+        j[StageConfigKeys::CLEAN_SECONDS] = 120;
+        j[StageConfigKeys::CLEAN_SPEED] = 2;
+        j[StageConfigKeys::FOCUS_NUMOFSTEP] = 120;
+        j[StageConfigKeys::FOCUS_STEP] = 256;
+        j[StageConfigKeys::HIGH_SECONDS] = 10;
+        j[StageConfigKeys::HIGH_SPEED] = 0.3;
+        j[StageConfigKeys::INIT_X_POS] = 0;
+        j[StageConfigKeys::INIT_Y_POS] = 0;
+        j[StageConfigKeys::NORMAL_SECONDS] = 180;
+        j[StageConfigKeys::NORMAL_SPEED] = 0.1;
+        j[StageConfigKeys::REFOCUS] = false;
+        j[StageConfigKeys::LAST_X_POS] = 0;
+        j[StageConfigKeys::LAST_Y_POS] = 0;
+        j[StageConfigKeys::THRESHOLD_ENTRY] = 3.0f;
+        j[StageConfigKeys::THRESHOLD_EXIT] = -3.0f;
+        j[StageConfigKeys::THRESHOLD_EXIT2] = -20.0f;
+        newFile << j.dump(4);
+        newFile.close();
+        spdlog::info("Init json ");
+
+        std::ifstream file2(config_file);
+        file2 >> config;
+
+    } else {
+
+        file >> config;
+    }
+    return config;
+}
+/// A key every camera section has; a missing one throws instead of
+/// being inserted as null, as operator[] would.
+template<typename T>
+static T
+Required(const nlohmann::json& stage, const char* key)
+{
+    auto it = stage.find(key);
+    if (it == stage.end())
+        throw std::out_of_range(std::string("missing ") + key);
+    return it->get<T>();
+}
+/// Sections of stage.json that are camera profiles, by a key they all have.
+static bool
+IsCameraProfile(const nlohmann::json& stage)
+{
+    return stage.is_object() and stage.contains(StageConfigKeys::INIT_X_POS);
+}
+/// Settings of one camera section; `stage` is only read. A corrected
+/// init_x_pos is in the result and reported through `corrected`.
+static SettingMap
+ParseProfile(const nlohmann::json& stage, bool& corrected)
+{
+    SettingMap settings;
+    auto add = [&settings](const char* key, const SettingType& value) {
+        settings[key] = value;
+    };
+    bool auto_mode = Required<bool>(stage, StageConfigKeys::AUTO_DETECT);
+    int init_x = Required<int>(stage, StageConfigKeys::INIT_X_POS);
+    int init_y = Required<int>(stage, StageConfigKeys::INIT_Y_POS);
+    int last_x = Required<int>(stage, StageConfigKeys::LAST_X_POS);
+    int last_y = Required<int>(stage, StageConfigKeys::LAST_Y_POS);
+    int clean_seconds = Required<int>(stage, StageConfigKeys::CLEAN_SECONDS);
+    float clean = Required<float>(stage, StageConfigKeys::CLEAN_SPEED);
+    int step = Required<int>(stage, StageConfigKeys::FOCUS_STEP);
+    int numofstep = Required<int>(stage, StageConfigKeys::FOCUS_NUMOFSTEP);
+    float high = Required<float>(stage, StageConfigKeys::HIGH_SPEED);
+    float normal = Required<float>(stage, StageConfigKeys::NORMAL_SPEED);
+    int prime_seconds = Required<int>(stage, StageConfigKeys::HIGH_SECONDS);
+    int camera_seconds = Required<int>(stage, StageConfigKeys::NORMAL_SECONDS);
+    bool re_focus = Required<bool>(stage, StageConfigKeys::REFOCUS);
+    float threshold_entry =
+      Required<float>(stage, StageConfigKeys::THRESHOLD_ENTRY);
+    float threshold_exit =
+      Required<float>(stage, StageConfigKeys::THRESHOLD_EXIT);
+    float threshold_exit2 =
+      Required<float>(stage, StageConfigKeys::THRESHOLD_EXIT2);
+    // optional, older stage.json files do not carry them
+    int motion_min = stage.value(StageConfigKeys::MOTION_MIN_SPEED, 200);
+    int motion_max = stage.value(StageConfigKeys::MOTION_MAX_SPEED, 1000);
+    int motion_accel = stage.value(StageConfigKeys::MOTION_ACCEL, 2000);
+    // 3 s at the default 0.1 ml/min normal flow
+    float settle_volume = stage.value(StageConfigKeys::SETTLE_VOLUME, 5.0f);
+    // empty profile: clean_speed for clean_seconds, as before
+    std::string clean_profile =
+      stage.value(StageConfigKeys::CLEAN_PROFILE, nlohmann::json::array())
+        .dump();
+    int clean_repeat = stage.value(StageConfigKeys::CLEAN_REPEAT, 1);
+    // dsf: the camera records, no ring; the rest is for dsr only
+    std::string record_format =
+      stage.value(StageConfigKeys::RECORD_FORMAT, std::string("dsf"));
+    int pre_trigger = stage.value(StageConfigKeys::PRE_TRIGGER_FRAMES, 0);
+    int post_trigger = stage.value(StageConfigKeys::POST_TRIGGER_FRAMES, 0);
+    int record_ring_mb = stage.value(StageConfigKeys::RECORD_RING_MB, 256);
+    int record_threads = stage.value(StageConfigKeys::RECORD_THREADS, 2);
+    int record_chunk =
+      stage.value(StageConfigKeys::RECORD_CHUNK_FRAMES, 16);
+    int record_cache = stage.value(StageConfigKeys::RECORD_CACHE_CHUNKS, 8);
+    int record_compression =
+      stage.value(StageConfigKeys::RECORD_COMPRESSION, 0);
+    bool record_delta = stage.value(StageConfigKeys::RECORD_DELTA, false);
+    std::error_code ec;
+    std::string bench_path = stage.value(
+      StageConfigKeys::BENCH_PATH,
+      (std::filesystem::temp_directory_path(ec) / "depthscan_bench.dsr")
+        .string());
+    std::string chip_type =
+      stage.value(StageConfigKeys::CHIP_TYPE, std::string("firefly"));
+    // 1x1: the single FOCUS ROI
+    int focus_tiles_x = stage.value(StageConfigKeys::FOCUS_TILES_X, 1);
+    int focus_tiles_y = stage.value(StageConfigKeys::FOCUS_TILES_Y, 1);
+    std::string focus_aggregate =
+      stage.value(StageConfigKeys::FOCUS_AGGREGATE, std::string("median"));
+
+    // Validate the values
+    int abs_diff_step_x = abs(last_x - init_x) / step;
+    if (abs_diff_step_x >= int(numofstep/5)) {
+        init_x -= (int(numofstep/6) * step);
+        corrected = true;
+    }
+
+    add(StageConfigKeys::AUTO_DETECT, auto_mode);
+    add(StageConfigKeys::INIT_X_POS, init_x);
+    add(StageConfigKeys::INIT_Y_POS, init_y);
+    add(StageConfigKeys::LAST_X_POS, last_x);
+    add(StageConfigKeys::LAST_Y_POS, last_y);
+    add(StageConfigKeys::CLEAN_SECONDS, clean_seconds);
+    add(StageConfigKeys::CLEAN_SPEED, clean);
+    add(StageConfigKeys::FOCUS_STEP, step);
+    add(StageConfigKeys::FOCUS_NUMOFSTEP, numofstep);
+    add(StageConfigKeys::HIGH_SPEED, high);
+    add(StageConfigKeys::NORMAL_SPEED, normal);
+    add(StageConfigKeys::HIGH_SECONDS, prime_seconds);
+    add(StageConfigKeys::NORMAL_SECONDS, camera_seconds);
+    add(StageConfigKeys::REFOCUS, re_focus);
+    add(StageConfigKeys::THRESHOLD_ENTRY, threshold_entry);
+    add(StageConfigKeys::THRESHOLD_EXIT, threshold_exit);
+    add(StageConfigKeys::THRESHOLD_EXIT2, threshold_exit2);
+    add(StageConfigKeys::MOTION_MIN_SPEED, motion_min);
+    add(StageConfigKeys::MOTION_MAX_SPEED, motion_max);
+    add(StageConfigKeys::MOTION_ACCEL, motion_accel);
+    add(StageConfigKeys::SETTLE_VOLUME, settle_volume);
+    add(StageConfigKeys::CLEAN_PROFILE, clean_profile);
+    add(StageConfigKeys::CLEAN_REPEAT, clean_repeat);
+    add(StageConfigKeys::RECORD_FORMAT, record_format);
+    add(StageConfigKeys::PRE_TRIGGER_FRAMES, pre_trigger);
+    add(StageConfigKeys::POST_TRIGGER_FRAMES, post_trigger);
+    add(StageConfigKeys::RECORD_RING_MB, record_ring_mb);
+    add(StageConfigKeys::RECORD_THREADS, record_threads);
+    add(StageConfigKeys::RECORD_CHUNK_FRAMES, record_chunk);
+    add(StageConfigKeys::RECORD_CACHE_CHUNKS, record_cache);
+    add(StageConfigKeys::RECORD_COMPRESSION, record_compression);
+    add(StageConfigKeys::RECORD_DELTA, record_delta);
+    add(StageConfigKeys::BENCH_PATH, bench_path);
+    add(StageConfigKeys::CHIP_TYPE, chip_type);
+    add(StageConfigKeys::FOCUS_TILES_X, focus_tiles_x);
+    add(StageConfigKeys::FOCUS_TILES_Y, focus_tiles_y);
+    add(StageConfigKeys::FOCUS_AGGREGATE, focus_aggregate);
+
+    return settings;
+}
+
+std::shared_ptr<StageSettingStorage>
+StageSettingStorage::GetInstance()
+{
+    return GetInstance(STATION_MAIN);
+}
+std::shared_ptr<StageSettingStorage>
+StageSettingStorage::GetInstance(const StationId& station)
+{
+    static std::mutex s_mutex;
+    static std::map<StationId, std::shared_ptr<StageSettingStorage>> s_stations;
+
+    std::lock_guard<std::mutex> lock(s_mutex);
+    auto& storage = s_stations[station];
+    if (not storage) {
+        storage = std::make_shared<StageSettingStorage>();
+        storage->m_station = station;
+        storage->file_path = StationPath(station, storage->file_path);
+    }
+    return storage;
+}
+void
+StageSettingStorage::AddSettings(const std::string& key,
+                                 const SettingType& value)
+{
+
+    if (key.empty())
+        throw std::invalid_argument("key cannot be empty");
+    try {
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        m_settings[key] = value;
+    } catch (const std::exception& e) {
+        std::cerr << "Exception during AddSettings:" << e.what() << std::endl;
+    }
+}
+
+SettingType
+StageSettingStorage::GetSettings(const std::string& key)
+{
+    std::shared_lock<std::shared_mutex>lock(m_mutex);
+    if (m_settings.find(key) != m_settings.end()) {
+        return m_settings[key];
+    } else {
+        throw std::out_of_range("Stage Setting Key not found.");
+    }
+}
+
+void
+StageSettingStorage::LoadProfiles()
+{
+    const auto start = std::chrono::steady_clock::now();
+    bool       corrected = false;
+    m_document = LoadConfig(file_path);
+    for (auto& [name, stage] : m_document.items()) {
+        if (not IsCameraProfile(stage))
+            continue;
+        try {
+            bool section_corrected = false;
+            auto settings = ParseProfile(stage, section_corrected);
+            // the corrected value only, the rest of the section as read
+            if (section_corrected) {
+                stage[StageConfigKeys::INIT_X_POS] =
+                  std::get<int>(settings[StageConfigKeys::INIT_X_POS]);
+                corrected = true;
+            }
+            m_profiles[name] =
+              std::make_shared<const SettingMap>(std::move(settings));
+        } catch (const std::exception& e) {
+            spdlog::error("json error {} in {}", e.what(), name);
+        }
+    }
+    // one write for every corrected section, after the parse
+    if (corrected) {
+        std::ofstream file(file_path);
+        if (file.is_open())
+            file << m_document.dump(4);
+    }
+    m_loaded = true;
+    spdlog::info("settings: {} camera profiles from {} in {} us",
+                 m_profiles.size(),
+                 file_path,
+                 std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now() - start)
+                   .count());
+}
+SettingProfile
+StageSettingStorage::GetProfile(const std::string& cameraname)
+{
+    std::lock_guard<std::mutex> lock(m_profile_mutex);
+    if (not m_loaded)
+        LoadProfiles();
+    auto it = m_profiles.find(cameraname);
+    return it != m_profiles.end() ? it->second : nullptr;
+}
+void
+StageSettingStorage::LoadSettingsFromJson(std::string cameraname)
+{
+    if (cameraname == "")
+        cameraname = "U3-300xSE-C";
+    auto profile = GetProfile(cameraname);
+    if (not profile) {
+        spdlog::error("Stage settings for {} not found in JSON", cameraname);
+        return;
+    }
+    std::unique_lock<std::shared_mutex> lock(m_mutex);
+    for (const auto& [key, value] : *profile)
+        m_settings[key] = value;
+}
+void
+StageSettingStorage::LoadCameraSettingsFromJson(std::string cameraname) 
+{
+    nlohmann::json config;
+    std::ifstream file("c:/ltis/depthscan/resources/settings/camera.json");
+
+    if (!file.is_open()) {
+        nlohmann::json j;
+        std::ofstream newFile(
+          "c:/ltis/depthscan/resources/settings/camera.json");
+
+        j["lens"] = 4;
+        j["pixel_size"] = 3.45;
+        j["exposure_time"] = 2000;
+
+        newFile << j.dump(4);
+        newFile.close();
+
+        std::ifstream file2("c:/ltis/depthscan/resources/settings/camera.json");
+        file2 >> config;
+
+    } else {
+
+        file >> config;
+    }
+
+    auto& cam = config[cameraname];
+    if (cam.empty())
+        spdlog::error("Camera settings for {} not found in JSON", cameraname);
+
+    m_lens = cam["lens"].get<int>();
+    m_pixel_size = cam["pixel_size"].get<float>();
+    m_exposure_time = cam["exposure_time"].get<int>();
+}
+template<typename T>
+void
+StageSettingStorage::SaveSettingToJson(const std::string& key, T value)
+{
+    try {
+        std::lock_guard<std::mutex> lock(m_profile_mutex);
+        if (not m_loaded)
+            LoadProfiles();
+        m_document[m_camera_name][key] = value;
+
+        std::ofstream file(file_path);
+        if (file.is_open()) {
+            file << m_document.dump(4);
+            file.close();
+        }
+
+        // the next LoadSettingsFromJson sees it, as when it re-read the file
+        auto it = m_profiles.find(m_camera_name);
+        if (it != m_profiles.end()) {
+            auto next = std::make_shared<SettingMap>(*it->second);
+            (*next)[key] = SettingType(value);
+            it->second = next;
+        }
+    } catch (const std::exception& e) {
+        spdlog::error("json error {}", e.what());
+    }
+}
+template void
+StageSettingStorage::SaveSettingToJson<int>(const std::string& key, 
+                                              int value);
+template void
+StageSettingStorage::SaveSettingToJson<float>(const std::string& key,
+                                              float              value);
+template void
+StageSettingStorage::SaveSettingToJson<bool>(const std::string& key,
+                                             bool               value);
+template void
+StageSettingStorage::SaveSettingToJson<std::string>(const std::string& key,
+                                                    std::string        value);
 } // namespace ds::depthscan
\ No newline at end of file
@@ -0,0 +1,16 @@
+#include <filesystem>
+#include "stage_station.h"
+
+namespace ds::depthscan {
+
+std::string
+StationPath(const StationId& station, const std::string& path)
+{
+    if (station == STATION_MAIN)
+        return path;
+    std::filesystem::path p(path);
+    auto name = p.stem().string() + "_" + station + p.extension().string();
+    return p.replace_filename(name).string();
+}
+
+} // namespace ds::depthscan
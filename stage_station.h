@@ -0,0 +1,15 @@
+#pragma once
+#include <string>
+
+namespace ds::depthscan {
+
+/// One instrument: its Avalon link and camera are looked up by this name,
+/// and it has its own settings, events, telemetry and log folders. Every
+/// model takes it in its constructor and hands it to the models it owns.
+using StationId = std::string;
+constexpr auto STATION_MAIN = "main";
+
+/// The main station keeps `path`, others get `<stem>_<station><ext>`.
+std::string StationPath(const StationId& station, const std::string& path);
+
+} // namespace ds::depthscan
@@ -0,0 +1,64 @@
+#pragma once
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <opencv2/opencv.hpp>
+#include "stage_histogram.h"
+
+namespace ds::depthscan {
+
+constexpr int UNDER_EXPOSED_LEVEL = 15;  // bins [0, 15)
+constexpr int OVER_EXPOSED_LEVEL = 240;  // bins [240, 256)
+
+using ExposureStatisticsOptions = HistogramOptions;
+
+struct ExposureStatistics
+{
+    GrayHistogram histogram;
+    uint64_t count{ 0 };
+    uint64_t underexposed{ 0 };
+    uint64_t overexposed{ 0 };
+    double mean{ 0.0 };
+    double variance{ 0.0 };
+
+    /// False for an empty image or one that could not be read as gray.
+    bool   Valid() const { return count != 0; }
+    double StdDev() const { return std::sqrt(variance); }
+    double UnderexposedRatio() const
+    {
+        return count ? double(underexposed) / double(count) : 0.0;
+    }
+    double OverexposedRatio() const
+    {
+        return count ? double(overexposed) / double(count) : 0.0;
+    }
+};
+
+/// One pass over an 8-bit gray image. Only the histogram is built per pixel;
+/// mean, variance and the under/over exposed counts are exact reductions of
+/// the bins, so no floating point work is done per pixel. BGR, BGRA and
+/// 16-bit images are converted to 8-bit gray first; other types give
+/// statistics that are not Valid().
+ExposureStatistics
+ComputeExposureStatistics(const cv::Mat& gray,
+                          const ExposureStatisticsOptions& options = {});
+/// The same reductions of a histogram built elsewhere.
+ExposureStatistics
+ComputeExposureStatistics(const GrayHistogram& histogram);
+
+struct SharpnessOptions
+{
+    int      subsample{ 1 }; ///< use every n-th row
+    cv::Rect roi{};          ///< measured region, empty for the whole image
+};
+
+/// Variance of the 3x3 Laplacian of an 8-bit gray image, the response of
+/// cv::Laplacian(gray, dst, CV_64F) with its default border, in one pass
+/// and without the full size temporary. Response, sum and sum of squares
+/// are integers (16, 32 and 64 bit), so the result equals the
+/// cv::Laplacian + cv::meanStdDev variance to within the final double
+/// rounding, 1e-12 relative. Pixels outside roi still feed its border.
+double
+ComputeSharpness(const cv::Mat& gray, const SharpnessOptions& options = {});
+
+} // namespace ds::depthscan
@@ -0,0 +1,54 @@
+#include <map>
+#include <memory>
+#include "stage_telemetry.h"
+
+namespace ds::depthscan {
+
+StageTelemetry&
+StageTelemetry::Get(const StationId& station)
+{
+    static std::mutex s_mutex;
+    static std::map<StationId, std::unique_ptr<StageTelemetry>> s_stations;
+
+    std::lock_guard<std::mutex> lock(s_mutex);
+    auto& telemetry = s_stations[station];
+    if (not telemetry)
+        telemetry = std::make_unique<StageTelemetry>();
+    return *telemetry;
+}
+uint64_t
+StageTelemetry::Generation()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_generation;
+}
+bool
+StageTelemetry::Store(const TelemetrySnapshot& snapshot, uint64_t generation)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (generation != m_generation)
+        return false;
+    m_last = snapshot;
+    return true;
+}
+void
+StageTelemetry::Invalidate()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_last.valid = false;
+    m_generation++;
+}
+TelemetrySnapshot
+StageTelemetry::Last()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_last;
+}
+bool
+StageTelemetry::IsFresh(std::chrono::milliseconds max_age)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_last.valid and m_last.Age() <= max_age;
+}
+
+} // namespace ds::depthscan
@@ -0,0 +1,59 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include "stage_station.h"
+
+namespace ds::depthscan {
+
+/// Axes with a POS/ENC window in the stepper register map (0x240 ~ 0x27F).
+constexpr int TELEMETRY_AXES = 4;
+
+struct AxisTelemetry
+{
+    long long position{ 0 };  ///< POS_H:POS_L, micro steps
+    long long encoder{ 0 };   ///< ENC_H:ENC_L
+    uint32_t  elapsed{ 0 };   ///< ELAPSED, controller clock ticks
+    bool      busy{ false };
+    bool      home{ false };
+};
+
+/// All stepper registers of one burst read, stamped on arrival.
+struct TelemetrySnapshot
+{
+    using Clock = std::chrono::steady_clock;
+
+    Clock::time_point stamp{};
+    uint32_t          stat{ 0 };
+    bool              valid{ false };
+    std::array<AxisTelemetry, TELEMETRY_AXES> axes{};
+
+    std::chrono::nanoseconds Age() const { return Clock::now() - stamp; }
+};
+
+/// Last snapshot read by any Stage of a station. Moves started through
+/// Stage invalidate it, so a snapshot younger than max_age is what the
+/// registers hold now. Every Invalidate starts a new generation; a read
+/// started before it is dropped by Store instead of reviving old values.
+class StageTelemetry
+{
+public:
+    /// Lives as long as the process.
+    static StageTelemetry& Get(const StationId& station);
+
+    uint64_t          Generation();
+    /// false, and nothing kept, when generation is no longer current
+    bool              Store(const TelemetrySnapshot& snapshot,
+                            uint64_t generation);
+    void              Invalidate();
+    TelemetrySnapshot Last();
+    bool              IsFresh(std::chrono::milliseconds max_age);
+
+private:
+    std::mutex        m_mutex;
+    TelemetrySnapshot m_last;
+    uint64_t          m_generation{ 0 };
+};
+
+} // namespace ds::depthscan
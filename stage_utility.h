@@ -1,194 +1,246 @@
-#pragma once
-#include <cmath>
-#include <filesystem>
-#include <iostream>
-#include <stdexcept>
-#include <time.h>
-#include <sstream>
-#include <string>
-#include <spdlog/spdlog.h>
-#include <opencv2/opencv.hpp>
-
-#include "stage_frame.h"
-
-namespace fs = std::filesystem;
-
-class ProgressCalculator
-{
-public:
-    ProgressCalculator(int total_time)
-      : m_total_time(total_time)
-    {
-    }
-    ~ProgressCalculator() = default;
-
-    int GetPogress(int current_time) const
-    {
-        double progress =
-          (static_cast<double>(current_time) / m_total_time) * 100;
-        return static_cast<int>(std::ceil(progress / 5.0) * 5);
-    }
-
-private:
-    int m_total_time;
-};
-
-class StageFileHandle
-{
-public:
-    explicit StageFileHandle(const std::string& folder_path)
-      : m_folder_path(folder_path)
-    {
-        if (not fs::exists(m_folder_path)) {
-            fs::create_directories(m_folder_path);
-        }
-        if (not fs::is_directory(m_folder_path)) {
-            throw std::invalid_argument("Path '" + m_folder_path +
-                                        "' is not a directory");
-        }
-    }
-    void DeleteWholeFiles()
-    {
-        try {
-            for (const auto& entry : fs::directory_iterator(m_folder_path)) {
-                if (fs::is_regular_file(entry.path())) {
-                    fs::remove(entry.path());
-                }
-            }
-        } catch (const fs::filesystem_error& e) {
-            spdlog::info("Error deleting files:{} " ,e.what());
-        }
-    }
-    template<typename... Args>
-    std::string GetFileName(const std::string& time,
-                            const std::string& extension,
-                            Args... args)
-    {
-        std::stringstream ss;
-        ss << m_folder_path;
-        if (not m_folder_path.empty() && m_folder_path.back() != '/' &&
-            m_folder_path.back() != '\\') {
-            ss << '/';
-        }
-        ss << time;
-        ((ss << "_" << args), ...);
-        ss << extension;
-
-        return ss.str();
-    }
-
-    std::string GetPngFile()
-    {
-        for (const auto& entry : fs::directory_iterator(m_folder_path)) {
-            if (entry.is_regular_file()) {
-                auto ext = entry.path().extension().string();
-                if (ext == ".png" || ext == ".PNG") {
-                    return entry.path().string(); 
-                }
-            }
-        }
-        return ""; 
-    }
-
-private:
-    std::string m_folder_path;
-};
-
-class StageDateTimeFormat
-{
-public:
-    std::string GetTime()
-    {
-        const auto now = std::chrono::system_clock::now();
-        return std::format("{0:%Y%m%d}_{0:%H%M%S}", now);
-    }
-};
-
-class StageProcessImage
-{
-public:
-    cv::Mat RotateImage(const cv::Mat& image, double angle)
-    {
-        cv::Point2f center(image.cols / 2.0f, image.rows / 2.0f);
-        cv::Mat rotation_matrix = cv::getRotationMatrix2D(center, -angle, 1.0);
-        double  radians         = angle * CV_PI / 180.0;
-        double  sin_theta       = std::abs(std::sin(radians));
-        double  cos_theta       = std::abs(std::cos(radians));
-
-        int new_width =
-          static_cast<int>(image.rows * sin_theta + image.cols * cos_theta);
-        int new_height =
-          static_cast<int>(image.rows * cos_theta + image.cols * sin_theta);
-        rotation_matrix.at<double>(0, 2) += (new_width - image.cols) / 2.0;
-        rotation_matrix.at<double>(1, 2) += (new_height - image.rows) / 2.0;
-
-        cv::Mat rotated_image;
-        cv::warpAffine(image,
-                       rotated_image,
-                       rotation_matrix,
-                       cv::Size(new_width, new_height),
-                       cv::INTER_LINEAR,
-                       cv::BORDER_CONSTANT,
-                       cv::Scalar(255, 255, 255));
-
-        return rotated_image;
-    }
-
-    void SaveImages(const std::string& name, const cv::Mat& image, double angle)
-    {
-        if (angle != 0) {
-            cv::Mat rotated_image = RotateImage(image, angle);
-            cv::imwrite(
-              name, rotated_image);
-        } else {
-            cv::imwrite(name, image);
-        }
-    }
-
-    cv::Mat CropImage(auto image, auto x, auto y, auto w, auto h)
-    {
-        cv::Rect roi(x, y, w, h);
-        return image(roi);
-    }
-
-    cv::Mat CalculateHistogram(const cv::Mat& image)
-    {
-        cv::Mat hist;
-        int histSize = 256;
-        float range[] = { 0, 256 };
-        const float* histRange = { range };
-        cv::calcHist(&image, 1, 0, cv::Mat(), hist, 1, &histSize, &histRange);
-
-        return hist;
-    }
-
-    cv::Mat ImageRegions(const cv::Mat& src,
-                                         int cropX,
-                                         int cropY,
-                                         int cropWidth,
-                                         int cropHeight,
-                                         int rotate)
-    {
-        StageProcessImage Image;
-
-        return Image.RotateImage(
-          Image.CropImage(src, cropX, cropY, cropWidth, cropHeight), rotate);
-    }
-
-    double Sharpness(const cv::Mat& image,bool is_gray)
-    {
-        cv::Mat gray;
-        if (not is_gray) {
-            cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
-        } else {
-            gray = image;
-        }   
-        cv::Mat laplacian;
-        cv::Laplacian(gray, laplacian, CV_64F);
-        cv::Scalar mean, stddev;
-        cv::meanStdDev(laplacian, mean, stddev);
-
-        double variance = stddev.val[0] * stddev.val[0];
-        return variance;
-    }
-};
+#pragma once
+#include <cmath>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <time.h>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <spdlog/spdlog.h>
+#include <opencv2/opencv.hpp>
+
+#include "stage_frame.h"
+#include "stage_logsession.h"
+#include "stage_statistics.h"
+
+namespace fs = std::filesystem;
+
+class ProgressCalculator
+{
+public:
+    ProgressCalculator(int total_time)
+      : m_total_time(total_time)
+    {
+    }
+    ~ProgressCalculator() = default;
+
+    int GetPogress(int current_time) const
+    {
+        double progress =
+          (static_cast<double>(current_time) / m_total_time) * 100;
+        return static_cast<int>(std::ceil(progress / 5.0) * 5);
+    }
+
+private:
+    int m_total_time;
+};
+
+class StageFileHandle
+{
+public:
+    /// The folder's running log session, created with the first handle.
+    explicit StageFileHandle(const std::string& folder_path)
+      : m_session(ds::depthscan::StageLogSession::Get(folder_path))
+    {
+    }
+    template<typename... Args>
+    std::string GetFileName(const std::string& time,
+                            const std::string& extension,
+                            Args... args)
+    {
+        return m_session->GetFileName(time, extension, args...);
+    }
+
+    std::string GetPngFile()
+    {
+        for (const auto& entry :
+             fs::directory_iterator(m_session->GetFolder())) {
+            if (entry.is_regular_file()) {
+                auto ext = entry.path().extension().string();
+                if (ext == ".png" || ext == ".PNG") {
+                    return entry.path().string(); 
+                }
+            }
+        }
+        return ""; 
+    }
+
+private:
+    std::shared_ptr<ds::depthscan::StageLogSession> m_session;
+};
+
+class StageDateTimeFormat
+{
+public:
+    std::string GetTime()
+    {
+        const auto now = std::chrono::system_clock::now();
+        return std::format("{0:%Y%m%d}_{0:%H%M%S}", now);
+    }
+};
+
+class StageProcessImage
+{
+public:
+    /// Clockwise by angle degrees into a canvas that holds the whole
+    /// image. 0 returns the image itself and multiples of 90 are exact
+    /// transposes / flips; only other angles interpolate, through a remap
+    /// table kept per (size, angle).
+    cv::Mat RotateImage(const cv::Mat& image, double angle)
+    {
+        double turn = std::fmod(angle, 360.0);
+        if (turn < 0)
+            turn += 360.0;
+
+        cv::Mat rotated_image;
+        if (turn == 0.0)
+            return image;
+        if (turn == 90.0) {
+            cv::rotate(image, rotated_image, cv::ROTATE_90_CLOCKWISE);
+            return rotated_image;
+        }
+        if (turn == 180.0) {
+            cv::rotate(image, rotated_image, cv::ROTATE_180);
+            return rotated_image;
+        }
+        if (turn == 270.0) {
+            cv::rotate(image, rotated_image, cv::ROTATE_90_COUNTERCLOCKWISE);
+            return rotated_image;
+        }
+
+        auto table = RotationTable(image.size(), angle);
+        cv::remap(image,
+                  rotated_image,
+                  table->map1,
+                  table->map2,
+                  cv::INTER_LINEAR,
+                  cv::BORDER_CONSTANT,
+                  cv::Scalar(255, 255, 255));
+
+        return rotated_image;
+    }
+
+    void SaveImages(const std::string& name, const cv::Mat& image, double angle)
+    {
+        if (angle != 0) {
+            cv::Mat rotated_image = RotateImage(image, angle);
+            cv::imwrite(
+              name, rotated_image);
+        } else {
+            cv::imwrite(name, image);
+        }
+    }
+
+    cv::Mat CropImage(auto image, auto x, auto y, auto w, auto h)
+    {
+        cv::Rect roi(x, y, w, h);
+        return image(roi);
+    }
+
+    /// 256 x 1 CV_32F counts of the first channel, the cv::calcHist layout.
+    cv::Mat CalculateHistogram(const cv::Mat& image,
+                               const ds::depthscan::HistogramOptions& options = {})
+    {
+        cv::Mat gray = image;
+        if (image.channels() != 1) {
+            cv::extractChannel(image, gray, 0);
+        }
+        auto histogram = ds::depthscan::ComputeHistogram(gray, options);
+        cv::Mat hist(ds::depthscan::HISTOGRAM_BINS, 1, CV_32F);
+        for (int i = 0; i < ds::depthscan::HISTOGRAM_BINS; i++) {
+            hist.at<float>(i) = float(histogram.bins[i]);
+        }
+        return hist;
+    }
+
+    /// The region of src, then rotated. Only the region is ever rotated,
+    /// and at 0 the result is a view into src.
+    cv::Mat ImageRegions(const cv::Mat& src,
+                                         int cropX,
+                                         int cropY,
+                                         int cropWidth,
+                                         int cropHeight,
+                                         int rotate)
+    {
+        StageProcessImage Image;
+
+        return Image.RotateImage(
+          Image.CropImage(src, cropX, cropY, cropWidth, cropHeight), rotate);
+    }
+
+    /// Variance of the Laplacian, see ds::depthscan::ComputeSharpness.
+    double Sharpness(const cv::Mat& image,
+                     bool is_gray,
+                     const ds::depthscan::SharpnessOptions& options = {})
+    {
+        cv::Mat gray;
+        if (not is_gray or image.channels() != 1) {
+            cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+        } else {
+            gray = image;
+        }   
+        return ds::depthscan::ComputeSharpness(gray, options);
+    }
+
+private:
+    struct RotationMaps
+    {
+        cv::Mat map1; ///< fixed point source coordinates
+        cv::Mat map2; ///< interpolation weights
+    };
+
+    /// Remap table of RotateImage, built once per (size, angle).
+    static std::shared_ptr<const RotationMaps> RotationTable(cv::Size size,
+                                                             double angle)
+    {
+        static std::mutex s_mutex;
+        static std::map<std::tuple<int, int, double>,
+                        std::shared_ptr<const RotationMaps>>
+          s_tables;
+
+        const auto key = std::make_tuple(size.width, size.height, angle);
+        std::lock_guard<std::mutex> lock(s_mutex);
+        if (auto it = s_tables.find(key); it != s_tables.end())
+            return it->second;
+
+        // the same transform the warpAffine rotation used, inverted
+        cv::Point2f center(size.width / 2.0f, size.height / 2.0f);
+        cv::Mat rotation_matrix = cv::getRotationMatrix2D(center, -angle, 1.0);
+        double  radians         = angle * CV_PI / 180.0;
+        double  sin_theta       = std::abs(std::sin(radians));
+        double  cos_theta       = std::abs(std::cos(radians));
+
+        int new_width =
+          static_cast<int>(size.height * sin_theta + size.width * cos_theta);
+        int new_height =
+          static_cast<int>(size.height * cos_theta + size.width * sin_theta);
+        rotation_matrix.at<double>(0, 2) += (new_width - size.width) / 2.0;
+        rotation_matrix.at<double>(1, 2) += (new_height - size.height) / 2.0;
+        cv::Mat inverse;
+        cv::invertAffineTransform(rotation_matrix, inverse);
+
+        cv::Mat map(new_height, new_width, CV_32FC2);
+        for (int y = 0; y < new_height; y++) {
+            auto* row = map.ptr<cv::Vec2f>(y);
+            for (int x = 0; x < new_width; x++) {
+                row[x][0] = float(inverse.at<double>(0, 0) * x +
+                                  inverse.at<double>(0, 1) * y +
+                                  inverse.at<double>(0, 2));
+                row[x][1] = float(inverse.at<double>(1, 0) * x +
+                                  inverse.at<double>(1, 1) * y +
+                                  inverse.at<double>(1, 2));
+            }
+        }
+        auto table = std::make_shared<RotationMaps>();
+        cv::convertMaps(map, cv::Mat(), table->map1, table->map2, CV_16SC2);
+
+        if (s_tables.size() >= 8) // a handful of sizes in practice
+            s_tables.clear();
+        s_tables[key] = table;
+        return table;
+    }
+};
@@ -0,0 +1,305 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <spdlog/spdlog.h>
+#include "stage_writer.h"
+
+namespace ds::depthscan {
+
+std::size_t
+FrameBytes(const RecordedFrame& frame)
+{
+    const cv::Mat& image =
+      frame.gray.empty() ? CameraFrameImage(*frame.frame) : frame.gray;
+    return image.elemSize() * image.total();
+}
+
+double
+WriterBenchResult::FramesPerSecond() const
+{
+    return elapsed.count() ? written * 1e6 / elapsed.count() : 0.0;
+}
+double
+WriterBenchResult::BytesPerSecond() const
+{
+    return elapsed.count() ? bytes * 1e6 / elapsed.count() : 0.0;
+}
+
+StageFrameWriter::StageFrameWriter(const std::filesystem::path& path,
+                                   std::size_t max_queue_bytes,
+                                   const WriterOptions& options)
+  : m_path(path)
+  , m_file(path, std::ios::binary | std::ios::trunc)
+  , m_max_queue_bytes(max_queue_bytes)
+  , m_options(options)
+  , m_open{ 0, {}, 0 }
+  , m_sequence(0)
+  , m_in_flight(0)
+  , m_closing(false)
+  , m_next(0)
+  , m_queue_bytes(0)
+  , m_queue_peak(0)
+  , m_written(0)
+  , m_dropped(0)
+  , m_errors(0)
+  , m_file_bytes(0)
+  , m_raw_bytes(0)
+{
+    if (not m_file.is_open())
+        throw std::runtime_error("cannot open " + path.string());
+
+    m_options.threads = std::max(1, m_options.threads);
+    m_options.chunk_frames = std::max(1, m_options.chunk_frames);
+    m_options.cache_chunks = std::max(1, m_options.cache_chunks);
+    m_open.frames.reserve(m_options.chunk_frames);
+
+    RecordFileHeader header;
+    m_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    m_file_bytes = sizeof(header);
+    for (int i = 0; i < m_options.threads; i++)
+        m_threads.emplace_back(&StageFrameWriter::Work, this);
+}
+StageFrameWriter::~StageFrameWriter()
+{
+    Close();
+}
+
+bool
+StageFrameWriter::Push(RecordedFrame frame)
+{
+    const std::size_t bytes = FrameBytes(frame);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_closing or (m_queue_bytes + bytes) > m_max_queue_bytes) {
+            m_dropped++;
+            return false;
+        }
+        m_open.frames.push_back(std::move(frame));
+        m_open.bytes += bytes;
+        m_queue_bytes += bytes;
+        m_queue_peak = std::max<std::size_t>(m_queue_peak, m_queue_bytes);
+        if (int(m_open.frames.size()) < m_options.chunk_frames)
+            return true;
+        Submit();
+    }
+    m_wake.notify_one();
+    return true;
+}
+void
+StageFrameWriter::Submit()
+{
+    // called with m_mutex held
+    if (m_open.frames.empty())
+        return;
+    if (m_in_flight >= m_options.cache_chunks) {
+        // disk is behind by a whole cache, drop the chunk rather than stall
+        m_dropped += m_open.frames.size();
+        m_queue_bytes -= m_open.bytes;
+    } else {
+        m_open.sequence = m_sequence++;
+        m_queue.push_back(std::move(m_open));
+        m_in_flight++;
+    }
+    m_open = Chunk{ 0, {}, 0 };
+    m_open.frames.reserve(m_options.chunk_frames);
+}
+double
+StageFrameWriter::GetRatio() const
+{
+    const uint64_t file = m_file_bytes;
+    return file ? double(m_raw_bytes) / file : 1.0;
+}
+void
+StageFrameWriter::Close()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_closing)
+            return;
+        Submit();
+        m_closing = true;
+    }
+    m_wake.notify_all();
+    for (auto& thread : m_threads) {
+        if (thread.joinable())
+            thread.join();
+    }
+    if (m_file.is_open())
+        m_file.close();
+}
+
+std::vector<char>
+StageFrameWriter::Encode(const Chunk& chunk, uint64_t& raw) const
+{
+    std::vector<char> data(sizeof(RecordChunkHeader));
+    data.reserve(sizeof(RecordChunkHeader) +
+                 chunk.bytes +
+                 chunk.frames.size() * sizeof(RecordFrameHeader));
+
+    // each chunk starts from a keyframe, so chunks encode and decode alone
+    DeltaBackground    background;
+    std::vector<uchar> payload;
+    for (const auto& item : chunk.frames) {
+        // gray conversion happens here, off the frame delivery path
+        cv::Mat gray = item.gray.empty() ? item.frame->CreateGray() : item.gray;
+        if (not gray.isContinuous())
+            gray = gray.clone();
+        raw += gray.total();
+        EncodeFrame(m_options.codec, gray, m_options.level, background, payload);
+
+        RecordFrameHeader header{ item.index,
+                                  item.timestamp.count(),
+                                  uint32_t(gray.cols),
+                                  uint32_t(gray.rows),
+                                  uint32_t(payload.size()) };
+        const auto at = data.size();
+        data.resize(at + sizeof(header) + payload.size());
+        std::memcpy(data.data() + at, &header, sizeof(header));
+        if (not payload.empty())
+            std::memcpy(data.data() + at + sizeof(header),
+                        payload.data(),
+                        payload.size());
+    }
+
+    RecordChunkHeader header{ chunk.frames.front().index,
+                              uint32_t(chunk.frames.size()),
+                              uint32_t(m_options.codec),
+                              uint64_t(data.size() - sizeof(header)) };
+    std::memcpy(data.data(), &header, sizeof(header));
+    return data;
+}
+void
+StageFrameWriter::Flush(uint64_t sequence, std::vector<char>&& data)
+{
+    std::lock_guard<std::mutex> lock(m_file_mutex);
+    m_done.emplace(sequence, std::move(data));
+
+    // whoever completes the next chunk in order writes all that are ready
+    int flushed = 0;
+    for (auto it = m_done.find(m_next); it != m_done.end();
+         it = m_done.find(m_next)) {
+        // an empty chunk failed to encode, it only keeps the order
+        const auto& chunk = it->second;
+        if (not chunk.empty()) {
+            m_file.write(chunk.data(), std::streamsize(chunk.size()));
+            RecordChunkHeader header;
+            std::memcpy(&header, chunk.data(), sizeof(header));
+            if (m_file) {
+                m_written += header.frames;
+                m_file_bytes += chunk.size();
+            } else {
+                m_errors++;
+                m_dropped += header.frames;
+                spdlog::error("record write failed: {}", m_path.string());
+            }
+        }
+        m_done.erase(it);
+        m_next++;
+        flushed++;
+    }
+    if (flushed) {
+        std::lock_guard<std::mutex> queue_lock(m_mutex);
+        m_in_flight -= flushed;
+    }
+}
+void
+StageFrameWriter::Work()
+{
+    while (true) {
+        Chunk chunk;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock,
+                        [this]() { return m_closing or not m_queue.empty(); });
+            if (m_queue.empty())
+                return; // closing and drained
+            chunk = std::move(m_queue.front());
+            m_queue.pop_front();
+        }
+
+        // an exception must not leave the thread, it would end the process
+        std::vector<char> data;
+        uint64_t          raw = 0;
+        try {
+            data = Encode(chunk, raw);
+        } catch (const std::exception& e) {
+            m_errors++;
+            m_dropped += chunk.frames.size();
+            spdlog::error("record encode failed: {}", e.what());
+        }
+        // the frames go back to the camera before the disk write
+        const auto sequence = chunk.sequence;
+        m_queue_bytes -= chunk.bytes;
+        if (not data.empty())
+            m_raw_bytes += raw;
+        chunk.frames.clear();
+        Flush(sequence, std::move(data));
+    }
+}
+
+WriterBenchResult
+StageFrameWriter::Bench(const std::filesystem::path& path,
+                        const std::vector<cv::Mat>& grays,
+                        int frames,
+                        std::chrono::microseconds interval,
+                        const WriterOptions& options,
+                        const std::atomic<bool>* cancel)
+{
+    WriterBenchResult bench;
+    if (grays.empty())
+        return bench;
+    const auto start = std::chrono::steady_clock::now();
+    {
+        // 1. the cache bounds what is held, the byte cap does not
+        StageFrameWriter writer(path, std::size_t(-1), options);
+        int pushed = 0;
+        for (; pushed < frames; pushed++) {
+            if (cancel and *cancel) {
+                bench.cancelled = true;
+                break;
+            }
+            if (interval.count())
+                std::this_thread::sleep_until(start + interval * pushed);
+            RecordedFrame item;
+            item.index = uint64_t(pushed);
+            item.timestamp = std::chrono::duration_cast<
+              std::chrono::microseconds>(std::chrono::steady_clock::now() -
+                                         start);
+            item.gray = grays[std::size_t(pushed) % grays.size()];
+            writer.Push(std::move(item));
+        }
+        // 2. sustained means until the last byte is on disk
+        writer.Close();
+        bench.frames = uint64_t(pushed);
+        bench.written = writer.GetWritten();
+        bench.dropped = writer.GetDropped();
+        bench.errors = writer.GetErrors();
+        bench.bytes = writer.GetFileBytes();
+        bench.ratio = writer.GetRatio();
+    }
+    bench.elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+
+    std::error_code ec;
+    std::filesystem::remove(path, ec);
+    if (bench.errors)
+        spdlog::error("writer bench: {} chunks failed, see above",
+                      bench.errors);
+    spdlog::info("writer bench: {} threads, chunk {}, codec {}, {} distinct: "
+                 "{}/{} frames, {} dropped, {:.1f} fps, {:.1f} MB/s, "
+                 "ratio {:.1f}{}",
+                 options.threads,
+                 options.chunk_frames,
+                 uint32_t(options.codec),
+                 grays.size(),
+                 bench.written,
+                 bench.frames,
+                 bench.dropped,
+                 bench.FramesPerSecond(),
+                 bench.BytesPerSecond() / (1 << 20),
+                 bench.ratio,
+                 bench.cancelled ? ", cancelled" : "");
+    return bench;
+}
+
+} // namespace ds::depthscan
@@ -0,0 +1,153 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <camera.h>
+#include <opencv2/opencv.hpp>
+#include "stage_codec.h"
+
+namespace ds::depthscan {
+
+/// Reference to a delivered frame, the pixels are not copied.
+struct RecordedFrame
+{
+    std::shared_ptr<const ds::camera::Frame> frame;
+    uint64_t                                 index{ 0 };
+    std::chrono::microseconds                timestamp{ 0 };
+    cv::Mat                                  gray; ///< used instead of frame
+};
+
+/// The camera's running frame counter; a gap is a frame it dropped.
+inline uint64_t
+CameraFrameId(const ds::camera::Frame& frame)
+{
+    return frame.id;
+}
+/// The delivered pixels as the camera holds them, not copied.
+inline const cv::Mat&
+CameraFrameImage(const ds::camera::Frame& frame)
+{
+    return frame.image;
+}
+
+/// Bytes a frame occupies while held, in its own pixel format.
+std::size_t FrameBytes(const RecordedFrame& frame);
+
+struct WriterOptions
+{
+    int         threads{ 2 };       ///< gray conversion and encoding
+    int         chunk_frames{ 16 }; ///< frames per chunk, delta keyframe interval
+    int         cache_chunks{ 8 };  ///< chunks in flight before dropping
+    RecordCodec codec{ RecordCodec::raw };
+    int         level{ 1 };         ///< png compression, 0 ~ 9
+};
+
+/// Distinct live frames a bench rotates through, so the delta codec sees
+/// real residuals and png no repeated image.
+constexpr int WRITER_BENCH_FRAMES = 16;
+
+struct WriterBenchResult
+{
+    uint64_t                  frames{ 0 };
+    uint64_t                  written{ 0 };
+    uint64_t                  dropped{ 0 };
+    uint64_t                  errors{ 0 }; ///< chunks not encoded or written
+    bool                      cancelled{ false };
+    uint64_t                  bytes{ 0 }; ///< on disk
+    double                    ratio{ 1.0 };
+    std::chrono::microseconds elapsed{ 0 };
+
+    double FramesPerSecond() const;
+    double BytesPerSecond() const;
+};
+
+/// Appends frames to a .dsr file in chunks. Push never blocks the caller:
+/// frames are grouped into chunks of chunk_frames, a pool of threads
+/// converts and encodes whole chunks, and finished chunks go to disk in
+/// order. Frames beyond max_queue_bytes, or chunks beyond cache_chunks,
+/// are dropped and counted. A chunk that fails to encode or to write is
+/// counted as an error and its frames as dropped; the pool keeps going.
+class StageFrameWriter
+{
+public:
+    StageFrameWriter(const std::filesystem::path& path,
+                     std::size_t max_queue_bytes,
+                     const WriterOptions& options = {});
+    ~StageFrameWriter(); ///< drains the queue and closes the file
+
+    bool        Push(RecordedFrame frame);
+    void        Close();
+    std::size_t GetQueueBytes() const { return m_queue_bytes; }
+    std::size_t GetQueuePeak() const { return m_queue_peak; }
+    uint64_t    GetWritten() const { return m_written; }
+    uint64_t    GetDropped() const { return m_dropped; }
+    uint64_t    GetErrors() const { return m_errors; }
+    uint64_t    GetFileBytes() const { return m_file_bytes; }
+    uint64_t    GetRawBytes() const { return m_raw_bytes; } ///< 8-bit gray
+    double      GetRatio() const; ///< raw / file bytes
+
+    const std::filesystem::path& GetPath() const { return m_path; }
+    const WriterOptions&         GetOptions() const { return m_options; }
+
+    /// Writes `frames` frames to path, cycling through grays, one every
+    /// `interval` (0: as fast as Push takes them), and removes the file
+    /// afterwards. Stops pushing once *cancel is set. Throws if path
+    /// cannot be opened.
+    static WriterBenchResult Bench(const std::filesystem::path& path,
+                                   const std::vector<cv::Mat>& grays,
+                                   int frames,
+                                   std::chrono::microseconds interval,
+                                   const WriterOptions& options = {},
+                                   const std::atomic<bool>* cancel = nullptr);
+
+private:
+    struct Chunk
+    {
+        uint64_t                   sequence;
+        std::vector<RecordedFrame> frames;
+        std::size_t                bytes; ///< held, see FrameBytes
+    };
+
+    void              Submit();
+    void              Work();
+    /// raw gains the 8-bit gray bytes the chunk encodes.
+    std::vector<char> Encode(const Chunk& chunk, uint64_t& raw) const;
+    void              Flush(uint64_t sequence, std::vector<char>&& data);
+
+    std::filesystem::path m_path;
+    std::ofstream         m_file;
+    std::size_t           m_max_queue_bytes;
+    WriterOptions         m_options;
+
+    std::mutex               m_mutex;
+    std::condition_variable  m_wake;
+    Chunk                    m_open;     ///< being filled by Push
+    std::deque<Chunk>        m_queue;    ///< waiting for a thread
+    uint64_t                 m_sequence; ///< next chunk to submit
+    int                      m_in_flight;
+    bool                     m_closing;
+    std::vector<std::thread> m_threads;
+
+    std::mutex                          m_file_mutex;
+    std::map<uint64_t, std::vector<char>> m_done; ///< encoded, out of order
+    uint64_t                            m_next;   ///< next chunk to write
+
+    std::atomic<std::size_t> m_queue_bytes;
+    std::atomic<std::size_t> m_queue_peak;
+    std::atomic<uint64_t>    m_written;
+    std::atomic<uint64_t>    m_dropped;
+    std::atomic<uint64_t>    m_errors;
+    std::atomic<uint64_t>    m_file_bytes;
+    std::atomic<uint64_t>    m_raw_bytes;
+};
+
+} // namespace ds::depthscan